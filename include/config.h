@@ -6,6 +6,7 @@
 // ==========================================================================
 #define ENABLE_LOG
 //#define ENABLE_DEBUG
+//#define ENABLE_PROFILER  // Per-stage loop timing, published on diag/loop-profile
 #define ENABLE_SEND_DATA
 
 // ==========================================================================
@@ -21,16 +22,50 @@
 #define LOG_LEVEL LOG_LEVEL_INFO
 #endif
 
-#define LOG_E(...) if (LOG_LEVEL >= LOG_LEVEL_ERROR) Serial.printf("[ERROR] " __VA_ARGS__)
-#define LOG_W(...) if (LOG_LEVEL >= LOG_LEVEL_WARN) Serial.printf("[WARN] " __VA_ARGS__)
-#define LOG_I(...) if (LOG_LEVEL >= LOG_LEVEL_INFO) Serial.printf("[INFO] " __VA_ARGS__)
-#define LOG_D(...) if (LOG_LEVEL >= LOG_LEVEL_DEBUG) Serial.printf("[DEBUG] " __VA_ARGS__)
+#if defined(ARDUINO)
+#define LOG_PRINTF Serial.printf
+#else
+#include <stdio.h>
+#define LOG_PRINTF printf
+#endif
+
+#define LOG_E(...) if (LOG_LEVEL >= LOG_LEVEL_ERROR) LOG_PRINTF("[ERROR] " __VA_ARGS__)
+#define LOG_W(...) if (LOG_LEVEL >= LOG_LEVEL_WARN) LOG_PRINTF("[WARN] " __VA_ARGS__)
+#define LOG_I(...) if (LOG_LEVEL >= LOG_LEVEL_INFO) LOG_PRINTF("[INFO] " __VA_ARGS__)
+#define LOG_D(...) if (LOG_LEVEL >= LOG_LEVEL_DEBUG) LOG_PRINTF("[DEBUG] " __VA_ARGS__)
 
 
 // ==========================================================================
 // ==                         GENERAL SETTINGS                             ==
 // ==========================================================================
-#define PUB_DELAY (1 * 1000)  // 1 second
+#define PUB_DELAY (1 * 1000)  // Telemetry publish period, 1 second
+#define MQTT_PACKET_SIZE 512  // Max MQTT packet, also the size of outgoing payload buffers
+#define MQTT_MAX_SUBSCRIPTIONS 12
+#define MQTT_MAX_TOPIC_LENGTH 96  // Full topic including the device or fleet prefix
+#define MQTT_DEVICE_ID_LENGTH 52  // Longest device_id the portal accepts, terminator included
+#define MQTT_GROUP_LENGTH 24
+#define MQTT_BACKOFF_MIN 500  // ms before retrying after a failed attempt, doubles up to MQTT_BACKOFF_MAX
+#define MQTT_BACKOFF_MAX 30000
+#define MQTT_CONNECT_TIMEOUT 2000  // ms a broker connection attempt may hold up loop()
+#define MQTT_DNS_TIMEOUT 1000  // ms the broker name lookup may hold up loop(), once per Wi-Fi association
+#define WIFI_FAST_CONNECT_TIMEOUT 3000  // ms for the cached access point before falling back to a scan
+#define WIFI_CONNECT_TIMEOUT 15000
+#define WIFI_LEASE_DEFAULT_TIME 3600  // s assumed for a DHCP lease whose time the SDK does not report
+#define WIFI_PORTAL_TIMEOUT 60000  // ms after boot without ever joining Wi-Fi before the setup portal starts
+#define TELEMETRY_STREAM_INTERVAL 10  // Period of the telemetry/subscribe stream task in ms, caps a stream at 100 Hz
+#define TELEMETRY_STREAM_MIN_RATE 0.01f  // Slowest telemetry/subscribe rate in Hz, one sample per 100 s
+#define COMMAND_MAX_AGE 250  // Default ms a command may lag the fastest recent one before it is rejected as stale, "command_max_age" in /config.json
+#define COMMAND_CLOCK_WINDOW 10000  // ms, window of the fastest-transit baseline used for the age
+#define COMMAND_ID_LENGTH 24  // Longest request id echoed in acknowledgements, terminator included
+#define COMMAND_ACK_QUEUE 4
+#define UDP_PORT 4210  // LAN control/telemetry endpoint, enabled by "udp_key" in /config.json
+#define UDP_PEER_TIMEOUT 500  // ms without a valid datagram before the peer is dropped and MQTT takes over
+#define UDP_TELEMETRY_INTERVAL 50  // ms between telemetry datagrams to an active peer
+#define UDP_MAX_DATAGRAM 128
+#define SPOOL_SEGMENTS 32  // Ring of segment files on LittleFS, 128 KB: ~30 min of offline sensors + control frames
+#define SPOOL_SEGMENT_PAGES 16  // Pages per segment file, 4 KB = one flash block
+#define SPOOL_REPLAY_INTERVAL 100  // ms between telemetry/backfill pages after a reconnect
+#define CONFIG_JSON_MAX_SIZE 1024 // Largest /config.json ConfigStore reads, on the stack
 
 
 // ==========================================================================
@@ -47,6 +82,7 @@
 #define STEERING_WHEEL 14
 
 // -- Sonar Pins (for single-pin operation) --
+// GPIO16 cannot interrupt, so the right echo is sampled by a timer instead
 #define SONAR_RIGHT_PING 16
 #define SONAR_LEFT_PING 15
 
@@ -54,6 +90,16 @@
 #define SW_I2C_SCL 12
 #define SW_I2C_SDA 13
 
+// -- I2C Bus --
+#define I2C_CLOCK_SPEED 400000 // Hz, both the MPU6050 and the INA226 support fast mode
+#define I2C_STRETCH_LIMIT 1000 // us a device may hold SCL before the transfer fails
+#define I2C_QUEUE_SIZE 16 // Pending register transactions
+#define I2C_MAX_TRANSFER 128 // Bytes per transfer, the ESP8266 Wire buffer
+#define I2C_MAX_WRITE 4 // Payload bytes of a queued register write
+#define I2C_MAX_DEVICES 4
+#define I2C_DEVICE_MAX_ERRORS 3 // Consecutive failures before a device is backed off
+#define I2C_DEVICE_BACKOFF 1000 // ms a failing device is skipped
+
 
 // ==========================================================================
 // ==                          COMPONENT SETTINGS                          ==
@@ -61,13 +107,23 @@
 
 // -- Sonar Settings --
 #define MAX_DISTANCE 200  // Maximum distance to ping for (in cm)
+#define SONAR_PING_INTERVAL 30  // Gap between consecutive pings of the two sonars in ms (avoids cross-echo)
+#define SONAR_ECHO_POLL_PERIOD 24  // Echo sampling period on a pin without interrupt in us (NewPing ECHO_TIMER_FREQ)
 
 // -- MPU6050 Settings --
 // Note: MPU6050 I2C address is now configurable via captive portal. Default: 0x68
 #define MPU_ADDRESS 0x68
-#define MPU_CALIBRATION_BUFFER_SIZE 100
+#define MPU_CALIBRATION_BUFFER_SIZE 100 // Samples averaged per calibration pass
+#define MPU_CALIBRATION_SETTLE 100 // Samples discarded after each offset change
+#define MPU_CALIBRATION_MAX_PASSES 10
+#define MPU_CALIBRATION_SLICE 10 // getMotion6() reads per calibration tick
+#define MPU_CALIBRATION_ACCEL_TOLERANCE 16 // LSB at +-2 g, 2 offset register steps
+#define MPU_CALIBRATION_GYRO_TOLERANCE 4 // LSB at +-250 deg/s, 1 offset register step
 #define MPU_METRIC_DEVIDER 32768
-#define MPU_MESUAREMENT_DELAY 100  // Delay between MPU measurements in ms (changed to common 100ms)
+#define MPU_INT_PIN -1 // GPIO wired to the MPU INT pin, -1 if not wired (FIFO is polled)
+#define MPU_DMP_RATE_HZ 100 // MotionApps20 FIFO output rate
+#define IMU_HISTORY_SIZE 32 // Timestamped DMP samples kept, power of two
+#define IMU_FIFO_BATCH 8 // DMP packets drained per IMU task run
 
 // -- INA226 Settings --
 // Note: INA226 I2C address is now configurable via captive portal. Default: 0x40
@@ -75,16 +131,48 @@
 #define INA226_SHUNT_RESISTANCE 0.1  // Shunt resistance in ohms (example: 0.1 ohm for current up to 3.2A)
 
 // -- EEPROM Settings --
-#define EEPROM_START_ADDRESS 0x00
-#define EEPROM_PORTAL_FLAG_ADDRESS 100
+#define EEPROM_START_ADDRESS 0x00  // Legacy MPU offsets (int32_t[6]), read once to migrate them to KvStore
+#define EEPROM_PORTAL_FLAG_ADDRESS 100  // Legacy portal flag, read once to migrate it to KvStore
+#define EEPROM_WIFI_CACHE_ADDRESS 128  // Access point and address of the last Wi-Fi connection
+#define RTC_LEASE_CLOCK_BLOCK 64  // RTC user memory block of the DHCP lease age, clear of the OTA boot command at block 0
+
+// -- Key/Value Store Settings --
+#define KV_SECTORS 4  // Flash sectors reserved in ld/eagle.flash.4m2m.kv.ld, written in rotation
+#define KV_MAX_KEYS 8
+#define KV_MAX_VALUE_SIZE 32  // Bytes, a multiple of 4
+#define KV_FLUSH_INTERVAL 60000  // Period of the store task writing staged counters in ms
+#define KV_KEY_MPU_OFFSETS 1  // int16_t[6], offset register units
+#define KV_KEY_PORTAL_REQUESTED 2  // uint8_t, start the setup portal on the next boot
+#define KV_KEY_ENERGY 3  // uint32_t, lifetime energy in uWh
 
 // -- Motor Controller Settings --
-#define MOTOR_UPDATE_INTERVAL 100 // Update motor speed every 100ms (changed to common)
+#define MOTOR_UPDATE_INTERVAL 100 // Default period of the motor task in ms
+#define MOTOR_TICK_INTERVAL 1 // Period of the SDK timer (not an ISR) that ramps the outputs in ms (1 kHz)
+#define MOTOR_SPEED_SCALE 1000 // Internal speed units per percent
+#define MOTOR_DEFAULT_ACCELERATION 20 // Slew rate in percent of full speed per second
+#define MOTOR_PWM_RANGE 1023 // analogWriteRange() default, 10 bits
+#define MOTOR_PWM_FREQUENCY 1000 // analogWriteFreq() default in Hz
 
 // -- Steering Settings --
-#define STEERING_UPDATE_INTERVAL 100 // Update steering angle every 100ms (changed to common)
+#define STEERING_UPDATE_INTERVAL 100 // Default period of the steering task in ms
+
+// -- Drive Kinematics Settings --
+// Defaults of the wheelbase, track_width, ... keys in /config.json
+#define KINEMATICS_WHEELBASE 0.16 // Driven axle to steered axle in m
+#define KINEMATICS_TRACK_WIDTH 0.13 // Between the driven wheels in m
+#define KINEMATICS_MAX_WHEEL_SPEED 0.6 // Wheel speed at 100 % in m/s
+#define KINEMATICS_MAX_STEER_ANGLE 30 // Steered wheels at full servo travel in deg
+#define KINEMATICS_SERVO_CENTER 90 // Servo angle for straight ahead
+#define KINEMATICS_SERVO_TRAVEL 90 // Servo degrees from center to full lock
+#define KINEMATICS_MIN_SPEED 0.01 // m/s below which a yaw rate gives no curvature
 
 // -- Sensor Manager Settings --
-#define SENSOR_UPDATE_INTERVAL 100 // Common update interval for all sensors in ms
+#define SENSOR_UPDATE_INTERVAL 100 // Default period of the power task in ms
+#define SONAR_POLL_INTERVAL 5 // Period of the sonar harvest task in ms
+#define IMU_POLL_INTERVAL 5 // Period of the DMP FIFO drain task in ms
+#define CALIBRATION_UPDATE_INTERVAL 10 // Period of the IMU calibration task in ms
+
+// -- Scheduler Settings --
+#define SCHEDULER_MAX_TASKS 16
 
 #endif // CONFIG_H
@@ -0,0 +1,61 @@
+#include "BootReport.h"
+#include <ArduinoJson.h>
+#include "Hal.h"
+
+static const char* const PHASE_NAMES[BOOT_PHASE_COUNT] = {"storage", "network", "actuators", "sensors", "spool", "tasks"};
+static const char* const MILESTONE_NAMES[BOOT_MILESTONE_COUNT] = {"setup-ms", "wifi-ms", "mqtt-ms", "ready-ms"};
+
+namespace BootReport {
+
+static bool _fast = false;
+static uint32_t _phaseTime[BOOT_PHASE_COUNT];  // us
+static uint32_t _milestones[BOOT_MILESTONE_COUNT];
+static bool _marked[BOOT_MILESTONE_COUNT];
+static uint8_t _phase = BOOT_PHASE_COUNT;
+static uint32_t _phaseStart = 0;
+
+void setFast(bool fast) {
+    _fast = fast;
+}
+
+void phase(BootPhase next) {
+    uint32_t now = hal::clock().micros();
+    if (_phase < BOOT_PHASE_COUNT) {
+        // A phase may run in several pieces, fast boot reorders them
+        _phaseTime[_phase] += now - _phaseStart;
+    }
+    _phase = next;
+    _phaseStart = now;
+}
+
+void milestone(BootMilestone milestone, uint32_t ms) {
+    if (milestone < BOOT_MILESTONE_COUNT && !_marked[milestone]) {
+        _milestones[milestone] = ms;
+        _marked[milestone] = true;
+    }
+}
+
+bool fast() {
+    return _fast;
+}
+
+bool ready() {
+    return _marked[BOOT_READY];
+}
+
+size_t toJson(char* buffer, size_t size) {
+    JsonDocument doc;
+    doc["fast"] = _fast;
+    JsonObject phases = doc["phases-us"].to<JsonObject>();
+    for (uint8_t i = 0; i < BOOT_PHASE_COUNT; i++) {
+        phases[PHASE_NAMES[i]] = _phaseTime[i];
+    }
+    for (uint8_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        if (_marked[i]) {
+            doc[MILESTONE_NAMES[i]] = _milestones[i];
+        }
+    }
+    return serializeJson(doc, buffer, size);
+}
+
+} // namespace BootReport
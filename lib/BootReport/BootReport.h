@@ -0,0 +1,45 @@
+#ifndef BOOT_REPORT_H
+#define BOOT_REPORT_H
+
+#include "Platform.h"
+#include "config.h"
+
+// Time from power-on to the first telemetry, split into the phases of
+// setup() and the milestones after it. setup() calls phase() as it moves
+// on; the milestones are marked where they happen. The report goes out
+// once, retained, on diag/boot.
+
+enum BootPhase : uint8_t {
+    BOOT_STORAGE,    // EEPROM, key/value store, LittleFS mount, config
+    BOOT_NETWORK,    // Transport, Wi-Fi start, UDP
+    BOOT_ACTUATORS,  // Motors and steering
+    BOOT_SENSORS,    // IMU and DMP, sonars, INA226
+    BOOT_SPOOL,
+    BOOT_TASKS,
+    BOOT_PHASE_COUNT
+};
+
+enum BootMilestone : uint8_t {
+    BOOT_SETUP_DONE,
+    BOOT_WIFI,       // Associated and addressed
+    BOOT_MQTT,       // Broker session
+    BOOT_READY,      // First telemetry published
+    BOOT_MILESTONE_COUNT
+};
+
+namespace BootReport {
+
+// Fast boot starts Wi-Fi before the sensors so association overlaps the
+// DMP initialization, and wakes the telemetry task on the first connection
+void setFast(bool fast);
+// Ends the running phase and starts the next; BOOT_PHASE_COUNT only ends it
+void phase(BootPhase next);
+// Time in ms since boot; only the first mark of each milestone counts
+void milestone(BootMilestone milestone, uint32_t ms);
+bool fast();
+bool ready();
+size_t toJson(char* buffer, size_t size);
+
+} // namespace BootReport
+
+#endif // BOOT_REPORT_H
@@ -0,0 +1,112 @@
+#include "CommandTracker.h"
+#include "Hal.h"
+
+CommandTracker::CommandTracker() {
+    _ackHead = 0;
+    _ackCount = 0;
+    _pendingAck = -1;
+    _actuationPending = false;
+    _actuationStart = 0;
+    _maxAge = COMMAND_MAX_AGE;
+    _windowStart = 0;
+    _currentMin = 0;
+    _previousMin = 0;
+    _baselineValid = false;
+    resetStats();
+}
+
+// Differences are compared as signed so both clocks may wrap
+uint32_t CommandTracker::transitDelay(uint32_t senderTime, uint32_t now) {
+    uint32_t offset = now - senderTime;
+    if (!_baselineValid) {
+        _currentMin = _previousMin = offset;
+        _windowStart = now;
+        _baselineValid = true;
+    } else if (now - _windowStart >= COMMAND_CLOCK_WINDOW) {
+        _previousMin = _currentMin;
+        _currentMin = offset;
+        _windowStart = now;
+    } else if ((int32_t)(offset - _currentMin) < 0) {
+        _currentMin = offset;
+    }
+
+    uint32_t baseline = (int32_t)(_previousMin - _currentMin) < 0 ? _previousMin : _currentMin;
+    int32_t delay = (int32_t)(offset - baseline);
+    delay = max(delay, (int32_t)0);
+    recordLatency(LATENCY_TRANSIT, delay);
+    return delay;
+}
+
+void CommandTracker::record(const char* id, uint32_t sequence, uint32_t senderTime, uint32_t delay, CommandStatus status) {
+    if (status == COMMAND_STALE) {
+        _stale++;
+    }
+    if (status == COMMAND_PENDING) {
+        if (_pendingAck >= 0) {
+            _acks[_pendingAck].status = COMMAND_SUPERSEDED;
+            _pendingAck = -1;
+        }
+        _actuationPending = true;
+        _actuationStart = hal::clock().micros();
+    }
+    if (!id || !id[0]) {
+        return;
+    }
+    if (_ackCount >= COMMAND_ACK_QUEUE) {
+        LOG_W("Command ack queue full, %s not acknowledged\n", id);
+        return;
+    }
+
+    uint8_t slot = (_ackHead + _ackCount++) % COMMAND_ACK_QUEUE;
+    if (status == COMMAND_PENDING) {
+        _pendingAck = slot;
+    }
+    CommandAck& ack = _acks[slot];
+    strncpy(ack.id, id, sizeof(ack.id) - 1);
+    ack.id[sizeof(ack.id) - 1] = '\0';
+    ack.sequence = sequence;
+    ack.senderTime = senderTime;
+    ack.received = hal::clock().millis();
+    ack.delay = delay;
+    ack.actuation = 0;
+    ack.status = status;
+}
+
+void CommandTracker::actuated(uint32_t time) {
+    if (!_actuationPending) {
+        return;
+    }
+    _actuationPending = false;
+    uint32_t latency = (int32_t)(time - _actuationStart) > 0 ? time - _actuationStart : 0;
+    recordLatency(LATENCY_ACTUATION, latency);
+
+    if (_pendingAck >= 0) {
+        _acks[_pendingAck].actuation = latency;
+        _acks[_pendingAck].status = COMMAND_ACTUATED;
+        _pendingAck = -1;
+    }
+}
+
+bool CommandTracker::nextAck(CommandAck& ack) {
+    if (_ackCount == 0 || _acks[_ackHead].status == COMMAND_PENDING) {
+        return false;
+    }
+    ack = _acks[_ackHead];
+    _ackHead = (_ackHead + 1) % COMMAND_ACK_QUEUE;
+    _ackCount--;
+    return true;
+}
+
+void CommandTracker::recordLatency(uint8_t stage, uint32_t value) {
+    ProfileStats& stats = _stats[stage];
+    if (stats.count == 0 || value < stats.min) stats.min = value;
+    if (value > stats.max) stats.max = value;
+    stats.count++;
+    stats.total += value;
+    stats.histogram[value ? 31 - __builtin_clz(value) : 0]++;
+}
+
+void CommandTracker::resetStats() {
+    memset(_stats, 0, sizeof(_stats));
+    _stale = 0;
+}
@@ -0,0 +1,84 @@
+#ifndef COMMAND_TRACKER_H
+#define COMMAND_TRACKER_H
+
+#include "Platform.h"
+#include "config.h"
+#include "Profiler.h"
+
+// Age, acknowledgement and latency bookkeeping of remote commands.
+//
+// The sender clock is not synchronised with ours, so the age of a command
+// is measured against the fastest one seen recently: the smallest
+// (receive time - sender time) over the last two COMMAND_CLOCK_WINDOWs is
+// taken as "no delay". Windows only rotate when commands arrive, so a
+// backlog flushed after an outage is still compared with the baseline
+// from before it.
+
+enum CommandStatus : uint8_t {
+    COMMAND_PENDING,     // Applied, waiting for the motor outputs to change
+    COMMAND_ACTUATED,
+    COMMAND_STALE,       // Older than the max age, not applied
+    COMMAND_OUT_OF_ORDER,
+    COMMAND_SUPERSEDED   // Replaced by a newer command before it was actuated
+};
+
+struct CommandAck {
+    char id[COMMAND_ID_LENGTH];
+    uint32_t sequence;
+    uint32_t senderTime;   // As sent, ms
+    uint32_t received;     // millis()
+    uint32_t delay;        // ms beyond the fastest recent transit
+    uint32_t actuation;    // us from receive to the first motor output change, when actuated
+    CommandStatus status;
+};
+
+enum LatencyStage : uint8_t {
+    LATENCY_TRANSIT,     // ms beyond the fastest recent transit
+    LATENCY_ACTUATION,   // us from receive to the first motor output change
+    LATENCY_STAGE_COUNT
+};
+
+class CommandTracker {
+public:
+    CommandTracker();
+
+    // Delay of a command sent at senderTime, received now, in ms
+    uint32_t transitDelay(uint32_t senderTime, uint32_t now);
+    bool isStale(uint32_t delay) const { return delay > _maxAge; }
+    // COMMAND_MAX_AGE until set
+    void setMaxAge(uint32_t maxAge) { _maxAge = maxAge; }
+    uint32_t getMaxAge() const { return _maxAge; }
+
+    // Records a command; an id makes it acknowledged. Applied commands
+    // stay pending until actuated() is called.
+    void record(const char* id, uint32_t sequence, uint32_t senderTime, uint32_t delay, CommandStatus status);
+    // The pending command took effect at time (micros())
+    void actuated(uint32_t time);
+    // Oldest acknowledgement ready to publish
+    bool nextAck(CommandAck& ack);
+
+    const ProfileStats& getStats(uint8_t stage) const { return _stats[stage]; }
+    uint32_t getStaleCount() const { return _stale; }
+    void resetStats();
+
+private:
+    void recordLatency(uint8_t stage, uint32_t value);
+
+    CommandAck _acks[COMMAND_ACK_QUEUE];  // FIFO, published in order
+    uint8_t _ackHead;
+    uint8_t _ackCount;
+    int8_t _pendingAck;  // Slot waiting for actuation, -1 if none
+    bool _actuationPending;
+    uint32_t _actuationStart;  // micros() when the pending command arrived
+
+    uint32_t _maxAge;
+    uint32_t _windowStart;
+    uint32_t _currentMin;
+    uint32_t _previousMin;
+    bool _baselineValid;
+
+    ProfileStats _stats[LATENCY_STAGE_COUNT];
+    uint32_t _stale;
+};
+
+#endif // COMMAND_TRACKER_H
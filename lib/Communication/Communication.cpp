@@ -1,170 +1,849 @@
 #include "Communication.h"
 #include "config.h"
 #include <ArduinoJson.h>
-#include <LittleFS.h>
-#include <EEPROM.h>
+#include "Profiler.h"
+#include "TelemetryStreams.h"
+#include "DriveKinematics.h"
+#include "CommandTracker.h"
+#include "TopicDispatch.h"
+#include "UdpLink.h"
+#include "ControlLoop.h"
+#include "BootReport.h"
 
-// TODO: Move credentials to a more secure location
-String wifi_ssid, wifi_pass, mqtt_server, mqtt_port_str, device_id;
-EspMQTTClient* client = nullptr;
+hal::MqttTransport* client = nullptr;
 
 MotorController* _motorController;
 SensorManager* _sensorManager;
 Steering* _steering;
+Scheduler* _scheduler;
+I2cQueue* _i2cQueue;
+TelemetrySpool* _spool;
+static ConfigStore* _configStore = nullptr;
+
+// Last control/drive sequence number applied. Restarts on reconnect or
+// when a sender starts over at 0.
+static uint32_t _driveSequence = 0;
+static bool _driveSequenceValid = false;
+static CommandTracker _commandTracker;
+static bool _udpControl = false;
+static bool _wasConnected = false;
+
+// While a UDP peer drives the robot, MQTT motion commands are ignored
+static bool mqttDriveAllowed(const char* topic) {
+  if (_udpControl) {
+    LOG_D("%s ignored, UDP peer in control\n", topic);
+    return false;
+  }
+  return true;
+}
 
-void onConnectionEstablished() {
-  LOG_I("MQTT connected, subscribing to topics...\n");
-  client->subscribe("service/calibrate-mcu", [] (const String &payload)  {
-      LOG_I("Remote calibration command accepted. Start Calibration...");
-    _sensorManager->calibrateMPU();
-
-    JsonDocument response;
-    response["accel-x"] = _sensorManager->getAccelXOffset();
-    response["accel-y"] = _sensorManager->getAccelYOffset();
-    response["accel-z"] = _sensorManager->getAccelZOffset();
-    response["gyro-x"] = _sensorManager->getGyroXOffset();
-    response["gyro-y"] = _sensorManager->getGyroYOffset();
-    response["gyro-z"] = _sensorManager->getGyroZOffset();
-
-    String output;
-    serializeJson(response, output);
-    client->publish("service/calibrate-mcu-result", output);
-  });
-
-  client->subscribe("service/restart", [] (const String &payload)  {
-      LOG_I("Remote restart command accepted. Restarting...");
-    Communication::requestRestart();
-  });
-  
-  client->subscribe("engines/left/speed_percent", [] (const String &payload)  {
-    LOG_I("engines/left/speed_percent -> %d\n", payload.toInt());
-    _motorController->setLeftSpeedPercent(payload.toInt());
-  });
-
-  client->subscribe("engines/right/speed_percent", [] (const String &payload)  {
-    LOG_I("engines/right/speed_percent -> %d\n", payload.toInt());
-    _motorController->setRightSpeedPercent(payload.toInt());
-  });
-
-  client->subscribe("engines/left/acceleration", [] (const String &payload)  {
-    LOG_I("engines/left/acceleration -> %d\n", payload.toInt());
-    _motorController->setLeftAcceleration(payload.toInt());
-  });
-
-  client->subscribe("engines/right/acceleration", [] (const String &payload)  {
-    LOG_I("engines/right/acceleration -> %d\n", payload.toInt());
-    _motorController->setRightAcceleration(payload.toInt());
-  });
-
-  client->subscribe("steering-wheel/rotate", [] (const String &payload)  {
-    LOG_I("steering-wheel/rotate -> %d\n", payload.toInt());
-    _steering->setAngle(payload.toInt());
-  });
-
-  client->subscribe("steering-wheel/acceleration", [] (const String &payload)  {
-    LOG_I("steering-wheel/acceleration -> %d\n", payload.toInt());
-    _steering->setAcceleration(payload.toInt());
-  });
-
-  client->subscribe("service/scan-i2c", [] (const String &payload)  {
-    LOG_I("I2C scan command received. Starting scan...\n");
+static const char* commandStatusName(CommandStatus status) {
+  switch (status) {
+    case COMMAND_ACTUATED: return "ok";
+    case COMMAND_STALE: return "stale";
+    case COMMAND_OUT_OF_ORDER: return "out-of-order";
+    case COMMAND_SUPERSEDED: return "superseded";
+    default: return "pending";
+  }
+}
+
+static void publishLatencyStats(const char* stage, const char* unit, const ProfileStats& stats) {
+  JsonDocument doc;
+  doc["stage"] = stage;
+  doc["unit"] = unit;
+  doc["count"] = stats.count;
+  doc["min"] = stats.min;
+  doc["max"] = stats.max;
+  doc["mean"] = stats.count ? (uint32_t)(stats.total / stats.count) : 0;
+  doc["stale"] = _commandTracker.getStaleCount();
+  doc["max-age"] = _commandTracker.getMaxAge();
+
+  // Same trimmed log2 histogram as diag/loop-profile
+  int first = -1, last = -1;
+  for (uint8_t bucket = 0; bucket < PROFILE_HISTOGRAM_BUCKETS; bucket++) {
+    if (stats.histogram[bucket]) {
+      if (first < 0) first = bucket;
+      last = bucket;
+    }
+  }
+  doc["hist-base"] = first < 0 ? 0 : first;
+  JsonArray hist = doc["hist"].to<JsonArray>();
+  for (int bucket = first; first >= 0 && bucket <= last; bucket++) {
+    hist.add(stats.histogram[bucket]);
+  }
+
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("service/command-latency-result", output);
+}
+
+// One telemetry/subscribe entry; a rejection is recorded in response
+static bool applyStreamRequest(JsonObject request, JsonDocument& response) {
+  const char* channel = request["channel"] | "";
+  float rate = request["rate"] | 0.0f;
+  float deadband = request["deadband"] | -1.0f;
+  if (strcmp(channel, "all") == 0 && rate == 0) {
+    TelemetryStreams::unsubscribeAll();
+    return true;
+  }
+  if (TelemetryStreams::subscribe(channel, rate, deadband) != STREAM_OK) {
+    LOG_W("telemetry/subscribe: rejected %s\n", channel);
+    response["status"] = "rejected";
+    response["channel"] = channel;
+    return false;
+  }
+  LOG_I("telemetry/subscribe: %s at %d mHz\n", channel, (int)(rate * 1000));
+  return true;
+}
+
+static void onCalibrate(const char* payload, size_t length) {
+  // Runs in the background from the calibration task, which reports
+  // progress and the result
+  if (!_sensorManager->startCalibration()) {
+    Communication::publish("service/calibrate-mcu-result", "{\"status\":\"busy\"}");
+    return;
+  }
+  LOG_I("Remote calibration command accepted. Calibration started\n");
+  _motorController->setHold(true);
+}
+
+static void onRestart(const char* payload, size_t length) {
+  LOG_I("Remote restart command accepted. Restarting...");
+  Communication::requestRestart();
+}
+
+// The engines/* and steering-wheel/* payloads are a bare number with no
+// sender time or id, so these commands are neither checked for age nor
+// acknowledged. They still replace the targets of a pending control/drive,
+// which then reports superseded rather than their actuation.
+static void untrackedCommand() {
+  _commandTracker.record(nullptr, 0, 0, 0, COMMAND_PENDING);
+}
+
+static void onLeftSpeed(const char* payload, size_t length) {
+  if (!mqttDriveAllowed("engines/left/speed_percent")) return;
+  int value = atoi(payload);
+  LOG_I("engines/left/speed_percent -> %d\n", value);
+  _motorController->setLeftSpeedPercent(value);
+  untrackedCommand();
+}
+
+static void onRightSpeed(const char* payload, size_t length) {
+  if (!mqttDriveAllowed("engines/right/speed_percent")) return;
+  int value = atoi(payload);
+  LOG_I("engines/right/speed_percent -> %d\n", value);
+  _motorController->setRightSpeedPercent(value);
+  untrackedCommand();
+}
+
+static void onLeftAcceleration(const char* payload, size_t length) {
+  if (!mqttDriveAllowed("engines/left/acceleration")) return;
+  int value = atoi(payload);
+  LOG_I("engines/left/acceleration -> %d\n", value);
+  _motorController->setLeftAcceleration(value);
+}
+
+static void onRightAcceleration(const char* payload, size_t length) {
+  if (!mqttDriveAllowed("engines/right/acceleration")) return;
+  int value = atoi(payload);
+  LOG_I("engines/right/acceleration -> %d\n", value);
+  _motorController->setRightAcceleration(value);
+}
+
+static void onSteeringRotate(const char* payload, size_t length) {
+  if (!mqttDriveAllowed("steering-wheel/rotate")) return;
+  int value = atoi(payload);
+  LOG_I("steering-wheel/rotate -> %d\n", value);
+  _steering->setAngle(value);
+  untrackedCommand();
+}
+
+  // Both wheels and the steering in one message. All targets are set in this
+  // callback, so the next motors/steering pass applies them together.
+static void onDrive(const char* payload, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length) || !doc["seq"].is<uint32_t>()) {
+    LOG_W("control/drive: invalid command\n");
+    return;
+  }
+  if (!mqttDriveAllowed("control/drive")) return;
+  uint32_t sequence = doc["seq"];
+  const char* id = doc["id"] | "";
+
+  // Only the low 32 bits of the sender time matter for the age
+  uint32_t senderTime = (uint32_t)(doc["time"] | (uint64_t)0);
+  uint32_t delay = doc["time"].isNull() ? 0 : _commandTracker.transitDelay(senderTime, hal::clock().millis());
+  if (_commandTracker.isStale(delay)) {
+    LOG_W("control/drive: seq %lu is %lu ms late, rejected\n", (unsigned long)sequence, (unsigned long)delay);
+    _commandTracker.record(id, sequence, senderTime, delay, COMMAND_STALE);
+    return;
+  }
+  if (_driveSequenceValid && sequence != 0 && (int32_t)(sequence - _driveSequence) <= 0) {
+    LOG_D("control/drive: dropped seq %lu, last %lu\n", (unsigned long)sequence, (unsigned long)_driveSequence);
+    _commandTracker.record(id, sequence, senderTime, delay, COMMAND_OUT_OF_ORDER);
+    return;
+  }
+  _driveSequence = sequence;
+  _driveSequenceValid = true;
+
+  // Omitted fields keep their current target
+  DriveCommand drive = {};
+  const char* const keys[] = {"left", "right", "steering", "left-acceleration", "right-acceleration", "steering-acceleration"};
+  int16_t* const values[] = {&drive.left, &drive.right, &drive.steering, &drive.leftAcceleration, &drive.rightAcceleration, &drive.steeringAcceleration};
+  for (uint8_t i = 0; i < 6; i++) {
+    if (doc[keys[i]].is<int>()) {
+      *values[i] = doc[keys[i]];
+      drive.fields |= 1 << i;
+    }
+  }
+  // "v" with "curvature" or "omega" replaces left, right and steering;
+  // "v" alone drives straight
+  if (doc["v"].is<float>()) {
+    float velocity = doc["v"];
+    float curvature = doc["curvature"] | 0.0f;
+    if (doc["omega"].is<float>() && !doc["curvature"].is<float>()) {
+      float omega = doc["omega"];
+      curvature = fabsf(velocity) < KINEMATICS_MIN_SPEED ? 0 : omega / velocity;
+    }
+    drive.velocity = (int16_t)constrain(lroundf(velocity * 1000), -32767L, 32767L);
+    drive.curvature = (int16_t)constrain(lroundf(curvature * 1000), -32767L, 32767L);
+    drive.fields |= DRIVE_KINEMATIC;
+  }
+  Communication::applyDrive(drive);
+  _commandTracker.record(id, sequence, senderTime, delay, COMMAND_PENDING);
+  LOG_D("control/drive: seq %lu, %lu ms late\n", (unsigned long)sequence, (unsigned long)delay);
+}
+
+static void onSteeringAcceleration(const char* payload, size_t length) {
+  if (!mqttDriveAllowed("steering-wheel/acceleration")) return;
+  int value = atoi(payload);
+  LOG_I("steering-wheel/acceleration -> %d\n", value);
+  _steering->setAcceleration(value);
+}
+
+static void onScanI2c(const char* payload, size_t length) {
+  LOG_I("I2C scan command received. Starting scan...\n");
+  JsonDocument doc;
+  JsonArray arr = doc.to<JsonArray>();
+
+  for (uint8_t addr = 0x03; addr <= 0x77; addr++) {
+    if (hal::i2c().probe(addr)) {
+      char hexAddr[8];
+      sprintf(hexAddr, "0x%02X", addr);
+      arr.add(hexAddr);
+    }
+  }
+
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("service/scan-i2c-result", output);
+  LOG_I("I2C scan completed. Found %u devices.\n", (unsigned)arr.size());
+}
+
+static void onTasks(const char* payload, size_t length) {
+  LOG_I("Task stats requested\n");
+  // One message per task keeps each payload below the MQTT packet size
+  for (uint8_t i = 0; i < _scheduler->getTaskCount(); i++) {
+    const TaskStats& stats = _scheduler->getTaskStats(i);
+    JsonDocument doc;
+    doc["task"] = _scheduler->getTaskName(i);
+    doc["period"] = _scheduler->getTaskPeriod(i);
+    doc["runs"] = stats.runs;
+    doc["overruns"] = stats.overruns;
+    doc["skipped"] = stats.skipped;
+    doc["jitter"] = stats.lastJitter;
+    doc["max-jitter"] = stats.maxJitter;
+    doc["duration"] = stats.lastDuration;
+    doc["max-duration"] = stats.maxDuration;
+
+    char output[MQTT_PACKET_SIZE];
+    serializeJson(doc, output, sizeof(output));
+    Communication::publish("service/tasks-result", output);
+  }
+
+  if (strcmp(payload, "reset") == 0) {
+    _scheduler->resetStats();
+  }
+}
+
+static void onI2cStats(const char* payload, size_t length) {
+  LOG_I("I2C stats requested\n");
+  // One message per device, like service/tasks
+  for (uint8_t i = 0; i < _i2cQueue->getDeviceCount(); i++) {
+    const I2cDeviceStats& stats = _i2cQueue->getDeviceStats(i);
+    char address[8];
+    sprintf(address, "0x%02X", _i2cQueue->getDeviceAddress(i));
+
+    JsonDocument doc;
+    doc["device"] = _i2cQueue->getDeviceName(i);
+    doc["address"] = address;
+    doc["transfers"] = stats.transfers;
+    doc["errors"] = stats.errors;
+    doc["merged"] = stats.merged;
+    doc["skipped"] = stats.skipped;
+    doc["recoveries"] = _i2cQueue->getRecoveryCount();
+
+    char output[MQTT_PACKET_SIZE];
+    serializeJson(doc, output, sizeof(output));
+    Communication::publish("service/i2c-stats-result", output);
+  }
+
+  if (strcmp(payload, "reset") == 0) {
+    _i2cQueue->resetStats();
+  }
+}
+
+static void onCommandLatency(const char* payload, size_t length) {
+  LOG_I("Command latency requested\n");
+  publishLatencyStats("transit", "ms", _commandTracker.getStats(LATENCY_TRANSIT));
+  publishLatencyStats("actuation", "us", _commandTracker.getStats(LATENCY_ACTUATION));
+
+  if (strcmp(payload, "reset") == 0) {
+    _commandTracker.resetStats();
+  }
+}
+
+static void onTaskPeriod(const char* payload, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length)) {
+    LOG_W("service/task-period: invalid JSON\n");
+    return;
+  }
+  const char* task = doc["task"] | "";
+  unsigned long period = doc["period"] | 0;
+  if (period == 0 || !_scheduler->setPeriod(task, period)) {
+    LOG_W("service/task-period: rejected %s -> %lu\n", task, period);
+    return;
+  }
+  LOG_I("service/task-period: %s -> %lu ms\n", task, period);
+}
+
+#if defined(ENABLE_PROFILER)
+static void onLoopProfile(const char* payload, size_t length) {
+  LOG_I("Loop profile requested\n");
+  // One message per stage keeps each payload below the MQTT packet size
+  for (uint8_t stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    const ProfileStats& stats = Profiler::getStats(stage);
     JsonDocument doc;
-    JsonArray arr = doc.to<JsonArray>();
-
-    for (uint8_t addr = 0x03; addr <= 0x77; addr++) {
-      Wire.beginTransmission(addr);
-      if (Wire.endTransmission() == 0) {
-        char hexAddr[8];
-        sprintf(hexAddr, "0x%02X", addr);
-        arr.add(hexAddr);
+    doc["stage"] = Profiler::stageName(stage);
+    doc["ticks-per-us"] = Profiler::ticksPerMicrosecond();
+    doc["count"] = stats.count;
+    doc["min"] = stats.min;
+    doc["max"] = stats.max;
+    doc["mean"] = stats.count ? (uint32_t)(stats.total / stats.count) : 0;
+    doc["p99"] = Profiler::percentile(stage, 99);
+
+    // Histogram trimmed to the populated range, "hist-base" is the first bucket's log2
+    int first = -1, last = -1;
+    for (uint8_t bucket = 0; bucket < PROFILE_HISTOGRAM_BUCKETS; bucket++) {
+      if (stats.histogram[bucket]) {
+        if (first < 0) first = bucket;
+        last = bucket;
+      }
+    }
+    doc["hist-base"] = first < 0 ? 0 : first;
+    JsonArray hist = doc["hist"].to<JsonArray>();
+    for (int bucket = first; first >= 0 && bucket <= last; bucket++) {
+      hist.add(stats.histogram[bucket]);
+    }
+
+    char output[MQTT_PACKET_SIZE];
+    serializeJson(doc, output, sizeof(output));
+    Communication::publish("diag/loop-profile", output);
+  }
+
+  if (strcmp(payload, "reset") == 0) {
+    Profiler::reset();
+  }
+}
+#endif
+
+static void onTelemetryFormat(const char* payload, size_t length) {
+  TelemetryFormat format;
+  if (strcmp(payload, "json") == 0) {
+    format = TELEMETRY_FORMAT_JSON;
+  } else if (strcmp(payload, "bin") == 0) {
+    format = TELEMETRY_FORMAT_BINARY;
+  } else if (strcmp(payload, "both") == 0) {
+    format = TELEMETRY_FORMAT_BOTH;
+  } else if (strcmp(payload, "off") == 0) {
+    format = TELEMETRY_FORMAT_OFF;
+  } else {
+    LOG_W("service/telemetry-format: unknown format %s\n", payload);
+    Communication::publish("service/telemetry-format-result", "{\"status\":\"rejected\"}");
+    return;
+  }
+  LOG_I("service/telemetry-format -> %s\n", payload);
+  Communication::setTelemetryFormat(format);
+
+  JsonDocument response;
+  response["status"] = "ok";
+  response["format"] = payload;
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(response, output, sizeof(output));
+  Communication::publish("service/telemetry-format-result", output);
+}
+
+static void onTelemetrySubscribe(const char* payload, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length)) {
+    LOG_W("telemetry/subscribe: invalid JSON\n");
+    Communication::publish("telemetry/subscribe-result", "{\"status\":\"rejected\"}");
+    return;
+  }
+
+  // A single request or an array of them
+  JsonDocument response;
+  response["status"] = "ok";
+  if (doc.is<JsonArray>()) {
+    for (JsonObject request : doc.as<JsonArray>()) {
+      if (!applyStreamRequest(request, response)) break;
+    }
+  } else {
+    applyStreamRequest(doc.as<JsonObject>(), response);
+  }
+  response["active"] = TelemetryStreams::getActiveCount();
+
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(response, output, sizeof(output));
+  Communication::publish("telemetry/subscribe-result", output);
+}
+
+static void onTelemetryBatch(const char* payload, size_t length) {
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length)) {
+    LOG_W("telemetry/batch: invalid JSON\n");
+    Communication::publish("telemetry/batch-result", "{\"status\":\"rejected\"}");
+    return;
+  }
+  const char* channel = doc["channel"] | "";
+  uint32_t maxAge = doc["max-age"] | 0;
+
+  JsonDocument response;
+  if (TelemetryStreams::setBatch(channel, maxAge) == STREAM_OK) {
+    LOG_I("telemetry/batch: %s, max age %lu ms\n", channel, (unsigned long)maxAge);
+    response["status"] = "ok";
+  } else {
+    LOG_W("telemetry/batch: rejected %s\n", channel);
+    response["status"] = "rejected";
+    response["channel"] = channel;
+  }
+  response["batches"] = TelemetryStreams::getBatchCount();
+
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(response, output, sizeof(output));
+  Communication::publish("telemetry/batch-result", output);
+}
+
+static void onStartPortal(const char* payload, size_t length) {
+  LOG_I("Start portal command received. Setting portal flag and restarting...\n");
+  Communication::requestPortal();
+
+  JsonDocument response;
+  response["status"] = "accepted";
+  response["message"] = "Portal will start after restart";
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(response, output, sizeof(output));
+  Communication::publish("service/start-portal-result", output);
+}
+
+static void onMqttStats(const char* payload, size_t length);
+
+static void onSpool(const char* payload, size_t length) {
+  if (!_spool) {
+    Communication::publish("service/spool-result", "{\"status\":\"disabled\"}");
+    return;
+  }
+  const SpoolStats& stats = _spool->getStats();
+  JsonDocument doc;
+  doc["pages"] = _spool->getStoredPages();
+  doc["capacity"] = _spool->getCapacityPages();
+  doc["fill"] = _spool->getStoredPages() * 100 / _spool->getCapacityPages();
+  doc["records"] = stats.records;
+  doc["dropped"] = stats.dropped;
+  doc["backfilled"] = stats.backfilled;
+  doc["write-errors"] = stats.writeErrors;
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("service/spool-result", output);
+
+  if (strcmp(payload, "reset") == 0) {
+    _spool->resetStats();
+  }
+}
+
+static const char* connectionStateName(hal::ConnectionState state) {
+  switch (state) {
+    case hal::CONNECTION_WIFI_CONNECTING: return "wifi-connecting";
+    case hal::CONNECTION_MQTT_CONNECTING: return "mqtt-connecting";
+    case hal::CONNECTION_CONNECTED: return "connected";
+    case hal::CONNECTION_BACKOFF: return "backoff";
+  }
+  return "unknown";
+}
+
+static void onConfigGet(const char* payload, size_t length) {
+  if (!_configStore) {
+    Communication::publish("config/get-result", "{\"status\":\"disabled\"}");
+    return;
+  }
+  char output[MQTT_PACKET_SIZE];
+  _configStore->toJson(output, sizeof(output), CONFIG_SECRET_FIELDS);
+  Communication::publish("config/get-result", output);
+}
+
+static uint8_t _dispatchNamespace = 0;
+
+// Live fields take effect at once; the rest are saved for the next boot.
+// Fleet namespaces may only change live fields, so a fleet-wide message
+// cannot rename every robot or move them all to another network.
+static void onConfigSet(const char* payload, size_t length) {
+  if (!_configStore) {
+    Communication::publish("config/set-result", "{\"status\":\"disabled\"}");
+    return;
+  }
+  uint32_t allowed = _dispatchNamespace == 0 ? 0xFFFFFFFF : CONFIG_LIVE_FIELDS;
+  uint32_t changed;
+  const char* error;
+  JsonDocument doc;
+  if (!_configStore->update(payload, length, allowed, changed, error)) {
+    LOG_W("config/set rejected: %s\n", error);
+    doc["status"] = "error";
+    doc["error"] = error;
+  } else {
+    ControlLoop::applyConfig(_configStore->get(), changed & CONFIG_LIVE_FIELDS);
+    doc["status"] = "ok";
+    JsonArray applied = doc["applied"].to<JsonArray>();
+    JsonArray restart = doc["restart"].to<JsonArray>();
+    for (uint8_t i = 0; i < 32; i++) {
+      uint32_t field = 1u << i;
+      if (changed & field) {
+        (field & CONFIG_LIVE_FIELDS ? applied : restart).add(ConfigStore::fieldName(field));
       }
     }
+    LOG_I("config/set: %u fields changed\n", (unsigned)__builtin_popcount(changed));
+  }
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("config/set-result", output);
+}
+
+static void onConnection(const char* payload, size_t length) {
+  const hal::ConnectionStats& stats = client->getConnectionStats();
+  JsonDocument doc;
+  doc["state"] = connectionStateName(client->getState());
+  doc["connects"] = stats.connects;
+  doc["attempts"] = stats.attempts;
+  doc["drops"] = stats.drops;
+  doc["wifi-connects"] = stats.wifiConnects;
+  doc["wifi-ms"] = stats.wifiTime;
+  doc["connect-ms"] = stats.connectTime;
+  doc["max-connect-ms"] = stats.maxConnectTime;
+  doc["fast-connect"] = stats.fastConnect;
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("service/connection-result", output);
+}
+
+// Topics are matched exactly; the subscriptions below only decide what the
+// broker sends.
+static constexpr TopicRoute ROUTES[] = {
+  TOPIC_ROUTE("engines/left/speed_percent", onLeftSpeed),
+  TOPIC_ROUTE("engines/right/speed_percent", onRightSpeed),
+  TOPIC_ROUTE("engines/left/acceleration", onLeftAcceleration),
+  TOPIC_ROUTE("engines/right/acceleration", onRightAcceleration),
+  TOPIC_ROUTE("steering-wheel/rotate", onSteeringRotate),
+  TOPIC_ROUTE("steering-wheel/acceleration", onSteeringAcceleration),
+  TOPIC_ROUTE("control/drive", onDrive),
+  TOPIC_ROUTE("telemetry/subscribe", onTelemetrySubscribe),
+  TOPIC_ROUTE("telemetry/batch", onTelemetryBatch),
+  TOPIC_ROUTE("service/calibrate-mcu", onCalibrate),
+  TOPIC_ROUTE("service/restart", onRestart),
+  TOPIC_ROUTE("service/scan-i2c", onScanI2c),
+  TOPIC_ROUTE("service/tasks", onTasks),
+  TOPIC_ROUTE("service/i2c-stats", onI2cStats),
+  TOPIC_ROUTE("service/command-latency", onCommandLatency),
+  TOPIC_ROUTE("service/task-period", onTaskPeriod),
+#if defined(ENABLE_PROFILER)
+  TOPIC_ROUTE("service/loop-profile", onLoopProfile),
+#endif
+  TOPIC_ROUTE("service/telemetry-format", onTelemetryFormat),
+  TOPIC_ROUTE("service/mqtt-stats", onMqttStats),
+  TOPIC_ROUTE("service/spool", onSpool),
+  TOPIC_ROUTE("service/connection", onConnection),
+  TOPIC_ROUTE("config/get", onConfigGet),
+  TOPIC_ROUTE("config/set", onConfigSet),
+  TOPIC_ROUTE("service/start-portal", onStartPortal),
+};
+static_assert(topicsUnique(ROUTES), "Topic hash collision, rename a topic");
+
+// Filters under the device namespace, where this module publishes nothing
+// else. MQTT 3.1.1 has no no-local option, so a wildcard over control/ or
+// telemetry/ would have the broker echo every telemetry message back to us.
+// Under service/ only the occasional *-result reply comes back. The fleet
+// namespaces carry commands only and get a single "#" each.
+static const char* const SUBSCRIPTIONS[] = {
+  "engines/+/+",
+  "steering-wheel/+",
+  "service/+",
+  "control/drive",
+  "telemetry/subscribe",
+  "telemetry/batch",
+  "config/+",
+};
+
+#define NAMESPACE_COUNT 3
+
+static char _deviceId[MQTT_DEVICE_ID_LENGTH] = "";
+static char _group[MQTT_GROUP_LENGTH] = "";
+// "<device>/", "fleet/all/" and "fleet/<group>/" when a group is set
+static char _namespaces[NAMESPACE_COUNT][MQTT_DEVICE_ID_LENGTH + 1];
+static uint8_t _namespaceCount = 0;
+
+// Copies a device or group name, replacing characters that are not allowed
+// in a topic level
+static void copyTopicLevel(char* target, size_t size, const char* name) {
+  size_t i = 0;
+  for (; name[i] && i < size - 1; i++) {
+    char c = name[i];
+    target[i] = (c == '/' || c == '+' || c == '#') ? '_' : c;
+  }
+  target[i] = '\0';
+  if (name[i] || strpbrk(name, "/+#")) {
+    LOG_W("Topic level \"%s\" shortened or sanitized to \"%s\"\n", name, target);
+  }
+}
+
+// Strips the namespace prefix; nullptr when the topic is in none of them
+static const char* localTopic(const char* topic, uint8_t& index) {
+  for (uint8_t i = 0; i < _namespaceCount; i++) {
+    size_t length = strlen(_namespaces[i]);
+    if (strncmp(topic, _namespaces[i], length) == 0) {
+      index = i;
+      return topic + length;
+    }
+  }
+  return nullptr;
+}
 
-    String output;
-    serializeJson(doc, output);
-    client->publish("service/scan-i2c-result", output);
-    LOG_I("I2C scan completed. Found %d devices.\n", arr.size());
-  });
+static uint32_t _messagesReceived = 0;
+static uint32_t _unknownTopics = 0;
+static char _lastUnknownTopic[MQTT_MAX_TOPIC_LENGTH] = "";
+
+static void dispatch(const char* topic, const char* payload, size_t length) {
+  _messagesReceived++;
+  const char* local = localTopic(topic, _dispatchNamespace);
+  const TopicRoute* route = local ? findRoute(ROUTES, local) : nullptr;
+  if (route) {
+    route->handler(payload, length);
+    return;
+  }
+
+  size_t topicLength = strlen(topic);
+  if (topicLength > 7 && strcmp(topic + topicLength - 7, "-result") == 0) {
+    return;  // Our own reply, see SUBSCRIPTIONS
+  }
+  _unknownTopics++;
+  strncpy(_lastUnknownTopic, topic, sizeof(_lastUnknownTopic) - 1);
+  LOG_D("No handler for %s\n", topic);
+}
 
-  client->subscribe("service/start-portal", [] (const String &payload)  {
-    LOG_I("Start portal command received. Setting portal flag and restarting...\n");
-    Communication::requestPortal();
+static void onMqttStats(const char* payload, size_t length) {
+  JsonDocument doc;
+  doc["received"] = _messagesReceived;
+  doc["unknown"] = _unknownTopics;
+  doc["last-unknown"] = _lastUnknownTopic;
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("service/mqtt-stats-result", output);
+
+  if (strcmp(payload, "reset") == 0) {
+    _messagesReceived = 0;
+    _unknownTopics = 0;
+    _lastUnknownTopic[0] = '\0';
+  }
+}
 
-    uint8_t portalFlag = 1;
-    EEPROM.put(EEPROM_PORTAL_FLAG_ADDRESS, portalFlag);
-    EEPROM.commit();
+// Retained, so a fleet dashboard subscribed to +/announce learns every robot
+// on the broker and what it supports without polling
+static void announce() {
+  JsonDocument doc;
+  doc["device"] = _deviceId;
+  doc["group"] = _group;
+  doc["protocol"] = 1;
+  doc["connect-ms"] = client->getConnectionStats().connectTime;
+  JsonArray capabilities = doc["capabilities"].to<JsonArray>();
+  capabilities.add("drive");
+  capabilities.add("telemetry-bin");
+  capabilities.add("streams");
+  capabilities.add("batch");
+  capabilities.add("command-ack");
+  if (_spool) capabilities.add("backfill");
+  if (_configStore) capabilities.add("config");
+#if defined(ENABLE_PROFILER)
+  capabilities.add("loop-profile");
+#endif
+  if (UdpLink::isEnabled()) {
+    capabilities.add("udp");
+    doc["udp-port"] = UDP_PORT;
+  }
+
+  char output[MQTT_PACKET_SIZE];
+  serializeJson(doc, output, sizeof(output));
+  Communication::publish("announce", output, true);
+}
 
-    JsonDocument response;
-    response["status"] = "accepted";
-    response["message"] = "Portal will start after restart";
-    String output;
-    serializeJson(response, output);
-    client->publish("service/start-portal-result", output);
-  });
+void onConnectionEstablished() {
+  LOG_I("MQTT connected, subscribing to topics...\n");
+  _driveSequenceValid = false;
+
+  const hal::ConnectionStats& stats = client->getConnectionStats();
+  if (stats.wifiConnects > 0) {
+    BootReport::milestone(BOOT_WIFI, stats.wifiConnectedAt);
+  }
+  BootReport::milestone(BOOT_MQTT, hal::clock().millis());
+  if (BootReport::fast() && !BootReport::ready()) {
+    // The first telemetry marks the robot ready, no need to wait a period
+    _scheduler->wake("telemetry");
+  }
+
+  char filter[MQTT_MAX_TOPIC_LENGTH];
+  for (const char* subscription : SUBSCRIPTIONS) {
+    snprintf(filter, sizeof(filter), "%s%s", _namespaces[0], subscription);
+    client->subscribe(filter, dispatch);
+  }
+  for (uint8_t i = 1; i < _namespaceCount; i++) {
+    snprintf(filter, sizeof(filter), "%s#", _namespaces[i]);
+    client->subscribe(filter, dispatch);
+  }
+  announce();
 }
 
 namespace Communication {
 
 bool _restart_requested = false;
 bool _portal_requested = false;
+TelemetryFormat _telemetry_format = TELEMETRY_FORMAT_JSON;
 
-void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering) {
+void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering, Scheduler* scheduler, I2cQueue* i2cQueue, TelemetrySpool* spool, ConfigStore* configStore, hal::MqttTransport* transport, const char* deviceId, const char* group) {
     _motorController = motorController;
     _sensorManager = sensorManager;
     _steering = steering;
+    _scheduler = scheduler;
+    _i2cQueue = i2cQueue;
+    _spool = spool;
+    _configStore = configStore;
+
+    copyTopicLevel(_deviceId, sizeof(_deviceId), deviceId);
+    copyTopicLevel(_group, sizeof(_group), group);
+    _namespaceCount = 0;
+    snprintf(_namespaces[_namespaceCount++], sizeof(_namespaces[0]), "%s/", _deviceId);
+    snprintf(_namespaces[_namespaceCount++], sizeof(_namespaces[0]), "fleet/all/");
+    if (_group[0]) {
+        snprintf(_namespaces[_namespaceCount++], sizeof(_namespaces[0]), "fleet/%s/", _group);
+    }
+
+    client = transport;
+    client->setOnConnected(onConnectionEstablished);
+}
+
+void loop() {
+    PROFILE_SCOPE(PROFILE_MQTT);
+    if (!client) return;
+    client->loop();
 
-    LOG_I("Reading config from NVS...\n");
-    if (!LittleFS.begin()) {
-        LOG_E("Failed to mount LittleFS\n");
-        wifi_ssid = "ssid-default";
-        wifi_pass = "pass-default";
-        mqtt_server = "dev.rightech.io";
-        mqtt_port_str = "1883";
-        device_id = "wheelbot-default";
-    } else {
-        File configFile = LittleFS.open("/config.json", "r");
-        if (configFile) {
-            DynamicJsonDocument doc(512);
-            deserializeJson(doc, configFile);
-            configFile.close();
-            wifi_ssid = doc["ssid"] | "ssid-default";
-            wifi_pass = doc["password"] | "pass-default";
-            mqtt_server = doc["server"] | "dev.rightech.io";
-            mqtt_port_str = doc["server_port"] | "1883";
-            device_id = doc["device_id"] | "wheelbot-default";
-            LOG_I("Config loaded: SSID=%s, Server=%s:%s, ID=%s\n", wifi_ssid.c_str(), mqtt_server.c_str(), mqtt_port_str.c_str(), device_id.c_str());
-        } else {
-            LOG_W("Config file not found, using defaults\n");
-            wifi_ssid = "ssid-default";
-            wifi_pass = "pass-default";
-            mqtt_server = "dev.rightech.io";
-            mqtt_port_str = "1883";
-            device_id = "wheelbot-default";
+    // Commands stop arriving with the connection, so the last speed would
+    // otherwise hold until the broker is back. A UDP peer keeps control.
+    bool connected = client->isConnected();
+    if (_wasConnected && !connected && !_udpControl) {
+        LOG_W("Connection lost, stopping the wheels\n");
+        DriveCommand stop = {DRIVE_LEFT | DRIVE_RIGHT, 0, 0, 0, 0, 0, 0, 0, 0};
+        applyDrive(stop);
+    }
+    _wasConnected = connected;
+
+    CommandAck ack;
+    while (client->isConnected() && _commandTracker.nextAck(ack)) {
+        JsonDocument doc;
+        doc["id"] = ack.id;
+        doc["seq"] = ack.sequence;
+        doc["status"] = commandStatusName(ack.status);
+        doc["time"] = ack.senderTime;
+        doc["received"] = ack.received;
+        doc["delay"] = ack.delay;
+        if (ack.status == COMMAND_ACTUATED) {
+            doc["actuation"] = ack.actuation;
         }
+        char output[MQTT_PACKET_SIZE];
+        serializeJson(doc, output, sizeof(output));
+        Communication::publish("control/drive-ack", output);
     }
+}
 
-    LOG_I("Creating MQTT client...\n");
-    client = new EspMQTTClient(wifi_ssid.c_str(), wifi_pass.c_str(), mqtt_server.c_str(), device_id.c_str(), atoi(mqtt_port_str.c_str()));
+void applyDrive(const DriveCommand& drive) {
+    if (drive.fields & DRIVE_LEFT_ACCELERATION) _motorController->setLeftAcceleration(drive.leftAcceleration);
+    if (drive.fields & DRIVE_RIGHT_ACCELERATION) _motorController->setRightAcceleration(drive.rightAcceleration);
+    if (drive.fields & DRIVE_STEERING_ACCELERATION) _steering->setAcceleration(drive.steeringAcceleration);
+    if (drive.fields & DRIVE_KINEMATIC) {
+        DriveKinematics::drive(drive.velocity / 1000.0f, drive.curvature / 1000.0f);
+        return;
+    }
+    if (drive.fields & DRIVE_LEFT) _motorController->setLeftSpeedPercent(drive.left);
+    if (drive.fields & DRIVE_RIGHT) _motorController->setRightSpeedPercent(drive.right);
+    if (drive.fields & DRIVE_STEERING) _steering->setAngle(drive.steering);
+}
 
-    client->setMaxPacketSize(512);
-    client->enableMQTTPersistence();
-    client->setOnConnectionEstablishedCallback(onConnectionEstablished);
+void setUdpControl(bool active) {
+    _udpControl = active;
+}
 
+bool udpControl() {
+    return _udpControl;
 }
 
-void loop() {
-    if (client) client->loop();
+void commandsActuated(uint32_t time) {
+    _commandTracker.actuated(time);
 }
 
-void publish(const char* topic, const String& payload) {
-    if (client) client->publish(topic, payload);
+void setCommandMaxAge(uint32_t maxAge) {
+    _commandTracker.setMaxAge(maxAge);
+}
+
+// Both publish() overloads prefix the topic with "<device>/"
+static bool deviceTopic(char* buffer, size_t size, const char* topic) {
+    if ((size_t)snprintf(buffer, size, "%s%s", _namespaces[0], topic) >= size) {
+        LOG_W("Topic %s%s too long\n", _namespaces[0], topic);
+        return false;
+    }
+    return true;
+}
+
+bool publish(const char* topic, const char* payload, bool retain) {
+    char fullTopic[MQTT_MAX_TOPIC_LENGTH];
+    return client && deviceTopic(fullTopic, sizeof(fullTopic), topic) && client->publish(fullTopic, payload, retain);
+}
+
+bool publish(const char* topic, const uint8_t* payload, size_t length) {
+    char fullTopic[MQTT_MAX_TOPIC_LENGTH];
+    return client && deviceTopic(fullTopic, sizeof(fullTopic), topic) && client->publish(fullTopic, payload, length);
+}
+
+const char* getDeviceId() {
+    return _deviceId;
 }
 
 bool isConnected() {
-    client->loop();
     return client && client->isConnected();
 }
 
+TelemetryFormat getTelemetryFormat() {
+    return _telemetry_format;
+}
+
+void setTelemetryFormat(TelemetryFormat format) {
+    _telemetry_format = format;
+}
+
 bool restartRequested() {
     if (_restart_requested) {
         _restart_requested = false; // Reset the flag
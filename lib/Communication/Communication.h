@@ -1,24 +1,84 @@
 #ifndef COMMUNICATION_H
 #define COMMUNICATION_H
 
-#include <EspMQTTClient.h>
 #include "config.h"
+#include "Hal.h"
 #include "MotorController.h"
 #include "SensorManager.h"
 #include "Steering.h"
+#include "Scheduler.h"
+#include "I2cQueue.h"
+#include "TelemetrySpool.h"
+#include "ConfigStore.h"
 
 extern MotorController* _motorController;
 extern SensorManager* _sensorManager;
 extern Steering* _steering;
+extern Scheduler* _scheduler;
+extern I2cQueue* _i2cQueue;
+extern TelemetrySpool* _spool;
 
 void onConnectionEstablished();
 
+// Which encodings the telemetry task publishes: */json, */bin, both or
+// neither when only telemetry/subscribe streams are wanted
+enum TelemetryFormat : uint8_t {
+  TELEMETRY_FORMAT_OFF = 0,
+  TELEMETRY_FORMAT_JSON = 1,
+  TELEMETRY_FORMAT_BINARY = 2,
+  TELEMETRY_FORMAT_BOTH = TELEMETRY_FORMAT_JSON | TELEMETRY_FORMAT_BINARY
+};
+
+// Targets of one drive command. Only the flagged fields are applied, the
+// others keep their current target. The flags follow the field order;
+// DRIVE_KINEMATIC covers velocity and curvature, which go through
+// DriveKinematics and take the place of left, right and steering.
+enum DriveField : uint8_t {
+  DRIVE_LEFT = 1 << 0,
+  DRIVE_RIGHT = 1 << 1,
+  DRIVE_STEERING = 1 << 2,
+  DRIVE_LEFT_ACCELERATION = 1 << 3,
+  DRIVE_RIGHT_ACCELERATION = 1 << 4,
+  DRIVE_STEERING_ACCELERATION = 1 << 5,
+  DRIVE_KINEMATIC = 1 << 6
+};
+
+struct DriveCommand {
+  uint8_t fields;
+  int16_t left;       // % -100..100
+  int16_t right;
+  int16_t steering;   // deg 0..180
+  int16_t leftAcceleration;
+  int16_t rightAcceleration;
+  int16_t steeringAcceleration;
+  int16_t velocity;   // mm/s
+  int16_t curvature;  // 1/km, positive turns left
+};
+
 namespace Communication {
 
-void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering);
+// Topics live under "<deviceId>/"; commands are also accepted from
+// "fleet/all/" and, with a non-empty group, "fleet/<group>/". Without a
+// configStore, config/get and config/set report "disabled".
+void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering, Scheduler* scheduler, I2cQueue* i2cQueue, TelemetrySpool* spool, ConfigStore* configStore, hal::MqttTransport* transport, const char* deviceId, const char* group);
 void loop();
-void publish(const char* topic, const String& payload);
+// The pending drive command changed the motor outputs at time (micros()),
+// for command latency
+void commandsActuated(uint32_t time);
+// ms a control/drive command may lag the fastest recent one, COMMAND_MAX_AGE by default
+void setCommandMaxAge(uint32_t maxAge);
+// Sets the targets of all flagged fields within one call
+void applyDrive(const DriveCommand& drive);
+// While set, MQTT motion commands are ignored (see UdpLink)
+void setUdpControl(bool active);
+bool udpControl();
+// topic is relative to the device namespace
+bool publish(const char* topic, const char* payload, bool retain = false);
+bool publish(const char* topic, const uint8_t* payload, size_t length);
 bool isConnected();
+const char* getDeviceId();
+TelemetryFormat getTelemetryFormat();
+void setTelemetryFormat(TelemetryFormat format);
 bool restartRequested();
 void requestRestart();
 bool portalRequested();
@@ -0,0 +1,49 @@
+#ifndef TOPIC_DISPATCH_H
+#define TOPIC_DISPATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Routing of incoming MQTT messages to their handlers. The table is built
+// from topic literals at compile time: every entry carries the FNV-1a hash
+// of its topic, and topicsUnique() lets the table owner static_assert that
+// no two hashes collide. A lookup is then one hash of the received topic, a
+// scan of integers and a single strcmp to reject foreign topics.
+
+typedef void (*TopicHandler)(const char* payload, size_t length);
+
+struct TopicRoute {
+    const char* topic;
+    uint32_t hash;
+    TopicHandler handler;
+};
+
+constexpr uint32_t topicHash(const char* topic, uint32_t hash = 2166136261u) {
+    return *topic ? topicHash(topic + 1, (hash ^ (uint8_t)*topic) * 16777619u) : hash;
+}
+
+#define TOPIC_ROUTE(topic, handler) {topic, topicHash(topic), handler}
+
+template <size_t N>
+constexpr bool topicsUnique(const TopicRoute (&routes)[N]) {
+    for (size_t i = 0; i < N; i++) {
+        for (size_t j = i + 1; j < N; j++) {
+            if (routes[i].hash == routes[j].hash) return false;
+        }
+    }
+    return true;
+}
+
+template <size_t N>
+const TopicRoute* findRoute(const TopicRoute (&routes)[N], const char* topic) {
+    uint32_t hash = topicHash(topic);
+    for (size_t i = 0; i < N; i++) {
+        if (routes[i].hash == hash) {
+            return strcmp(routes[i].topic, topic) == 0 ? &routes[i] : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+#endif // TOPIC_DISPATCH_H
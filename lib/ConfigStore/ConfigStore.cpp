@@ -0,0 +1,403 @@
+#include "ConfigStore.h"
+#include "Crc32.h"
+#include <ArduinoJson.h>
+
+enum FieldType : uint8_t {
+    FIELD_STRING,   // min/max: length
+    FIELD_KEY,      // Empty or 32 hex digits
+    FIELD_TOPIC,    // String used as one MQTT topic level, min/max: length
+    FIELD_BOOL,
+    FIELD_UINT16,   // Number or numeric string, min..max
+    FIELD_ADDRESS,  // I2C address, number or "0x.." string
+    FIELD_FLOAT     // Number or numeric string, min..max
+};
+
+struct FieldInfo {
+    const char* key;
+    FieldType type;
+    size_t offset;
+    size_t size;
+    float min;
+    float max;
+};
+
+#define CONFIG_FIELD(key, type, member, min, max) {key, type, offsetof(Config, member), sizeof(Config::member), min, max}
+
+// Keys are the ones the portal has always written to /config.json
+static const FieldInfo FIELDS[] = {
+    CONFIG_FIELD("ssid", FIELD_STRING, ssid, 0, 32),
+    CONFIG_FIELD("password", FIELD_STRING, password, 0, 64),
+    CONFIG_FIELD("server", FIELD_STRING, server, 1, 63),
+    CONFIG_FIELD("server_port", FIELD_UINT16, serverPort, 1, 65535),
+    CONFIG_FIELD("device_id", FIELD_TOPIC, deviceId, 1, MQTT_DEVICE_ID_LENGTH - 1),
+    CONFIG_FIELD("group", FIELD_TOPIC, group, 0, MQTT_GROUP_LENGTH - 1),
+    CONFIG_FIELD("udp_key", FIELD_KEY, udpKey, 0, 32),
+    CONFIG_FIELD("wifi_reuse_ip", FIELD_BOOL, wifiReuseIp, 0, 1),
+    CONFIG_FIELD("mpu_address", FIELD_ADDRESS, mpuAddress, 0x03, 0x77),
+    CONFIG_FIELD("ina226_address", FIELD_ADDRESS, ina226Address, 0x03, 0x77),
+    CONFIG_FIELD("shunt_resistance", FIELD_FLOAT, shuntResistance, 0.001f, 10.0f),
+    CONFIG_FIELD("max_current", FIELD_FLOAT, maxCurrent, 0.01f, 20.0f),
+    CONFIG_FIELD("telemetry_interval", FIELD_UINT16, telemetryInterval, 10, 60000),
+    CONFIG_FIELD("sensor_interval", FIELD_UINT16, sensorInterval, 10, 10000),
+    CONFIG_FIELD("fast_boot", FIELD_BOOL, fastBoot, 0, 1),
+    CONFIG_FIELD("pwm_range", FIELD_UINT16, pwmRange, 255, 16383),
+    CONFIG_FIELD("pwm_frequency", FIELD_UINT16, pwmFrequency, 100, 40000),
+    CONFIG_FIELD("wheelbase", FIELD_FLOAT, wheelbase, 0.02f, 2.0f),
+    CONFIG_FIELD("track_width", FIELD_FLOAT, trackWidth, 0.02f, 2.0f),
+    CONFIG_FIELD("max_wheel_speed", FIELD_FLOAT, maxWheelSpeed, 0.05f, 20.0f),
+    CONFIG_FIELD("max_steer_angle", FIELD_FLOAT, maxSteerAngle, 1.0f, 60.0f),
+    CONFIG_FIELD("servo_center", FIELD_UINT16, servoCenter, 0, 180),
+    CONFIG_FIELD("servo_travel", FIELD_UINT16, servoTravel, 1, 90),
+    CONFIG_FIELD("command_max_age", FIELD_UINT16, commandMaxAge, 10, 60000),
+};
+
+#define FIELD_COUNT (sizeof(FIELDS) / sizeof(FIELDS[0]))
+static_assert(FIELD_COUNT == 24, "FIELDS must list every ConfigField in order");
+
+// Names that would put a robot inside the fleet namespaces: a device
+// called "fleet" would receive fleet/... commands as its own topics, and a
+// group called "all" would be subscribed twice
+static const char* const RESERVED_LEVELS[][2] = {
+    {"device_id", "fleet"},
+    {"group", "all"},
+};
+
+struct CacheHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t jsonCrc;
+    uint32_t crc;
+};
+
+// The portal stores numbers as strings, so both are accepted
+static bool numberValue(JsonVariantConst value, float& number, int base) {
+    if (value.is<float>()) {
+        number = value.as<float>();
+        return true;
+    }
+    const char* text = value.as<const char*>();
+    if (!text || !*text) {
+        return false;
+    }
+    char* end;
+    number = base == 10 ? strtof(text, &end) : (float)strtol(text, &end, base);
+    return *end == '\0';
+}
+
+static bool parseField(const FieldInfo& field, JsonVariantConst value, Config& config, char* error, size_t errorSize) {
+    uint8_t* target = reinterpret_cast<uint8_t*>(&config) + field.offset;
+    float number;
+    switch (field.type) {
+        case FIELD_STRING:
+        case FIELD_KEY:
+        case FIELD_TOPIC: {
+            const char* text = value.as<const char*>();
+            if (!text) {
+                snprintf(error, errorSize, "%s: string expected", field.key);
+                return false;
+            }
+            size_t length = strlen(text);
+            if (length < field.min || length > field.max) {
+                snprintf(error, errorSize, "%s: length %u..%u", field.key, (unsigned)field.min, (unsigned)field.max);
+                return false;
+            }
+            if (field.type == FIELD_KEY && length > 0 && (length != 32 || strspn(text, "0123456789abcdefABCDEF") != length)) {
+                snprintf(error, errorSize, "%s: 32 hex digits expected", field.key);
+                return false;
+            }
+            if (field.type == FIELD_TOPIC && !ConfigStore::validTopicLevel(field.key, text)) {
+                snprintf(error, errorSize, "%s: no / + # and not reserved", field.key);
+                return false;
+            }
+            memcpy(target, text, length + 1);
+            return true;
+        }
+        case FIELD_BOOL:
+            if (!value.is<bool>()) {
+                snprintf(error, errorSize, "%s: true or false expected", field.key);
+                return false;
+            }
+            *reinterpret_cast<bool*>(target) = value.as<bool>();
+            return true;
+        case FIELD_UINT16:
+        case FIELD_ADDRESS:
+        case FIELD_FLOAT:
+            if (!numberValue(value, number, field.type == FIELD_ADDRESS ? 0 : 10) || number < field.min || number > field.max ||
+                (field.type != FIELD_FLOAT && number != floorf(number))) {
+                snprintf(error, errorSize, "%s: %g..%g expected", field.key, field.min, field.max);
+                return false;
+            }
+            if (field.type == FIELD_UINT16) {
+                *reinterpret_cast<uint16_t*>(target) = (uint16_t)number;
+            } else if (field.type == FIELD_ADDRESS) {
+                *target = (uint8_t)number;
+            } else {
+                *reinterpret_cast<float*>(target) = number;
+            }
+            return true;
+    }
+    return false;
+}
+
+static void writeField(const FieldInfo& field, const Config& config, JsonDocument& doc, bool secret) {
+    const uint8_t* source = reinterpret_cast<const uint8_t*>(&config) + field.offset;
+    switch (field.type) {
+        case FIELD_STRING:
+        case FIELD_KEY:
+        case FIELD_TOPIC:
+            doc[field.key] = secret && *source ? "***" : reinterpret_cast<const char*>(source);
+            break;
+        case FIELD_BOOL:
+            doc[field.key] = *reinterpret_cast<const bool*>(source);
+            break;
+        case FIELD_UINT16:
+            doc[field.key] = *reinterpret_cast<const uint16_t*>(source);
+            break;
+        case FIELD_ADDRESS: {
+            char address[5];
+            snprintf(address, sizeof(address), "0x%02X", *source);
+            doc[field.key] = address;
+            break;
+        }
+        case FIELD_FLOAT:
+            doc[field.key] = *reinterpret_cast<const float*>(source);
+            break;
+    }
+}
+
+ConfigStore::ConfigStore(hal::FileSystem& fileSystem) {
+    _fileSystem = &fileSystem;
+    _fromCache = false;
+    _jsonCrc = 0;
+    _error[0] = '\0';
+    defaults(_config);
+}
+
+void ConfigStore::defaults(Config& config) {
+    memset(&config, 0, sizeof(config));
+    strcpy(config.server, "dev.rightech.io");
+    config.serverPort = 1883;
+    strcpy(config.deviceId, "wheelbot-default");
+    config.mpuAddress = MPU_ADDRESS;
+    config.ina226Address = INA226_ADDRESS;
+    config.shuntResistance = 0.1f;
+    config.maxCurrent = 0.8f;
+    config.telemetryInterval = PUB_DELAY;
+    config.sensorInterval = SENSOR_UPDATE_INTERVAL;
+    config.fastBoot = true;
+    config.pwmRange = MOTOR_PWM_RANGE;
+    config.pwmFrequency = MOTOR_PWM_FREQUENCY;
+    config.wheelbase = KINEMATICS_WHEELBASE;
+    config.trackWidth = KINEMATICS_TRACK_WIDTH;
+    config.maxWheelSpeed = KINEMATICS_MAX_WHEEL_SPEED;
+    config.maxSteerAngle = KINEMATICS_MAX_STEER_ANGLE;
+    config.servoCenter = KINEMATICS_SERVO_CENTER;
+    config.servoTravel = KINEMATICS_SERVO_TRAVEL;
+    config.commandMaxAge = COMMAND_MAX_AGE;
+}
+
+const char* ConfigStore::fieldName(uint32_t field) {
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+        if (field == 1u << i) {
+            return FIELDS[i].key;
+        }
+    }
+    return nullptr;
+}
+
+// The JSON is read on every boot to check the cache against it; reading and
+// hashing it is still much cheaper than parsing it
+bool ConfigStore::load() {
+    char buffer[CONFIG_JSON_MAX_SIZE];
+    size_t length = _fileSystem->read(CONFIG_JSON_PATH, 0, buffer, sizeof(buffer));
+    _jsonCrc = Crc32::compute(buffer, length);
+    _fromCache = length > 0 && length < sizeof(buffer) && loadCache();
+    if (_fromCache) {
+        return true;
+    }
+
+    defaults(_config);
+    if (length == 0) {
+        LOG_I("No %s, using defaults\n", CONFIG_JSON_PATH);
+        return false;
+    }
+    if (!loadJson(buffer, length)) {
+        defaults(_config);
+        return false;
+    }
+    writeCache();
+    return true;
+}
+
+bool ConfigStore::loadCache() {
+    CacheHeader header;
+    if (_fileSystem->read(CONFIG_CACHE_PATH, 0, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != CONFIG_CACHE_MAGIC || header.version != CONFIG_CACHE_VERSION ||
+        header.size != sizeof(Config) || header.jsonCrc != _jsonCrc) {
+        return false;
+    }
+
+    Config config;
+    if (_fileSystem->read(CONFIG_CACHE_PATH, sizeof(header), &config, sizeof(config)) != sizeof(config) ||
+        Crc32::compute(&config, sizeof(config)) != header.crc) {
+        LOG_W("%s corrupt, parsing %s\n", CONFIG_CACHE_PATH, CONFIG_JSON_PATH);
+        return false;
+    }
+    // A CRC match says nothing about terminators a future layout forgot
+    for (const FieldInfo& field : FIELDS) {
+        if (field.type == FIELD_STRING || field.type == FIELD_KEY || field.type == FIELD_TOPIC) {
+            reinterpret_cast<char*>(&config)[field.offset + field.size - 1] = '\0';
+        }
+    }
+    _config = config;
+    return true;
+}
+
+// Lenient: an invalid field keeps its default, so one typo does not cost
+// the network settings
+bool ConfigStore::loadJson(const char* json, size_t length) {
+    if (length == CONFIG_JSON_MAX_SIZE) {
+        LOG_E("%s larger than %d bytes\n", CONFIG_JSON_PATH, CONFIG_JSON_MAX_SIZE);
+        return false;
+    }
+
+    JsonDocument doc;
+    DeserializationError error = deserializeJson(doc, json, length);
+    if (error) {
+        LOG_E("%s: %s\n", CONFIG_JSON_PATH, error.c_str());
+        return false;
+    }
+    for (const FieldInfo& field : FIELDS) {
+        JsonVariantConst value = doc[field.key];
+        if (!value.isNull() && !parseField(field, value, _config, _error, sizeof(_error))) {
+            LOG_W("%s: %s, using the default\n", CONFIG_JSON_PATH, _error);
+        }
+    }
+    return true;
+}
+
+bool ConfigStore::update(const char* json, size_t length, uint32_t allowed, uint32_t& changed, const char*& error) {
+    changed = 0;
+    error = _error;
+
+    JsonDocument doc;
+    if (deserializeJson(doc, json, length) || !doc.is<JsonObject>()) {
+        snprintf(_error, sizeof(_error), "JSON object expected");
+        return false;
+    }
+
+    Config next = _config;
+    size_t matched = 0;
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+        JsonVariantConst value = doc[FIELDS[i].key];
+        if (value.isNull()) {
+            continue;
+        }
+        matched++;
+        if (!(allowed & (1u << i))) {
+            snprintf(_error, sizeof(_error), "%s: not allowed here", FIELDS[i].key);
+            return false;
+        }
+        if (!parseField(FIELDS[i], value, next, _error, sizeof(_error))) {
+            return false;
+        }
+    }
+    if (matched != doc.size()) {
+        snprintf(_error, sizeof(_error), "unknown field");
+        return false;
+    }
+
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+        const FieldInfo& field = FIELDS[i];
+        const uint8_t* before = reinterpret_cast<const uint8_t*>(&_config) + field.offset;
+        const uint8_t* after = reinterpret_cast<const uint8_t*>(&next) + field.offset;
+        if (memcmp(before, after, field.size) != 0) {
+            changed |= 1u << i;
+        }
+    }
+    if (!changed) {
+        return true;
+    }
+
+    Config previous = _config;
+    _config = next;
+    if (!writeJson()) {
+        _config = previous;
+        changed = 0;
+        snprintf(_error, sizeof(_error), "flash write failed");
+        return false;
+    }
+    writeCache();
+    return true;
+}
+
+bool ConfigStore::validTopicLevel(const char* key, const char* text) {
+    if (strpbrk(text, "/+#")) {
+        return false;
+    }
+    for (const auto& reserved : RESERVED_LEVELS) {
+        if (strcmp(key, reserved[0]) == 0 && strcmp(text, reserved[1]) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ConfigStore::save(const Config& config) {
+    _config = config;
+    return writeJson() && writeCache();
+}
+
+void ConfigStore::clear() {
+    _fileSystem->remove(CONFIG_JSON_PATH);
+    _fileSystem->remove(CONFIG_CACHE_PATH);
+    defaults(_config);
+    _fromCache = false;
+}
+
+size_t ConfigStore::toJson(char* buffer, size_t size, uint32_t secretFields) const {
+    JsonDocument doc;
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+        writeField(FIELDS[i], _config, doc, secretFields & (1u << i));
+    }
+    return serializeJson(doc, buffer, size);
+}
+
+// Written to a temporary file and renamed over the old one, so a reset
+// mid-write leaves either the old or the new settings
+bool ConfigStore::writeJson() {
+    char buffer[CONFIG_JSON_MAX_SIZE];
+    size_t length = toJson(buffer, sizeof(buffer), 0);
+    if (length == 0 || length >= sizeof(buffer) - 1) {
+        LOG_E("Config does not fit %d bytes\n", CONFIG_JSON_MAX_SIZE);
+        return false;
+    }
+    _fileSystem->remove(CONFIG_TEMP_PATH);
+    if (!_fileSystem->append(CONFIG_TEMP_PATH, buffer, length) || !_fileSystem->rename(CONFIG_TEMP_PATH, CONFIG_JSON_PATH)) {
+        LOG_E("Writing %s failed\n", CONFIG_JSON_PATH);
+        return false;
+    }
+    _jsonCrc = Crc32::compute(buffer, length);
+    return true;
+}
+
+bool ConfigStore::writeCache() {
+    uint8_t buffer[sizeof(CacheHeader) + sizeof(Config)];
+    CacheHeader header;
+    header.magic = CONFIG_CACHE_MAGIC;
+    header.version = CONFIG_CACHE_VERSION;
+    header.size = sizeof(Config);
+    header.jsonCrc = _jsonCrc;
+    header.crc = Crc32::compute(&_config, sizeof(_config));
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), &_config, sizeof(_config));
+
+    // A torn write fails the CRC and costs one JSON parse on the next boot
+    _fileSystem->remove(CONFIG_CACHE_PATH);
+    if (!_fileSystem->append(CONFIG_CACHE_PATH, buffer, sizeof(buffer))) {
+        LOG_W("Writing %s failed\n", CONFIG_CACHE_PATH);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,134 @@
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include "config.h"
+#include "Hal.h"
+
+// Device settings, parsed and validated once. /config.json stays the
+// source of truth (the portal writes it); a binary copy with a CRC in
+// /config.bin lets later boots skip JSON parsing. The copy records a
+// CRC-32 of the JSON it was made from, so any edit to /config.json is
+// noticed, including one that keeps its size.
+//
+// Cache layout, little-endian:
+//
+//   offset  type    field
+//   0       uint32  magic        CONFIG_CACHE_MAGIC
+//   4       uint16  version      CONFIG_CACHE_VERSION
+//   6       uint16  size         sizeof(Config)
+//   8       uint32  jsonCrc      CRC-32 of /config.json when the copy was made
+//   12      uint32  crc          CRC-32 of the Config that follows
+//   16      ...     Config
+
+#define CONFIG_CACHE_MAGIC 0x57434647  // "WCFG"
+#define CONFIG_CACHE_VERSION 7
+#define CONFIG_JSON_PATH "/config.json"
+#define CONFIG_CACHE_PATH "/config.bin"
+#define CONFIG_TEMP_PATH "/config.tmp"
+
+// One bit per field, in the order of the field table in ConfigStore.cpp
+enum ConfigField : uint32_t {
+    CONFIG_SSID = 1 << 0,
+    CONFIG_PASSWORD = 1 << 1,
+    CONFIG_SERVER = 1 << 2,
+    CONFIG_SERVER_PORT = 1 << 3,
+    CONFIG_DEVICE_ID = 1 << 4,
+    CONFIG_GROUP = 1 << 5,
+    CONFIG_UDP_KEY = 1 << 6,
+    CONFIG_WIFI_REUSE_IP = 1 << 7,
+    CONFIG_MPU_ADDRESS = 1 << 8,
+    CONFIG_INA226_ADDRESS = 1 << 9,
+    CONFIG_SHUNT_RESISTANCE = 1 << 10,
+    CONFIG_MAX_CURRENT = 1 << 11,
+    CONFIG_TELEMETRY_INTERVAL = 1 << 12,
+    CONFIG_SENSOR_INTERVAL = 1 << 13,
+    CONFIG_FAST_BOOT = 1 << 14,
+    CONFIG_PWM_RANGE = 1 << 15,
+    CONFIG_PWM_FREQUENCY = 1 << 16,
+    CONFIG_WHEELBASE = 1 << 17,
+    CONFIG_TRACK_WIDTH = 1 << 18,
+    CONFIG_MAX_WHEEL_SPEED = 1 << 19,
+    CONFIG_MAX_STEER_ANGLE = 1 << 20,
+    CONFIG_SERVO_CENTER = 1 << 21,
+    CONFIG_SERVO_TRAVEL = 1 << 22,
+    CONFIG_COMMAND_MAX_AGE = 1 << 23
+};
+
+// The DriveKinematics geometry and servo calibration
+#define CONFIG_KINEMATICS_FIELDS (CONFIG_WHEELBASE | CONFIG_TRACK_WIDTH | CONFIG_MAX_WHEEL_SPEED | CONFIG_MAX_STEER_ANGLE | CONFIG_SERVO_CENTER | CONFIG_SERVO_TRAVEL)
+
+// Fields ControlLoop::applyConfig() takes over at runtime; the others need a restart
+#define CONFIG_LIVE_FIELDS (CONFIG_SHUNT_RESISTANCE | CONFIG_MAX_CURRENT | CONFIG_TELEMETRY_INTERVAL | CONFIG_SENSOR_INTERVAL | CONFIG_KINEMATICS_FIELDS | CONFIG_COMMAND_MAX_AGE)
+// Never published by config/get
+#define CONFIG_SECRET_FIELDS (CONFIG_PASSWORD | CONFIG_UDP_KEY)
+
+struct Config {
+    char ssid[33];
+    char password[65];
+    char server[64];
+    uint16_t serverPort;
+    char deviceId[MQTT_DEVICE_ID_LENGTH];
+    char group[MQTT_GROUP_LENGTH];
+    char udpKey[33];               // 32 hex digits or empty
+    bool wifiReuseIp;
+    uint8_t mpuAddress;
+    uint8_t ina226Address;
+    float shuntResistance;         // Ohm
+    float maxCurrent;              // A
+    uint16_t telemetryInterval;    // ms, the telemetry task
+    uint16_t sensorInterval;       // ms, the sensors (power) task
+    bool fastBoot;                 // Start Wi-Fi before the sensors, see BootReport
+    uint16_t pwmRange;             // Motor PWM full scale, analogWriteRange()
+    uint16_t pwmFrequency;         // Hz, analogWriteFreq()
+    float wheelbase;               // m, see DriveKinematics
+    float trackWidth;              // m
+    float maxWheelSpeed;           // m/s at 100 %
+    float maxSteerAngle;           // deg at full servo travel
+    uint16_t servoCenter;          // Servo angle for straight ahead
+    uint16_t servoTravel;          // Servo degrees from center to full lock
+    uint16_t commandMaxAge;        // ms a control/drive command may be late, see CommandTracker
+};
+
+class ConfigStore {
+public:
+    explicit ConfigStore(hal::FileSystem& fileSystem);
+
+    // Reads the cache, or parses /config.json and rewrites the cache when
+    // the cache is missing, stale or corrupt. Defaults when neither exists.
+    bool load();
+    const Config& get() const { return _config; }
+    bool loadedFromCache() const { return _fromCache; }
+
+    // Applies a JSON object of fields atomically: nothing changes when a
+    // field is invalid or not in allowed. Saves to flash on success.
+    // changed gets the ConfigField bits whose value actually changed.
+    bool update(const char* json, size_t length, uint32_t allowed, uint32_t& changed, const char*& error);
+    // Replaces the whole configuration and saves it (used by the portal)
+    bool save(const Config& config);
+    // Removes the files, the next load() gives the defaults
+    void clear();
+
+    // secretFields go out as "***" when set, so a client can tell they exist
+    size_t toJson(char* buffer, size_t size, uint32_t secretFields) const;
+
+    static void defaults(Config& config);
+    // JSON key of a single ConfigField bit, nullptr when there is none
+    static const char* fieldName(uint32_t field);
+    // device_id and group become topic levels: no "/", "+" or "#", and
+    // not a name the fleet namespaces use for that key
+    static bool validTopicLevel(const char* key, const char* text);
+
+private:
+    bool loadCache();
+    bool loadJson(const char* json, size_t length);
+    bool writeJson();
+    bool writeCache();
+
+    hal::FileSystem* _fileSystem;
+    Config _config;
+    bool _fromCache;
+    uint32_t _jsonCrc;  // Of /config.json as last read or written
+    char _error[64];
+};
+
+#endif // CONFIG_STORE_H
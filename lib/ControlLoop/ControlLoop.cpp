@@ -0,0 +1,328 @@
+#include "ControlLoop.h"
+#include <ArduinoJson.h>
+#include "Communication.h"
+#include "Profiler.h"
+#include "JsonWriter.h"
+#include "TelemetryFrame.h"
+#include "TelemetryStreams.h"
+#include "DriveKinematics.h"
+#include "UdpLink.h"
+#include "BootReport.h"
+
+namespace ControlLoop {
+
+static MotorController* _motorController;
+static SensorManager* _sensorManager;
+static Steering* _steering;
+static Scheduler* _scheduler;
+static I2cQueue* _i2cQueue;
+static TelemetrySpool* _spool;
+static KvStore* _store;
+
+// A drive command counts as actuated when the tick that changed the PWM
+// for it ran, not when this task gets to it. A command that set no wheel
+// target (steering only) counts now.
+static void collectActuation() {
+  uint32_t time;
+  if (_motorController->takeActuation(time)) {
+    Communication::commandsActuated(time);
+  } else if (!_motorController->isActuationPending()) {
+    Communication::commandsActuated(hal::clock().micros());
+  }
+}
+
+void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering, Scheduler* scheduler, I2cQueue* i2cQueue, TelemetrySpool* spool, KvStore* store) {
+  _motorController = motorController;
+  _sensorManager = sensorManager;
+  _steering = steering;
+  _scheduler = scheduler;
+  _i2cQueue = i2cQueue;
+  _spool = spool;
+  _store = store;
+  TelemetryStreams::setup(motorController, sensorManager, steering);
+  DriveKinematics::setup(motorController, steering);
+
+  // Control tasks first, telemetry last; periods can be changed over MQTT.
+  // Motor ramps are time-based, so the firmware's tick timer and this task
+  // can both call update().
+  _scheduler->addTask("motors", [] { PROFILE_SCOPE(PROFILE_MOTORS); _motorController->update(); collectActuation(); }, MOTOR_UPDATE_INTERVAL, MOTOR_UPDATE_INTERVAL, TASK_PRIORITY_CONTROL);
+  _scheduler->addTask("steering", [] { PROFILE_SCOPE(PROFILE_STEERING); _steering->update(); }, STEERING_UPDATE_INTERVAL, STEERING_UPDATE_INTERVAL, TASK_PRIORITY_CONTROL);
+  // One I2C transfer per pass, the sensor tasks only queue requests
+  _scheduler->addTask("i2c", [] { _i2cQueue->process(); }, 0, 2, TASK_PRIORITY_SENSORS);
+  _scheduler->addTask("imu", [] { _sensorManager->updateImu(); }, IMU_POLL_INTERVAL, IMU_POLL_INTERVAL, TASK_PRIORITY_SENSORS);
+  _scheduler->addTask("sonars", [] { _sensorManager->updateSonars(); }, SONAR_POLL_INTERVAL, SONAR_POLL_INTERVAL, TASK_PRIORITY_SENSORS);
+  _scheduler->addTask("sensors", [] { _sensorManager->update(); }, SENSOR_UPDATE_INTERVAL, SENSOR_UPDATE_INTERVAL, TASK_PRIORITY_SENSORS);
+  _scheduler->addTask("calibration", [] { updateCalibration(); }, CALIBRATION_UPDATE_INTERVAL, CALIBRATION_UPDATE_INTERVAL, TASK_PRIORITY_SENSORS);
+  _scheduler->addTask("comms", [] { Communication::loop(); }, 0, 50, TASK_PRIORITY_COMMS);
+  _scheduler->addTask("telemetry", [] { publishParameters(); }, PUB_DELAY, PUB_DELAY, TASK_PRIORITY_TELEMETRY);
+  _scheduler->addTask("streams", [] { TelemetryStreams::update(); }, TELEMETRY_STREAM_INTERVAL, TELEMETRY_STREAM_INTERVAL, TASK_PRIORITY_TELEMETRY);
+  _scheduler->addTask("udp", [] { UdpLink::loop(); }, 0, 10, TASK_PRIORITY_COMMS);
+  _scheduler->addTask("udp-telemetry", [] { sendUdpTelemetry(); }, UDP_TELEMETRY_INTERVAL, UDP_TELEMETRY_INTERVAL, TASK_PRIORITY_TELEMETRY);
+  _scheduler->addTask("backfill", [] { publishBackfill(); }, SPOOL_REPLAY_INTERVAL, SPOOL_REPLAY_INTERVAL, TASK_PRIORITY_TELEMETRY);
+  // One record per staged counter per period instead of one per change
+  _scheduler->addTask("store", [] { if (_store) _store->flush(); }, KV_FLUSH_INTERVAL, KV_FLUSH_INTERVAL, TASK_PRIORITY_TELEMETRY);
+}
+
+void loop() {
+  PROFILE_SCOPE(PROFILE_LOOP);
+  _scheduler->run();
+}
+
+void applyConfig(const Config& config, uint32_t changed) {
+  if (changed & (CONFIG_SHUNT_RESISTANCE | CONFIG_MAX_CURRENT)) {
+    _sensorManager->setPowerCalibration(config.shuntResistance, config.maxCurrent);
+  }
+  if (changed & CONFIG_TELEMETRY_INTERVAL) {
+    _scheduler->setPeriod("telemetry", config.telemetryInterval);
+  }
+  if (changed & CONFIG_SENSOR_INTERVAL) {
+    _scheduler->setPeriod("sensors", config.sensorInterval);
+  }
+  if (changed & CONFIG_KINEMATICS_FIELDS) {
+    KinematicsConfig kinematics = {config.wheelbase, config.trackWidth, config.maxWheelSpeed, config.maxSteerAngle,
+                                   (uint8_t)config.servoCenter, (uint8_t)config.servoTravel};
+    DriveKinematics::configure(kinematics);
+  }
+  if (changed & CONFIG_COMMAND_MAX_AGE) {
+    Communication::setCommandMaxAge(config.commandMaxAge);
+  }
+}
+
+// Runs one slice of a calibration started over MQTT. The motors are held
+// at zero until it ends; progress goes out after every pass.
+void updateCalibration() {
+  if (_sensorManager->getCalibrationState() != CALIBRATION_RUNNING) {
+    return;
+  }
+  _motorController->setHold(true);
+  if (!_sensorManager->updateCalibration()) {
+    return;
+  }
+
+  CalibrationState state = _sensorManager->getCalibrationState();
+  char output[MQTT_PACKET_SIZE];
+  if (state == CALIBRATION_RUNNING) {
+    JsonDocument progress;
+    progress["pass"] = _sensorManager->getCalibrationPass();
+    progress["max-passes"] = MPU_CALIBRATION_MAX_PASSES;
+    progress["error"] = _sensorManager->getCalibrationError();
+    serializeJson(progress, output, sizeof(output));
+    Communication::publish("service/calibrate-mcu-progress", output);
+    return;
+  }
+
+  _motorController->setHold(false);
+  JsonDocument response;
+  response["status"] = state == CALIBRATION_DONE ? "ok" : "failed";
+  response["passes"] = _sensorManager->getCalibrationPass();
+  response["error"] = _sensorManager->getCalibrationError();
+  response["accel-x"] = _sensorManager->getAccelXOffset();
+  response["accel-y"] = _sensorManager->getAccelYOffset();
+  response["accel-z"] = _sensorManager->getAccelZOffset();
+  response["gyro-x"] = _sensorManager->getGyroXOffset();
+  response["gyro-y"] = _sensorManager->getGyroYOffset();
+  response["gyro-z"] = _sensorManager->getGyroZOffset();
+  serializeJson(response, output, sizeof(output));
+  Communication::publish("service/calibrate-mcu-result", output);
+}
+
+// Telemetry is written into one static buffer and published from it, so a
+// publish does not touch the heap
+static char _telemetryBuffer[MQTT_PACKET_SIZE];
+
+static void writeSensors(JsonWriter& json) {
+  json.beginObject();
+  json.beginObject("sonars")
+    .field("right", _sensorManager->getSonarRight())
+    .field("left", _sensorManager->getSonarLeft())
+    .endObject();
+  json.beginObject("accelerometr")
+    .fieldQ16("x", _sensorManager->getAccelX(), 4)
+    .fieldQ16("y", _sensorManager->getAccelY(), 4)
+    .fieldQ16("z", _sensorManager->getAccelZ(), 4)
+    .endObject();
+  json.beginObject("gyroscope")
+    .fieldQ16("x", _sensorManager->getGyroX(), 2)
+    .fieldQ16("y", _sensorManager->getGyroY(), 2)
+    .fieldQ16("z", _sensorManager->getGyroZ(), 2)
+    .endObject();
+  json.beginObject("angles")
+    .fieldQ16("yaw", _sensorManager->getYaw(), 2)
+    .fieldQ16("pitch", _sensorManager->getPitch(), 2)
+    .fieldQ16("roll", _sensorManager->getRoll(), 2)
+    .endObject();
+  // Human units only here: V, A, W and Wh
+  json.beginObject("power")
+    .fieldScaled("voltage", _sensorManager->getVoltage(), 3)
+    .fieldScaled("current", _sensorManager->getCurrent(), 6)
+    .fieldScaled("power", _sensorManager->getPower(), 6)
+    .fieldScaled("energy", _sensorManager->getEnergy(), 6)
+    .endObject();
+  json.endObject();
+}
+
+static void writeControl(JsonWriter& json) {
+  json.beginObject();
+  json.beginObject("engines");
+  json.beginObject("left")
+    .field("speed", _motorController->getCurrentLeftSpeed())
+    .field("direction", _motorController->getLeftDirection())
+    .field("acceleration", _motorController->getLeftAcceleration())
+    .endObject();
+  json.beginObject("right")
+    .field("speed", _motorController->getCurrentRightSpeed())
+    .field("direction", _motorController->getRightDirection())
+    .field("acceleration", _motorController->getRightAcceleration())
+    .endObject();
+  json.endObject();
+  json.beginObject("steering")
+    .field("direction", _steering->getAngle())
+    .field("acceleration", _steering->getAcceleration())
+    .endObject();
+  json.endObject();
+}
+
+static void publishTelemetry(const char* topic, void (*write)(JsonWriter&)) {
+  JsonWriter json(_telemetryBuffer, sizeof(_telemetryBuffer));
+  {
+    PROFILE_SCOPE(PROFILE_SERIALIZE);
+    write(json);
+  }
+  if (!json.ok()) {
+    LOG_W("Telemetry for %s does not fit in %d bytes\n", topic, MQTT_PACKET_SIZE);
+    return;
+  }
+
+  LOG_D("Published %s: %s\n", topic, json.c_str());
+
+  #if defined(ENABLE_SEND_DATA)
+    Communication::publish(topic, json.c_str());
+  #endif
+}
+
+// Binary counterparts of writeSensors/writeControl, layouts in docs/README_EN.md
+static uint16_t _sensorsSequence = 0;
+static uint16_t _controlSequence = 0;
+
+static void writeSensors(TelemetryFrame& frame) {
+  frame.putU16(_sensorManager->getSonarRight());
+  frame.putU16(_sensorManager->getSonarLeft());
+  frame.putQ16(_sensorManager->getAccelX(), 1000);
+  frame.putQ16(_sensorManager->getAccelY(), 1000);
+  frame.putQ16(_sensorManager->getAccelZ(), 1000);
+  frame.putQ16(_sensorManager->getGyroX(), 100);
+  frame.putQ16(_sensorManager->getGyroY(), 100);
+  frame.putQ16(_sensorManager->getGyroZ(), 100);
+  frame.putQ16(_sensorManager->getYaw(), 100);
+  frame.putQ16(_sensorManager->getPitch(), 100);
+  frame.putQ16(_sensorManager->getRoll(), 100);
+  frame.putU16(constrain(_sensorManager->getVoltage(), 0, 65535));
+  frame.putI32(_sensorManager->getCurrent());
+  frame.putI32(_sensorManager->getPower());
+  frame.putU32(_sensorManager->getEnergy());
+}
+
+static void writeControl(TelemetryFrame& frame) {
+  frame.putI8(_motorController->getCurrentLeftSpeed());
+  frame.putU8(_motorController->getLeftDirection());
+  frame.putI16(_motorController->getLeftAcceleration());
+  frame.putI8(_motorController->getCurrentRightSpeed());
+  frame.putU8(_motorController->getRightDirection());
+  frame.putI16(_motorController->getRightAcceleration());
+  frame.putI16(_steering->getAngle());
+  frame.putI16(_steering->getAcceleration());
+}
+
+static void publishTelemetry(const char* topic, TelemetrySchema schema, uint16_t& sequence, void (*write)(TelemetryFrame&)) {
+  TelemetryFrame frame(schema, sequence++, hal::clock().millis());
+  {
+    PROFILE_SCOPE(PROFILE_SERIALIZE);
+    write(frame);
+  }
+  if (!frame.ok()) {
+    LOG_W("Telemetry for %s does not fit in %d bytes\n", topic, TELEMETRY_FRAME_MAX_SIZE);
+    return;
+  }
+
+  LOG_D("Published %s: %d bytes\n", topic, (int)frame.length());
+
+  #if defined(ENABLE_SEND_DATA)
+    Communication::publish(topic, frame.data(), frame.length());
+  #endif
+}
+
+// Same frames over the UDP link, with their own sequence so MQTT gaps do not show up as UDP loss
+static uint16_t _udpSensorsSequence = 0;
+static uint16_t _udpControlSequence = 0;
+
+static void sendUdpFrame(TelemetrySchema schema, uint16_t& sequence, void (*write)(TelemetryFrame&)) {
+  TelemetryFrame frame(schema, sequence++, hal::clock().millis());
+  write(frame);
+  if (frame.ok()) {
+    UdpLink::send(UDP_TELEMETRY, frame.data(), frame.length());
+  }
+}
+
+void sendUdpTelemetry() {
+  if (!UdpLink::isActive()) {
+    return;
+  }
+  sendUdpFrame(TELEMETRY_SCHEMA_SENSORS, _udpSensorsSequence, writeSensors);
+  sendUdpFrame(TELEMETRY_SCHEMA_CONTROL, _udpControlSequence, writeControl);
+}
+
+// Offline, the binary frames go to the spool instead, on the same sequence
+// counters so that backfilled and live frames line up
+static void spoolTelemetry(TelemetrySchema schema, uint16_t& sequence, void (*write)(TelemetryFrame&)) {
+  TelemetryFrame frame(schema, sequence++, hal::clock().millis());
+  write(frame);
+  if (frame.ok()) {
+    _spool->append(frame.data(), frame.length());
+  }
+}
+
+// One spooled page per run, so a long outage drains without crowding out
+// live telemetry and commands
+void publishBackfill() {
+  if (!_spool || !Communication::isConnected()) {
+    return;
+  }
+  uint8_t page[SPOOL_PAGE_SIZE];
+  size_t length;
+  if (_spool->peek(page, length) && Communication::publish("telemetry/backfill", page, length)) {
+    _spool->release();
+  }
+}
+
+void publishParameters() {
+  if (!Communication::isConnected()) {
+    if (_spool) {
+      spoolTelemetry(TELEMETRY_SCHEMA_SENSORS, _sensorsSequence, writeSensors);
+      spoolTelemetry(TELEMETRY_SCHEMA_CONTROL, _controlSequence, writeControl);
+    }
+    return;
+  }
+  if (Communication::getTelemetryFormat() == TELEMETRY_FORMAT_OFF) {
+    return;
+  }
+
+  TelemetryFormat format = Communication::getTelemetryFormat();
+  if (format & TELEMETRY_FORMAT_JSON) {
+    publishTelemetry("sensors/json", writeSensors);
+    publishTelemetry("control/json", writeControl);
+  }
+  if (format & TELEMETRY_FORMAT_BINARY) {
+    publishTelemetry("sensors/bin", TELEMETRY_SCHEMA_SENSORS, _sensorsSequence, writeSensors);
+    publishTelemetry("control/bin", TELEMETRY_SCHEMA_CONTROL, _controlSequence, writeControl);
+  }
+
+  if (!BootReport::ready()) {
+    BootReport::milestone(BOOT_READY, hal::clock().millis());
+    char output[MQTT_PACKET_SIZE];
+    BootReport::toJson(output, sizeof(output));
+    LOG_I("Boot report: %s\n", output);
+    Communication::publish("diag/boot", output, true);
+  }
+}
+
+} // namespace ControlLoop
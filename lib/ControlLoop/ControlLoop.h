@@ -0,0 +1,32 @@
+#ifndef CONTROL_LOOP_H
+#define CONTROL_LOOP_H
+
+#include "config.h"
+#include "MotorController.h"
+#include "SensorManager.h"
+#include "Steering.h"
+#include "Scheduler.h"
+#include "I2cQueue.h"
+#include "TelemetrySpool.h"
+#include "ConfigStore.h"
+#include "KvStore.h"
+
+// Platform-independent part of the firmware: task registration, the body of
+// loop() and telemetry. Called from src/firmware.cpp on the ESP8266 and from
+// the native entry point on the host.
+namespace ControlLoop {
+
+// spool may be nullptr, telemetry taken offline is then lost. store may
+// be nullptr too; otherwise its staged counters are flushed periodically.
+void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering, Scheduler* scheduler, I2cQueue* i2cQueue, TelemetrySpool* spool, KvStore* store);
+void loop();
+// Takes over the fields in CONFIG_LIVE_FIELDS that are set in changed
+void applyConfig(const Config& config, uint32_t changed);
+void updateCalibration();
+void publishParameters();
+void sendUdpTelemetry();
+void publishBackfill();
+
+} // namespace ControlLoop
+
+#endif // CONTROL_LOOP_H
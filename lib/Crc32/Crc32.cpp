@@ -0,0 +1,24 @@
+#include "Crc32.h"
+
+namespace Crc32 {
+
+// A nibble at a time: a 64-byte table instead of 1 KB, and two lookups per
+// byte instead of eight shifts, since ConfigStore::load() hashes the whole
+// JSON on every boot
+static const uint32_t NIBBLES[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t compute(const void* data, size_t length) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ NIBBLES[crc & 15];
+        crc = (crc >> 4) ^ NIBBLES[crc & 15];
+    }
+    return ~crc;
+}
+
+}
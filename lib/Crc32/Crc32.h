@@ -0,0 +1,16 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Crc32 {
+
+// CRC-32 (IEEE), as zlib computes it. Used by the config cache and the
+// key/value store records. In a namespace since the ESP8266 core declares
+// a crc32() of its own.
+uint32_t compute(const void* data, size_t length);
+
+}
+
+#endif // CRC32_H
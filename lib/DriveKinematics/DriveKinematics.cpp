@@ -0,0 +1,87 @@
+#include "DriveKinematics.h"
+
+namespace DriveKinematics {
+
+static MotorController* _motorController = nullptr;
+static Steering* _steering = nullptr;
+static KinematicsConfig _config = {
+    KINEMATICS_WHEELBASE, KINEMATICS_TRACK_WIDTH, KINEMATICS_MAX_WHEEL_SPEED,
+    KINEMATICS_MAX_STEER_ANGLE, KINEMATICS_SERVO_CENTER, KINEMATICS_SERVO_TRAVEL
+};
+static DriveTargets _targets = {0, 0, KINEMATICS_SERVO_CENTER, 0, 0, false};
+
+void setup(MotorController* motorController, Steering* steering) {
+    _motorController = motorController;
+    _steering = steering;
+}
+
+void configure(const KinematicsConfig& config) {
+    _config = config;
+    LOG_D("Kinematics: wheelbase %.3f m, track %.3f m, %.2f m/s, %.1f deg lock\n",
+          config.wheelbase, config.trackWidth, config.maxWheelSpeed, config.maxSteerAngle);
+}
+
+const KinematicsConfig& getConfig() {
+    return _config;
+}
+
+float maxCurvature(const KinematicsConfig& config) {
+    return tanf(radians(config.maxSteerAngle)) / config.wheelbase;
+}
+
+DriveTargets solve(const KinematicsConfig& config, float velocity, float curvature) {
+    DriveTargets targets;
+    targets.saturated = false;
+
+    float limit = maxCurvature(config);
+    if (fabsf(curvature) > limit) {
+        curvature = curvature > 0 ? limit : -limit;
+        targets.saturated = true;
+    }
+
+    // The servo only takes whole degrees; going back from the rounded angle
+    // gives the curvature the front axle will actually hold
+    float maxSteer = radians(config.maxSteerAngle);
+    float steer = atanf(config.wheelbase * curvature);
+    targets.steering = constrain((int)lroundf(config.servoCenter + steer / maxSteer * config.servoTravel), 0, 180);
+    steer = (float)(targets.steering - (int)config.servoCenter) / config.servoTravel * maxSteer;
+    curvature = tanf(steer) / config.wheelbase;
+
+    float left = velocity * (1 - curvature * config.trackWidth / 2);
+    float right = velocity * (1 + curvature * config.trackWidth / 2);
+    float fastest = max(fabsf(left), fabsf(right));
+    if (fastest > config.maxWheelSpeed) {
+        float scale = config.maxWheelSpeed / fastest;
+        left *= scale;
+        right *= scale;
+        velocity *= scale;
+        targets.saturated = true;
+    }
+
+    targets.left = constrain(lroundf(left / config.maxWheelSpeed * MOTOR_SPEED_FULL), -MOTOR_SPEED_FULL, MOTOR_SPEED_FULL);
+    targets.right = constrain(lroundf(right / config.maxWheelSpeed * MOTOR_SPEED_FULL), -MOTOR_SPEED_FULL, MOTOR_SPEED_FULL);
+    targets.velocity = velocity;
+    targets.curvature = curvature;
+    return targets;
+}
+
+const DriveTargets& drive(float velocity, float curvature) {
+    _targets = solve(_config, velocity, curvature);
+    _motorController->setTargets(_targets.left, _targets.right);
+    _steering->setAngle(_targets.steering);
+    if (_targets.saturated) {
+        LOG_D("Kinematics: %.2f m/s at %.3f 1/m saturated to %.2f m/s at %.3f 1/m\n",
+              velocity, curvature, _targets.velocity, _targets.curvature);
+    }
+    return _targets;
+}
+
+const DriveTargets& driveYawRate(float velocity, float yawRate) {
+    return drive(velocity, fabsf(velocity) < KINEMATICS_MIN_SPEED ? 0 : yawRate / velocity);
+}
+
+const DriveTargets& getTargets() {
+    return _targets;
+}
+
+} // namespace DriveKinematics
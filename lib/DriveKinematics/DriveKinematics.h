@@ -0,0 +1,57 @@
+#ifndef DRIVE_KINEMATICS_H
+#define DRIVE_KINEMATICS_H
+
+#include "config.h"
+#include "MotorController.h"
+#include "Steering.h"
+
+// Velocity and curvature to wheel and servo targets. The robot is a
+// bicycle model: driven rear wheels and a steered front axle. Following a
+// path of curvature k (1/m, positive turns left) takes a steering angle of
+// atan(wheelbase * k) and the rear wheels at v * (1 -/+ k * track / 2), so
+// they roll along the arc instead of scrubbing.
+//
+// The curvature is clamped to what the steering lock allows. A wheel past
+// maxWheelSpeed scales both wheels and the velocity down by the same
+// factor, which keeps their ratio and so the turning radius.
+
+struct KinematicsConfig {
+    float wheelbase;       // m
+    float trackWidth;      // m
+    float maxWheelSpeed;   // m/s at 100 %
+    float maxSteerAngle;   // deg of the steered wheels at full servo travel
+    uint8_t servoCenter;   // Servo angle for straight ahead
+    uint8_t servoTravel;   // Servo degrees from center to full lock
+};
+
+struct DriveTargets {
+    int32_t left;          // MotorController speed units
+    int32_t right;
+    int steering;          // Servo angle
+    float velocity;        // m/s, after saturation
+    float curvature;       // 1/m, as the whole-degree servo angle holds it
+    bool saturated;        // Velocity scaled down or curvature clamped
+};
+
+namespace DriveKinematics {
+
+void setup(MotorController* motorController, Steering* steering);
+void configure(const KinematicsConfig& config);
+const KinematicsConfig& getConfig();
+float maxCurvature(const KinematicsConfig& config);
+// Targets for velocity (m/s) along curvature (1/m), without applying them.
+// The wheels follow the curvature of the rounded servo angle, so the two
+// axles agree.
+DriveTargets solve(const KinematicsConfig& config, float velocity, float curvature);
+// Sets both wheels and the servo within one call, so the next motor tick
+// and steering pass start them together
+const DriveTargets& drive(float velocity, float curvature);
+// curvature = yawRate / velocity; below KINEMATICS_MIN_SPEED the yaw rate
+// is ignored and the robot goes straight
+const DriveTargets& driveYawRate(float velocity, float yawRate);
+// The targets of the last drive() call
+const DriveTargets& getTargets();
+
+} // namespace DriveKinematics
+
+#endif // DRIVE_KINEMATICS_H
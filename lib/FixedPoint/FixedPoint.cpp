@@ -0,0 +1,79 @@
+#include "FixedPoint.h"
+
+#define CORDIC_ITERATIONS 16
+
+// atan(2^-i) in Q16.16 degrees
+static const q16_16 CORDIC_ANGLES[CORDIC_ITERATIONS] = {
+    2949120, 1740967, 919879, 466945,
+    234379, 117304, 58666, 29335,
+    14668, 7334, 3667, 1833,
+    917, 458, 229, 115
+};
+
+namespace FixedPoint {
+
+// CORDIC in vectoring mode: rotate (x, y) onto the x axis by +-atan(2^-i)
+// steps and sum the rotations. Only shifts and adds, about 0.002 deg error.
+q16_16 atan2Degrees(int32_t y, int32_t x) {
+    if (x == 0 && y == 0) {
+        return 0;
+    }
+
+    // CORDIC converges for |angle| < 99 deg, fold the left half plane over
+    q16_16 angle = 0;
+    if (x < 0) {
+        angle = y >= 0 ? q16FromInt(180) : q16FromInt(-180);
+        x = -x;
+        y = -y;
+    }
+
+    // Normalize to 2^26..2^27 for resolution, leaving headroom for the
+    // CORDIC gain of ~1.65
+    uint32_t magnitude = (uint32_t)x | (uint32_t)(y < 0 ? -y : y);
+    int8_t shift = __builtin_clz(magnitude) - 5;
+    if (shift >= 0) {
+        x <<= shift;
+        y <<= shift;
+    } else {
+        x >>= -shift;
+        y >>= -shift;
+    }
+
+    for (uint8_t i = 0; i < CORDIC_ITERATIONS; i++) {
+        int32_t dx = x >> i;
+        int32_t dy = y >> i;
+        if (y > 0) {
+            x += dy;
+            y -= dx;
+            angle += CORDIC_ANGLES[i];
+        } else {
+            x -= dy;
+            y += dx;
+            angle -= CORDIC_ANGLES[i];
+        }
+    }
+
+    if (angle > q16FromInt(180)) angle -= q16FromInt(360);
+    if (angle < q16FromInt(-180)) angle += q16FromInt(360);
+    return angle;
+}
+
+uint32_t sqrt64(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)result;
+}
+
+}
@@ -0,0 +1,26 @@
+#ifndef FIXED_POINT_H
+#define FIXED_POINT_H
+
+#include <stdint.h>
+
+// Q16.16 fixed point for the sensor path. The ESP8266 has no FPU, so sensor
+// values stay integer end to end and only become floats when serialized.
+typedef int32_t q16_16;
+
+#define Q16_ONE 65536
+#define Q16_SHIFT 16
+
+inline q16_16 q16FromInt(int32_t value) { return value * Q16_ONE; }
+inline q16_16 q16Mul(q16_16 a, q16_16 b) { return (q16_16)(((int64_t)a * b) >> Q16_SHIFT); }
+inline float q16ToFloat(q16_16 value) { return value / (float)Q16_ONE; }
+
+namespace FixedPoint {
+
+// Angle of (x, y) in Q16.16 degrees, -180..180. Any common scale of the
+// inputs works.
+q16_16 atan2Degrees(int32_t y, int32_t x);
+uint32_t sqrt64(uint64_t value);
+
+}
+
+#endif // FIXED_POINT_H
@@ -0,0 +1,111 @@
+#include "Platform.h"
+#include "config.h"
+#include "AsyncSonar.h"
+
+#define SONAR_ROUNDTRIP_CM 57      // Microseconds for sound to travel 1 cm and back (same as NewPing)
+#define SONAR_MAX_SENSOR_DELAY 5800 // Max time for the sensor to raise the echo line after trigger (us)
+
+AsyncSonar::AsyncSonar(uint8_t pin, unsigned int maxDistanceCm, hal::TickTimer* pollTimer) {
+    _pin = pin;
+    _useInterrupt = false;
+    _pollTimer = pollTimer;
+    _clock = nullptr;
+    _gpio = nullptr;
+    _maxEchoTime = (unsigned long)(maxDistanceCm + 1) * SONAR_ROUNDTRIP_CM + SONAR_ROUNDTRIP_CM / 2;
+    _triggerTime = 0;
+    _distance = 0;
+    _state = SONAR_IDLE;
+    _echoStart = 0;
+    _echoEnd = 0;
+}
+
+void AsyncSonar::begin() {
+    _clock = &hal::clock();
+    _gpio = &hal::gpio();
+    _gpio->pinMode(_pin, INPUT);
+    _useInterrupt = _gpio->attachInterrupt(_pin, echoIsr, this);
+    if (!_useInterrupt) {
+        if (_pollTimer) {
+            LOG_I("Sonar pin %d has no interrupt support, echo is sampled every %d us\n", _pin, SONAR_ECHO_POLL_PERIOD);
+        } else {
+            LOG_E("Sonar pin %d has no interrupt support and no poll timer, no readings\n", _pin);
+        }
+    }
+}
+
+void IRAM_ATTR AsyncSonar::echoIsr(void* arg) {
+    static_cast<AsyncSonar*>(arg)->sampleEcho();
+}
+
+void IRAM_ATTR AsyncSonar::sampleEcho() {
+    unsigned long now = _clock->micros();
+    bool high = _gpio->digitalRead(_pin) == HIGH;
+
+    if (_state == SONAR_WAIT_ECHO_START && high) {
+        _echoStart = now;
+        _state = SONAR_WAIT_ECHO_END;
+    } else if (_state == SONAR_WAIT_ECHO_END && !high) {
+        _echoEnd = now;
+        _state = SONAR_ECHO_DONE;
+    }
+    if (!_useInterrupt && _state != SONAR_WAIT_ECHO_START && _state != SONAR_WAIT_ECHO_END) {
+        _pollTimer->stop();
+    }
+}
+
+void AsyncSonar::trigger() {
+    if (busy() || (!_useInterrupt && !_pollTimer)) {
+        return;
+    }
+
+    // The only busy wait left: the 10us trigger pulse required by the HC-SR04
+    _gpio->pinMode(_pin, OUTPUT);
+    _gpio->digitalWrite(_pin, LOW);
+    _clock->delayMicroseconds(4);
+    _gpio->digitalWrite(_pin, HIGH);
+    _clock->delayMicroseconds(10);
+    _gpio->digitalWrite(_pin, LOW);
+    _gpio->pinMode(_pin, INPUT);
+
+    _triggerTime = _clock->micros();
+    _state = SONAR_WAIT_ECHO_START;
+    if (!_useInterrupt) {
+        _pollTimer->start(SONAR_ECHO_POLL_PERIOD, echoIsr, this);
+    }
+}
+
+bool AsyncSonar::poll() {
+    // The handler writes _echoStart before _state, so reading them in the
+    // other order and micros() last never sees an edge newer than now
+    uint8_t state = _state;
+    unsigned long echoStart = _echoStart;
+    unsigned long now = _clock ? _clock->micros() : 0;
+
+    switch (state) {
+    case SONAR_WAIT_ECHO_START:
+        if (now - _triggerTime > SONAR_MAX_SENSOR_DELAY) {
+            finish(0); // Sensor never answered
+            return true;
+        }
+        return false;
+    case SONAR_WAIT_ECHO_END:
+        if (now - echoStart > _maxEchoTime) {
+            finish(0); // Out of range, report NO_ECHO like NewPing
+            return true;
+        }
+        return false;
+    case SONAR_ECHO_DONE:
+        finish((_echoEnd - echoStart) / SONAR_ROUNDTRIP_CM);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void AsyncSonar::finish(unsigned int distance) {
+    _distance = distance;
+    _state = SONAR_IDLE;
+    if (!_useInterrupt && _pollTimer) {
+        _pollTimer->stop();
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef ASYNC_SONAR_H
+#define ASYNC_SONAR_H
+
+#include "Hal.h"
+
+// Non-blocking HC-SR04 reader for single-pin (trigger == echo) wiring.
+// trigger() fires the ping and returns immediately; the echo edges are
+// timestamped in interrupt context and poll() only harvests the result.
+// GPIO16 has no interrupt support on the ESP8266, so on such a pin
+// pollTimer samples the echo every SONAR_ECHO_POLL_PERIOD while a ping is
+// out, like NewPing's ping_timer(). An edge is then timed to within that
+// period (24 us, ~0.4 cm) and nothing waits for it.
+class AsyncSonar : public hal::SonarDevice {
+public:
+    AsyncSonar(uint8_t pin, unsigned int maxDistanceCm, hal::TickTimer* pollTimer = nullptr);
+    void begin() override;
+    void trigger() override;
+    bool poll() override;   // true once per finished measurement (echo or timeout)
+    bool busy() const override { return _state != SONAR_IDLE; }
+    unsigned int getDistance() const override { return _distance; }
+
+private:
+    enum State : uint8_t {
+        SONAR_IDLE,
+        SONAR_WAIT_ECHO_START,
+        SONAR_WAIT_ECHO_END,
+        SONAR_ECHO_DONE
+    };
+
+    // Pin-change interrupt or poll timer tick
+    static void IRAM_ATTR echoIsr(void* arg);
+    void sampleEcho();
+    void finish(unsigned int distance);
+
+    uint8_t _pin;
+    bool _useInterrupt;
+    hal::TickTimer* _pollTimer;
+    // Taken in begin(): the hal accessors are not in IRAM, the handlers use these
+    hal::Clock* _clock;
+    hal::Gpio* _gpio;
+    unsigned long _maxEchoTime;
+    unsigned long _triggerTime;
+    unsigned int _distance;
+
+    volatile uint8_t _state;
+    volatile unsigned long _echoStart;
+    volatile unsigned long _echoEnd;
+};
+
+#endif // ASYNC_SONAR_H
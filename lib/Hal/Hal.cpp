@@ -0,0 +1,53 @@
+#include "Hal.h"
+
+namespace hal {
+
+static Clock* _clock = nullptr;
+static Gpio* _gpio = nullptr;
+static I2cBus* _i2c = nullptr;
+static Storage* _storage = nullptr;
+
+void setup(Clock* clock, Gpio* gpio, I2cBus* i2c, Storage* storage) {
+    _clock = clock;
+    _gpio = gpio;
+    _i2c = i2c;
+    _storage = storage;
+}
+
+Clock& clock() {
+    return *_clock;
+}
+
+Gpio& gpio() {
+    return *_gpio;
+}
+
+I2cBus& i2c() {
+    return *_i2c;
+}
+
+Storage& storage() {
+    return *_storage;
+}
+
+bool topicMatches(const char* filter, const char* topic) {
+    while (*filter) {
+        // "a/#" also matches "a" itself
+        if (*filter == '#' || (*topic == '\0' && strcmp(filter, "/#") == 0)) {
+            return true;
+        }
+        if (*filter == '+') {
+            while (*topic && *topic != '/') topic++;
+            filter++;
+            continue;
+        }
+        if (*filter != *topic) {
+            return false;
+        }
+        filter++;
+        topic++;
+    }
+    return *topic == '\0';
+}
+
+} // namespace hal
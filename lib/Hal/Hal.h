@@ -0,0 +1,227 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include "Platform.h"
+
+// Thin hardware interfaces used by the control code. The ESP8266 backends
+// live in HalArduino.h, the host fakes driven by a virtual clock in
+// HalNative.h. Board-wide services (clock, GPIO, I2C bus, EEPROM-like
+// storage) are reached through the accessors below; per-device objects
+// (servo, sonars, IMU, power monitor, MQTT) are injected into their owners.
+
+namespace hal {
+
+class Clock {
+public:
+    virtual ~Clock() {}
+    virtual uint32_t millis() = 0;
+    virtual uint32_t micros() = 0;
+    virtual void delay(uint32_t ms) = 0;
+    // Only for pulses of a few us
+    virtual void delayMicroseconds(uint32_t us) = 0;
+};
+
+typedef void (*InterruptHandler)(void* arg);
+
+class Gpio {
+public:
+    virtual ~Gpio() {}
+    virtual void pinMode(uint8_t pin, uint8_t mode) = 0;
+    virtual void digitalWrite(uint8_t pin, uint8_t value) = 0;
+    virtual int digitalRead(uint8_t pin) = 0;
+    virtual void analogWrite(uint8_t pin, int value) = 0;
+    // Full scale of analogWrite() and the PWM frequency, for all pins
+    virtual void analogWriteRange(uint16_t range) = 0;
+    virtual void analogWriteFreq(uint16_t frequency) = 0;
+    // Calls handler on both edges of the pin, in interrupt context on the
+    // ESP8266; false when the pin has no interrupt (GPIO16)
+    virtual bool attachInterrupt(uint8_t pin, InterruptHandler handler, void* arg) = 0;
+};
+
+// Short periodic interrupt, for sampling a pin that cannot interrupt.
+// start() restarts it; stop() may be called from the handler.
+class TickTimer {
+public:
+    virtual ~TickTimer() {}
+    virtual void start(uint32_t periodUs, InterruptHandler handler, void* arg) = 0;
+    virtual void stop() = 0;
+};
+
+enum I2cResult : uint8_t {
+    I2C_RESULT_OK,
+    I2C_RESULT_NACK,       // Device did not acknowledge
+    I2C_RESULT_BUS_ERROR   // Lost arbitration, SCL held low or short read
+};
+
+class I2cBus {
+public:
+    virtual ~I2cBus() {}
+    virtual bool probe(uint8_t address) = 0;
+    // Writes tx, then reads rxLength bytes after a repeated start. Either
+    // part may be empty.
+    virtual I2cResult transfer(uint8_t address, const uint8_t* tx, uint8_t txLength, uint8_t* rx, uint8_t rxLength) = 0;
+    // Clocks SCL until a device holding SDA low releases it, then sends a STOP
+    virtual void recover() = 0;
+};
+
+// Byte-addressed persistent storage with EEPROM semantics
+class Storage {
+public:
+    virtual ~Storage() {}
+    virtual void read(size_t address, void* data, size_t length) = 0;
+    virtual void write(size_t address, const void* data, size_t length) = 0;
+    virtual bool commit() = 0;
+};
+
+// Small files on the flash file system (LittleFS on the ESP8266). Only
+// appends and whole-file removal: LittleFS rewrites everything after a
+// modified block, so in-place writes are deliberately not offered.
+class FileSystem {
+public:
+    virtual ~FileSystem() {}
+    virtual bool append(const char* path, const void* data, size_t length) = 0;
+    // Bytes read, 0 when the file is missing or shorter than offset
+    virtual size_t read(const char* path, size_t offset, void* data, size_t length) = 0;
+    // 0 when the file is missing
+    virtual size_t size(const char* path) = 0;
+    virtual bool remove(const char* path) = 0;
+    // Replaces to when it exists, atomically on LittleFS
+    virtual bool rename(const char* from, const char* to) = 0;
+};
+
+// Raw NOR flash sectors outside the file system. erase() sets every bit of
+// a sector, write() can only clear bits. Offsets, lengths and buffers are
+// 4-byte aligned, as the ESP8266 flash API requires.
+class Flash {
+public:
+    virtual ~Flash() {}
+    virtual uint8_t sectorCount() = 0;
+    virtual size_t sectorSize() = 0;
+    virtual bool read(uint8_t sector, size_t offset, void* data, size_t length) = 0;
+    virtual bool write(uint8_t sector, size_t offset, const void* data, size_t length) = 0;
+    virtual bool erase(uint8_t sector) = 0;
+};
+
+class ServoOutput {
+public:
+    virtual ~ServoOutput() {}
+    virtual void attach(uint8_t pin) = 0;
+    virtual void write(int angle) = 0;
+};
+
+class SonarDevice {
+public:
+    virtual ~SonarDevice() {}
+    virtual void begin() = 0;
+    virtual void trigger() = 0;
+    virtual bool poll() = 0;            // true once per finished measurement
+    virtual bool busy() const = 0;
+    virtual unsigned int getDistance() const = 0;  // cm, 0 = no echo
+};
+
+// One DMP output packet in the raw units of the MPU6050 FIFO
+// (quaternion 1.0 = 16384, accel 1 g = 8192).
+struct ImuRawSample {
+    int16_t quaternion[4];  // w, x, y, z
+    int16_t accel[3];
+    int16_t gyro[3];
+};
+
+// Offsets/motion arrays are ordered accel x, y, z, gyro x, y, z
+class ImuDevice {
+public:
+    virtual ~ImuDevice() {}
+    virtual bool begin(uint8_t address) = 0;
+    // True when new packets may be waiting; timestamp is when they became
+    // ready (the INT edge when wired, otherwise now)
+    virtual bool dataReady(uint32_t& timestamp) = 0;
+    // Reads every complete packet from the FIFO, oldest first. On FIFO
+    // overflow the FIFO is reset, overflow is set and nothing is returned.
+    virtual uint8_t readFifo(ImuRawSample* samples, uint8_t maxSamples, bool& overflow) = 0;
+    virtual void getMotion6(int16_t motion[6]) = 0;
+    virtual void prepareCalibration() = 0;
+    virtual void setOffsets(const int16_t offsets[6]) = 0;
+    virtual void getOffsets(int16_t offsets[6]) = 0;
+};
+
+class PowerMonitor {
+public:
+    virtual ~PowerMonitor() {}
+    virtual bool begin(uint8_t address, float shunt, float maxCurrent) = 0;
+    // New shunt calibration without restarting the device
+    virtual bool calibrate(float shunt, float maxCurrent) = 0;
+    // Starts an asynchronous refresh of the readings below
+    virtual void requestUpdate() = 0;
+    // Latest readings, in integer units so that the sensor path needs no soft-float
+    virtual int32_t getBusVoltage() = 0;  // mV
+    virtual int32_t getCurrent() = 0;     // uA
+    virtual int32_t getPower() = 0;       // uW
+};
+
+typedef void (*MessageCallback)(const char* topic, const char* payload, size_t length);
+typedef void (*ConnectionCallback)();
+
+// MQTT topic filter match: '+' stands for one level, a trailing '#' for the rest
+bool topicMatches(const char* filter, const char* topic);
+
+// For nonces: the hardware generator on the ESP8266, a fixed-seed
+// generator on the host
+uint32_t random32();
+
+enum ConnectionState : uint8_t {
+    CONNECTION_WIFI_CONNECTING,
+    CONNECTION_MQTT_CONNECTING,
+    CONNECTION_CONNECTED,
+    CONNECTION_BACKOFF       // Waiting before the next attempt
+};
+
+struct ConnectionStats {
+    uint32_t wifiConnects;
+    uint32_t connects;       // Broker sessions established
+    uint32_t attempts;       // Broker connection attempts
+    uint32_t drops;          // Established sessions lost
+    uint32_t wifiTime;       // ms from starting to associate to having an address, last time
+    uint32_t connectTime;    // ms from boot or the drop to the broker session, last time
+    uint32_t maxConnectTime;
+    uint32_t wifiConnectedAt;  // millis() of the last association
+    bool fastConnect;        // The last association used the cached access point
+};
+
+// subscribe() takes a topic filter; the callback gets the topic the message
+// arrived on. Payloads handed to MessageCallback are NUL-terminated.
+class MqttTransport {
+public:
+    virtual ~MqttTransport() {}
+    virtual void setOnConnected(ConnectionCallback callback) = 0;
+    virtual bool subscribe(const char* topic, MessageCallback callback) = 0;
+    virtual bool publish(const char* topic, const char* payload, bool retain = false) = 0;
+    // Binary payloads may contain NUL bytes
+    virtual bool publish(const char* topic, const uint8_t* payload, size_t length, bool retain = false) = 0;
+    // Services the connection, never waits for the network
+    virtual void loop() = 0;
+    virtual bool isConnected() = 0;
+    virtual ConnectionState getState() = 0;
+    virtual const ConnectionStats& getConnectionStats() = 0;
+};
+
+// Connectionless datagrams (UDP on the ESP8266). Addresses are IPv4 in the
+// uint32_t form of IPAddress.
+class DatagramSocket {
+public:
+    virtual ~DatagramSocket() {}
+    virtual bool begin(uint16_t port) = 0;
+    // Copies the next pending datagram into buffer and returns its length,
+    // 0 when there is none. Datagrams larger than size are dropped.
+    virtual size_t receive(uint8_t* buffer, size_t size, uint32_t& address, uint16_t& port) = 0;
+    virtual bool send(uint32_t address, uint16_t port, const uint8_t* data, size_t length) = 0;
+};
+
+void setup(Clock* clock, Gpio* gpio, I2cBus* i2c, Storage* storage);
+Clock& clock();
+Gpio& gpio();
+I2cBus& i2c();
+Storage& storage();
+
+} // namespace hal
+
+#endif // HAL_H
@@ -0,0 +1,784 @@
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <EEPROM.h>
+#include <LittleFS.h>
+#include <flash_hal.h>
+#include <lwip/dhcp.h>
+#include <lwip/netif.h>
+#include "config.h"
+#include "HalArduino.h"
+
+#define INA226_REGISTER_BUS_VOLTAGE 0x02
+#define INA226_REGISTER_POWER 0x03
+#define INA226_REGISTER_CURRENT 0x04
+
+uint32_t hal::random32() {
+    return ESP.random();
+}
+
+uint32_t IRAM_ATTR ArduinoClock::micros() {
+    return ::micros();
+}
+
+int IRAM_ATTR ArduinoGpio::digitalRead(uint8_t pin) {
+    return ::digitalRead(pin);
+}
+
+bool ArduinoGpio::attachInterrupt(uint8_t pin, hal::InterruptHandler handler, void* arg) {
+    if (digitalPinToInterrupt(pin) == NOT_AN_INTERRUPT) {
+        return false;
+    }
+    attachInterruptArg(digitalPinToInterrupt(pin), handler, arg, CHANGE);
+    return true;
+}
+
+// Written before the compare is armed, read only by the handler
+static hal::InterruptHandler _tickHandler = nullptr;
+static void* _tickArg = nullptr;
+static uint32_t _tickCycles = 0;
+static volatile bool _tickRunning = false;
+
+void Timer0TickTimer::start(uint32_t periodUs, hal::InterruptHandler handler, void* arg) {
+    _tickRunning = false;
+    _tickHandler = handler;
+    _tickArg = arg;
+    _tickCycles = periodUs * ESP.getCpuFreqMHz();
+    _tickRunning = true;
+    timer0_isr_init();
+    timer0_attachInterrupt(tick);
+    timer0_write(ESP.getCycleCount() + _tickCycles);
+}
+
+// A compare already armed still fires once and finds the timer stopped
+void IRAM_ATTR Timer0TickTimer::stop() {
+    _tickRunning = false;
+}
+
+void IRAM_ATTR Timer0TickTimer::tick() {
+    if (!_tickRunning) {
+        return;
+    }
+    _tickHandler(_tickArg);
+    if (_tickRunning) {
+        timer0_write(ESP.getCycleCount() + _tickCycles);
+    }
+}
+
+void WireI2cBus::begin(uint8_t sda, uint8_t scl) {
+    _sda = sda;
+    _scl = scl;
+    Wire.begin(sda, scl);
+    Wire.setClock(I2C_CLOCK_SPEED);
+    Wire.setClockStretchLimit(I2C_STRETCH_LIMIT);
+}
+
+bool WireI2cBus::probe(uint8_t address) {
+    Wire.beginTransmission(address);
+    return Wire.endTransmission() == 0;
+}
+
+hal::I2cResult WireI2cBus::transfer(uint8_t address, const uint8_t* tx, uint8_t txLength, uint8_t* rx, uint8_t rxLength) {
+    if (txLength > 0) {
+        Wire.beginTransmission(address);
+        Wire.write(tx, txLength);
+        // endTransmission: 2 and 3 are address/data NACKs, 4 a bus error
+        uint8_t status = Wire.endTransmission(rxLength == 0);
+        if (status == 2 || status == 3) return hal::I2C_RESULT_NACK;
+        if (status != 0) return hal::I2C_RESULT_BUS_ERROR;
+    }
+    if (rxLength > 0) {
+        if (Wire.requestFrom(address, rxLength) != rxLength) {
+            return Wire.status() == I2C_OK ? hal::I2C_RESULT_NACK : hal::I2C_RESULT_BUS_ERROR;
+        }
+        for (uint8_t i = 0; i < rxLength; i++) {
+            rx[i] = Wire.read();
+        }
+    }
+    return hal::I2C_RESULT_OK;
+}
+
+// A device reset mid-read can keep driving SDA low while it waits for
+// clocks. Up to nine SCL pulses let it shift out the byte and release SDA.
+void WireI2cBus::recover() {
+    pinMode(_sda, INPUT_PULLUP);
+    pinMode(_scl, OUTPUT_OPEN_DRAIN);
+    for (uint8_t i = 0; i < 9 && digitalRead(_sda) == LOW; i++) {
+        digitalWrite(_scl, LOW);
+        delayMicroseconds(5);
+        digitalWrite(_scl, HIGH);
+        delayMicroseconds(5);
+    }
+
+    // STOP: SDA low to high while SCL is high
+    pinMode(_sda, OUTPUT_OPEN_DRAIN);
+    digitalWrite(_sda, LOW);
+    delayMicroseconds(5);
+    digitalWrite(_sda, HIGH);
+    delayMicroseconds(5);
+
+    LOG_W("I2C bus recovered, SDA %s\n", digitalRead(_sda) == HIGH ? "released" : "still held low");
+    begin(_sda, _scl);
+}
+
+void EepromStorage::begin(size_t size) {
+    EEPROM.begin(size);
+}
+
+void EepromStorage::read(size_t address, void* data, size_t length) {
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    for (size_t i = 0; i < length; i++) {
+        bytes[i] = EEPROM.read(address + i);
+    }
+}
+
+void EepromStorage::write(size_t address, const void* data, size_t length) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < length; i++) {
+        EEPROM.write(address + i, bytes[i]);
+    }
+}
+
+bool EepromStorage::commit() {
+    return EEPROM.commit();
+}
+
+// Files are closed after every call, which also commits them: LittleFS
+// updates are atomic at close, so a power cut loses at most this write
+bool LittleFileSystem::append(const char* path, const void* data, size_t length) {
+    File file = LittleFS.open(path, "a");
+    if (!file) {
+        return false;
+    }
+    size_t written = file.write(static_cast<const uint8_t*>(data), length);
+    file.close();
+    return written == length;
+}
+
+size_t LittleFileSystem::read(const char* path, size_t offset, void* data, size_t length) {
+    if (!LittleFS.exists(path)) {
+        return 0;
+    }
+    File file = LittleFS.open(path, "r");
+    if (!file || !file.seek(offset)) {
+        return 0;
+    }
+    size_t read = file.read(static_cast<uint8_t*>(data), length);
+    file.close();
+    return read;
+}
+
+size_t LittleFileSystem::size(const char* path) {
+    if (!LittleFS.exists(path)) {
+        return 0;
+    }
+    File file = LittleFS.open(path, "r");
+    size_t size = file ? file.size() : 0;
+    file.close();
+    return size;
+}
+
+bool LittleFileSystem::remove(const char* path) {
+    return LittleFS.remove(path);
+}
+
+bool LittleFileSystem::rename(const char* from, const char* to) {
+    return LittleFS.rename(from, to);
+}
+
+// From the linker script, like _FS_start. Without it the build fails to
+// link rather than the store landing where an OTA update is staged.
+extern "C" uint32_t _KV_start;
+extern "C" uint32_t _KV_end;
+#define KV_PHYS_ADDR ((uint32_t)&_KV_start - 0x40200000)
+#define KV_PHYS_SIZE ((uint32_t)&_KV_end - (uint32_t)&_KV_start)
+
+EspFlash::EspFlash(uint8_t sectors) :
+    _firstSector(KV_PHYS_ADDR / FLASH_SECTOR_SIZE),
+    _sectors(min((uint32_t)sectors, KV_PHYS_SIZE / FLASH_SECTOR_SIZE)) {
+}
+
+EspFlash::EspFlash(uint32_t firstSector, uint8_t sectors) :
+    _firstSector(firstSector),
+    _sectors(sectors) {
+}
+
+bool EspFlash::read(uint8_t sector, size_t offset, void* data, size_t length) {
+    if (sector >= _sectors || offset + length > FLASH_SECTOR_SIZE) return false;
+    return ESP.flashRead((_firstSector + sector) * FLASH_SECTOR_SIZE + offset, static_cast<uint32_t*>(data), length);
+}
+
+bool EspFlash::write(uint8_t sector, size_t offset, const void* data, size_t length) {
+    if (sector >= _sectors || offset + length > FLASH_SECTOR_SIZE) return false;
+    return ESP.flashWrite((_firstSector + sector) * FLASH_SECTOR_SIZE + offset, static_cast<const uint32_t*>(data), length);
+}
+
+bool EspFlash::erase(uint8_t sector) {
+    if (sector >= _sectors) return false;
+    return ESP.flashEraseSector(_firstSector + sector);
+}
+
+Mpu6050Imu::Mpu6050Imu(I2cQueue& queue, int8_t interruptPin) :
+    _queue(&queue),
+    _device(-1),
+    _userControl(0),
+    _interruptPin(interruptPin),
+    _packetSize(0),
+    _interruptTime(0),
+    _interruptPending(false),
+    _fetching(false),
+    _backlog(false),
+    _intStatus(0),
+    _fetchTime(0),
+    _sampleCount(0),
+    _overflow(false)
+{
+}
+
+bool Mpu6050Imu::begin(uint8_t address) {
+    _mpu = MPU6050(address);
+    _mpu.initialize();
+    uint8_t status = _mpu.dmpInitialize();
+    _mpu.setDMPEnabled(true);
+    if (status != 0) {
+        LOG_E("MPU6050 DMP init failed (code %d)\n", status);
+    }
+    _packetSize = _mpu.dmpGetFIFOPacketSize();
+    _device = _queue->addDevice(address, "mpu6050", true);
+    // FIFO resets from the queue write USER_CTRL with the DMP/FIFO enables kept
+    I2Cdev::readByte(address, MPU6050_RA_USER_CTRL, &_userControl);
+
+    // dmpInitialize() enables the DMP-ready and FIFO-overflow interrupts
+    if (_interruptPin >= 0) {
+        pinMode(_interruptPin, INPUT);
+        attachInterruptArg(digitalPinToInterrupt(_interruptPin), interruptIsr, this, RISING);
+    }
+    _mpu.resetFIFO();
+    return status == 0;
+}
+
+void IRAM_ATTR Mpu6050Imu::interruptIsr(void* arg) {
+    Mpu6050Imu* imu = static_cast<Mpu6050Imu*>(arg);
+    imu->_interruptTime = micros();
+    imu->_interruptPending = true;
+}
+
+void Mpu6050Imu::startFetch() {
+    if (_interruptPin >= 0) {
+        noInterrupts();
+        bool pending = _interruptPending;
+        uint32_t interruptTime = _interruptTime;
+        _interruptPending = false;
+        interrupts();
+        if (!pending && !_backlog) {
+            return;
+        }
+        if (pending) {
+            _fetchTime = interruptTime;
+        }
+    } else {
+        _fetchTime = micros();
+    }
+    _backlog = false;
+
+    // Reading INT_STATUS also releases the INT line
+    if (_queue->read(_device, MPU6050_RA_INT_STATUS, 1, onIntStatus, this) &&
+            _queue->read(_device, MPU6050_RA_FIFO_COUNTH, 2, onFifoCount, this)) {
+        _fetching = true;
+    }
+}
+
+void Mpu6050Imu::onIntStatus(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length) {
+    Mpu6050Imu* imu = static_cast<Mpu6050Imu*>(context);
+    imu->_intStatus = result == hal::I2C_RESULT_OK ? data[0] : 0;
+}
+
+void Mpu6050Imu::onFifoCount(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length) {
+    Mpu6050Imu* imu = static_cast<Mpu6050Imu*>(context);
+    if (result != hal::I2C_RESULT_OK) {
+        imu->_fetching = false;
+        return;
+    }
+
+    uint16_t count = (data[0] << 8) | data[1];
+    if ((imu->_intStatus & (1 << MPU6050_INTERRUPT_FIFO_OFLOW_BIT)) || count >= 1024) {
+        uint8_t reset = imu->_userControl | (1 << MPU6050_USERCTRL_FIFO_RESET_BIT);
+        imu->_queue->write(imu->_device, MPU6050_RA_USER_CTRL, &reset, 1);
+        imu->_overflow = true;
+        imu->_fetching = false;
+        return;
+    }
+
+    // FIFO_R_W streams the FIFO, it must not be merged with other registers
+    uint16_t packets = min((uint16_t)(count / imu->_packetSize), (uint16_t)min(IMU_FIFO_BATCH, I2C_MAX_TRANSFER / imu->_packetSize));
+    imu->_backlog = count / imu->_packetSize > packets;
+    if (packets == 0 || !imu->_queue->read(imu->_device, MPU6050_RA_FIFO_R_W, packets * imu->_packetSize, onFifoData, imu, false)) {
+        imu->_fetching = false;
+    }
+}
+
+void Mpu6050Imu::onFifoData(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length) {
+    Mpu6050Imu* imu = static_cast<Mpu6050Imu*>(context);
+    imu->_fetching = false;
+    if (result != hal::I2C_RESULT_OK) {
+        return;
+    }
+
+    imu->_sampleCount = 0;
+    for (uint8_t offset = 0; offset + imu->_packetSize <= length; offset += imu->_packetSize) {
+        hal::ImuRawSample& sample = imu->_samples[imu->_sampleCount++];
+        imu->_mpu.dmpGetQuaternion(sample.quaternion, data + offset);
+        imu->_mpu.dmpGetAccel(sample.accel, data + offset);
+        imu->_mpu.dmpGetGyro(sample.gyro, data + offset);
+    }
+}
+
+bool Mpu6050Imu::dataReady(uint32_t& timestamp) {
+    if (!_fetching && _sampleCount == 0 && !_overflow) {
+        startFetch();
+    }
+    timestamp = _fetchTime;
+    return _sampleCount > 0 || _overflow;
+}
+
+uint8_t Mpu6050Imu::readFifo(hal::ImuRawSample* samples, uint8_t maxSamples, bool& overflow) {
+    overflow = _overflow;
+    if (_overflow) {
+        _overflow = false;
+        _sampleCount = 0;
+        return 0;
+    }
+
+    uint8_t read = min(_sampleCount, maxSamples);
+    memcpy(samples, _samples, read * sizeof(hal::ImuRawSample));
+    memmove(_samples, _samples + read, (_sampleCount - read) * sizeof(hal::ImuRawSample));
+    _sampleCount -= read;
+    return read;
+}
+
+void Mpu6050Imu::getMotion6(int16_t motion[6]) {
+    _mpu.getMotion6(&motion[0], &motion[1], &motion[2], &motion[3], &motion[4], &motion[5]);
+}
+
+void Mpu6050Imu::prepareCalibration() {
+    _mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_2);
+    _mpu.setFullScaleGyroRange(MPU6050_GYRO_FS_250);
+}
+
+void Mpu6050Imu::setOffsets(const int16_t offsets[6]) {
+    _mpu.setXAccelOffset(offsets[0]);
+    _mpu.setYAccelOffset(offsets[1]);
+    _mpu.setZAccelOffset(offsets[2]);
+    _mpu.setXGyroOffset(offsets[3]);
+    _mpu.setYGyroOffset(offsets[4]);
+    _mpu.setZGyroOffset(offsets[5]);
+}
+
+void Mpu6050Imu::getOffsets(int16_t offsets[6]) {
+    offsets[0] = _mpu.getXAccelOffset();
+    offsets[1] = _mpu.getYAccelOffset();
+    offsets[2] = _mpu.getZAccelOffset();
+    offsets[3] = _mpu.getXGyroOffset();
+    offsets[4] = _mpu.getYGyroOffset();
+    offsets[5] = _mpu.getZGyroOffset();
+}
+
+Ina226PowerMonitor::Ina226PowerMonitor(I2cQueue& queue) :
+    _ina226(INA226_ADDRESS),
+    _queue(&queue),
+    _device(-1),
+    _currentLsb(0),
+    _pending(0),
+    _voltage(0),
+    _current(0),
+    _power(0)
+{
+}
+
+bool Ina226PowerMonitor::begin(uint8_t address, float shunt, float maxCurrent) {
+    _ina226 = INA226(address);
+    if (!_ina226.begin()) {
+        LOG_E("INA226 not found at address 0x%X\n", address);
+        return false;
+    }
+
+    calibrate(shunt, maxCurrent);
+    _ina226.setModeShuntBusContinuous();
+    _ina226.setBusVoltageConversionTime(INA226_1100_us);
+    _ina226.setShuntVoltageConversionTime(INA226_1100_us);
+    _ina226.setAverage(INA226_4_SAMPLES);
+
+    LOG_I("INA226 initialized:\n");
+    LOG_I("  Shunt: %.2f Ohm\n", shunt);
+    LOG_I("  Max Current: %.2f A\n", maxCurrent);
+    LOG_I("  Mode: %d (continuous)\n", _ina226.getMode());
+    LOG_I("  Calibrated: %s\n", _ina226.isCalibrated() ? "yes" : "no");
+    LOG_I("  Max Measurable: %.2f A\n", _ina226.getMaxCurrent());
+
+    // The INA226 register pointer does not auto-increment
+    _device = _queue->addDevice(address, "ina226", false);
+    return true;
+}
+
+// Writes the calibration register directly; tasks run one at a time, so no
+// queued transfer is in flight
+bool Ina226PowerMonitor::calibrate(float shunt, float maxCurrent) {
+    if (_ina226.setMaxCurrentShunt(maxCurrent, shunt) != INA226_ERR_NONE) {
+        LOG_W("INA226 rejected shunt %.3f Ohm, max current %.2f A\n", shunt, maxCurrent);
+        return false;
+    }
+    _currentLsb = (uint32_t)(_ina226.getCurrentLSB_uA() * 1000);
+    return true;
+}
+
+void Ina226PowerMonitor::requestUpdate() {
+    if (_pending > 0 || _device < 0) {
+        return;
+    }
+    _pending += _queue->read(_device, INA226_REGISTER_BUS_VOLTAGE, 2, onBusVoltage, this);
+    _pending += _queue->read(_device, INA226_REGISTER_POWER, 2, onPower, this);
+    _pending += _queue->read(_device, INA226_REGISTER_CURRENT, 2, onCurrent, this);
+}
+
+// Bus voltage register: 1.25 mV per bit
+void Ina226PowerMonitor::onBusVoltage(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length) {
+    Ina226PowerMonitor* monitor = static_cast<Ina226PowerMonitor*>(context);
+    monitor->_pending--;
+    if (result == hal::I2C_RESULT_OK) {
+        monitor->_voltage = (int32_t)((data[0] << 8) | data[1]) * 5 / 4;
+    }
+}
+
+// Power register: 25 current LSBs * 1 V per bit, always positive
+void Ina226PowerMonitor::onPower(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length) {
+    Ina226PowerMonitor* monitor = static_cast<Ina226PowerMonitor*>(context);
+    monitor->_pending--;
+    if (result == hal::I2C_RESULT_OK) {
+        monitor->_power = (int32_t)((uint64_t)((data[0] << 8) | data[1]) * 25 * monitor->_currentLsb / 1000);
+    }
+}
+
+void Ina226PowerMonitor::onCurrent(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length) {
+    Ina226PowerMonitor* monitor = static_cast<Ina226PowerMonitor*>(context);
+    monitor->_pending--;
+    if (result == hal::I2C_RESULT_OK) {
+        monitor->_current = (int32_t)((int64_t)(int16_t)((data[0] << 8) | data[1]) * monitor->_currentLsb / 1000);
+    }
+}
+
+#define WIFI_CACHE_MAGIC 0x57494649  // "WIFI"
+#define LEASE_CLOCK_MAGIC 0x4c454153  // "LEAS"
+#define LEASE_AGE_UNKNOWN 0xFFFFFFFF
+#define LEASE_CLOCK_STEP 60  // s between updates of the lease age
+
+static uint32_t fnv1a(const void* data, size_t length) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+EspMqttTransport::EspMqttTransport(const char* ssid, const char* password, const char* server, const char* clientName, uint16_t port, bool reuseAddress) :
+    _ssid(ssid),
+    _password(password),
+    _server(server),
+    _clientName(clientName),
+    _port(port),
+    _brokerResolved(false),
+    _mqtt(_wifiClient),
+    _onConnected(nullptr),
+    _subscriptionCount(0),
+    _state(hal::CONNECTION_WIFI_CONNECTING),
+    _stateTime(0),
+    _outageStart(millis()),
+    _backoff(MQTT_BACKOFF_MIN),
+    _backoffWait(0),
+    _reuseAddress(reuseAddress),
+    _staticAddress(false),
+    _leaseTick(millis())
+{
+    memset(&_stats, 0, sizeof(_stats));
+    hal::storage().read(EEPROM_WIFI_CACHE_ADDRESS, &_cache, sizeof(_cache));
+    _cacheValid = _cache.magic == WIFI_CACHE_MAGIC && _cache.ssidHash == fnv1a(ssid, strlen(ssid)) &&
+                  _cache.checksum == fnv1a(&_cache, offsetof(WifiCache, checksum));
+
+    // RTC memory holds garbage after a power loss, and how long the power
+    // was off is unknown, so the lease may have run out
+    LeaseClock clock;
+    ESP.rtcUserMemoryRead(RTC_LEASE_CLOCK_BLOCK, reinterpret_cast<uint32_t*>(&clock), sizeof(clock));
+    bool clockValid = clock.magic == LEASE_CLOCK_MAGIC && clock.checksum == fnv1a(&clock, offsetof(LeaseClock, checksum));
+    _leaseAge = clockValid ? clock.age : LEASE_AGE_UNKNOWN;
+
+    // The SDK would otherwise write its station config to flash on every
+    // begin(), and its own reconnect always scans
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+    WiFi.mode(WIFI_STA);
+
+    _wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT);
+    _mqtt.setBufferSize(MQTT_PACKET_SIZE);
+    _mqtt.setSocketTimeout(max(MQTT_CONNECT_TIMEOUT / 1000, 1));
+    _mqtt.setCallback([this] (char* topic, uint8_t* payload, unsigned int length) {
+        onMessage(topic, payload, length);
+    });
+
+    startWifi();
+}
+
+void EspMqttTransport::enter(hal::ConnectionState state) {
+    _state = state;
+    _stateTime = millis();
+}
+
+bool EspMqttTransport::leaseUsable() {
+    return _reuseAddress && _cacheValid && _cache.address != 0 && _leaseAge < _cache.leaseTime / 2;
+}
+
+void EspMqttTransport::saveLeaseAge() {
+    LeaseClock clock;
+    clock.magic = LEASE_CLOCK_MAGIC;
+    clock.age = _leaseAge;
+    clock.checksum = fnv1a(&clock, offsetof(LeaseClock, checksum));
+    ESP.rtcUserMemoryWrite(RTC_LEASE_CLOCK_BLOCK, reinterpret_cast<uint32_t*>(&clock), sizeof(clock));
+}
+
+// Lease time the server granted, from lwIP's DHCP client
+static uint32_t dhcpLeaseTime() {
+    struct dhcp* dhcp = netif_default ? netif_dhcp_data(netif_default) : nullptr;
+    return dhcp && dhcp->offered_t0_lease ? dhcp->offered_t0_lease : WIFI_LEASE_DEFAULT_TIME;
+}
+
+void EspMqttTransport::startWifi() {
+    _stats.fastConnect = _cacheValid;
+    _staticAddress = leaseUsable();
+    // The network may have changed, so the broker is looked up again
+    _brokerResolved = false;
+    if (_staticAddress) {
+        WiFi.config(IPAddress(_cache.address), IPAddress(_cache.gateway), IPAddress(_cache.subnet), IPAddress(_cache.dns));
+    } else {
+        WiFi.config(IPAddress(), IPAddress(), IPAddress());  // Back to DHCP
+    }
+    if (_cacheValid) {
+        WiFi.begin(_ssid.c_str(), _password.c_str(), _cache.channel, _cache.bssid);
+    } else {
+        WiFi.begin(_ssid.c_str(), _password.c_str());
+    }
+    enter(hal::CONNECTION_WIFI_CONNECTING);
+}
+
+void EspMqttTransport::startBackoff() {
+    _backoffWait = _backoff + random(_backoff / 4 + 1);  // Jitter keeps a fleet from retrying in lockstep
+    _backoff = min(_backoff * 2, (uint32_t)MQTT_BACKOFF_MAX);
+    LOG_D("Next connection attempt in %lu ms\n", (unsigned long)_backoffWait);
+    enter(hal::CONNECTION_BACKOFF);
+}
+
+// Written only when the access point or the lease changed, so a stable
+// network costs no flash writes. The lease is only taken from a DHCP
+// connect; a reused address would otherwise renew itself forever.
+void EspMqttTransport::saveWifiCache() {
+    WifiCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.magic = WIFI_CACHE_MAGIC;
+    cache.ssidHash = fnv1a(_ssid.c_str(), _ssid.length());
+    memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    cache.channel = WiFi.channel();
+    if (_staticAddress) {
+        cache.address = _cache.address;
+        cache.gateway = _cache.gateway;
+        cache.subnet = _cache.subnet;
+        cache.dns = _cache.dns;
+        cache.leaseTime = _cache.leaseTime;
+    } else {
+        cache.address = (uint32_t)WiFi.localIP();
+        cache.gateway = (uint32_t)WiFi.gatewayIP();
+        cache.subnet = (uint32_t)WiFi.subnetMask();
+        cache.dns = (uint32_t)WiFi.dnsIP();
+        cache.leaseTime = dhcpLeaseTime();
+        _leaseAge = 0;
+        _leaseTick = millis();
+        saveLeaseAge();
+    }
+    cache.checksum = fnv1a(&cache, offsetof(WifiCache, checksum));
+
+    _cacheValid = true;
+    if (memcmp(&cache, &_cache, sizeof(cache)) == 0) {
+        return;
+    }
+    _cache = cache;
+    hal::storage().write(EEPROM_WIFI_CACHE_ADDRESS, &_cache, sizeof(_cache));
+    hal::storage().commit();
+    LOG_I("WiFi cache updated: channel %u\n", _cache.channel);
+}
+
+void EspMqttTransport::loop() {
+    // The lease ages whatever the connection does; RTC memory costs no flash wear
+    if (millis() - _leaseTick >= LEASE_CLOCK_STEP * 1000) {
+        _leaseTick += LEASE_CLOCK_STEP * 1000;
+        if (_reuseAddress && _leaseAge != LEASE_AGE_UNKNOWN) {
+            _leaseAge += LEASE_CLOCK_STEP;
+            saveLeaseAge();
+        }
+    }
+
+    uint32_t elapsed = millis() - _stateTime;
+    switch (_state) {
+        case hal::CONNECTION_CONNECTED:
+            if (_staticAddress && !leaseUsable()) {
+                LOG_I("Reused address due for renewal, reconnecting through DHCP\n");
+                _mqtt.disconnect();
+                WiFi.disconnect();
+                _outageStart = millis();
+                startWifi();
+                return;
+            }
+            if (WiFi.status() == WL_CONNECTED && _mqtt.loop()) {
+                return;
+            }
+            LOG_W("MQTT connection lost (state %d)\n", _mqtt.state());
+            _mqtt.disconnect();
+            _stats.drops++;
+            _outageStart = millis();
+            if (WiFi.status() == WL_CONNECTED) {
+                enter(hal::CONNECTION_MQTT_CONNECTING);
+            } else {
+                startWifi();
+            }
+            return;
+
+        case hal::CONNECTION_WIFI_CONNECTING:
+            if (WiFi.status() == WL_CONNECTED) {
+                _stats.wifiConnects++;
+                _stats.wifiTime = elapsed;
+                _stats.wifiConnectedAt = millis();
+                LOG_I("WiFi connected in %lu ms%s\n", (unsigned long)elapsed, _stats.fastConnect ? " (cached access point)" : "");
+                saveWifiCache();
+                // The broker attempt waits for the next pass, keeping this one short
+                enter(hal::CONNECTION_MQTT_CONNECTING);
+            } else if (_stats.fastConnect && elapsed > WIFI_FAST_CONNECT_TIMEOUT) {
+                LOG_W("Cached access point not reachable, scanning\n");
+                _cacheValid = false;
+                startWifi();
+            } else if (elapsed > WIFI_CONNECT_TIMEOUT) {
+                LOG_W("WiFi connection to %s timed out\n", _ssid.c_str());
+                WiFi.disconnect();
+                startBackoff();
+            }
+            return;
+
+        case hal::CONNECTION_MQTT_CONNECTING:
+            if (WiFi.status() != WL_CONNECTED) {
+                startWifi();
+                return;
+            }
+            _stats.attempts++;
+            // PubSubClient would look the name up in every connect(), with
+            // the SDK's 10 s DNS timeout; here it is resolved once, bounded
+            if (!_brokerResolved) {
+                if (!WiFi.hostByName(_server.c_str(), _brokerAddress, MQTT_DNS_TIMEOUT)) {
+                    LOG_W("Cannot resolve %s\n", _server.c_str());
+                    startBackoff();
+                    return;
+                }
+                _brokerResolved = true;
+                _mqtt.setServer(_brokerAddress, _port);
+            }
+            // cleanSession = false keeps subscriptions and QoS 1 messages across reconnects
+            if (!_mqtt.connect(_clientName.c_str(), nullptr, nullptr, nullptr, 0, false, nullptr, false)) {
+                LOG_W("MQTT connection to %s failed (state %d)\n", _server.c_str(), _mqtt.state());
+                // The broker may have moved; and a reused address may be
+                // taken, so the next association goes through DHCP
+                _brokerResolved = false;
+                if (_staticAddress) {
+                    _leaseAge = LEASE_AGE_UNKNOWN;
+                    saveLeaseAge();
+                    WiFi.disconnect();
+                }
+                startBackoff();
+                return;
+            }
+            _stats.connects++;
+            _stats.connectTime = millis() - _outageStart;
+            _stats.maxConnectTime = max(_stats.maxConnectTime, _stats.connectTime);
+            _backoff = MQTT_BACKOFF_MIN;
+            LOG_I("MQTT connected, %lu ms after boot or the last drop\n", (unsigned long)_stats.connectTime);
+            enter(hal::CONNECTION_CONNECTED);
+
+            _subscriptionCount = 0;
+            if (_onConnected) {
+                _onConnected();
+            }
+            return;
+
+        case hal::CONNECTION_BACKOFF:
+            if (elapsed < _backoffWait) {
+                return;
+            }
+            if (WiFi.status() == WL_CONNECTED) {
+                enter(hal::CONNECTION_MQTT_CONNECTING);
+            } else {
+                startWifi();
+            }
+            return;
+    }
+}
+
+bool EspMqttTransport::subscribe(const char* topic, hal::MessageCallback callback) {
+    if (_subscriptionCount >= MQTT_MAX_SUBSCRIPTIONS || strlen(topic) >= MQTT_MAX_TOPIC_LENGTH) {
+        LOG_E("Cannot subscribe to %s\n", topic);
+        return false;
+    }
+    Subscription& subscription = _subscriptions[_subscriptionCount++];
+    strcpy(subscription.topic, topic);
+    subscription.callback = callback;
+    return _mqtt.subscribe(topic);
+}
+
+bool EspMqttTransport::publish(const char* topic, const char* payload, bool retain) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retain);
+}
+
+bool EspMqttTransport::publish(const char* topic, const uint8_t* payload, size_t length, bool retain) {
+    return _mqtt.publish(topic, payload, length, retain);
+}
+
+// PubSubClient's payload is not NUL-terminated, handlers get a copy that is
+void EspMqttTransport::onMessage(char* topic, uint8_t* payload, unsigned int length) {
+    length = min(length, (unsigned int)MQTT_PACKET_SIZE);
+    memcpy(_inbox, payload, length);
+    _inbox[length] = '\0';
+
+    for (uint8_t i = 0; i < _subscriptionCount; i++) {
+        if (hal::topicMatches(_subscriptions[i].topic, topic)) {
+            _subscriptions[i].callback(topic, _inbox, length);
+            return;
+        }
+    }
+}
+
+size_t WiFiUdpSocket::receive(uint8_t* buffer, size_t size, uint32_t& address, uint16_t& port) {
+    int length = _udp.parsePacket();
+    if (length <= 0) {
+        return 0;
+    }
+    if ((size_t)length > size) {
+        _udp.flush();
+        return 0;
+    }
+    address = (uint32_t)_udp.remoteIP();
+    port = _udp.remotePort();
+    return _udp.read(buffer, length);
+}
+
+bool WiFiUdpSocket::send(uint32_t address, uint16_t port, const uint8_t* data, size_t length) {
+    if (!_udp.beginPacket(IPAddress(address), port)) {
+        return false;
+    }
+    _udp.write(data, length);
+    return _udp.endPacket() == 1;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,278 @@
+#ifndef HAL_ARDUINO_H
+#define HAL_ARDUINO_H
+
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+#include <Servo.h>
+#include <I2Cdev.h>
+#include <MPU6050_6Axis_MotionApps20.h>
+#include <INA226.h>
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+#include <WiFiUdp.h>
+#include "config.h"
+#include "Hal.h"
+#include "AsyncSonar.h"
+#include "I2cQueue.h"
+
+// ESP8266 backends of the hal interfaces
+
+// micros() and digitalRead() are in IRAM: interrupt handlers use them
+class ArduinoClock : public hal::Clock {
+public:
+    uint32_t millis() override { return ::millis(); }
+    uint32_t micros() override;
+    void delay(uint32_t ms) override { ::delay(ms); }
+    void delayMicroseconds(uint32_t us) override { ::delayMicroseconds(us); }
+};
+
+class ArduinoGpio : public hal::Gpio {
+public:
+    void pinMode(uint8_t pin, uint8_t mode) override { ::pinMode(pin, mode); }
+    void digitalWrite(uint8_t pin, uint8_t value) override { ::digitalWrite(pin, value); }
+    int digitalRead(uint8_t pin) override;
+    void analogWrite(uint8_t pin, int value) override { ::analogWrite(pin, value); }
+    void analogWriteRange(uint16_t range) override { ::analogWriteRange(range); }
+    void analogWriteFreq(uint16_t frequency) override { ::analogWriteFreq(frequency); }
+    bool attachInterrupt(uint8_t pin, hal::InterruptHandler handler, void* arg) override;
+};
+
+// CCOMPARE0 (timer0 in the core), which nothing else in this firmware uses:
+// timer1 belongs to the PWM and servo waveforms. One instance per board.
+class Timer0TickTimer : public hal::TickTimer {
+public:
+    void start(uint32_t periodUs, hal::InterruptHandler handler, void* arg) override;
+    void stop() override;
+
+private:
+    static void IRAM_ATTR tick();
+};
+
+class WireI2cBus : public hal::I2cBus {
+public:
+    void begin(uint8_t sda, uint8_t scl);
+    bool probe(uint8_t address) override;
+    hal::I2cResult transfer(uint8_t address, const uint8_t* tx, uint8_t txLength, uint8_t* rx, uint8_t rxLength) override;
+    void recover() override;
+
+private:
+    uint8_t _sda;
+    uint8_t _scl;
+};
+
+class EepromStorage : public hal::Storage {
+public:
+    void begin(size_t size);
+    void read(size_t address, void* data, size_t length) override;
+    void write(size_t address, const void* data, size_t length) override;
+    bool commit() override;
+};
+
+// Expects LittleFS.begin() to have succeeded
+class LittleFileSystem : public hal::FileSystem {
+public:
+    bool append(const char* path, const void* data, size_t length) override;
+    size_t read(const char* path, size_t offset, void* data, size_t length) override;
+    size_t size(const char* path) override;
+    bool remove(const char* path) override;
+    bool rename(const char* from, const char* to) override;
+};
+
+// Raw flash sectors for the key/value store
+class EspFlash : public hal::Flash {
+public:
+    // The sectors ld/eagle.flash.4m2m.kv.ld reserves between LittleFS and
+    // EEPROM, at most as many as the script reserves
+    explicit EspFlash(uint8_t sectors);
+    // Any other span; the old store location is read this way
+    EspFlash(uint32_t firstSector, uint8_t sectors);
+    uint8_t sectorCount() override { return _sectors; }
+    size_t sectorSize() override { return FLASH_SECTOR_SIZE; }
+    bool read(uint8_t sector, size_t offset, void* data, size_t length) override;
+    bool write(uint8_t sector, size_t offset, const void* data, size_t length) override;
+    bool erase(uint8_t sector) override;
+
+private:
+    uint32_t _firstSector;
+    uint8_t _sectors;
+};
+
+class ArduinoServo : public hal::ServoOutput {
+public:
+    void attach(uint8_t pin) override { _servo.attach(pin); }
+    void write(int angle) override { _servo.write(angle); }
+
+private:
+    Servo _servo;
+};
+
+// DMP packets are fetched through the I2C queue: INT status and FIFO count
+// first, then a burst of whole packets. dataReady() starts a fetch when the
+// INT pin fired (or on every call when it is not wired) and reports the
+// packets of the last completed one.
+class Mpu6050Imu : public hal::ImuDevice {
+public:
+    Mpu6050Imu(I2cQueue& queue, int8_t interruptPin);
+    bool begin(uint8_t address) override;
+    bool dataReady(uint32_t& timestamp) override;
+    uint8_t readFifo(hal::ImuRawSample* samples, uint8_t maxSamples, bool& overflow) override;
+    void getMotion6(int16_t motion[6]) override;
+    void prepareCalibration() override;
+    void setOffsets(const int16_t offsets[6]) override;
+    void getOffsets(int16_t offsets[6]) override;
+
+private:
+    static void IRAM_ATTR interruptIsr(void* arg);
+    static void onIntStatus(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+    static void onFifoCount(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+    static void onFifoData(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+    void startFetch();
+
+    MPU6050 _mpu;
+    I2cQueue* _queue;
+    int8_t _device;
+    uint8_t _userControl;
+    int8_t _interruptPin;
+    uint16_t _packetSize;
+    volatile uint32_t _interruptTime;
+    volatile bool _interruptPending;
+
+    bool _fetching;
+    bool _backlog;  // FIFO held more packets than the last fetch took
+    uint8_t _intStatus;
+    uint32_t _fetchTime;
+    hal::ImuRawSample _samples[IMU_FIFO_BATCH];
+    uint8_t _sampleCount;
+    bool _overflow;
+};
+
+// Configured through the INA226 library, read through the I2C queue. The
+// library converts every reading to float, so the registers are scaled with
+// integers here instead.
+class Ina226PowerMonitor : public hal::PowerMonitor {
+public:
+    Ina226PowerMonitor(I2cQueue& queue);
+    bool begin(uint8_t address, float shunt, float maxCurrent) override;
+    bool calibrate(float shunt, float maxCurrent) override;
+    void requestUpdate() override;
+    int32_t getBusVoltage() override { return _voltage; }
+    int32_t getCurrent() override { return _current; }
+    int32_t getPower() override { return _power; }
+
+private:
+    static void onBusVoltage(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+    static void onPower(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+    static void onCurrent(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+
+    INA226 _ina226;
+    I2cQueue* _queue;
+    int8_t _device;
+    uint32_t _currentLsb;  // nA per current register bit, from the calibration
+    uint8_t _pending;
+    int32_t _voltage;
+    int32_t _current;
+    int32_t _power;
+};
+
+// WiFi station plus PubSubClient. Payloads go out straight from the caller's
+// buffer; the settings are copied because PubSubClient keeps the pointers.
+// The session is persistent (no clean session).
+//
+// loop() runs the connection as a state machine: associate, connect to the
+// broker, and after a failure wait with exponential backoff. Two steps
+// block: the broker name lookup, once per association and for at most
+// MQTT_DNS_TIMEOUT, and the broker connect, for at most MQTT_CONNECT_TIMEOUT.
+// The access point (BSSID and channel) of the last connection is cached in
+// storage, so reconnects and cold boots join it directly instead of
+// scanning.
+//
+// With reuseAddress the last DHCP lease is also reused as a static address,
+// but only a lease from a DHCP connect and only while it is younger than
+// half its lease time, when a DHCP client would renew it. The lease age is
+// kept in RTC memory, which survives a restart but not a power loss, so the
+// first connection after power-on always uses DHCP. A session on a reused
+// address reconnects through DHCP once the lease is due for renewal.
+class EspMqttTransport : public hal::MqttTransport {
+public:
+    EspMqttTransport(const char* ssid, const char* password, const char* server, const char* clientName, uint16_t port, bool reuseAddress = false);
+    void setOnConnected(hal::ConnectionCallback callback) override { _onConnected = callback; }
+    bool subscribe(const char* topic, hal::MessageCallback callback) override;
+    bool publish(const char* topic, const char* payload, bool retain = false) override;
+    bool publish(const char* topic, const uint8_t* payload, size_t length, bool retain = false) override;
+    void loop() override;
+    bool isConnected() override { return _state == hal::CONNECTION_CONNECTED && _mqtt.connected(); }
+    hal::ConnectionState getState() override { return _state; }
+    const hal::ConnectionStats& getConnectionStats() override { return _stats; }
+
+private:
+    struct Subscription {
+        char topic[MQTT_MAX_TOPIC_LENGTH];
+        hal::MessageCallback callback;
+    };
+
+    struct WifiCache {
+        uint32_t magic;
+        uint32_t ssidHash;  // A changed SSID invalidates the cache
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint8_t reserved;
+        uint32_t address;
+        uint32_t gateway;
+        uint32_t subnet;
+        uint32_t dns;
+        uint32_t leaseTime;  // s, as granted by the DHCP server
+        uint32_t checksum;
+    };
+
+    struct LeaseClock {
+        uint32_t magic;
+        uint32_t age;  // s since the cached lease was granted
+        uint32_t checksum;
+    };
+
+    void onMessage(char* topic, uint8_t* payload, unsigned int length);
+    void enter(hal::ConnectionState state);
+    void startWifi();
+    void startBackoff();
+    void saveWifiCache();
+    bool leaseUsable();
+    void saveLeaseAge();
+
+    String _ssid, _password, _server, _clientName;
+    uint16_t _port;
+    IPAddress _brokerAddress;
+    bool _brokerResolved;
+    WiFiClient _wifiClient;
+    PubSubClient _mqtt;
+    hal::ConnectionCallback _onConnected;
+    Subscription _subscriptions[MQTT_MAX_SUBSCRIPTIONS];
+    uint8_t _subscriptionCount;
+    hal::ConnectionState _state;
+    hal::ConnectionStats _stats;
+    uint32_t _stateTime;    // millis() when the current state began
+    uint32_t _outageStart;  // Boot or the last drop, for connectTime
+    uint32_t _backoff;      // Next backoff base
+    uint32_t _backoffWait;  // Current wait, with jitter
+    WifiCache _cache;
+    bool _cacheValid;
+    bool _reuseAddress;
+    bool _staticAddress;  // This association reuses the cached lease
+    uint32_t _leaseAge;   // s, LEASE_AGE_UNKNOWN after a power loss
+    uint32_t _leaseTick;  // millis() the age was last advanced at
+    char _inbox[MQTT_PACKET_SIZE + 1];
+};
+
+class WiFiUdpSocket : public hal::DatagramSocket {
+public:
+    bool begin(uint16_t port) override { return _udp.begin(port) == 1; }
+    size_t receive(uint8_t* buffer, size_t size, uint32_t& address, uint16_t& port) override;
+    bool send(uint32_t address, uint16_t port, const uint8_t* data, size_t length) override;
+
+private:
+    WiFiUDP _udp;
+};
+
+#endif // ARDUINO
+
+#endif // HAL_ARDUINO_H
@@ -0,0 +1,362 @@
+#if !defined(ARDUINO)
+
+#include "HalNative.h"
+
+#define SONAR_ROUNDTRIP_CM 57
+
+// xorshift32, so runs are repeatable
+uint32_t hal::random32() {
+    static uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+FakeGpio::FakeGpio() {
+    memset(_mode, 0, sizeof(_mode));
+    memset(_digital, 0, sizeof(_digital));
+    memset(_analog, 0, sizeof(_analog));
+    memset(_handlers, 0, sizeof(_handlers));
+    memset(_handlerArgs, 0, sizeof(_handlerArgs));
+    _analogRange = 255;  // The ESP8266 core defaults
+    _analogFrequency = 1000;
+}
+
+void FakeGpio::pinMode(uint8_t pin, uint8_t mode) {
+    if (pin < NATIVE_PIN_COUNT) _mode[pin] = mode;
+}
+
+// Driving an output with an interrupt attached raises it like on the chip
+void FakeGpio::digitalWrite(uint8_t pin, uint8_t value) {
+    setInput(pin, value);
+}
+
+int FakeGpio::digitalRead(uint8_t pin) {
+    return pin < NATIVE_PIN_COUNT ? _digital[pin] : LOW;
+}
+
+void FakeGpio::analogWrite(uint8_t pin, int value) {
+    if (pin < NATIVE_PIN_COUNT) _analog[pin] = value;
+}
+
+bool FakeGpio::attachInterrupt(uint8_t pin, hal::InterruptHandler handler, void* arg) {
+    if (pin >= NATIVE_PIN_COUNT || pin == NATIVE_NO_INTERRUPT_PIN) {
+        return false;
+    }
+    _handlers[pin] = handler;
+    _handlerArgs[pin] = arg;
+    return true;
+}
+
+void FakeGpio::setInput(uint8_t pin, uint8_t value) {
+    if (pin >= NATIVE_PIN_COUNT || _digital[pin] == value) {
+        return;
+    }
+    _digital[pin] = value;
+    if (_handlers[pin]) {
+        _handlers[pin](_handlerArgs[pin]);
+    }
+}
+
+void FakeTickTimer::start(uint32_t periodUs, hal::InterruptHandler handler, void* arg) {
+    _handler = handler;
+    _arg = arg;
+    _period = periodUs;
+    _next = hal::clock().micros() + periodUs;
+    _running = true;
+}
+
+void FakeTickTimer::run() {
+    while (_running && (int32_t)(hal::clock().micros() - _next) >= 0) {
+        _next += _period;
+        _ticks++;
+        _handler(_arg);
+    }
+}
+
+hal::I2cResult FakeI2cBus::transfer(uint8_t address, const uint8_t* tx, uint8_t txLength, uint8_t* rx, uint8_t rxLength) {
+    _transfers++;
+    if (!probe(address)) {
+        return hal::I2C_RESULT_NACK;
+    }
+    if (rxLength > 0) memset(rx, 0, rxLength);
+    return hal::I2C_RESULT_OK;
+}
+
+void MemoryStorage::read(size_t address, void* data, size_t length) {
+    if (address + length > NATIVE_STORAGE_SIZE) return;
+    memcpy(data, _data + address, length);
+}
+
+void MemoryStorage::write(size_t address, const void* data, size_t length) {
+    if (address + length > NATIVE_STORAGE_SIZE) return;
+    memcpy(_data + address, data, length);
+}
+
+MemoryFileSystem::File* MemoryFileSystem::find(const char* path) {
+    for (uint8_t i = 0; i < NATIVE_FILE_COUNT; i++) {
+        if (_files[i].used && strcmp(_files[i].path, path) == 0) return &_files[i];
+    }
+    return nullptr;
+}
+
+bool MemoryFileSystem::append(const char* path, const void* data, size_t length) {
+    File* file = find(path);
+    for (uint8_t i = 0; !file && i < NATIVE_FILE_COUNT; i++) {
+        if (!_files[i].used && strlen(path) < NATIVE_FILE_PATH_LENGTH) {
+            file = &_files[i];
+            file->used = true;
+            strcpy(file->path, path);
+            file->size = 0;
+        }
+    }
+    if (!file || file->size + length > NATIVE_FILE_SIZE) {
+        return false;
+    }
+    memcpy(file->data + file->size, data, length);
+    file->size += length;
+    _appends++;
+    _bytesWritten += length;
+    return true;
+}
+
+size_t MemoryFileSystem::read(const char* path, size_t offset, void* data, size_t length) {
+    File* file = find(path);
+    if (!file || offset >= file->size) return 0;
+    length = min(length, file->size - offset);
+    memcpy(data, file->data + offset, length);
+    return length;
+}
+
+size_t MemoryFileSystem::size(const char* path) {
+    File* file = find(path);
+    return file ? file->size : 0;
+}
+
+bool MemoryFileSystem::remove(const char* path) {
+    File* file = find(path);
+    if (!file) return false;
+    file->used = false;
+    return true;
+}
+
+bool MemoryFileSystem::rename(const char* from, const char* to) {
+    File* file = find(from);
+    if (!file || strlen(to) >= NATIVE_FILE_PATH_LENGTH) return false;
+    remove(to);
+    strcpy(file->path, to);
+    return true;
+}
+
+MemoryFlash::MemoryFlash() {
+    memset(_data, 0xFF, sizeof(_data));
+    memset(_erases, 0, sizeof(_erases));
+    _writes = 0;
+    _budget = -1;
+    _powered = true;
+}
+
+bool MemoryFlash::valid(uint8_t sector, size_t offset, size_t length) const {
+    return _powered && sector < NATIVE_FLASH_SECTORS && offset % 4 == 0 && length % 4 == 0 &&
+           offset + length <= NATIVE_FLASH_SECTOR_SIZE;
+}
+
+bool MemoryFlash::spend() {
+    if (_budget < 0) return true;
+    if (_budget-- > 0) return true;
+    _powered = false;
+    return false;
+}
+
+bool MemoryFlash::read(uint8_t sector, size_t offset, void* data, size_t length) {
+    if (!valid(sector, offset, length)) return false;
+    memcpy(data, _data[sector] + offset, length);
+    return true;
+}
+
+bool MemoryFlash::write(uint8_t sector, size_t offset, const void* data, size_t length) {
+    if (!valid(sector, offset, length)) return false;
+    bool complete = spend();
+    if (!complete) {
+        length = length / 8 * 4;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < length; i++) {
+        _data[sector][offset + i] &= bytes[i];
+    }
+    _writes++;
+    return complete;
+}
+
+bool MemoryFlash::erase(uint8_t sector) {
+    if (!valid(sector, 0, 0)) return false;
+    bool complete = spend();
+    size_t start = complete ? 0 : NATIVE_FLASH_SECTOR_SIZE / 2;
+    memset(_data[sector] + start, 0xFF, NATIVE_FLASH_SECTOR_SIZE - start);
+    _erases[sector]++;
+    return complete;
+}
+
+void FakeSonar::trigger() {
+    if (_busy) return;
+    _busy = true;
+    _triggerTime = hal::clock().micros();
+}
+
+bool FakeSonar::poll() {
+    if (!_busy || hal::clock().micros() - _triggerTime < (uint32_t)_distance * SONAR_ROUNDTRIP_CM) {
+        return false;
+    }
+    _busy = false;
+    _result = _distance;
+    return true;
+}
+
+FakeImu::FakeImu() {
+    _fifoCount = 0;
+    _overflow = false;
+    _readyTime = 0;
+    memset(_motion, 0, sizeof(_motion));
+    memset(_offsets, 0, sizeof(_offsets));
+}
+
+// Offset registers are in +-16 g (accel) and +-1000 deg/s (gyro) units, 8
+// and 4 LSB of the +-2 g / +-250 deg/s readings
+void FakeImu::getMotion6(int16_t motion[6]) {
+    for (uint8_t i = 0; i < 6; i++) {
+        motion[i] = constrain(_motion[i] + _offsets[i] * (i < 3 ? 8 : 4), -32768, 32767);
+    }
+}
+
+void FakeImu::pushSample(const hal::ImuRawSample& sample) {
+    if (_fifoCount >= NATIVE_IMU_FIFO_PACKETS) {
+        _overflow = true;
+        return;
+    }
+    _fifo[_fifoCount++] = sample;
+    _readyTime = hal::clock().micros();
+}
+
+bool FakeImu::dataReady(uint32_t& timestamp) {
+    timestamp = _readyTime;
+    return _fifoCount > 0 || _overflow;
+}
+
+uint8_t FakeImu::readFifo(hal::ImuRawSample* samples, uint8_t maxSamples, bool& overflow) {
+    overflow = _overflow;
+    if (_overflow) {
+        _overflow = false;
+        _fifoCount = 0;
+        return 0;
+    }
+
+    uint8_t read = min(_fifoCount, maxSamples);
+    memcpy(samples, _fifo, read * sizeof(hal::ImuRawSample));
+    memmove(_fifo, _fifo + read, (_fifoCount - read) * sizeof(hal::ImuRawSample));
+    _fifoCount -= read;
+    return read;
+}
+
+LoopbackMqttTransport::LoopbackMqttTransport() {
+    _subscriptionCount = 0;
+    _onConnected = nullptr;
+    _observer = nullptr;
+    _connected = false;
+    _connectionPending = false;
+    _published = 0;
+    _dropTime = 0;
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+bool LoopbackMqttTransport::subscribe(const char* topic, hal::MessageCallback callback) {
+    if (_subscriptionCount >= NATIVE_MQTT_MAX_SUBSCRIPTIONS || strlen(topic) >= sizeof(_subscriptions[0].topic)) {
+        return false;
+    }
+    Subscription& subscription = _subscriptions[_subscriptionCount++];
+    strcpy(subscription.topic, topic);
+    subscription.callback = callback;
+    return true;
+}
+
+bool LoopbackMqttTransport::publish(const char* topic, const char* payload, bool retain) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retain);
+}
+
+bool LoopbackMqttTransport::publish(const char* topic, const uint8_t* payload, size_t length, bool retain) {
+    if (!_connected) return false;
+    _published++;
+    if (_observer) _observer(topic, payload, length, retain);
+    return true;
+}
+
+void LoopbackMqttTransport::loop() {
+    // Like EspMqttTransport, the connection callback fires from loop()
+    if (_connectionPending) {
+        _connectionPending = false;
+        _subscriptionCount = 0;
+        _stats.attempts++;
+        _stats.connects++;
+        _stats.connectTime = hal::clock().millis() - _dropTime;
+        _stats.maxConnectTime = max(_stats.maxConnectTime, _stats.connectTime);
+        if (_onConnected) _onConnected();
+    }
+}
+
+void LoopbackMqttTransport::setConnected(bool connected) {
+    if (_connected && !connected) {
+        _stats.drops++;
+        _dropTime = hal::clock().millis();
+    }
+    _connectionPending = connected && !_connected;
+    _connected = connected;
+}
+
+bool LoopbackMqttTransport::inject(const char* topic, const char* payload) {
+    for (uint8_t i = 0; i < _subscriptionCount; i++) {
+        if (hal::topicMatches(_subscriptions[i].topic, topic)) {
+            _subscriptions[i].callback(topic, payload, strlen(payload));
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t LoopbackDatagramSocket::receive(uint8_t* buffer, size_t size, uint32_t& address, uint16_t& port) {
+    while (_count > 0) {
+        Datagram& datagram = _queue[_head];
+        _head = (_head + 1) % NATIVE_DATAGRAM_QUEUE;
+        _count--;
+        if (datagram.length > size) {
+            continue;
+        }
+        memcpy(buffer, datagram.data, datagram.length);
+        address = datagram.address;
+        port = datagram.port;
+        return datagram.length;
+    }
+    return 0;
+}
+
+// Like UDP, a full queue or an oversized datagram loses the datagram
+bool LoopbackDatagramSocket::send(uint32_t address, uint16_t port, const uint8_t* data, size_t length) {
+    if (!_peer || address != _peer->_address || port != _peer->_port) {
+        return true;
+    }
+    return _peer->deliver(_address, _port, data, length);
+}
+
+bool LoopbackDatagramSocket::deliver(uint32_t address, uint16_t port, const uint8_t* data, size_t length) {
+    if (_count >= NATIVE_DATAGRAM_QUEUE || length > NATIVE_DATAGRAM_SIZE) {
+        _dropped++;
+        return false;
+    }
+    Datagram& datagram = _queue[(_head + _count++) % NATIVE_DATAGRAM_QUEUE];
+    datagram.address = address;
+    datagram.port = port;
+    datagram.length = length;
+    memcpy(datagram.data, data, length);
+    return true;
+}
+
+#endif // !ARDUINO
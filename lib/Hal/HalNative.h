@@ -0,0 +1,323 @@
+#ifndef HAL_NATIVE_H
+#define HAL_NATIVE_H
+
+#if !defined(ARDUINO)
+
+#include "Hal.h"
+
+// Host fakes of the hal interfaces. Time only moves when the owner of the
+// VirtualClock advances it, so the control code can run faster than real time.
+
+#define NATIVE_PIN_COUNT 17
+#define NATIVE_NO_INTERRUPT_PIN 16  // As on the ESP8266
+#define NATIVE_STORAGE_SIZE 512
+#define NATIVE_MQTT_MAX_SUBSCRIPTIONS 32
+#define NATIVE_IMU_FIFO_PACKETS 24  // 1024-byte MPU6050 FIFO / 42-byte DMP packet
+#define NATIVE_DATAGRAM_QUEUE 8
+#define NATIVE_DATAGRAM_SIZE 256
+#define NATIVE_FILE_COUNT 40
+#define NATIVE_FILE_SIZE 4096
+#define NATIVE_FILE_PATH_LENGTH 32
+#define NATIVE_FLASH_SECTORS 4
+#define NATIVE_FLASH_SECTOR_SIZE 4096
+
+class VirtualClock : public hal::Clock {
+public:
+    VirtualClock() : _micros(0) {}
+    uint32_t millis() override { return (uint32_t)(_micros / 1000); }
+    uint32_t micros() override { return (uint32_t)_micros; }
+    void delay(uint32_t ms) override { _micros += (uint64_t)ms * 1000; }
+    void delayMicroseconds(uint32_t us) override { _micros += us; }
+    void advance(uint32_t us) { _micros += us; }
+    uint64_t elapsedMicros() const { return _micros; }
+
+private:
+    uint64_t _micros;
+};
+
+class FakeGpio : public hal::Gpio {
+public:
+    FakeGpio();
+    void pinMode(uint8_t pin, uint8_t mode) override;
+    void digitalWrite(uint8_t pin, uint8_t value) override;
+    int digitalRead(uint8_t pin) override;
+    void analogWrite(uint8_t pin, int value) override;
+    void analogWriteRange(uint16_t range) override { _analogRange = range; }
+    void analogWriteFreq(uint16_t frequency) override { _analogFrequency = frequency; }
+    bool attachInterrupt(uint8_t pin, hal::InterruptHandler handler, void* arg) override;
+
+    uint16_t getAnalogRange() const { return _analogRange; }
+    uint16_t getAnalogFrequency() const { return _analogFrequency; }
+    uint8_t getMode(uint8_t pin) const { return pin < NATIVE_PIN_COUNT ? _mode[pin] : 0; }
+    int getAnalog(uint8_t pin) const { return pin < NATIVE_PIN_COUNT ? _analog[pin] : 0; }
+    // Runs the pin's interrupt handler when the level changes
+    void setInput(uint8_t pin, uint8_t value);
+
+private:
+    uint8_t _mode[NATIVE_PIN_COUNT];
+    uint8_t _digital[NATIVE_PIN_COUNT];
+    hal::InterruptHandler _handlers[NATIVE_PIN_COUNT];
+    void* _handlerArgs[NATIVE_PIN_COUNT];
+    int _analog[NATIVE_PIN_COUNT];
+    uint16_t _analogRange;
+    uint16_t _analogFrequency;
+};
+
+// Ticks only when the owner calls run(): once for every period that has
+// passed on hal::clock() since start() or the previous tick
+class FakeTickTimer : public hal::TickTimer {
+public:
+    FakeTickTimer() : _handler(nullptr), _arg(nullptr), _period(0), _next(0), _running(false), _ticks(0) {}
+    void start(uint32_t periodUs, hal::InterruptHandler handler, void* arg) override;
+    void stop() override { _running = false; }
+    void run();
+    bool isRunning() const { return _running; }
+    uint32_t getTickCount() const { return _ticks; }
+
+private:
+    hal::InterruptHandler _handler;
+    void* _arg;
+    uint32_t _period;
+    uint32_t _next;
+    bool _running;
+    uint32_t _ticks;
+};
+
+// Attached devices acknowledge every transfer and read back zeros
+class FakeI2cBus : public hal::I2cBus {
+public:
+    FakeI2cBus() : _transfers(0), _recoveries(0) { memset(_present, 0, sizeof(_present)); }
+    bool probe(uint8_t address) override { return address < 128 && _present[address]; }
+    hal::I2cResult transfer(uint8_t address, const uint8_t* tx, uint8_t txLength, uint8_t* rx, uint8_t rxLength) override;
+    void recover() override { _recoveries++; }
+    void attach(uint8_t address) { if (address < 128) _present[address] = true; }
+    void detach(uint8_t address) { if (address < 128) _present[address] = false; }
+    uint32_t getTransferCount() const { return _transfers; }
+    uint32_t getRecoveryCount() const { return _recoveries; }
+
+private:
+    bool _present[128];
+    uint32_t _transfers;
+    uint32_t _recoveries;
+};
+
+class MemoryStorage : public hal::Storage {
+public:
+    MemoryStorage() { memset(_data, 0xFF, sizeof(_data)); _commits = 0; }
+    void read(size_t address, void* data, size_t length) override;
+    void write(size_t address, const void* data, size_t length) override;
+    bool commit() override { _commits++; return true; }
+    uint32_t getCommitCount() const { return _commits; }
+
+private:
+    uint8_t _data[NATIVE_STORAGE_SIZE];
+    uint32_t _commits;
+};
+
+// Fixed table of files in RAM; counts appends and bytes written to compare
+// flash wear of spool layouts
+class MemoryFileSystem : public hal::FileSystem {
+public:
+    MemoryFileSystem() : _appends(0), _bytesWritten(0) { memset(_files, 0, sizeof(_files)); }
+    bool append(const char* path, const void* data, size_t length) override;
+    size_t read(const char* path, size_t offset, void* data, size_t length) override;
+    size_t size(const char* path) override;
+    bool remove(const char* path) override;
+    bool rename(const char* from, const char* to) override;
+
+    uint32_t getAppendCount() const { return _appends; }
+    uint32_t getBytesWritten() const { return _bytesWritten; }
+
+private:
+    struct File {
+        bool used;
+        char path[NATIVE_FILE_PATH_LENGTH];
+        size_t size;
+        uint8_t data[NATIVE_FILE_SIZE];
+    };
+
+    File* find(const char* path);
+
+    File _files[NATIVE_FILE_COUNT];
+    uint32_t _appends;
+    uint32_t _bytesWritten;
+};
+
+// NOR flash in RAM: write() ANDs into the cells, misaligned access fails.
+// powerLossAfter(n) lets n more writes or erases through and tears the one
+// after: a write lands only its first half, an erase clears only the second
+// half of the sector. Every access fails from then on until restorePower().
+class MemoryFlash : public hal::Flash {
+public:
+    MemoryFlash();
+    uint8_t sectorCount() override { return NATIVE_FLASH_SECTORS; }
+    size_t sectorSize() override { return NATIVE_FLASH_SECTOR_SIZE; }
+    bool read(uint8_t sector, size_t offset, void* data, size_t length) override;
+    bool write(uint8_t sector, size_t offset, const void* data, size_t length) override;
+    bool erase(uint8_t sector) override;
+
+    void powerLossAfter(int32_t operations) { _budget = operations; }
+    void restorePower() { _budget = -1; _powered = true; }
+    bool isPowered() const { return _powered; }
+    uint32_t getWriteCount() const { return _writes; }
+    uint32_t getEraseCount(uint8_t sector) const { return sector < NATIVE_FLASH_SECTORS ? _erases[sector] : 0; }
+
+private:
+    bool valid(uint8_t sector, size_t offset, size_t length) const;
+    // false when this operation is the one the power loss tears
+    bool spend();
+
+    uint8_t _data[NATIVE_FLASH_SECTORS][NATIVE_FLASH_SECTOR_SIZE];
+    uint32_t _writes;
+    uint32_t _erases[NATIVE_FLASH_SECTORS];
+    int32_t _budget;  // Operations left before the power loss, -1 for none
+    bool _powered;
+};
+
+class FakeServo : public hal::ServoOutput {
+public:
+    FakeServo() : _pin(0), _angle(-1) {}
+    void attach(uint8_t pin) override { _pin = pin; }
+    void write(int angle) override { _angle = angle; }
+    int getAngle() const { return _angle; }
+
+private:
+    uint8_t _pin;
+    int _angle;
+};
+
+// Completes a measurement after the acoustic round trip of the current
+// distance, measured on hal::clock()
+class FakeSonar : public hal::SonarDevice {
+public:
+    FakeSonar() : _distance(0), _result(0), _busy(false), _triggerTime(0) {}
+    void begin() override {}
+    void trigger() override;
+    bool poll() override;
+    bool busy() const override { return _busy; }
+    unsigned int getDistance() const override { return _result; }
+    void setDistance(unsigned int cm) { _distance = cm; }
+
+private:
+    unsigned int _distance;
+    unsigned int _result;
+    bool _busy;
+    uint32_t _triggerTime;
+};
+
+class FakeImu : public hal::ImuDevice {
+public:
+    FakeImu();
+    bool begin(uint8_t address) override { return true; }
+    bool dataReady(uint32_t& timestamp) override;
+    uint8_t readFifo(hal::ImuRawSample* samples, uint8_t maxSamples, bool& overflow) override;
+    void getMotion6(int16_t motion[6]) override;
+    void prepareCalibration() override {}
+    void setOffsets(const int16_t offsets[6]) override { memcpy(_offsets, offsets, sizeof(_offsets)); }
+    void getOffsets(int16_t offsets[6]) override { memcpy(offsets, _offsets, sizeof(_offsets)); }
+
+    // Queues a DMP packet as if the DMP had written it to the FIFO
+    void pushSample(const hal::ImuRawSample& sample);
+    // Reading without offsets; getMotion6() adds the offsets like the chip does
+    void setMotion6(const int16_t motion[6]) { memcpy(_motion, motion, sizeof(_motion)); }
+
+private:
+    hal::ImuRawSample _fifo[NATIVE_IMU_FIFO_PACKETS];
+    uint8_t _fifoCount;
+    bool _overflow;
+    uint32_t _readyTime;
+    int16_t _motion[6];
+    int16_t _offsets[6];
+};
+
+class FakePowerMonitor : public hal::PowerMonitor {
+public:
+    FakePowerMonitor() : _voltage(0), _current(0) {}
+    bool begin(uint8_t address, float shunt, float maxCurrent) override { return true; }
+    bool calibrate(float shunt, float maxCurrent) override { return true; }
+    void requestUpdate() override {}
+    int32_t getBusVoltage() override { return _voltage; }
+    int32_t getCurrent() override { return _current; }
+    int32_t getPower() override { return (int32_t)((int64_t)_voltage * _current / 1000); }
+    void set(float voltage, float current) { _voltage = (int32_t)(voltage * 1000); _current = (int32_t)(current * 1000000); }
+
+private:
+    int32_t _voltage;  // mV
+    int32_t _current;  // uA
+};
+
+typedef void (*PublishObserver)(const char* topic, const uint8_t* payload, size_t length, bool retain);
+
+// In-process broker: publish() goes to an observer, inject() delivers a
+// message to the matching subscription as if it came from the network.
+class LoopbackMqttTransport : public hal::MqttTransport {
+public:
+    LoopbackMqttTransport();
+    void setOnConnected(hal::ConnectionCallback callback) override { _onConnected = callback; }
+    bool subscribe(const char* topic, hal::MessageCallback callback) override;
+    bool publish(const char* topic, const char* payload, bool retain = false) override;
+    bool publish(const char* topic, const uint8_t* payload, size_t length, bool retain = false) override;
+    void loop() override;
+    bool isConnected() override { return _connected; }
+    hal::ConnectionState getState() override { return _connected ? hal::CONNECTION_CONNECTED : hal::CONNECTION_BACKOFF; }
+    const hal::ConnectionStats& getConnectionStats() override { return _stats; }
+
+    // Takes effect on the next loop(), like a broker session
+    void setConnected(bool connected);
+    void setPublishObserver(PublishObserver observer) { _observer = observer; }
+    bool inject(const char* topic, const char* payload);
+    uint32_t getPublishCount() const { return _published; }
+
+private:
+    struct Subscription {
+        char topic[64];
+        hal::MessageCallback callback;
+    };
+
+    Subscription _subscriptions[NATIVE_MQTT_MAX_SUBSCRIPTIONS];
+    uint8_t _subscriptionCount;
+    hal::ConnectionCallback _onConnected;
+    PublishObserver _observer;
+    bool _connected;
+    bool _connectionPending;
+    uint32_t _published;
+    uint32_t _dropTime;
+    hal::ConnectionStats _stats;
+};
+
+// One end of an in-process datagram link. send() queues into the connected
+// peer, which sees this socket's address and port as the source.
+class LoopbackDatagramSocket : public hal::DatagramSocket {
+public:
+    explicit LoopbackDatagramSocket(uint32_t address) : _address(address), _port(0), _peer(nullptr), _head(0), _count(0), _dropped(0) {}
+    bool begin(uint16_t port) override { _port = port; return true; }
+    size_t receive(uint8_t* buffer, size_t size, uint32_t& address, uint16_t& port) override;
+    bool send(uint32_t address, uint16_t port, const uint8_t* data, size_t length) override;
+
+    void connect(LoopbackDatagramSocket* peer) { _peer = peer; }
+    uint32_t getAddress() const { return _address; }
+    uint16_t getPort() const { return _port; }
+    uint32_t getDroppedCount() const { return _dropped; }
+
+private:
+    struct Datagram {
+        uint32_t address;
+        uint16_t port;
+        uint16_t length;
+        uint8_t data[NATIVE_DATAGRAM_SIZE];
+    };
+
+    bool deliver(uint32_t address, uint16_t port, const uint8_t* data, size_t length);
+
+    uint32_t _address;
+    uint16_t _port;
+    LoopbackDatagramSocket* _peer;
+    Datagram _queue[NATIVE_DATAGRAM_QUEUE];
+    uint8_t _head;
+    uint8_t _count;
+    uint32_t _dropped;
+};
+
+#endif // !ARDUINO
+
+#endif // HAL_NATIVE_H
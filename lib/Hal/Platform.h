@@ -0,0 +1,47 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+// Portable replacement for <Arduino.h> in control code. On the ESP8266 it
+// is just the Arduino core; on the host (native env) it provides the few
+// core helpers the control code relies on.
+
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x00
+#define OUTPUT 0x01
+
+#define IRAM_ATTR
+
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define degrees(rad) ((rad) * 57.295779513082320876798154814105)
+#define radians(deg) ((deg) * 0.017453292519943295769236907684886)
+
+inline long map(long x, long in_min, long in_max, long out_min, long out_max) {
+    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+typedef uint8_t byte;
+
+#endif // ARDUINO
+
+#endif // PLATFORM_H
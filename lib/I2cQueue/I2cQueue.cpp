@@ -0,0 +1,160 @@
+#include "I2cQueue.h"
+
+I2cQueue::I2cQueue() {
+    _deviceCount = 0;
+    _head = 0;
+    _count = 0;
+    _recoveries = 0;
+}
+
+int8_t I2cQueue::addDevice(uint8_t address, const char* name, bool autoIncrement) {
+    for (uint8_t i = 0; i < _deviceCount; i++) {
+        if (_devices[i].address == address) {
+            return i;
+        }
+    }
+    if (_deviceCount >= I2C_MAX_DEVICES) {
+        LOG_E("I2C device table full, %s at 0x%02X not added\n", name, address);
+        return -1;
+    }
+
+    Device& device = _devices[_deviceCount];
+    device.address = address;
+    device.name = name;
+    device.autoIncrement = autoIncrement;
+    device.backoffStart = 0;
+    memset(&device.stats, 0, sizeof(device.stats));
+    return _deviceCount++;
+}
+
+I2cQueue::Transaction* I2cQueue::push(int8_t device, uint8_t reg, uint8_t length, I2cCallback callback, void* context) {
+    if (device < 0 || device >= _deviceCount || _count >= I2C_QUEUE_SIZE) {
+        return nullptr;
+    }
+    Transaction& transaction = at(_count++);
+    transaction.device = device;
+    transaction.reg = reg;
+    transaction.length = length;
+    transaction.callback = callback;
+    transaction.context = context;
+    return &transaction;
+}
+
+bool I2cQueue::read(int8_t device, uint8_t reg, uint8_t length, I2cCallback callback, void* context, bool mergeable) {
+    if (length == 0 || length > I2C_MAX_TRANSFER) {
+        return false;
+    }
+    Transaction* transaction = push(device, reg, length, callback, context);
+    if (!transaction) {
+        return false;
+    }
+    transaction->isWrite = false;
+    transaction->mergeable = mergeable;
+    return true;
+}
+
+bool I2cQueue::write(int8_t device, uint8_t reg, const uint8_t* data, uint8_t length, I2cCallback callback, void* context) {
+    if (length > I2C_MAX_WRITE) {
+        return false;
+    }
+    Transaction* transaction = push(device, reg, length, callback, context);
+    if (!transaction) {
+        return false;
+    }
+    transaction->isWrite = true;
+    transaction->mergeable = false;
+    memcpy(transaction->data, data, length);
+    return true;
+}
+
+// Number of queued reads, starting at the head, that continue each other's
+// register range on the same device and fit in one transfer
+uint8_t I2cQueue::mergeCount(uint8_t& length) {
+    const Transaction& first = at(0);
+    length = first.length;
+    if (first.isWrite || !first.mergeable || !_devices[first.device].autoIncrement) {
+        return 1;
+    }
+
+    uint8_t count = 1;
+    while (count < _count) {
+        const Transaction& next = at(count);
+        if (next.isWrite || !next.mergeable || next.device != first.device ||
+                next.reg != first.reg + length || length + next.length > I2C_MAX_TRANSFER) {
+            break;
+        }
+        length += next.length;
+        count++;
+    }
+    return count;
+}
+
+void I2cQueue::complete(uint8_t count, hal::I2cResult result, const uint8_t* data) {
+    // Callbacks may queue follow-up transactions, so pop before calling
+    for (uint8_t i = 0; i < count; i++) {
+        Transaction transaction = at(0);
+        _head = (_head + 1) % I2C_QUEUE_SIZE;
+        _count--;
+        if (transaction.callback) {
+            transaction.callback(transaction.context, result, transaction.isWrite ? nullptr : data, transaction.length);
+        }
+        if (data) {
+            data += transaction.length;
+        }
+    }
+}
+
+void I2cQueue::process() {
+    if (_count == 0) {
+        return;
+    }
+
+    Transaction& head = at(0);
+    Device& device = _devices[head.device];
+    if (device.stats.consecutiveErrors >= I2C_DEVICE_MAX_ERRORS) {
+        if (hal::clock().millis() - device.backoffStart < I2C_DEVICE_BACKOFF) {
+            device.stats.skipped++;
+            complete(1, hal::I2C_RESULT_NACK, nullptr);
+            return;
+        }
+        // Backoff over, the next transfer is a retry
+        device.stats.consecutiveErrors = I2C_DEVICE_MAX_ERRORS - 1;
+    }
+
+    uint8_t length;
+    uint8_t count = mergeCount(length);
+    hal::I2cResult result;
+    if (head.isWrite) {
+        uint8_t tx[I2C_MAX_WRITE + 1];
+        tx[0] = head.reg;
+        memcpy(tx + 1, head.data, head.length);
+        result = hal::i2c().transfer(device.address, tx, head.length + 1, nullptr, 0);
+    } else {
+        result = hal::i2c().transfer(device.address, &head.reg, 1, _buffer, length);
+    }
+
+    device.stats.transfers++;
+    device.stats.merged += count - 1;
+    if (result == hal::I2C_RESULT_OK) {
+        device.stats.consecutiveErrors = 0;
+    } else {
+        device.stats.errors++;
+        if (++device.stats.consecutiveErrors >= I2C_DEVICE_MAX_ERRORS) {
+            device.backoffStart = hal::clock().millis();
+            LOG_W("I2C %s at 0x%02X failing, backing off for %d ms\n", device.name, device.address, I2C_DEVICE_BACKOFF);
+        }
+        if (result == hal::I2C_RESULT_BUS_ERROR) {
+            hal::i2c().recover();
+            _recoveries++;
+        }
+    }
+
+    complete(count, result, result == hal::I2C_RESULT_OK && !head.isWrite ? _buffer : nullptr);
+}
+
+void I2cQueue::resetStats() {
+    for (uint8_t i = 0; i < _deviceCount; i++) {
+        memset(&_devices[i].stats, 0, sizeof(_devices[i].stats));
+    }
+    _recoveries = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef I2C_QUEUE_H
+#define I2C_QUEUE_H
+
+#include "Platform.h"
+#include "config.h"
+#include "Hal.h"
+
+// Completion of a queued transaction. For reads, data points at the bytes
+// read and is only valid during the call.
+typedef void (*I2cCallback)(void* context, hal::I2cResult result, const uint8_t* data, uint8_t length);
+
+struct I2cDeviceStats {
+    uint32_t transfers;
+    uint32_t errors;
+    uint32_t merged;            // Reads folded into a preceding burst
+    uint32_t skipped;           // Transactions failed without bus traffic during a backoff
+    uint8_t consecutiveErrors;
+};
+
+// Register transaction queue shared by the drivers on the I2C bus. Drivers
+// queue reads and writes and get the result through a callback; process()
+// runs one transfer per call so no driver holds the loop for more than a
+// single transaction. Reads of consecutive registers on a device with
+// register auto-increment are merged into one burst.
+//
+// A device that fails I2C_DEVICE_MAX_ERRORS times in a row is backed off for
+// I2C_DEVICE_BACKOFF ms, and a bus error triggers a bus recovery, so one
+// glitching device cannot stall the others.
+class I2cQueue {
+public:
+    I2cQueue();
+    int8_t addDevice(uint8_t address, const char* name, bool autoIncrement);
+    bool read(int8_t device, uint8_t reg, uint8_t length, I2cCallback callback, void* context, bool mergeable = true);
+    bool write(int8_t device, uint8_t reg, const uint8_t* data, uint8_t length, I2cCallback callback = nullptr, void* context = nullptr);
+    void process();
+    bool idle() const { return _count == 0; }
+
+    uint8_t getDeviceCount() { return _deviceCount; }
+    uint8_t getDeviceAddress(uint8_t device) { return _devices[device].address; }
+    const char* getDeviceName(uint8_t device) { return _devices[device].name; }
+    const I2cDeviceStats& getDeviceStats(uint8_t device) { return _devices[device].stats; }
+    uint32_t getRecoveryCount() { return _recoveries; }
+    void resetStats();
+
+private:
+    struct Device {
+        uint8_t address;
+        const char* name;
+        bool autoIncrement;
+        uint32_t backoffStart;
+        I2cDeviceStats stats;
+    };
+
+    struct Transaction {
+        int8_t device;
+        uint8_t reg;
+        uint8_t length;
+        bool isWrite;
+        bool mergeable;
+        uint8_t data[I2C_MAX_WRITE];
+        I2cCallback callback;
+        void* context;
+    };
+
+    Transaction* push(int8_t device, uint8_t reg, uint8_t length, I2cCallback callback, void* context);
+    Transaction& at(uint8_t offset) { return _queue[(_head + offset) % I2C_QUEUE_SIZE]; }
+    uint8_t mergeCount(uint8_t& length);
+    void complete(uint8_t count, hal::I2cResult result, const uint8_t* data);
+
+    Device _devices[I2C_MAX_DEVICES];
+    uint8_t _deviceCount;
+    Transaction _queue[I2C_QUEUE_SIZE];
+    uint8_t _head;
+    uint8_t _count;
+    uint8_t _buffer[I2C_MAX_TRANSFER];
+    uint32_t _recoveries;
+};
+
+#endif // I2C_QUEUE_H
@@ -0,0 +1,114 @@
+#include "JsonWriter.h"
+
+static const uint32_t POWERS_OF_TEN[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+JsonWriter::JsonWriter(char* buffer, size_t size) {
+    _buffer = buffer;
+    _size = size;
+    _length = 0;
+    _needComma = false;
+    _overflow = size == 0;
+    if (size > 0) {
+        _buffer[0] = '\0';
+    }
+}
+
+void JsonWriter::append(char c) {
+    if (_length + 1 >= _size) {
+        _overflow = true;
+        return;
+    }
+    _buffer[_length++] = c;
+    _buffer[_length] = '\0';
+}
+
+void JsonWriter::append(const char* text) {
+    while (*text) {
+        append(*text++);
+    }
+}
+
+void JsonWriter::key(const char* name) {
+    if (_needComma) {
+        append(',');
+    }
+    if (name) {
+        append('"');
+        append(name);
+        append("\":");
+    }
+}
+
+void JsonWriter::appendNumber(bool negative, uint32_t whole, uint32_t fraction, uint8_t decimals) {
+    char digits[11];
+    uint8_t count = 0;
+    do {
+        digits[count++] = '0' + whole % 10;
+        whole /= 10;
+    } while (whole > 0);
+
+    if (negative) {
+        append('-');
+    }
+    while (count > 0) {
+        append(digits[--count]);
+    }
+    if (decimals > 0) {
+        append('.');
+        for (uint8_t i = decimals; i > 0; i--) {
+            append('0' + fraction / POWERS_OF_TEN[i - 1] % 10);
+        }
+    }
+    _needComma = true;
+}
+
+JsonWriter& JsonWriter::beginObject(const char* name) {
+    key(name);
+    append('{');
+    _needComma = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endObject() {
+    append('}');
+    _needComma = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::field(const char* name, int32_t value) {
+    key(name);
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    appendNumber(value < 0, magnitude, 0, 0);
+    return *this;
+}
+
+JsonWriter& JsonWriter::fieldScaled(const char* name, int32_t value, uint8_t decimals) {
+    key(name);
+    decimals = min(decimals, (uint8_t)9);
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    appendNumber(value < 0, magnitude / POWERS_OF_TEN[decimals], magnitude % POWERS_OF_TEN[decimals], decimals);
+    return *this;
+}
+
+JsonWriter& JsonWriter::fieldQ16(const char* name, q16_16 value, uint8_t decimals) {
+    key(name);
+    decimals = min(decimals, (uint8_t)4);
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    uint32_t whole = magnitude >> Q16_SHIFT;
+    uint32_t fraction = ((magnitude & (Q16_ONE - 1)) * POWERS_OF_TEN[decimals] + Q16_ONE / 2) >> Q16_SHIFT;
+    if (fraction >= POWERS_OF_TEN[decimals]) {
+        whole++;
+        fraction = 0;
+    }
+    appendNumber(value < 0 && (whole > 0 || fraction > 0), whole, fraction, decimals);
+    return *this;
+}
+
+JsonWriter& JsonWriter::fieldString(const char* name, const char* value) {
+    key(name);
+    append('"');
+    append(value);
+    append('"');
+    _needComma = true;
+    return *this;
+}
@@ -0,0 +1,40 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include "Platform.h"
+#include "FixedPoint.h"
+
+// Streaming JSON writer into a caller-owned buffer. No heap, no String and
+// no float formatting: fixed-point and scaled integers are printed with
+// integer math. Output that does not fit is dropped and ok() turns false.
+class JsonWriter {
+public:
+    JsonWriter(char* buffer, size_t size);
+
+    JsonWriter& beginObject(const char* key = nullptr);
+    JsonWriter& endObject();
+    JsonWriter& field(const char* key, int32_t value);
+    // value / 10^decimals, e.g. mV with 3 decimals is printed in V
+    JsonWriter& fieldScaled(const char* key, int32_t value, uint8_t decimals);
+    // Q16.16 rounded to decimals (at most 4)
+    JsonWriter& fieldQ16(const char* key, q16_16 value, uint8_t decimals);
+    JsonWriter& fieldString(const char* key, const char* value);  // Not escaped
+
+    bool ok() const { return !_overflow; }
+    const char* c_str() const { return _buffer; }
+    size_t length() const { return _length; }
+
+private:
+    void key(const char* name);
+    void append(char c);
+    void append(const char* text);
+    void appendNumber(bool negative, uint32_t whole, uint32_t fraction, uint8_t decimals);
+
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+    bool _needComma;
+    bool _overflow;
+};
+
+#endif // JSON_WRITER_H
@@ -0,0 +1,283 @@
+#include "KvStore.h"
+#include "Crc32.h"
+
+static void writeU16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void writeU32(uint8_t* p, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint16_t readU16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static uint32_t readU32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static size_t padded(size_t length) { return (length + 3) & ~(size_t)3; }
+
+static bool erased(const uint8_t* bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (bytes[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+// Magic and CRC match; generation and erases are only read then
+static bool validHeader(const uint8_t* header) {
+    return readU32(header) == KV_SECTOR_MAGIC && readU32(header + 12) == Crc32::compute(header, 12);
+}
+
+KvStore::KvStore(hal::Flash& flash) {
+    _flash = &flash;
+    memset(_entries, 0, sizeof(_entries));
+    _count = 0;
+    _sector = 0;
+    _offset = 0;
+    _generation = 0;
+    _erases = 0;
+    _version = 0;
+    _records = 0;
+    _compactions = 0;
+    _coalesced = 0;
+}
+
+bool KvStore::begin() {
+    _count = 0;
+    _version = 0;
+    bool found = false;
+    for (uint8_t sector = 0; sector < _flash->sectorCount(); sector++) {
+        uint32_t header[KV_SECTOR_HEADER_SIZE / 4];
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(header);
+        if (!_flash->read(sector, 0, header, sizeof(header)) || !validHeader(bytes)) {
+            continue;
+        }
+        uint32_t generation = readU32(bytes + 4);
+        if (!found || generation > _generation) {
+            found = true;
+            _sector = sector;
+            _generation = generation;
+            _erases = readU32(bytes + 8);
+        }
+    }
+
+    if (!found) {
+        LOG_I("Key/value store empty, formatting %u sectors\n", _flash->sectorCount());
+        _sector = _flash->sectorCount() - 1;
+        _generation = 0;
+        return compact();
+    }
+    replay();
+    LOG_D("Key/value store: sector %u, generation %u, %u keys, %u bytes used\n", _sector, _generation, _count, (unsigned)_offset);
+    return true;
+}
+
+void KvStore::replay() {
+    size_t sectorSize = _flash->sectorSize();
+    _offset = KV_SECTOR_HEADER_SIZE;
+    while (_offset + KV_RECORD_HEADER_SIZE <= sectorSize) {
+        uint32_t record[KV_RECORD_MAX_SIZE / 4];
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(record);
+        if (!_flash->read(_sector, _offset, record, KV_RECORD_HEADER_SIZE)) {
+            break;
+        }
+        if (erased(bytes, KV_RECORD_HEADER_SIZE)) {
+            return;
+        }
+
+        uint16_t length = readU16(bytes + 6);
+        size_t size = KV_RECORD_HEADER_SIZE + padded(length);
+        if (length > KV_MAX_VALUE_SIZE || _offset + size > sectorSize ||
+            !_flash->read(_sector, _offset + KV_RECORD_HEADER_SIZE, bytes + KV_RECORD_HEADER_SIZE, padded(length)) ||
+            readU32(bytes) != Crc32::compute(bytes + 4, 8 + length)) {
+            LOG_W("Key/value record at %u torn, sector %u sealed\n", (unsigned)_offset, _sector);
+            break;
+        }
+
+        bool changed;
+        Entry* entry = set(readU16(bytes + 4), bytes + KV_RECORD_HEADER_SIZE, length, changed);
+        uint32_t version = readU32(bytes + 8);
+        if (entry) {
+            entry->version = version;
+            entry->dirty = false;
+        }
+        _version = max(_version, version);
+        _offset += size;
+    }
+    // Nothing can be appended behind a torn record: the next write compacts
+    _offset = sectorSize;
+}
+
+KvStore::Entry* KvStore::find(uint16_t key) {
+    for (uint8_t i = 0; i < _count; i++) {
+        if (_entries[i].key == key) return &_entries[i];
+    }
+    return nullptr;
+}
+
+const KvStore::Entry* KvStore::find(uint16_t key) const {
+    return const_cast<KvStore*>(this)->find(key);
+}
+
+KvStore::Entry* KvStore::set(uint16_t key, const void* data, size_t length, bool& changed) {
+    if (length > KV_MAX_VALUE_SIZE) {
+        return nullptr;
+    }
+    Entry* entry = find(key);
+    if (entry) {
+        changed = entry->length != length || memcmp(entry->data, data, length) != 0;
+    } else {
+        if (_count >= KV_MAX_KEYS) {
+            return nullptr;
+        }
+        entry = &_entries[_count++];
+        memset(entry, 0, sizeof(Entry));
+        entry->key = key;
+        changed = true;
+    }
+    entry->length = length;
+    memcpy(entry->data, data, length);
+    return entry;
+}
+
+bool KvStore::get(uint16_t key, void* data, size_t length) const {
+    const Entry* entry = find(key);
+    if (!entry || entry->length != length) {
+        return false;
+    }
+    memcpy(data, entry->data, length);
+    return true;
+}
+
+bool KvStore::put(uint16_t key, const void* data, size_t length) {
+    bool changed;
+    Entry* entry = set(key, data, length, changed);
+    if (!entry) {
+        return false;
+    }
+    if (!changed && !entry->dirty) {
+        _coalesced++;
+        return true;
+    }
+    entry->dirty = true;
+    return append(*entry);
+}
+
+bool KvStore::stage(uint16_t key, const void* data, size_t length) {
+    bool changed;
+    Entry* entry = set(key, data, length, changed);
+    if (!entry) {
+        return false;
+    }
+    if (!changed || entry->dirty) {
+        _coalesced++;
+    }
+    entry->dirty |= changed;
+    return true;
+}
+
+bool KvStore::flush() {
+    bool written = true;
+    for (uint8_t i = 0; i < _count; i++) {
+        if (_entries[i].dirty && !append(_entries[i])) {
+            written = false;
+        }
+    }
+    return written;
+}
+
+bool KvStore::append(Entry& entry) {
+    size_t size;
+    if (writeRecord(_sector, _offset, entry, size)) {
+        _offset += size;
+        entry.dirty = false;
+        return true;
+    }
+    // Full, or the record did not read back: the sector takes no more
+    // records, and the compaction writes this value with the others
+    _offset = _flash->sectorSize();
+    return compact();
+}
+
+bool KvStore::writeRecord(uint8_t sector, size_t offset, Entry& entry, size_t& size) {
+    size = KV_RECORD_HEADER_SIZE + padded(entry.length);
+    if (offset + size > _flash->sectorSize()) {
+        return false;
+    }
+
+    uint32_t record[KV_RECORD_MAX_SIZE / 4];
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(record);
+    memset(bytes, 0xFF, size);
+    writeU16(bytes + 4, entry.key);
+    writeU16(bytes + 6, entry.length);
+    writeU32(bytes + 8, _version + 1);
+    memcpy(bytes + KV_RECORD_HEADER_SIZE, entry.data, entry.length);
+    writeU32(bytes, Crc32::compute(bytes + 4, 8 + entry.length));
+
+    uint32_t check[KV_RECORD_MAX_SIZE / 4];
+    if (!_flash->write(sector, offset, record, size) || !_flash->read(sector, offset, check, size) ||
+        memcmp(record, check, size) != 0) {
+        return false;
+    }
+    entry.version = ++_version;
+    _records++;
+    return true;
+}
+
+// The target sector is never the active one, and the active one holds the
+// newest value of every key, so erasing the target loses nothing. A power
+// loss before the header lands leaves a sector without a valid header,
+// which begin() ignores.
+bool KvStore::compact() {
+    uint8_t target = (_sector + 1) % _flash->sectorCount();
+    uint32_t header[KV_SECTOR_HEADER_SIZE / 4];
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(header);
+    uint32_t erases = 0;
+    if (_flash->read(target, 0, header, sizeof(header)) && validHeader(bytes)) {
+        erases = readU32(bytes + 8);
+    }
+    if (!_flash->erase(target)) {
+        return false;
+    }
+
+    size_t offset = KV_SECTOR_HEADER_SIZE;
+    for (uint8_t i = 0; i < _count; i++) {
+        size_t size;
+        if (!writeRecord(target, offset, _entries[i], size)) {
+            return false;
+        }
+        offset += size;
+    }
+
+    writeU32(bytes, KV_SECTOR_MAGIC);
+    writeU32(bytes + 4, _generation + 1);
+    writeU32(bytes + 8, erases + 1);
+    writeU32(bytes + 12, Crc32::compute(bytes, 12));
+    uint32_t check[KV_SECTOR_HEADER_SIZE / 4];
+    if (!_flash->write(target, 0, header, sizeof(header)) || !_flash->read(target, 0, check, sizeof(check)) ||
+        memcmp(header, check, sizeof(header)) != 0) {
+        return false;
+    }
+
+    _sector = target;
+    _generation++;
+    _erases = erases + 1;
+    _offset = offset;
+    _compactions++;
+    for (uint8_t i = 0; i < _count; i++) {
+        _entries[i].dirty = false;
+    }
+    LOG_D("Key/value store compacted into sector %u, generation %u\n", _sector, _generation);
+    return true;
+}
+
+KvStats KvStore::getStats() const {
+    KvStats stats;
+    stats.sector = _sector;
+    stats.generation = _generation;
+    stats.erases = _erases;
+    stats.used = _offset;
+    stats.records = _records;
+    stats.compactions = _compactions;
+    stats.coalesced = _coalesced;
+    return stats;
+}
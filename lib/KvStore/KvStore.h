@@ -0,0 +1,98 @@
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include "config.h"
+#include "Hal.h"
+
+// Small persistent values (calibration, flags, counters) as a log of
+// records on raw flash sectors. put() appends a record to the active
+// sector; a record only counts when its CRC matches, so a write cut short
+// by a power loss leaves the previous value. When the active sector is full
+// the newest value of every key is copied into the next sector of the ring,
+// and that sector's header is written last: until it lands, the old sector
+// stays active. Moving round the ring spreads the erases over all sectors.
+//
+// Sector layout, little-endian:
+//
+//   offset  type    field
+//   0       uint32  magic        KV_SECTOR_MAGIC
+//   4       uint32  generation   +1 per compaction, the highest valid one is active
+//   8       uint32  erases       of this sector, over its lifetime
+//   12      uint32  crc          CRC-32 of the fields above
+//   16      ...     records, up to the first erased (all 0xFF) record header
+//
+// Record:
+//
+//   0       uint32  crc          CRC-32 of key, length, version and the value
+//   4       uint16  key
+//   6       uint16  length       of the value, at most KV_MAX_VALUE_SIZE
+//   8       uint32  version      store-wide, +1 per record
+//   12      ...     value, padded with 0xFF to a multiple of 4 bytes
+
+#define KV_SECTOR_MAGIC 0x53564B57  // "WKVS"
+#define KV_SECTOR_HEADER_SIZE 16
+#define KV_RECORD_HEADER_SIZE 12
+#define KV_RECORD_MAX_SIZE (KV_RECORD_HEADER_SIZE + KV_MAX_VALUE_SIZE)
+
+struct KvStats {
+    uint8_t sector;        // Active
+    uint32_t generation;
+    uint32_t erases;       // Of the active sector
+    uint16_t used;         // Bytes of the active sector
+    uint32_t records;      // Written since boot, compactions included
+    uint32_t compactions;  // Since boot
+    uint32_t coalesced;    // stage() and put() calls that cost no record
+};
+
+class KvStore {
+public:
+    explicit KvStore(hal::Flash& flash);
+
+    // Reads the active sector, formats the flash when no sector is valid
+    bool begin();
+
+    // false when the key has no value of exactly this length
+    bool get(uint16_t key, void* data, size_t length) const;
+    // On flash when it returns true. An unchanged value costs nothing.
+    bool put(uint16_t key, const void* data, size_t length);
+    // For counters: changes the value in RAM only. Whatever was staged
+    // since the last flush() costs one record per key.
+    bool stage(uint16_t key, const void* data, size_t length);
+    bool flush();
+
+    KvStats getStats() const;
+
+private:
+    struct Entry {
+        uint16_t key;
+        uint16_t length;
+        uint32_t version;
+        bool dirty;  // Newer than on flash
+        uint32_t data[KV_MAX_VALUE_SIZE / 4];
+    };
+
+    Entry* find(uint16_t key);
+    const Entry* find(uint16_t key) const;
+    // nullptr when the table is full or the value too long; changed tells
+    // whether the value differs from the one in RAM
+    Entry* set(uint16_t key, const void* data, size_t length, bool& changed);
+    bool append(Entry& entry);
+    // Writes and reads back one record, size gets the bytes it took
+    bool writeRecord(uint8_t sector, size_t offset, Entry& entry, size_t& size);
+    bool compact();
+    void replay();
+
+    hal::Flash* _flash;
+    Entry _entries[KV_MAX_KEYS];
+    uint8_t _count;
+    uint8_t _sector;
+    size_t _offset;  // Of the next record in the active sector
+    uint32_t _generation;
+    uint32_t _erases;
+    uint32_t _version;
+    uint32_t _records;
+    uint32_t _compactions;
+    uint32_t _coalesced;
+};
+
+#endif // KV_STORE_H
@@ -1,141 +1,184 @@
-#include <Arduino.h>
+#include "Platform.h"
 #include "config.h"
+#include "Hal.h"
 #include "MotorController.h"
 
 MotorController::MotorController(int left_pwm_pin, int left_dir_pin, int right_pwm_pin, int right_dir_pin) {
-    _left_pwm_pin = left_pwm_pin;
-    _left_dir_pin = left_dir_pin;
-    _right_pwm_pin = right_pwm_pin;
-    _right_dir_pin = right_dir_pin;
-
-    _current_left_speed = 0;
-    _current_right_speed = 0;
-    _target_left_speed = 0;
-    _target_right_speed = 0;
-    _left_acceleration = 5; // Default acceleration
-    _right_acceleration = 5; // Default acceleration
-    _last_update = 0;
-    _left_forward = true;
-    _right_forward = true;
-    _target_left_forward = true;
-    _target_right_forward = true;
-    _left_direction_change_pending = false;
-    _right_direction_change_pending = false;
-}
-
-void MotorController::begin() {
-    pinMode(_left_pwm_pin, OUTPUT);
-    pinMode(_left_dir_pin, OUTPUT);
-    pinMode(_right_pwm_pin, OUTPUT);
-    pinMode(_right_dir_pin, OUTPUT);
+    memset(&_left, 0, sizeof(_left));
+    memset(&_right, 0, sizeof(_right));
+    _left.pwmPin = left_pwm_pin;
+    _left.dirPin = left_dir_pin;
+    _right.pwmPin = right_pwm_pin;
+    _right.dirPin = right_dir_pin;
+    _left.acceleration = MOTOR_DEFAULT_ACCELERATION;
+    _right.acceleration = MOTOR_DEFAULT_ACCELERATION;
+    _left.forward = true;
+    _right.forward = true;
+    _pwmRange = MOTOR_PWM_RANGE;
+    _lastUpdate = 0;
+    _started = false;
+    _hold = false;
+    _targetPending = false;
+    _actuated = false;
+    _actuationTime = 0;
+}
+
+void MotorController::begin(uint16_t pwmRange, uint16_t pwmFrequency) {
+    _pwmRange = pwmRange;
+    hal::gpio().analogWriteRange(pwmRange);
+    hal::gpio().analogWriteFreq(pwmFrequency);
+    for (Motor* motor : {&_left, &_right}) {
+        hal::gpio().pinMode(motor->pwmPin, OUTPUT);
+        hal::gpio().pinMode(motor->dirPin, OUTPUT);
+        hal::gpio().digitalWrite(motor->dirPin, motor->forward ? HIGH : LOW);
+    }
+}
+
+void MotorController::setTarget(Motor& motor, int32_t target) {
+    motor.target = constrain(target, -MOTOR_SPEED_FULL, MOTOR_SPEED_FULL);
+    _targetPending = true;
+    _actuated = false;
 }
 
 void MotorController::setLeftSpeed(int speed) {
-    _target_left_speed = constrain(speed, 0, 255);
+    int32_t magnitude = (int64_t)constrain(speed, 0, (int)_pwmRange) * MOTOR_SPEED_FULL / _pwmRange;
+    setTarget(_left, _left.target < 0 ? -magnitude : magnitude);
 }
 
 void MotorController::setRightSpeed(int speed) {
-    _target_right_speed = constrain(speed, 0, 255);
+    int32_t magnitude = (int64_t)constrain(speed, 0, (int)_pwmRange) * MOTOR_SPEED_FULL / _pwmRange;
+    setTarget(_right, _right.target < 0 ? -magnitude : magnitude);
 }
 
 void MotorController::setLeftDirection(bool forward) {
-    _left_forward = forward;
-    digitalWrite(_left_dir_pin, _left_forward ? HIGH : LOW);
+    setTarget(_left, forward ? abs(_left.target) : -abs(_left.target));
 }
 
 void MotorController::setRightDirection(bool forward) {
-    _right_forward = forward;
-    digitalWrite(_right_dir_pin, _right_forward ? HIGH : LOW);
+    setTarget(_right, forward ? abs(_right.target) : -abs(_right.target));
 }
 
 void MotorController::setLeftSpeedPercent(int percent) {
-    percent = constrain(percent, -100, 100);
-    _target_left_forward = (percent >= 0);
-    _target_left_speed = map(abs(percent), 0, 100, 0, 255);
-    _left_direction_change_pending = (_left_forward != _target_left_forward);
+    setTarget(_left, (int32_t)constrain(percent, -100, 100) * MOTOR_SPEED_SCALE);
 }
 
 void MotorController::setRightSpeedPercent(int percent) {
-    percent = constrain(percent, -100, 100);
-    _target_right_forward = (percent >= 0);
-    _target_right_speed = map(abs(percent), 0, 100, 0, 255);
-    _right_direction_change_pending = (_right_forward != _target_right_forward);
+    setTarget(_right, (int32_t)constrain(percent, -100, 100) * MOTOR_SPEED_SCALE);
+}
+
+void MotorController::setTargets(int32_t left, int32_t right) {
+    setTarget(_left, left);
+    setTarget(_right, right);
 }
 
 void MotorController::setLeftAcceleration(int acceleration) {
-    _left_acceleration = acceleration;
+    _left.acceleration = max(acceleration, 0);
 }
 
 void MotorController::setRightAcceleration(int acceleration) {
-    _right_acceleration = acceleration;
+    _right.acceleration = max(acceleration, 0);
+}
+
+// Stops both motors at once and keeps them stopped, ignoring speed
+// commands, until released
+void MotorController::setHold(bool hold) {
+    _hold = hold;
+    if (hold) {
+        for (Motor* motor : {&_left, &_right}) {
+            motor->current = 0;
+            motor->target = 0;
+            motor->remainder = 0;
+            output(*motor);
+        }
+    }
 }
 
 void MotorController::update() {
-    unsigned long now = millis();
-    if (now - _last_update > MOTOR_UPDATE_INTERVAL) {
-        _last_update = now;
-
-        // Left motor
-        if (_left_direction_change_pending) {
-            if (_current_left_speed > 0) {
-                _current_left_speed = max(_current_left_speed - _left_acceleration, 0);
-            } else {
-                _left_forward = _target_left_forward;
-                digitalWrite(_left_dir_pin, _left_forward ? HIGH : LOW);
-                _left_direction_change_pending = false;
-            }
-        } else {
-            if (_current_left_speed < _target_left_speed) {
-                _current_left_speed = min(_current_left_speed + _left_acceleration, _target_left_speed);
-            } else if (_current_left_speed > _target_left_speed) {
-                _current_left_speed = max(_current_left_speed - _left_acceleration, _target_left_speed);
-            }
-        }
+    uint32_t now = hal::clock().micros();
+    uint32_t elapsed = _started ? now - _lastUpdate : 0;
+    _lastUpdate = now;
+    _started = true;
+
+    if (_hold) {
+        _left.target = 0;
+        _right.target = 0;
+        return;
+    }
+    bool changed = ramp(_left, elapsed);
+    changed |= ramp(_right, elapsed);
+    if (_targetPending && (changed || (_left.current == _left.target && _right.current == _right.target))) {
+        _targetPending = false;
+        _actuationTime = now;
+        _actuated = true;
+    }
+}
 
-        // Right motor
-        if (_right_direction_change_pending) {
-            if (_current_right_speed > 0) {
-                _current_right_speed = max(_current_right_speed - _right_acceleration, 0);
-            } else {
-                _right_forward = _target_right_forward;
-                digitalWrite(_right_dir_pin, _right_forward ? HIGH : LOW);
-                _right_direction_change_pending = false;
-            }
+bool MotorController::takeActuation(uint32_t& time) {
+    if (!_actuated) {
+        return false;
+    }
+    time = _actuationTime;
+    _actuated = false;
+    return true;
+}
+
+// The part of a step below one unit is carried over, so many short steps
+// add up to the same slope as a few long ones
+bool MotorController::ramp(Motor& motor, uint32_t elapsed) {
+    if (motor.current == motor.target) {
+        motor.remainder = 0;
+    } else if (motor.acceleration == 0) {
+        motor.current = motor.target;
+    } else {
+        uint64_t step = (uint64_t)motor.acceleration * MOTOR_SPEED_SCALE * elapsed + motor.remainder;
+        motor.remainder = step % 1000000;
+        int32_t delta = (int32_t)min(step / 1000000, (uint64_t)2 * MOTOR_SPEED_FULL);
+        if (motor.current < motor.target) {
+            motor.current = min(motor.current + delta, motor.target);
         } else {
-            if (_current_right_speed < _target_right_speed) {
-                _current_right_speed = min(_current_right_speed + _right_acceleration, _target_right_speed);
-            } else if (_current_right_speed > _target_right_speed) {
-                _current_right_speed = max(_current_right_speed - _right_acceleration, _target_right_speed);
-            }
+            motor.current = max(motor.current - delta, motor.target);
         }
+    }
+    return output(motor);
+}
 
-        analogWrite(_left_pwm_pin, _current_left_speed);
-        analogWrite(_right_pwm_pin, _current_right_speed);
+bool MotorController::output(Motor& motor) {
+    // Standing still the pin already points where the ramp goes next
+    bool forward = motor.current != 0 ? motor.current > 0 : motor.target >= 0;
+    bool changed = forward != motor.forward;
+    if (changed) {
+        motor.forward = forward;
+        hal::gpio().digitalWrite(motor.dirPin, forward ? HIGH : LOW);
     }
+    int32_t duty = (int64_t)abs(motor.current) * _pwmRange / MOTOR_SPEED_FULL;
+    if (duty != motor.duty) {
+        motor.duty = duty;
+        hal::gpio().analogWrite(motor.pwmPin, duty);
+        changed = true;
+    }
+    return changed;
 }
 
 int MotorController::getCurrentLeftSpeed() {
-    int percent = map(_current_left_speed, 0, 255, 0, 100);
-    return _left_forward ? percent : -percent;
+    return _left.current / MOTOR_SPEED_SCALE;
 }
 
 int MotorController::getCurrentRightSpeed() {
-    int percent = map(_current_right_speed, 0, 255, 0, 100);
-    return _right_forward ? percent : -percent;
+    return _right.current / MOTOR_SPEED_SCALE;
 }
 
 int MotorController::getLeftAcceleration() {
-    return _left_acceleration;
+    return _left.acceleration;
 }
 
 int MotorController::getRightAcceleration() {
-    return _right_acceleration;
+    return _right.acceleration;
 }
 
 int MotorController::getLeftDirection() {
-    return _left_forward;
+    return _left.forward;
 }
 
 int MotorController::getRightDirection() {
-    return _right_forward;
-}
\ No newline at end of file
+    return _right.forward;
+}
@@ -1,49 +1,79 @@
 #ifndef MOTOR_CONTROLLER_H
 #define MOTOR_CONTROLLER_H
 
-#include <Arduino.h>
+#include "Platform.h"
 #include "config.h"
 
+#define MOTOR_SPEED_FULL (100L * MOTOR_SPEED_SCALE)  // 100 %
 
+// Speeds are signed, in MOTOR_SPEED_SCALE units per percent of full speed.
+// update() moves each motor towards its target by the acceleration (percent
+// per second) times the time since the previous call, so the ramp has the
+// same slope at any call rate; the firmware calls it from an SDK timer at
+// 1 / MOTOR_TICK_INTERVAL, in the system task rather than an interrupt.
+// A ramp through zero flips the direction pin there.
 class MotorController {
 public:
     MotorController(int left_pwm_pin, int left_dir_pin, int right_pwm_pin, int right_dir_pin);
-    void begin();
+    void begin(uint16_t pwmRange = MOTOR_PWM_RANGE, uint16_t pwmFrequency = MOTOR_PWM_FREQUENCY);
+    // Duty in counts of the PWM range, keeping the direction
     void setLeftSpeed(int speed);
     void setRightSpeed(int speed);
     void setLeftDirection(bool forward);
     void setRightDirection(bool forward);
     void setLeftSpeedPercent(int percent);
     void setRightSpeedPercent(int percent);
+    // Both targets in speed units, so the next update() ramps them together
+    void setTargets(int32_t left, int32_t right);
+    // Percent per second, 0 jumps straight to the target
     void setLeftAcceleration(int acceleration);
     void setRightAcceleration(int acceleration);
+    void setHold(bool hold);
+    bool isHeld() { return _hold; }
     void update();
+    // true once per target change, after the update() that first changed a
+    // PWM duty or direction pin for it, or found both motors on target;
+    // time is that update's micros()
+    bool takeActuation(uint32_t& time);
+    // A target change is still waiting for its first output change
+    bool isActuationPending() { return _targetPending; }
     int getCurrentLeftSpeed();
     int getCurrentRightSpeed();
+    int32_t getLeftSpeedUnits() { return _left.current; }
+    int32_t getRightSpeedUnits() { return _right.current; }
     int getLeftAcceleration();
     int getRightAcceleration();
     int getLeftDirection();
     int getRightDirection();
+    uint16_t getPwmRange() { return _pwmRange; }
 
 private:
-    int _left_pwm_pin;
-    int _left_dir_pin;
-    int _right_pwm_pin;
-    int _right_dir_pin;
+    struct Motor {
+        int pwmPin;
+        int dirPin;
+        int32_t current;
+        int32_t target;
+        int acceleration;
+        uint32_t remainder;  // Slew not yet worth a whole unit, in units / 1000000
+        int32_t duty;        // Last written to the PWM pin
+        bool forward;        // Direction pin
+    };
 
-    int _current_left_speed;
-    int _current_right_speed;
-    int _target_left_speed;
-    int _target_right_speed;
-    int _left_acceleration;
-    int _right_acceleration;
-    unsigned long _last_update;
-    bool _left_forward;
-    bool _right_forward;
-    bool _target_left_forward;
-    bool _target_right_forward;
-    bool _left_direction_change_pending;
-    bool _right_direction_change_pending;
+    void setTarget(Motor& motor, int32_t target);
+    // Both true when the PWM duty or the direction pin changed
+    bool ramp(Motor& motor, uint32_t elapsed);
+    bool output(Motor& motor);
+
+    Motor _left;
+    Motor _right;
+    uint16_t _pwmRange;
+    uint32_t _lastUpdate;  // micros()
+    bool _started;
+    bool _hold;
+    // The firmware's tick sets these, the motors task takes them
+    volatile bool _targetPending;
+    volatile bool _actuated;
+    volatile uint32_t _actuationTime;
 };
 
 #endif // MOTOR_CONTROLLER_H
@@ -0,0 +1,89 @@
+#include "Profiler.h"
+
+#if defined(ENABLE_PROFILER)
+
+#include <string.h>
+#if defined(ARDUINO)
+#include <Arduino.h>
+#else
+#include <chrono>
+#endif
+
+namespace Profiler {
+
+static ProfileStats _stats[PROFILE_STAGE_COUNT];
+
+static const char* const _stageNames[PROFILE_STAGE_COUNT] = {
+    "loop",
+    "sonars",
+    "imu",
+    "power",
+    "motors",
+    "steering",
+    "mqtt",
+    "serialize"
+};
+
+uint32_t ticks() {
+#if defined(ARDUINO)
+    return ESP.getCycleCount();
+#else
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint32_t ticksPerMicrosecond() {
+#if defined(ARDUINO)
+    return ESP.getCpuFreqMHz();
+#else
+    return 1000;
+#endif
+}
+
+void record(ProfileStage stage, uint32_t ticks) {
+    ProfileStats& stats = _stats[stage];
+    if (stats.count == 0 || ticks < stats.min) stats.min = ticks;
+    if (ticks > stats.max) stats.max = ticks;
+    stats.count++;
+    stats.total += ticks;
+
+    uint8_t bucket = ticks ? 31 - __builtin_clz(ticks) : 0;
+    stats.histogram[bucket]++;
+}
+
+void reset() {
+    memset(_stats, 0, sizeof(_stats));
+}
+
+const char* stageName(uint8_t stage) {
+    return stage < PROFILE_STAGE_COUNT ? _stageNames[stage] : "unknown";
+}
+
+const ProfileStats& getStats(uint8_t stage) {
+    return _stats[stage];
+}
+
+// Upper edge of the histogram bucket containing the given percentile,
+// clamped to the observed maximum.
+uint32_t percentile(uint8_t stage, uint8_t percent) {
+    const ProfileStats& stats = _stats[stage];
+    if (stats.count == 0) {
+        return 0;
+    }
+
+    uint32_t target = (uint32_t)(((uint64_t)stats.count * percent + 99) / 100);
+    uint32_t seen = 0;
+    for (uint8_t bucket = 0; bucket < PROFILE_HISTOGRAM_BUCKETS; bucket++) {
+        seen += stats.histogram[bucket];
+        if (seen >= target) {
+            uint32_t upper = bucket >= 31 ? UINT32_MAX : (2u << bucket) - 1;
+            return upper < stats.max ? upper : stats.max;
+        }
+    }
+    return stats.max;
+}
+
+} // namespace Profiler
+
+#endif // ENABLE_PROFILER
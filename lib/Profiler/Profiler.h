@@ -0,0 +1,66 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include "config.h"
+
+// Loop stages that can be timed with PROFILE_SCOPE()
+enum ProfileStage : uint8_t {
+    PROFILE_LOOP,
+    PROFILE_SONARS,
+    PROFILE_IMU,
+    PROFILE_POWER,
+    PROFILE_MOTORS,
+    PROFILE_STEERING,
+    PROFILE_MQTT,
+    PROFILE_SERIALIZE,
+    PROFILE_STAGE_COUNT
+};
+
+#define PROFILE_HISTOGRAM_BUCKETS 32  // Bucket n counts durations in [2^n, 2^(n+1)) ticks
+
+struct ProfileStats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+};
+
+#if defined(ENABLE_PROFILER)
+
+// Ticks are CPU cycles on the ESP8266 (ESP.getCycleCount()) and
+// nanoseconds on the host (std::chrono::steady_clock).
+namespace Profiler {
+
+uint32_t ticks();
+uint32_t ticksPerMicrosecond();
+void record(ProfileStage stage, uint32_t ticks);
+void reset();
+const char* stageName(uint8_t stage);
+const ProfileStats& getStats(uint8_t stage);
+uint32_t percentile(uint8_t stage, uint8_t percent);
+
+} // namespace Profiler
+
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfileStage stage) : _stage(stage), _start(Profiler::ticks()) {}
+    ~ProfileScope() { Profiler::record(_stage, Profiler::ticks() - _start); }
+
+private:
+    ProfileStage _stage;
+    uint32_t _start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(_profile_scope_, __LINE__)(stage)
+
+#else
+
+#define PROFILE_SCOPE(stage) do {} while (0)
+
+#endif // ENABLE_PROFILER
+
+#endif // PROFILER_H
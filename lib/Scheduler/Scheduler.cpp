@@ -0,0 +1,107 @@
+#include "Platform.h"
+#include "config.h"
+#include "Hal.h"
+#include "Scheduler.h"
+
+Scheduler::Scheduler() {
+    _taskCount = 0;
+}
+
+int Scheduler::addTask(const char* name, TaskCallback callback, unsigned long periodMs, unsigned long deadlineMs, TaskPriority priority) {
+    if (_taskCount >= SCHEDULER_MAX_TASKS) {
+        LOG_E("Scheduler full, task '%s' not added\n", name);
+        return -1;
+    }
+
+    // Keep the table sorted by priority so run() is a single ordered pass
+    int index = _taskCount;
+    while (index > 0 && _tasks[index - 1].priority > priority) {
+        _tasks[index] = _tasks[index - 1];
+        index--;
+    }
+
+    Task& task = _tasks[index];
+    task.name = name;
+    task.callback = callback;
+    task.period = periodMs * 1000;
+    task.deadline = deadlineMs * 1000;
+    task.release = hal::clock().micros();
+    task.priority = priority;
+    memset(&task.stats, 0, sizeof(task.stats));
+    _taskCount++;
+
+    return index;
+}
+
+bool Scheduler::setPeriod(const char* name, unsigned long periodMs) {
+    int index = findTask(name);
+    if (index < 0) {
+        return false;
+    }
+
+    Task& task = _tasks[index];
+    // Deadline scales with the period so a slower rate does not count as overruns
+    task.deadline = task.period > 0 ? (uint32_t)((uint64_t)task.deadline * periodMs * 1000 / task.period) : periodMs * 1000;
+    task.period = periodMs * 1000;
+    task.release = hal::clock().micros();
+    return true;
+}
+
+bool Scheduler::wake(const char* name) {
+    int index = findTask(name);
+    if (index < 0) {
+        return false;
+    }
+    _tasks[index].release = hal::clock().micros();
+    return true;
+}
+
+void Scheduler::run() {
+    for (uint8_t i = 0; i < _taskCount; i++) {
+        Task& task = _tasks[i];
+        uint32_t start = hal::clock().micros();
+        if ((int32_t)(start - task.release) < 0) {
+            continue;
+        }
+
+        task.callback();
+
+        uint32_t end = hal::clock().micros();
+        TaskStats& stats = task.stats;
+        stats.runs++;
+        stats.lastJitter = start - task.release;
+        stats.maxJitter = max(stats.maxJitter, stats.lastJitter);
+        stats.lastDuration = end - start;
+        stats.maxDuration = max(stats.maxDuration, stats.lastDuration);
+        if (end - task.release > task.deadline) {
+            stats.overruns++;
+        }
+
+        if (task.period == 0) {
+            task.release = end;
+            continue;
+        }
+
+        task.release += task.period;
+        if ((int32_t)(end - task.release) >= 0) {
+            uint32_t missed = (end - task.release) / task.period + 1;
+            task.release += missed * task.period;
+            stats.skipped += missed;
+        }
+    }
+}
+
+void Scheduler::resetStats() {
+    for (uint8_t i = 0; i < _taskCount; i++) {
+        memset(&_tasks[i].stats, 0, sizeof(_tasks[i].stats));
+    }
+}
+
+int Scheduler::findTask(const char* name) {
+    for (uint8_t i = 0; i < _taskCount; i++) {
+        if (strcmp(_tasks[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,62 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "Platform.h"
+#include "config.h"
+
+typedef void (*TaskCallback)();
+
+// Lower value runs first when several tasks are due in the same pass
+enum TaskPriority : uint8_t {
+    TASK_PRIORITY_CONTROL = 0,
+    TASK_PRIORITY_SENSORS = 1,
+    TASK_PRIORITY_COMMS = 2,
+    TASK_PRIORITY_TELEMETRY = 3
+};
+
+struct TaskStats {
+    uint32_t runs;
+    uint32_t overruns;      // Completed later than release + deadline
+    uint32_t skipped;       // Releases dropped because the task fell a full period behind
+    uint32_t lastJitter;    // Start delay after release, us
+    uint32_t maxJitter;
+    uint32_t lastDuration;  // Execution time, us
+    uint32_t maxDuration;
+};
+
+// Fixed-capacity cooperative scheduler. Tasks run to completion in priority
+// order; releases are phase-locked to the period so modules do not drift
+// against each other.
+class Scheduler {
+public:
+    Scheduler();
+    int addTask(const char* name, TaskCallback callback, unsigned long periodMs, unsigned long deadlineMs, TaskPriority priority);
+    bool setPeriod(const char* name, unsigned long periodMs);
+    // Runs the task on the next pass; later releases keep its period from then
+    bool wake(const char* name);
+    void run();
+    void resetStats();
+
+    uint8_t getTaskCount() { return _taskCount; }
+    const char* getTaskName(uint8_t index) { return _tasks[index].name; }
+    unsigned long getTaskPeriod(uint8_t index) { return _tasks[index].period / 1000; }
+    const TaskStats& getTaskStats(uint8_t index) { return _tasks[index].stats; }
+
+private:
+    struct Task {
+        const char* name;
+        TaskCallback callback;
+        uint32_t period;    // us
+        uint32_t deadline;  // us
+        uint32_t release;   // us, next due time
+        TaskPriority priority;
+        TaskStats stats;
+    };
+
+    int findTask(const char* name);
+
+    Task _tasks[SCHEDULER_MAX_TASKS];
+    uint8_t _taskCount;
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,40 @@
+#ifndef IMU_HISTORY_H
+#define IMU_HISTORY_H
+
+#include "Platform.h"
+#include "config.h"
+#include "Hal.h"
+
+static_assert((IMU_HISTORY_SIZE & (IMU_HISTORY_SIZE - 1)) == 0, "IMU_HISTORY_SIZE must be a power of two");
+
+struct ImuSample {
+    uint32_t timestamp;  // micros() when the DMP produced the packet
+    hal::ImuRawSample raw;
+};
+
+// Fixed-size ring of the most recent DMP samples. There is a single writer;
+// the write counter is only advanced after the slot is filled, so a reader
+// never sees a half written sample as the newest one. The oldest sample is
+// overwritten once the ring is full.
+class ImuHistory {
+public:
+    ImuHistory() : _written(0) {}
+
+    void push(uint32_t timestamp, const hal::ImuRawSample& raw) {
+        ImuSample& sample = _samples[_written & (IMU_HISTORY_SIZE - 1)];
+        sample.timestamp = timestamp;
+        sample.raw = raw;
+        _written = _written + 1;
+    }
+
+    uint8_t size() const { return _written < IMU_HISTORY_SIZE ? _written : IMU_HISTORY_SIZE; }
+    // age 0 is the newest sample, size() - 1 the oldest
+    const ImuSample& at(uint8_t age) const { return _samples[(_written - 1 - age) & (IMU_HISTORY_SIZE - 1)]; }
+    uint32_t getWrittenCount() const { return _written; }
+
+private:
+    ImuSample _samples[IMU_HISTORY_SIZE];
+    volatile uint32_t _written;
+};
+
+#endif // IMU_HISTORY_H
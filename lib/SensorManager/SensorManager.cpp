@@ -1,173 +1,269 @@
-#include <Arduino.h>
+#include "Platform.h"
 #include "config.h"
 #include "SensorManager.h"
-#include <EEPROM.h>
-#include <INA226.h>
-
-SensorManager::SensorManager() :
-    _mpu(),
-    _sonarRight(SONAR_RIGHT_PING, SONAR_RIGHT_PING, MAX_DISTANCE),
-    _sonarLeft(SONAR_LEFT_PING, SONAR_LEFT_PING, MAX_DISTANCE),
-    _ina226(INA226_ADDRESS),
+#include "FixedPoint.h"
+#include "Profiler.h"
+
+SensorManager::SensorManager(hal::ImuDevice& imu, hal::PowerMonitor& power, hal::SonarDevice& sonarRight, hal::SonarDevice& sonarLeft) :
+    _imu(&imu),
+    _powerMonitor(&power),
+    _sonarRight(&sonarRight),
+    _sonarLeft(&sonarLeft),
     _mpuAddress(MPU_ADDRESS),
     _ina226Address(INA226_ADDRESS)
 {
-    _last_mpu_calculate = 0;
+    _imuOverflows = 0;
+    _calibrationState = CALIBRATION_IDLE;
+    _calibrationPass = 0;
+    _calibrationSample = 0;
+    _calibrationError = 0;
+    memset(_mpuYPR, 0, sizeof(_mpuYPR));
+    memset(_accel, 0, sizeof(_accel));
+    memset(_gyro, 0, sizeof(_gyro));
+    _voltage = 0;
+    _current = 0;
+    _power = 0;
     _last_energy_time = 0;
-    _energy = 0.0;
+    _store = nullptr;
+    _energy = 0;
+    _energyRemainder = 0;
+    _sonarRightValue = 0;
+    _sonarLeftValue = 0;
+    _sonarRightActive = true;
+    _last_sonar_trigger = 0;
+    _sonarReadings = 0;
+    _sonarReadingTime = 0;
 }
 
 void SensorManager::begin(float shunt, float maxCurrent, uint8_t mpuAddr, uint8_t inaAddr) {
     _mpuAddress = mpuAddr;
     _ina226Address = inaAddr;
 
-    Wire.begin(SW_I2C_SDA, SW_I2C_SCL);
+    _imu->begin(_mpuAddress);
 
-    EEPROM.begin(512);
+    readOffsetsMPU();
+    if (_store) {
+        _store->get(KV_KEY_ENERGY, &_energy, sizeof(_energy));
+    }
 
-    _mpu = MPU6050(_mpuAddress);
-    _mpu.initialize();
-    _mpu.dmpInitialize();
-    _mpu.setDMPEnabled(true);
+    _sonarRight->begin();
+    _sonarLeft->begin();
 
-    readOffsetsMPU();
+    _powerMonitor->begin(_ina226Address, shunt, maxCurrent);
+}
+
+void SensorManager::update() {
+    unsigned long now = hal::clock().millis();
 
-    _ina226 = INA226(_ina226Address);
-    if (!_ina226.begin()) {
-        LOG_E("INA226 not found at address 0x%X\n", _ina226Address);
-    } else {
-        _ina226.setMaxCurrentShunt(maxCurrent, shunt);
-        _ina226.setModeShuntBusContinuous();
-        _ina226.setBusVoltageConversionTime(INA226_1100_us);
-        _ina226.setShuntVoltageConversionTime(INA226_1100_us);
-        _ina226.setAverage(INA226_4_SAMPLES);
-
-        LOG_I("INA226 initialized:\n");
-        LOG_I("  Shunt: %.2f Ohm\n", shunt);
-        LOG_I("  Max Current: %.2f A\n", maxCurrent);
-        LOG_I("  Mode: %d (continuous)\n", _ina226.getMode());
-        LOG_I("  Calibrated: %s\n", _ina226.isCalibrated() ? "yes" : "no");
-        LOG_I("  Max Measurable: %.2f A\n", _ina226.getMaxCurrent());
+    // Readings requested on the previous run, the I2C queue fetched them since
+    {
+        PROFILE_SCOPE(PROFILE_POWER);
+        _voltage = _powerMonitor->getBusVoltage();
+        _current = _powerMonitor->getCurrent();
+        _power = _powerMonitor->getPower();
+        _powerMonitor->requestUpdate();
     }
+    if (_last_energy_time > 0 && _power > 0) {
+        uint32_t added = addEnergy(_energyRemainder, _power, now - _last_energy_time);
+        if (added) {
+            _energy += added;
+            // RAM only, the store task writes it every KV_FLUSH_INTERVAL
+            if (_store) _store->stage(KV_KEY_ENERGY, &_energy, sizeof(_energy));
+        }
+    }
+    _last_energy_time = now;
 }
 
-void SensorManager::update() {
-    static unsigned long last_update = 0;
-    unsigned long now = millis();
-    if (now - last_update < SENSOR_UPDATE_INTERVAL) {
+// Drains every DMP packet waiting in the FIFO into the history. The packets
+// of one drain are back-dated one DMP period apart from the ready timestamp,
+// and the orientation getters follow the newest one.
+void SensorManager::updateImu() {
+    PROFILE_SCOPE(PROFILE_IMU);
+    uint32_t timestamp;
+    if (!_imu->dataReady(timestamp)) {
+        return;
+    }
+
+    hal::ImuRawSample samples[IMU_FIFO_BATCH];
+    bool overflow;
+    uint8_t count = _imu->readFifo(samples, IMU_FIFO_BATCH, overflow);
+    if (overflow) {
+        _imuOverflows++;
+        LOG_W("MPU6050 FIFO overflow, reset (%u so far)\n", _imuOverflows);
+        return;
+    }
+    if (count == 0) {
         return;
     }
-    last_update = now;
 
-    mpuCalculate();
-    _sonarRightValue = _sonarRight.ping_cm();
-    delay(30); // Wait for sonar ping
-    _sonarLeftValue = _sonarLeft.ping_cm();
+    for (uint8_t i = 0; i < count; i++) {
+        _imuHistory.push(timestamp - (uint32_t)(count - 1 - i) * (1000000 / MPU_DMP_RATE_HZ), samples[i]);
+    }
+    orientation(samples[count - 1], _mpuYPR, _accel, _gyro);
+}
 
-    // Read INA226 data
-    _voltage = _ina226.getBusVoltage();
-    _current = _ina226.getCurrent();
-    _power = _ina226.getPower();
-    if (_last_energy_time > 0) {
-        unsigned long delta_time = now - _last_energy_time;
-        _energy += _power * (delta_time / 3600000.0); // Wh
+// Sonars are pinged alternately, SONAR_PING_INTERVAL apart so that the echo
+// of one cannot be picked up by the other. Echoes are timed in the background,
+// this only collects finished results and fires the next ping.
+void SensorManager::updateSonars() {
+    PROFILE_SCOPE(PROFILE_SONARS);
+    hal::SonarDevice* active = _sonarRightActive ? _sonarRight : _sonarLeft;
+    if (active->poll()) {
+        if (_sonarRightActive) {
+            _sonarRightValue = active->getDistance();
+        } else {
+            _sonarLeftValue = active->getDistance();
+        }
+        _sonarReadingTime = hal::clock().micros();
+        _sonarReadings++;
     }
-    _last_energy_time = now;
+
+    unsigned long now = hal::clock().millis();
+    if (active->busy() || now - _last_sonar_trigger < SONAR_PING_INTERVAL) {
+        return;
+    }
+    _last_sonar_trigger = now;
+
+    _sonarRightActive = !_sonarRightActive;
+    (_sonarRightActive ? _sonarRight : _sonarLeft)->trigger();
 }
 
 void SensorManager::readOffsetsMPU() {
-    int offsets[6];
-    EEPROM.get(EEPROM_START_ADDRESS, offsets);
-    _mpu.setXAccelOffset(offsets[0]);
-    _mpu.setYAccelOffset(offsets[1]);
-    _mpu.setZAccelOffset(offsets[2]);
-    _mpu.setXGyroOffset(offsets[3]);
-    _mpu.setYGyroOffset(offsets[4]);
-    _mpu.setZGyroOffset(offsets[5]);
+    int16_t mpuOffsets[6] = {0, 0, 0, 0, 0, 0};
+    if (_store) {
+        _store->get(KV_KEY_MPU_OFFSETS, mpuOffsets, sizeof(mpuOffsets));
+    }
+    _imu->setOffsets(mpuOffsets);
 }
 
-void SensorManager::calibrateMPU() {
-    long offsets[6];
-    long offsetsOld[6];
-    int16_t mpuGet[6];
+int16_t SensorManager::getOffset(uint8_t axis) {
+    int16_t offsets[6];
+    _imu->getOffsets(offsets);
+    return offsets[axis];
+}
 
-    _mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_2);
-    _mpu.setFullScaleGyroRange(MPU6050_GYRO_FS_250);
+bool SensorManager::startCalibration() {
+    if (_calibrationState == CALIBRATION_RUNNING) {
+        return false;
+    }
 
-    _mpu.setXAccelOffset(0);
-    _mpu.setYAccelOffset(0);
-    _mpu.setZAccelOffset(0);
-    _mpu.setXGyroOffset(0);
-    _mpu.setYGyroOffset(0);
-    _mpu.setZGyroOffset(0);
-    delay(5);
+    int16_t mpuOffsets[6] = {0, 0, 0, 0, 0, 0};
+    _imu->prepareCalibration();
+    _imu->setOffsets(mpuOffsets);
 
-    for (byte n = 0; n < 10; n++) {
-        for (byte j = 0; j < 6; j++) {
-            offsets[j] = 0;
-        }
+    memset(_calibrationOffsets, 0, sizeof(_calibrationOffsets));
+    memset(_calibrationSum, 0, sizeof(_calibrationSum));
+    _calibrationPass = 0;
+    _calibrationSample = 0;
+    _calibrationError = 0;
+    _calibrationState = CALIBRATION_RUNNING;
+    return true;
+}
 
-        for (byte i = 0; i < 100 + MPU_CALIBRATION_BUFFER_SIZE; i++) {
-            _mpu.getMotion6(&mpuGet[0], &mpuGet[1], &mpuGet[2], &mpuGet[3], &mpuGet[4], &mpuGet[5]);
-            if (i >= 99) {
-                for (byte j = 0; j < 6; j++) {
-                    offsets[j] += (long)mpuGet[j];
-                }
+// Each pass discards MPU_CALIBRATION_SETTLE samples, averages the next
+// MPU_CALIBRATION_BUFFER_SIZE and moves the offsets against the mean error.
+// A level, still sensor reads 0 on every axis except +1 g (16384) on z. The
+// job ends as soon as every axis is within tolerance, or fails after
+// MPU_CALIBRATION_MAX_PASSES; only a converged result is saved to the store.
+bool SensorManager::updateCalibration() {
+    if (_calibrationState != CALIBRATION_RUNNING) {
+        return false;
+    }
+
+    int16_t mpuGet[6];
+    for (byte n = 0; n < MPU_CALIBRATION_SLICE && _calibrationSample < MPU_CALIBRATION_SETTLE + MPU_CALIBRATION_BUFFER_SIZE; n++) {
+        _imu->getMotion6(mpuGet);
+        if (_calibrationSample++ >= MPU_CALIBRATION_SETTLE) {
+            for (byte j = 0; j < 6; j++) {
+                _calibrationSum[j] += mpuGet[j];
             }
         }
+    }
+    if (_calibrationSample < MPU_CALIBRATION_SETTLE + MPU_CALIBRATION_BUFFER_SIZE) {
+        return false;
+    }
+
+    int32_t error[6];
+    bool converged = true;
+    _calibrationError = 0;
+    for (byte i = 0; i < 6; i++) {
+        error[i] = _calibrationSum[i] / MPU_CALIBRATION_BUFFER_SIZE - (i == 2 ? 16384 : 0);
+        int32_t tolerance = i < 3 ? MPU_CALIBRATION_ACCEL_TOLERANCE : MPU_CALIBRATION_GYRO_TOLERANCE;
+        if (abs(error[i]) > tolerance) {
+            converged = false;
+        }
+        _calibrationError = max(_calibrationError, (int32_t)abs(error[i]));
+    }
+    _calibrationPass++;
+    _calibrationSample = 0;
+    memset(_calibrationSum, 0, sizeof(_calibrationSum));
 
+    if (converged) {
+        int16_t offsets[6];
         for (byte i = 0; i < 6; i++) {
-            offsets[i] = offsetsOld[i] - ((long)offsets[i] / MPU_CALIBRATION_BUFFER_SIZE);
-            if (i == 2) offsets[i] += 16384;
-            offsetsOld[i] = offsets[i];
+            offsets[i] = _calibrationOffsets[i] / (i < 3 ? 8 : 4);
         }
+        if (_store && !_store->put(KV_KEY_MPU_OFFSETS, offsets, sizeof(offsets))) {
+            LOG_W("MPU offsets not saved, they are lost on restart\n");
+        }
+        _calibrationState = CALIBRATION_DONE;
+        LOG_I("MPU calibration converged after %d passes\n", _calibrationPass);
+        return true;
+    }
 
-        _mpu.setXAccelOffset(offsets[0] / 8);
-        _mpu.setYAccelOffset(offsets[1] / 8);
-        _mpu.setZAccelOffset(offsets[2] / 8);
-        _mpu.setXGyroOffset(offsets[3] / 4);
-        _mpu.setYGyroOffset(offsets[4] / 4);
-        _mpu.setZGyroOffset(offsets[5] / 4);
-        delay(2);
+    if (_calibrationPass >= MPU_CALIBRATION_MAX_PASSES) {
+        readOffsetsMPU();
+        _calibrationState = CALIBRATION_FAILED;
+        LOG_W("MPU calibration did not converge (error %d LSB), offsets restored\n", (int)_calibrationError);
+        return true;
     }
 
+    int16_t mpuOffsets[6];
     for (byte i = 0; i < 6; i++) {
-        if (i < 3) offsets[i] /= 8;
-        else offsets[i] /= 4;
+        _calibrationOffsets[i] -= error[i];
+        mpuOffsets[i] = _calibrationOffsets[i] / (i < 3 ? 8 : 4);
     }
-
-    EEPROM.put(EEPROM_START_ADDRESS, offsets);
+    _imu->setOffsets(mpuOffsets);
+    return true;
 }
 
-void SensorManager::mpuCalculate() {
-    long now = millis();
-    if (now - _last_mpu_calculate <= MPU_MESUAREMENT_DELAY) {
-        return;
-    }
-    _last_mpu_calculate = now;
-
-    if (!_mpu.dmpGetCurrentFIFOPacket(_mpuFifoBuffer)) {
-        return;
-    }
+// Same math as the MotionApps helpers dmpGetGravity(), dmpGetYawPitchRoll()
+// and dmpGetLinearAccel(), in integers. The quaternion is Q14 (16384 = 1),
+// so products of two components are Q28 and gravity comes out in Q16.16.
+void SensorManager::orientation(const hal::ImuRawSample& sample, q16_16 ypr[3], q16_16 accel[3], q16_16 gyro[3]) {
+    int32_t qw = sample.quaternion[0];
+    int32_t qx = sample.quaternion[1];
+    int32_t qy = sample.quaternion[2];
+    int32_t qz = sample.quaternion[3];
 
-    Quaternion q;
-    VectorFloat gravity;
-    VectorInt16 gyro;
-    VectorInt16 accel;
-    VectorInt16 accelReal;
+    int32_t gravityX = (qx * qz - qw * qy) >> 11;
+    int32_t gravityY = (qw * qx + qy * qz) >> 11;
+    int32_t gravityZ = (qw * qw - qx * qx - qy * qy + qz * qz) >> 12;
 
-    _mpu.dmpGetQuaternion(&q, _mpuFifoBuffer);
-    _mpu.dmpGetGravity(&gravity, &q);
-    _mpu.dmpGetYawPitchRoll(_mpuYPR, &q, &gravity);
+    ypr[0] = FixedPoint::atan2Degrees((qx * qy - qw * qz) >> 11, ((qw * qw + qx * qx) >> 11) - Q16_ONE);
+    uint32_t gravityYZ = FixedPoint::sqrt64((int64_t)gravityY * gravityY + (int64_t)gravityZ * gravityZ);
+    ypr[1] = FixedPoint::atan2Degrees(gravityX, gravityYZ);
+    ypr[2] = FixedPoint::atan2Degrees(gravityY, gravityZ);
+    if (gravityZ < 0) {
+        ypr[1] = (ypr[1] > 0 ? q16FromInt(180) : q16FromInt(-180)) - ypr[1];
+    }
 
-    _mpu.dmpGetGyro(&gyro, _mpuFifoBuffer);
-    _mpu.dmpGetAccel(&accel, _mpuFifoBuffer);
-    _mpu.dmpGetLinearAccel(&accelReal, &accel, &gravity);
+    // +1 g is 8192 in the DMP accel output, gravity * 8192 in Q16.16 is >> 3.
+    // Reported accel is raw / 16384 and gyro raw * 250 / 32768 deg/s.
+    int32_t gravity[3] = {gravityX, gravityY, gravityZ};
+    for (uint8_t i = 0; i < 3; i++) {
+        accel[i] = (sample.accel[i] - (gravity[i] >> 3)) * 4;
+        gyro[i] = sample.gyro[i] * 500;
+    }
+}
 
-    _accelX = static_cast<double>(accelReal.x) / MPU_METRIC_DEVIDER * 2;
-    _accelY = static_cast<double>(accelReal.y) / MPU_METRIC_DEVIDER * 2;
-    _accelZ = static_cast<double>(accelReal.z) / MPU_METRIC_DEVIDER * 2;
-    _gyroX = static_cast<double>(gyro.x) / MPU_METRIC_DEVIDER * 250;
-    _gyroY = static_cast<double>(gyro.y) / MPU_METRIC_DEVIDER * 250;
-    _gyroZ = static_cast<double>(gyro.z) / MPU_METRIC_DEVIDER * 250;
+// uW * ms, 3600000 of them make a uWh
+uint32_t SensorManager::addEnergy(uint64_t& remainder, int32_t power, uint32_t elapsed) {
+    remainder += (uint64_t)power * elapsed;
+    if (remainder < 3600000) {
+        return 0;
+    }
+    uint32_t added = (uint32_t)(remainder / 3600000);
+    remainder %= 3600000;
+    return added;
 }
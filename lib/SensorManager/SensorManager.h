@@ -1,64 +1,113 @@
 #ifndef SENSOR_MANAGER_H
 #define SENSOR_MANAGER_H
 
-#include <Arduino.h>
-#include <NewPing.h>
-#include <Wire.h>
-#include <I2Cdev.h>
-#include <MPU6050_6Axis_MotionApps20.h>
-#include <INA226.h>
+#include "Platform.h"
+#include "Hal.h"
+#include "FixedPoint.h"
+#include "ImuHistory.h"
+#include "KvStore.h"
+
+enum CalibrationState : uint8_t {
+    CALIBRATION_IDLE,
+    CALIBRATION_RUNNING,
+    CALIBRATION_DONE,
+    CALIBRATION_FAILED   // Did not converge, previous offsets restored
+};
 
 class SensorManager {
 public:
-    SensorManager();
+    SensorManager(hal::ImuDevice& imu, hal::PowerMonitor& power, hal::SonarDevice& sonarRight, hal::SonarDevice& sonarLeft);
+    // MPU offsets and the energy total persist in store; call before begin().
+    // Without a store offsets start at zero and energy counts from boot.
+    void setStore(KvStore* store) { _store = store; }
     void begin(float shunt = 0.1, float maxCurrent = 0.8, uint8_t mpuAddr = 0x68, uint8_t inaAddr = 0x40);
+    bool setPowerCalibration(float shunt, float maxCurrent) { return _powerMonitor->calibrate(shunt, maxCurrent); }
     void update();
-    void calibrateMPU();
+    void updateImu();
+    void updateSonars();
+
+    // IMU calibration runs as a job, MPU_CALIBRATION_SLICE samples per
+    // updateCalibration() call. updateCalibration() returns true when a
+    // pass completed, i.e. there is progress or a result to report.
+    bool startCalibration();
+    bool updateCalibration();
+    CalibrationState getCalibrationState() { return _calibrationState; }
+    uint8_t getCalibrationPass() { return _calibrationPass; }
+    int32_t getCalibrationError() { return _calibrationError; }  // Worst axis deviation of the last pass, LSB
 
-    // Getters
-    float getYaw() { return degrees(_mpuYPR[0]); }
-    float getPitch() { return degrees(_mpuYPR[1]); }
-    float getRoll() { return degrees(_mpuYPR[2]); }
-    double getAccelX() { return _accelX; }
-    double getAccelY() { return _accelY; }
-    double getAccelZ() { return _accelZ; }
-    double getGyroX() { return _gyroX; }
-    double getGyroY() { return _gyroY; }
-    double getGyroZ() { return _gyroZ; }
+    // Getters. Everything is integer: angles are Q16.16 degrees, accel is
+    // Q16.16 of raw / 16384 (the scale telemetry always used), gyro Q16.16 deg/s.
+    q16_16 getYaw() { return _mpuYPR[0]; }
+    q16_16 getPitch() { return _mpuYPR[1]; }
+    q16_16 getRoll() { return _mpuYPR[2]; }
+    q16_16 getAccelX() { return _accel[0]; }
+    q16_16 getAccelY() { return _accel[1]; }
+    q16_16 getAccelZ() { return _accel[2]; }
+    q16_16 getGyroX() { return _gyro[0]; }
+    q16_16 getGyroY() { return _gyro[1]; }
+    q16_16 getGyroZ() { return _gyro[2]; }
     unsigned int getSonarLeft() { return _sonarLeftValue; }
     unsigned int getSonarRight() { return _sonarRightValue; }
-    float getVoltage() { return _voltage; }
-    float getCurrent() { return _current; }
-    float getPower() { return _power; }
-    float getEnergy() { return _energy; }
+    // Bumped by every completed ping of either sonar
+    uint32_t getSonarReadingCount() { return _sonarReadings; }
+    uint32_t getSonarReadingTime() { return _sonarReadingTime; }  // micros()
+    int32_t getVoltage() { return _voltage; }  // mV
+    int32_t getCurrent() { return _current; }  // uA
+    int32_t getPower() { return _power; }      // uW
+    uint32_t getEnergy() { return _energy; }   // uWh, lifetime total when there is a store
+
+    // Every DMP packet drained from the FIFO, newest first
+    const ImuHistory& getImuHistory() { return _imuHistory; }
+    uint32_t getImuSampleCount() { return _imuHistory.getWrittenCount(); }
+    uint32_t getImuOverflowCount() { return _imuOverflows; }
+
+    // The arithmetic behind update() and updateImu(), without the device
+    // reads, so that it can be timed on its own. orientation() fills the
+    // getter values for one DMP packet; addEnergy() adds power (uW) over
+    // elapsed ms to remainder (uW * ms) and returns the whole uWh taken out.
+    static void orientation(const hal::ImuRawSample& sample, q16_16 ypr[3], q16_16 accel[3], q16_16 gyro[3]);
+    static uint32_t addEnergy(uint64_t& remainder, int32_t power, uint32_t elapsed);
 
     // MPU Offsets for calibration result
-    int16_t getAccelXOffset() { return _mpu.getXAccelOffset(); }
-    int16_t getAccelYOffset() { return _mpu.getYAccelOffset(); }
-    int16_t getAccelZOffset() { return _mpu.getZAccelOffset(); }
-    int16_t getGyroXOffset() { return _mpu.getXGyroOffset(); }
-    int16_t getGyroYOffset() { return _mpu.getYGyroOffset(); }
-    int16_t getGyroZOffset() { return _mpu.getZGyroOffset(); }
+    int16_t getAccelXOffset() { return getOffset(0); }
+    int16_t getAccelYOffset() { return getOffset(1); }
+    int16_t getAccelZOffset() { return getOffset(2); }
+    int16_t getGyroXOffset() { return getOffset(3); }
+    int16_t getGyroYOffset() { return getOffset(4); }
+    int16_t getGyroZOffset() { return getOffset(5); }
 
 private:
     void readOffsetsMPU();
-    void mpuCalculate();
+    int16_t getOffset(uint8_t axis);
 
-    MPU6050 _mpu;
-    NewPing _sonarRight;
-    NewPing _sonarLeft;
-    INA226 _ina226;
+    hal::ImuDevice* _imu;
+    hal::PowerMonitor* _powerMonitor;
+    hal::SonarDevice* _sonarRight;
+    hal::SonarDevice* _sonarLeft;
+    KvStore* _store;
     uint8_t _mpuAddress;
     uint8_t _ina226Address;
 
-    uint8_t _mpuFifoBuffer[45];
-    float _mpuYPR[3];
-    double _accelX, _accelY, _accelZ, _gyroX, _gyroY, _gyroZ;
+    ImuHistory _imuHistory;
+    uint32_t _imuOverflows;
+    CalibrationState _calibrationState;
+    uint8_t _calibrationPass;
+    uint16_t _calibrationSample;
+    int32_t _calibrationSum[6];
+    int32_t _calibrationOffsets[6];  // Raw units, register value times 8 (accel) or 4 (gyro)
+    int32_t _calibrationError;
+    q16_16 _mpuYPR[3];
+    q16_16 _accel[3];
+    q16_16 _gyro[3];
     unsigned int _sonarLeftValue, _sonarRightValue;
-    float _voltage, _current, _power, _energy;
+    uint32_t _sonarReadings;
+    uint32_t _sonarReadingTime;
+    int32_t _voltage, _current, _power;
+    uint32_t _energy;
+    uint64_t _energyRemainder;  // uW * ms not yet worth a whole uWh
     unsigned long _last_energy_time;
-
-    long _last_mpu_calculate;
+    unsigned long _last_sonar_trigger;
+    bool _sonarRightActive;
 };
 
 #endif // SENSOR_MANAGER_H
@@ -0,0 +1,217 @@
+#if !defined(ARDUINO)
+
+#include "config.h"
+#include "Simulator.h"
+
+#define SIM_GRAVITY 9.81f
+#define SIM_ACCEL_LSB_PER_G 8192.0f          // DMP accel output
+#define SIM_GYRO_LSB_PER_DPS (32768.0f / 250) // Matches the scale used by SensorManager
+#define SIM_SONAR_HALF_CONE 7.5f             // deg, HC-SR04 beam half angle
+#define SIM_STEER_SCRUB 0.3f                 // Share of the wheel speed difference that turns the robot
+
+Simulator::Simulator(FakeGpio& gpio, FakeServo& servo, FakeSonar& sonarRight, FakeSonar& sonarLeft, FakeImu& imu, FakePowerMonitor& power) {
+    _gpio = &gpio;
+    _servo = &servo;
+    _sonarRight = &sonarRight;
+    _sonarLeft = &sonarLeft;
+    _imu = &imu;
+    _power = &power;
+    _config = defaultConfig();
+    _wallCount = 0;
+    reset(0, 0, 0);
+}
+
+SimConfig Simulator::defaultConfig() {
+    SimConfig config;
+    config.wheelbase = 0.16f;
+    config.trackWidth = 0.13f;
+    config.robotRadius = 0.11f;
+    config.maxWheelSpeed = 0.6f;
+    config.motorTimeConstant = 0.15f;
+    config.servoSlewRate = 500.0f;  // SG90: ~0.12 s per 60 deg
+    config.maxSteerAngle = 30.0f;
+    config.sonarOffset = 0.04f;
+    config.sonarAngle = 15.0f;
+    config.batteryVoltage = 7.4f;
+    config.batteryResistance = 0.15f;
+    config.idleCurrent = 0.12f;
+    config.stallCurrent = 1.2f;
+    config.pwmRange = MOTOR_PWM_RANGE;
+    return config;
+}
+
+void Simulator::reset(float x, float y, float heading) {
+    memset(&_state, 0, sizeof(_state));
+    _state.x = x;
+    _state.y = y;
+    _state.heading = heading;
+    _state.servoAngle = 90;
+    _state.voltage = _config.batteryVoltage;
+    _imuElapsed = 0;
+    updateSensors();
+}
+
+bool Simulator::addWall(float x1, float y1, float x2, float y2) {
+    if (_wallCount >= SIM_MAX_WALLS) {
+        return false;
+    }
+    _walls[_wallCount++] = {x1, y1, x2, y2};
+    return true;
+}
+
+void Simulator::addBox(float x, float y, float width, float height) {
+    addWall(x, y, x + width, y);
+    addWall(x + width, y, x + width, y + height);
+    addWall(x + width, y + height, x, y + height);
+    addWall(x, y + height, x, y);
+}
+
+float Simulator::wheelTarget(uint8_t pwmPin, uint8_t dirPin) {
+    float duty = (float)_gpio->getAnalog(pwmPin) / _config.pwmRange;
+    float sign = _gpio->digitalRead(dirPin) == HIGH ? 1.0f : -1.0f;
+    return sign * constrain(duty, 0.0f, 1.0f) * _config.maxWheelSpeed;
+}
+
+void Simulator::step(float dt) {
+    // The DMP fills its FIFO at a fixed rate regardless of the step size
+    _imuElapsed += dt;
+    while (_imuElapsed >= 1.0f / MPU_DMP_RATE_HZ) {
+        _imuElapsed -= 1.0f / MPU_DMP_RATE_HZ;
+        pushImuSample();
+    }
+
+    if (_state.collided) {
+        updateSensors();
+        return;
+    }
+
+    // Actuators: first-order DC motors, slew-limited servo
+    float alpha = min(dt / _config.motorTimeConstant, 1.0f);
+    float leftTarget = wheelTarget(MOTOR_LEFT_PWM, MOTOR_LEFT_DIRECTION);
+    float rightTarget = wheelTarget(MOTOR_RIGHT_PWM, MOTOR_RIGHT_DIRECTION);
+    _state.leftSpeed += (leftTarget - _state.leftSpeed) * alpha;
+    _state.rightSpeed += (rightTarget - _state.rightSpeed) * alpha;
+
+    float servoTarget = _servo->getAngle() < 0 ? 90.0f : (float)_servo->getAngle();
+    float servoStep = _config.servoSlewRate * dt;
+    _state.servoAngle += constrain(servoTarget - _state.servoAngle, -servoStep, servoStep);
+
+    // Kinematics: the steered front axle sets the path, a wheel speed
+    // mismatch only partly turns the robot (the rest is scrubbed)
+    float speed = (_state.leftSpeed + _state.rightSpeed) / 2;
+    float steer = radians((_state.servoAngle - 90) / 90 * _config.maxSteerAngle);
+    float steerYawRate = speed * tanf(steer) / _config.wheelbase;
+    float diffYawRate = (_state.rightSpeed - _state.leftSpeed) / _config.trackWidth;
+    float yawRate = steerYawRate + SIM_STEER_SCRUB * (diffYawRate - steerYawRate);
+
+    _state.accelForward = (speed - _state.speed) / dt;
+    _state.accelLateral = speed * yawRate;
+    _state.speed = speed;
+    _state.yawRate = yawRate;
+
+    _state.heading += yawRate * dt;
+    if (_state.heading > PI) _state.heading -= 2 * PI;
+    if (_state.heading < -PI) _state.heading += 2 * PI;
+    _state.x += speed * cosf(_state.heading) * dt;
+    _state.y += speed * sinf(_state.heading) * dt;
+    _state.distance += fabsf(speed) * dt;
+    _state.collided = checkCollision();
+
+    // Power: motor current falls with back-EMF as the wheel spins up
+    float current = _config.idleCurrent;
+    float wheels[2] = {_state.leftSpeed, _state.rightSpeed};
+    uint8_t pins[2] = {MOTOR_LEFT_PWM, MOTOR_RIGHT_PWM};
+    for (uint8_t i = 0; i < 2; i++) {
+        float duty = (float)_gpio->getAnalog(pins[i]) / _config.pwmRange;
+        float backEmf = fabsf(wheels[i]) / _config.maxWheelSpeed;
+        current += _config.stallCurrent * max(duty - 0.8f * backEmf * duty, 0.0f);
+    }
+    _state.current = current;
+    _state.voltage = _config.batteryVoltage - current * _config.batteryResistance;
+
+    updateSensors();
+}
+
+// Distance along the ray to the nearest wall, or maxRange when nothing is hit
+float Simulator::castRay(float x, float y, float angle, float maxRange) {
+    float dx = cosf(angle);
+    float dy = sinf(angle);
+    float nearest = maxRange;
+
+    for (uint8_t i = 0; i < _wallCount; i++) {
+        const SimWall& wall = _walls[i];
+        float ex = wall.x2 - wall.x1;
+        float ey = wall.y2 - wall.y1;
+        float denom = dx * ey - dy * ex;
+        if (fabsf(denom) < 1e-6f) {
+            continue;
+        }
+        float wx = wall.x1 - x;
+        float wy = wall.y1 - y;
+        float t = (wx * ey - wy * ex) / denom;
+        float u = (wx * dy - wy * dx) / denom;
+        if (t >= 0 && u >= 0 && u <= 1 && t < nearest) {
+            nearest = t;
+        }
+    }
+    return nearest;
+}
+
+// HC-SR04 reading in cm for a sonar mounted at the front edge, 0 when out of range
+float Simulator::sonarRange(float lateral, float yaw) {
+    float forward = _config.robotRadius;
+    float cosH = cosf(_state.heading);
+    float sinH = sinf(_state.heading);
+    float x = _state.x + forward * cosH - lateral * sinH;
+    float y = _state.y + forward * sinH + lateral * cosH;
+    float maxRange = MAX_DISTANCE / 100.0f;
+
+    float nearest = maxRange;
+    for (int8_t ray = -1; ray <= 1; ray++) {
+        float angle = _state.heading + radians(yaw + ray * SIM_SONAR_HALF_CONE);
+        nearest = min(nearest, castRay(x, y, angle, maxRange));
+    }
+    return nearest >= maxRange ? 0 : nearest * 100;
+}
+
+bool Simulator::checkCollision() {
+    for (uint8_t i = 0; i < _wallCount; i++) {
+        const SimWall& wall = _walls[i];
+        float ex = wall.x2 - wall.x1;
+        float ey = wall.y2 - wall.y1;
+        float lengthSq = ex * ex + ey * ey;
+        float t = lengthSq > 0 ? ((_state.x - wall.x1) * ex + (_state.y - wall.y1) * ey) / lengthSq : 0;
+        t = constrain(t, 0.0f, 1.0f);
+        float px = wall.x1 + t * ex - _state.x;
+        float py = wall.y1 + t * ey - _state.y;
+        if (px * px + py * py < _config.robotRadius * _config.robotRadius) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Simulator::updateSensors() {
+    _sonarRight->setDistance((unsigned int)sonarRange(-_config.sonarOffset, -_config.sonarAngle));
+    _sonarLeft->setDistance((unsigned int)sonarRange(_config.sonarOffset, _config.sonarAngle));
+    _power->set(_state.voltage, _state.current);
+}
+
+void Simulator::pushImuSample() {
+    // Level robot: the quaternion only carries yaw. SensorManager reports
+    // yaw = -2 * asin(qz) for such a quaternion, hence the sign.
+    hal::ImuRawSample sample;
+    sample.quaternion[0] = (int16_t)(cosf(_state.heading / 2) * 16384);
+    sample.quaternion[1] = 0;
+    sample.quaternion[2] = 0;
+    sample.quaternion[3] = (int16_t)(-sinf(_state.heading / 2) * 16384);
+    sample.accel[0] = (int16_t)constrain(_state.accelForward / SIM_GRAVITY * SIM_ACCEL_LSB_PER_G, -32768.0f, 32767.0f);
+    sample.accel[1] = (int16_t)constrain(_state.accelLateral / SIM_GRAVITY * SIM_ACCEL_LSB_PER_G, -32768.0f, 32767.0f);
+    sample.accel[2] = (int16_t)SIM_ACCEL_LSB_PER_G;
+    sample.gyro[0] = 0;
+    sample.gyro[1] = 0;
+    sample.gyro[2] = (int16_t)constrain(degrees(_state.yawRate) * SIM_GYRO_LSB_PER_DPS, -32768.0f, 32767.0f);
+    _imu->pushSample(sample);
+}
+
+#endif // !ARDUINO
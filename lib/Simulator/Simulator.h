@@ -0,0 +1,85 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#if !defined(ARDUINO)
+
+#include "HalNative.h"
+
+// Planar physics model of the robot for the sim environment. It reads the
+// actuator outputs the firmware wrote into the fakes (PWM/direction pins,
+// servo angle), integrates the robot state over a step of virtual time and
+// writes synthesized sonar, IMU and power readings back into the fakes.
+
+#define SIM_MAX_WALLS 32
+
+struct SimConfig {
+    float wheelbase;          // m, rear axle to steered front axle
+    float trackWidth;         // m, between driven wheels
+    float robotRadius;        // m, collision circle
+    float maxWheelSpeed;      // m/s at full PWM
+    float motorTimeConstant;  // s, first-order wheel speed response
+    float servoSlewRate;      // deg/s
+    float maxSteerAngle;      // deg of wheel angle at servo 0/180
+    float sonarOffset;        // m, lateral offset of each sonar from the centre line
+    float sonarAngle;         // deg, outward yaw of each sonar
+    float batteryVoltage;     // V, open circuit
+    float batteryResistance;  // Ohm
+    float idleCurrent;        // A
+    float stallCurrent;       // A per motor at full PWM
+    int pwmRange;             // analogWrite full scale
+};
+
+struct SimWall {
+    float x1, y1, x2, y2;
+};
+
+struct SimState {
+    float x, y, heading;          // m, m, rad (CCW from +x)
+    float leftSpeed, rightSpeed;  // m/s
+    float servoAngle;             // deg, 90 = straight
+    float speed, yawRate;         // m/s, rad/s
+    float accelForward, accelLateral;  // m/s^2
+    float current, voltage;
+    float distance;               // m travelled
+    bool collided;
+};
+
+class Simulator {
+public:
+    Simulator(FakeGpio& gpio, FakeServo& servo, FakeSonar& sonarRight, FakeSonar& sonarLeft, FakeImu& imu, FakePowerMonitor& power);
+
+    static SimConfig defaultConfig();
+    void setConfig(const SimConfig& config) { _config = config; }
+    void reset(float x, float y, float heading);
+    void clearWalls() { _wallCount = 0; }
+    bool addWall(float x1, float y1, float x2, float y2);
+    void addBox(float x, float y, float width, float height);
+
+    void step(float dt);
+    const SimState& getState() const { return _state; }
+
+private:
+    float wheelTarget(uint8_t pwmPin, uint8_t dirPin);
+    float castRay(float x, float y, float angle, float maxRange);
+    float sonarRange(float lateral, float yaw);
+    bool checkCollision();
+    void updateSensors();
+    void pushImuSample();
+
+    FakeGpio* _gpio;
+    FakeServo* _servo;
+    FakeSonar* _sonarRight;
+    FakeSonar* _sonarLeft;
+    FakeImu* _imu;
+    FakePowerMonitor* _power;
+
+    SimConfig _config;
+    SimState _state;
+    float _imuElapsed;  // s since the last DMP packet
+    SimWall _walls[SIM_MAX_WALLS];
+    uint8_t _wallCount;
+};
+
+#endif // !ARDUINO
+
+#endif // SIMULATOR_H
@@ -1,12 +1,12 @@
 #ifndef STEERING_H
 #define STEERING_H
 
-#include <Arduino.h>
-#include <Servo.h>
+#include "Platform.h"
+#include "Hal.h"
 
 class Steering {
 public:
-    Steering();
+    Steering(hal::ServoOutput& servo);
     void begin();
     void setAngle(int angle);
     int getAngle();
@@ -15,11 +15,10 @@ public:
     void update();
 
 private:
-    Servo _servo;
+    hal::ServoOutput* _servo;
     int _current_angle;
     int _target_angle;
     int _acceleration;
-    unsigned long _last_update;
 };
 
 #endif // STEERING_H
@@ -0,0 +1,173 @@
+#include "TelemetryBatch.h"
+
+// Payload bits of the 10/110/1110/1111 buckets
+static const uint8_t TIMESTAMP_WIDTHS[4] = {7, 12, 20, 32};
+static const uint8_t VALUE_WIDTHS[4] = {6, 10, 16, 32};
+
+#define MAX_DELTA_BITS (4 + 32)
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// Wrapping difference, so counters and extreme values round-trip too
+static int32_t difference(uint32_t value, uint32_t previous) {
+    return (int32_t)(value - previous);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+TelemetryBatch::TelemetryBatch(TelemetryBatchChannel channel, uint8_t fieldCount) {
+    _channel = channel;
+    _fieldCount = min(fieldCount, (uint8_t)TELEMETRY_BATCH_MAX_FIELDS);
+    _sequence = 0;
+    _count = 0;
+    clear();
+}
+
+void TelemetryBatch::clear() {
+    if (_count > 0) {
+        _sequence++;
+    }
+    memset(_buffer, 0, sizeof(_buffer));
+    _buffer[0] = TELEMETRY_BATCH_VERSION;
+    _buffer[1] = _channel;
+    _buffer[2] = _fieldCount;
+    _buffer[4] = _sequence & 0xFF;
+    _buffer[5] = _sequence >> 8;
+    _bitLength = 0;
+    _count = 0;
+    _lastInterval = 0;
+    memset(_lastValues, 0, sizeof(_lastValues));
+}
+
+bool TelemetryBatch::full() const {
+    uint32_t freeBits = (TELEMETRY_BATCH_SIZE - TELEMETRY_BATCH_HEADER_SIZE) * 8 - _bitLength;
+    return _count >= TELEMETRY_BATCH_MAX_COUNT || freeBits < (uint32_t)MAX_DELTA_BITS * (_fieldCount + 1);
+}
+
+bool TelemetryBatch::add(uint32_t timestamp, const int32_t* values) {
+    if (full()) {
+        return false;
+    }
+
+    if (_count == 0) {
+        for (uint8_t i = 0; i < 4; i++) {
+            _buffer[6 + i] = (timestamp >> (8 * i)) & 0xFF;
+        }
+    } else {
+        int32_t interval = difference(timestamp, _lastTimestamp);
+        writeDelta(difference(interval, _lastInterval), TIMESTAMP_WIDTHS);
+        _lastInterval = interval;
+    }
+    _lastTimestamp = timestamp;
+
+    for (uint8_t i = 0; i < _fieldCount; i++) {
+        writeDelta(difference(values[i], _lastValues[i]), VALUE_WIDTHS);
+        _lastValues[i] = values[i];
+    }
+    _buffer[3] = ++_count;
+    return true;
+}
+
+void TelemetryBatch::writeBits(uint32_t value, uint8_t bits) {
+    while (bits > 0) {
+        uint8_t room = 8 - (_bitLength & 7);
+        uint8_t take = min(bits, room);
+        uint8_t chunk = (value >> (bits - take)) & ((1 << take) - 1);
+        _buffer[TELEMETRY_BATCH_HEADER_SIZE + (_bitLength >> 3)] |= chunk << (room - take);
+        _bitLength += take;
+        bits -= take;
+    }
+}
+
+void TelemetryBatch::writeDelta(int32_t delta, const uint8_t* widths) {
+    if (delta == 0) {
+        writeBits(0, 1);
+        return;
+    }
+    uint32_t encoded = zigzag(delta);
+    uint8_t bucket = 0;
+    while (bucket < 3 && encoded >= (1UL << widths[bucket])) {
+        bucket++;
+    }
+    // 10, 110, 1110, 1111
+    if (bucket < 3) {
+        writeBits((1 << (bucket + 2)) - 2, bucket + 2);
+    } else {
+        writeBits(0xF, 4);
+    }
+    writeBits(encoded, widths[bucket]);
+}
+
+#if !defined(ARDUINO)
+
+TelemetryBatchDecoder::TelemetryBatchDecoder(const uint8_t* data, size_t length) {
+    _data = data;
+    _length = length;
+    _valid = length >= TELEMETRY_BATCH_HEADER_SIZE && data[0] == TELEMETRY_BATCH_VERSION && data[2] <= TELEMETRY_BATCH_MAX_FIELDS;
+    _bitPosition = 0;
+    _decoded = 0;
+    _lastTimestamp = 0;
+    _lastInterval = 0;
+    memset(_lastValues, 0, sizeof(_lastValues));
+}
+
+bool TelemetryBatchDecoder::readBits(uint8_t bits, uint32_t& value) {
+    if (TELEMETRY_BATCH_HEADER_SIZE + (_bitPosition + bits + 7) / 8 > _length) {
+        return false;
+    }
+    value = 0;
+    for (uint8_t i = 0; i < bits; i++, _bitPosition++) {
+        uint8_t byte = _data[TELEMETRY_BATCH_HEADER_SIZE + (_bitPosition >> 3)];
+        value = (value << 1) | ((byte >> (7 - (_bitPosition & 7))) & 1);
+    }
+    return true;
+}
+
+bool TelemetryBatchDecoder::readDelta(const uint8_t* widths, int32_t& delta) {
+    uint8_t ones = 0;
+    uint32_t bit = 1;
+    while (ones < 4) {
+        if (!readBits(1, bit)) return false;
+        if (!bit) break;
+        ones++;
+    }
+    if (ones == 0) {
+        delta = 0;
+        return true;
+    }
+    uint32_t encoded;
+    if (!readBits(widths[ones - 1], encoded)) return false;
+    delta = unzigzag(encoded);
+    return true;
+}
+
+bool TelemetryBatchDecoder::next(uint32_t& timestamp, int32_t* values) {
+    if (!_valid || _decoded >= count()) {
+        return false;
+    }
+
+    if (_decoded == 0) {
+        _lastTimestamp = _data[6] | _data[7] << 8 | _data[8] << 16 | (uint32_t)_data[9] << 24;
+    } else {
+        int32_t delta;
+        if (!readDelta(TIMESTAMP_WIDTHS, delta)) return false;
+        _lastInterval = (int32_t)((uint32_t)_lastInterval + delta);
+        _lastTimestamp += _lastInterval;
+    }
+    timestamp = _lastTimestamp;
+
+    for (uint8_t i = 0; i < fieldCount(); i++) {
+        int32_t delta;
+        if (!readDelta(VALUE_WIDTHS, delta)) return false;
+        _lastValues[i] = (int32_t)((uint32_t)_lastValues[i] + delta);
+        values[i] = _lastValues[i];
+    }
+    _decoded++;
+    return true;
+}
+
+#endif // !ARDUINO
@@ -0,0 +1,108 @@
+#ifndef TELEMETRY_BATCH_H
+#define TELEMETRY_BATCH_H
+
+#include "Platform.h"
+
+// Many timestamped samples of one channel packed into one frame, so a
+// 100 Hz source does not cost one MQTT publish per sample. The frame is a
+// 10-byte little-endian header followed by an MSB-first bit stream:
+//
+//   offset  type    field
+//   0       uint8   version      TELEMETRY_BATCH_VERSION
+//   1       uint8   channel      TelemetryBatchChannel
+//   2       uint8   fields       values per sample
+//   3       uint8   count        samples in the frame
+//   4       uint16  sequence     per channel, wraps
+//   6       uint32  timestamp    of the first sample, us
+//
+// Timestamps after the first are stored as the change of the sample
+// interval (delta of delta), each value as the change from the same field
+// of the previous sample (the first sample against 0). Both are zigzag
+// encoded behind a Gorilla-style prefix:
+//
+//   0       unchanged
+//   10      small    (7 bits for timestamps, 6 for values)
+//   110     medium   (12 / 10 bits)
+//   1110    large    (20 / 16 bits)
+//   1111    full 32 bits
+//
+// A steady 100 Hz clock costs one bit per sample, a slowly moving value a
+// few bits instead of 32.
+
+#define TELEMETRY_BATCH_VERSION 1
+#define TELEMETRY_BATCH_HEADER_SIZE 10
+#define TELEMETRY_BATCH_SIZE 384  // Frame bytes, header included
+#define TELEMETRY_BATCH_MAX_FIELDS 10
+#define TELEMETRY_BATCH_MAX_COUNT 255
+
+enum TelemetryBatchChannel : uint8_t {
+    TELEMETRY_BATCH_IMU = 1,     // Raw DMP packet: quaternion w, x, y, z, accel x, y, z, gyro x, y, z
+    TELEMETRY_BATCH_SONARS = 2   // cm: right, left
+};
+
+class TelemetryBatch {
+public:
+    TelemetryBatch(TelemetryBatchChannel channel, uint8_t fieldCount);
+
+    // Starts a new frame; the sequence number advances with every frame
+    void clear();
+    // Returns false when the frame has no room left. Once add() leaves
+    // less than a worst-case sample of room, full() is true and the frame
+    // should be published.
+    bool add(uint32_t timestamp, const int32_t* values);
+    bool full() const;
+    bool empty() const { return _count == 0; }
+    uint8_t count() const { return _count; }
+
+    const uint8_t* data() const { return _buffer; }
+    size_t length() const { return TELEMETRY_BATCH_HEADER_SIZE + (_bitLength + 7) / 8; }
+
+private:
+    void writeBits(uint32_t value, uint8_t bits);
+    void writeDelta(int32_t delta, const uint8_t* widths);
+
+    uint8_t _buffer[TELEMETRY_BATCH_SIZE];
+    uint32_t _bitLength;  // Of the stream after the header
+    TelemetryBatchChannel _channel;
+    uint8_t _fieldCount;
+    uint8_t _count;
+    uint16_t _sequence;
+    uint32_t _lastTimestamp;
+    int32_t _lastInterval;
+    int32_t _lastValues[TELEMETRY_BATCH_MAX_FIELDS];
+};
+
+#if !defined(ARDUINO)
+
+// Host-side reader of TelemetryBatch frames, for tools and checks that run
+// in the native environment
+class TelemetryBatchDecoder {
+public:
+    TelemetryBatchDecoder(const uint8_t* data, size_t length);
+
+    bool valid() const { return _valid; }
+    TelemetryBatchChannel channel() const { return (TelemetryBatchChannel)_data[1]; }
+    uint8_t fieldCount() const { return _data[2]; }
+    uint8_t count() const { return _data[3]; }
+    uint16_t sequence() const { return _data[4] | _data[5] << 8; }
+
+    // Next sample in order; false after the last one or on a truncated frame
+    bool next(uint32_t& timestamp, int32_t* values);
+
+private:
+    bool readBits(uint8_t bits, uint32_t& value);
+    bool readDelta(const uint8_t* widths, int32_t& delta);
+
+    const uint8_t* _data;
+    size_t _length;
+    bool _valid;
+    uint32_t _bitPosition;
+    uint8_t _decoded;
+    uint32_t _lastTimestamp;
+    int32_t _lastInterval;
+    int32_t _lastValues[TELEMETRY_BATCH_MAX_FIELDS];
+};
+
+#endif // !ARDUINO
+
+#endif // TELEMETRY_BATCH_H
@@ -0,0 +1,33 @@
+#include "TelemetryFrame.h"
+
+TelemetryFrame::TelemetryFrame(TelemetrySchema schema, uint16_t sequence, uint32_t timestamp) {
+    _length = 0;
+    _overflow = false;
+    putU8(TELEMETRY_FRAME_VERSION);
+    putU8(schema);
+    putU16(sequence);
+    putU32(timestamp);
+}
+
+void TelemetryFrame::putU8(uint8_t value) {
+    if (_length >= TELEMETRY_FRAME_MAX_SIZE) {
+        _overflow = true;
+        return;
+    }
+    _data[_length++] = value;
+}
+
+void TelemetryFrame::putU16(uint16_t value) {
+    putU8(value & 0xFF);
+    putU8(value >> 8);
+}
+
+void TelemetryFrame::putQ16(q16_16 value, int32_t scale) {
+    int64_t scaled = ((int64_t)value * scale + Q16_ONE / 2) >> Q16_SHIFT;
+    putI16((int16_t)constrain(scaled, (int64_t)INT16_MIN, (int64_t)INT16_MAX));
+}
+
+void TelemetryFrame::putU32(uint32_t value) {
+    putU16(value & 0xFFFF);
+    putU16(value >> 16);
+}
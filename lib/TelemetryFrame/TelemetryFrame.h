@@ -0,0 +1,51 @@
+#ifndef TELEMETRY_FRAME_H
+#define TELEMETRY_FRAME_H
+
+#include "Platform.h"
+#include "FixedPoint.h"
+
+// Fixed-layout little-endian binary telemetry, published on sensors/bin and
+// control/bin. Every frame starts with the same 8-byte header:
+//
+//   offset  type    field
+//   0       uint8   version      TELEMETRY_FRAME_VERSION
+//   1       uint8   schema       TelemetrySchema
+//   2       uint16  sequence     per schema, wraps
+//   4       uint32  timestamp    device millis()
+//
+// The payload layout of each schema is documented in docs/README_EN.md.
+// Fields are only ever appended within a version; a layout change bumps it.
+
+#define TELEMETRY_FRAME_VERSION 1
+#define TELEMETRY_FRAME_HEADER_SIZE 8
+#define TELEMETRY_FRAME_MAX_SIZE 64
+
+enum TelemetrySchema : uint8_t {
+    TELEMETRY_SCHEMA_SENSORS = 1,
+    TELEMETRY_SCHEMA_CONTROL = 2
+};
+
+class TelemetryFrame {
+public:
+    TelemetryFrame(TelemetrySchema schema, uint16_t sequence, uint32_t timestamp);
+
+    void putU8(uint8_t value);
+    void putI8(int8_t value) { putU8((uint8_t)value); }
+    void putU16(uint16_t value);
+    void putI16(int16_t value) { putU16((uint16_t)value); }
+    void putU32(uint32_t value);
+    void putI32(int32_t value) { putU32((uint32_t)value); }
+    // Q16.16 as a rounded int16 of value * scale, saturated
+    void putQ16(q16_16 value, int32_t scale);
+
+    const uint8_t* data() const { return _data; }
+    size_t length() const { return _length; }
+    bool ok() const { return !_overflow; }
+
+private:
+    uint8_t _data[TELEMETRY_FRAME_MAX_SIZE];
+    size_t _length;
+    bool _overflow;
+};
+
+#endif // TELEMETRY_FRAME_H
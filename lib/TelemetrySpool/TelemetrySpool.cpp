@@ -0,0 +1,224 @@
+#include "TelemetrySpool.h"
+
+#define SPOOL_PATH_LENGTH 20
+
+static void writeU16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void writeU32(uint8_t* p, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint16_t readU16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static uint32_t readU32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+TelemetrySpool::TelemetrySpool(hal::FileSystem& fileSystem) {
+    _fileSystem = &fileSystem;
+    memset(&_stats, 0, sizeof(_stats));
+    memset(_pages, 0, sizeof(_pages));
+    _writeSegment = 0;
+    _readSegment = 0;
+    _readPage = 0;
+    _sequence = 1;
+    _peekedRam = false;
+    _length = SPOOL_PAGE_HEADER_SIZE;
+    _count = 0;
+}
+
+void TelemetrySpool::path(char* buffer, size_t size, uint8_t segment) const {
+    snprintf(buffer, size, "/spool-%02u.bin", segment);
+}
+
+void TelemetrySpool::begin() {
+    uint32_t oldest = 0;
+    uint32_t newest = 0;
+    bool found = false;
+
+    for (uint8_t segment = 0; segment < SPOOL_SEGMENTS; segment++) {
+        char file[SPOOL_PATH_LENGTH];
+        path(file, sizeof(file), segment);
+        _pages[segment] = min(_fileSystem->size(file) / SPOOL_PAGE_SIZE, (size_t)SPOOL_SEGMENT_PAGES);
+        if (_pages[segment] == 0) {
+            continue;
+        }
+
+        uint8_t header[SPOOL_PAGE_HEADER_SIZE];
+        if (_fileSystem->read(file, 0, header, sizeof(header)) != sizeof(header) || header[0] != SPOOL_VERSION) {
+            LOG_W("Spool segment %s unreadable, removed\n", file);
+            removeSegment(segment);
+            continue;
+        }
+
+        // Sequence order, not slot order, tells which segment is the oldest
+        uint32_t first = readU32(header + 4);
+        if (!found || (int32_t)(first - oldest) < 0) {
+            oldest = first;
+            _readSegment = segment;
+        }
+        if (!found || (int32_t)(first - newest) > 0) {
+            newest = first;
+            _writeSegment = segment;
+        }
+        found = true;
+    }
+
+    _readPage = 0;
+    if (found) {
+        _sequence = newest + _pages[_writeSegment];
+        LOG_I("Spool: %u pages left from the previous run\n", (unsigned)getStoredPages());
+    }
+}
+
+bool TelemetrySpool::append(const uint8_t* record, size_t length) {
+    if (length == 0 || length > SPOOL_PAGE_SIZE - SPOOL_PAGE_HEADER_SIZE - 1) {
+        _stats.dropped++;
+        return false;
+    }
+    if (_length + 1 + length > SPOOL_PAGE_SIZE) {
+        flush();
+    }
+
+    _page[_length++] = length;
+    memcpy(_page + _length, record, length);
+    _length += length;
+    _count++;
+    _stats.records++;
+    return true;
+}
+
+void TelemetrySpool::sealPage(uint8_t* page) const {
+    page[0] = SPOOL_VERSION;
+    page[1] = _count;
+    writeU16(page + 2, _length);
+    writeU32(page + 4, _sequence);
+}
+
+// Pages are written at full size, so page n of a segment is at n * SPOOL_PAGE_SIZE
+bool TelemetrySpool::flush() {
+    if (_count == 0) {
+        return true;
+    }
+
+    if (_pages[_writeSegment] >= SPOOL_SEGMENT_PAGES) {
+        uint8_t next = (_writeSegment + 1) % SPOOL_SEGMENTS;
+        if (_pages[next] > 0) {
+            dropSegment(next);
+        }
+        _writeSegment = next;
+    }
+
+    sealPage(_page);
+    memset(_page + _length, 0, SPOOL_PAGE_SIZE - _length);
+    char file[SPOOL_PATH_LENGTH];
+    path(file, sizeof(file), _writeSegment);
+    bool written = _fileSystem->append(file, _page, SPOOL_PAGE_SIZE);
+    if (written) {
+        _pages[_writeSegment]++;
+    } else {
+        LOG_W("Spool write to %s failed, %u records lost\n", file, _count);
+        _stats.writeErrors++;
+        _stats.dropped += _count;
+    }
+
+    _sequence++;
+    _length = SPOOL_PAGE_HEADER_SIZE;
+    _count = 0;
+    return written;
+}
+
+// The ring is full: the oldest segment makes room, counting the records
+// in its undelivered pages as dropped
+void TelemetrySpool::dropSegment(uint8_t segment) {
+    char file[SPOOL_PATH_LENGTH];
+    path(file, sizeof(file), segment);
+    uint8_t first = segment == _readSegment ? _readPage : 0;
+    for (uint8_t page = first; page < _pages[segment]; page++) {
+        uint8_t header[SPOOL_PAGE_HEADER_SIZE];
+        if (_fileSystem->read(file, page * SPOOL_PAGE_SIZE, header, sizeof(header)) == sizeof(header)) {
+            _stats.dropped += header[1];
+        }
+    }
+    LOG_W("Spool full, oldest segment dropped\n");
+
+    removeSegment(segment);
+    if (segment == _readSegment) {
+        _readSegment = (segment + 1) % SPOOL_SEGMENTS;
+        _readPage = 0;
+    }
+}
+
+void TelemetrySpool::removeSegment(uint8_t segment) {
+    char file[SPOOL_PATH_LENGTH];
+    path(file, sizeof(file), segment);
+    _fileSystem->remove(file);
+    _pages[segment] = 0;
+}
+
+bool TelemetrySpool::peek(uint8_t* page, size_t& length) {
+    _peekedRam = false;
+    while (_readPage < _pages[_readSegment] || _readSegment != _writeSegment) {
+        if (_readPage >= _pages[_readSegment]) {
+            if (_pages[_readSegment] > 0) removeSegment(_readSegment);
+            _readSegment = (_readSegment + 1) % SPOOL_SEGMENTS;
+            _readPage = 0;
+            continue;
+        }
+
+        char file[SPOOL_PATH_LENGTH];
+        path(file, sizeof(file), _readSegment);
+        if (_fileSystem->read(file, _readPage * SPOOL_PAGE_SIZE, page, SPOOL_PAGE_SIZE) == SPOOL_PAGE_SIZE) {
+            length = readU16(page + 2);
+            if (page[0] == SPOOL_VERSION && length >= SPOOL_PAGE_HEADER_SIZE && length <= SPOOL_PAGE_SIZE) {
+                return true;
+            }
+        }
+        LOG_W("Spool page %u of %s unreadable, skipped\n", _readPage, file);
+        _readPage++;
+    }
+
+    // Flash has caught up, the page still filling in RAM goes out directly
+    if (_count == 0) {
+        return false;
+    }
+    sealPage(_page);
+    memcpy(page, _page, _length);
+    length = _length;
+    _peekedRam = true;
+    return true;
+}
+
+void TelemetrySpool::release() {
+    _stats.backfilled++;
+    if (_peekedRam) {
+        _peekedRam = false;
+        _sequence++;
+        _length = SPOOL_PAGE_HEADER_SIZE;
+        _count = 0;
+        return;
+    }
+
+    // A delivered segment is deleted right away, so a reboot does not
+    // replay it again
+    if (++_readPage >= _pages[_readSegment]) {
+        bool caughtUp = _readSegment == _writeSegment;
+        removeSegment(_readSegment);
+        _readPage = 0;
+        if (!caughtUp) {
+            _readSegment = (_readSegment + 1) % SPOOL_SEGMENTS;
+        }
+    }
+}
+
+uint32_t TelemetrySpool::getStoredPages() const {
+    uint32_t pages = 0;
+    for (uint8_t segment = 0; segment < SPOOL_SEGMENTS; segment++) {
+        pages += _pages[segment];
+    }
+    return pages - _readPage;
+}
+
+void TelemetrySpool::resetStats() {
+    memset(&_stats, 0, sizeof(_stats));
+}
@@ -0,0 +1,76 @@
+#ifndef TELEMETRY_SPOOL_H
+#define TELEMETRY_SPOOL_H
+
+#include "config.h"
+#include "Hal.h"
+
+// Store-and-forward of telemetry frames taken while the broker is out of
+// reach. Records are collected in a RAM page and written one page at a
+// time, so the flash sees a 256-byte append every few seconds instead of
+// one write per sample. Pages are appended to SPOOL_SEGMENTS segment files
+// used as a ring; when the ring is full the oldest segment is dropped.
+// Replay reads pages oldest first and deletes a segment once all of it was
+// delivered. Segments left by a previous run are picked up by begin().
+//
+// Page layout, little-endian:
+//
+//   offset  type    field
+//   0       uint8   version      SPOOL_VERSION
+//   1       uint8   count        records in the page
+//   2       uint16  length       bytes used, header included
+//   4       uint32  sequence     increases by one per page, gaps are lost pages
+//   8       ...     records: uint8 length, then a TelemetryFrame
+
+#define SPOOL_VERSION 1
+#define SPOOL_PAGE_SIZE 256
+#define SPOOL_PAGE_HEADER_SIZE 8
+
+struct SpoolStats {
+    uint32_t records;      // Appended
+    uint32_t dropped;      // Records lost to a full ring or a failed write
+    uint32_t backfilled;   // Pages delivered through release()
+    uint32_t writeErrors;
+};
+
+class TelemetrySpool {
+public:
+    explicit TelemetrySpool(hal::FileSystem& fileSystem);
+
+    // Recovers the segments of a previous run
+    void begin();
+    // Buffers a record; a full page is written to flash first
+    bool append(const uint8_t* record, size_t length);
+    // Copies the oldest undelivered page, false when there is none. The
+    // page stays in the spool until release().
+    bool peek(uint8_t* page, size_t& length);
+    void release();
+
+    bool empty() const { return getStoredPages() == 0 && _count == 0; }
+    // Pages on flash that were not delivered yet
+    uint32_t getStoredPages() const;
+    uint32_t getCapacityPages() const { return SPOOL_SEGMENTS * SPOOL_SEGMENT_PAGES; }
+    const SpoolStats& getStats() const { return _stats; }
+    void resetStats();
+
+private:
+    void path(char* buffer, size_t size, uint8_t segment) const;
+    bool flush();
+    void dropSegment(uint8_t segment);
+    void removeSegment(uint8_t segment);
+    void sealPage(uint8_t* page) const;
+
+    hal::FileSystem* _fileSystem;
+    SpoolStats _stats;
+    uint8_t _pages[SPOOL_SEGMENTS];  // Pages in each segment file
+    uint8_t _writeSegment;
+    uint8_t _readSegment;
+    uint8_t _readPage;
+    uint32_t _sequence;  // Of the page in RAM
+    bool _peekedRam;
+
+    uint8_t _page[SPOOL_PAGE_SIZE];
+    uint16_t _length;
+    uint8_t _count;
+};
+
+#endif // TELEMETRY_SPOOL_H
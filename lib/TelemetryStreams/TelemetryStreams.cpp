@@ -0,0 +1,296 @@
+#include "TelemetryStreams.h"
+#include "Communication.h"
+#include "JsonWriter.h"
+#include "TelemetryBatch.h"
+
+namespace TelemetryStreams {
+
+struct StreamField {
+    const char* name;
+    uint8_t decimals;  // Sampled values are value * 10^decimals
+};
+
+struct StreamChannel {
+    const char* name;
+    const char* topic;
+    uint8_t fieldCount;
+    StreamField fields[TELEMETRY_STREAM_MAX_FIELDS];
+    void (*sample)(int32_t* values);
+};
+
+struct StreamState {
+    uint32_t period;  // ms, 0 when nobody subscribed
+    uint32_t release;
+    int32_t deadband[TELEMETRY_STREAM_MAX_FIELDS];  // Same scale as the values, -1 disables
+    int32_t last[TELEMETRY_STREAM_MAX_FIELDS];
+    bool published;
+};
+
+static MotorController* _motorController;
+static SensorManager* _sensorManager;
+static Steering* _steering;
+
+// Q16.16 sensor values are rounded to the decimals they are published with
+static int32_t scaled(q16_16 value, int32_t scale) {
+    return (int32_t)(((int64_t)value * scale + Q16_ONE / 2) >> Q16_SHIFT);
+}
+
+static const StreamChannel CHANNELS[] = {
+    {"sonars", "telemetry/sonars", 2, {{"right", 0}, {"left", 0}}, [] (int32_t* values) {
+        values[0] = _sensorManager->getSonarRight();
+        values[1] = _sensorManager->getSonarLeft();
+    }},
+    {"accel", "telemetry/accel", 3, {{"x", 4}, {"y", 4}, {"z", 4}}, [] (int32_t* values) {
+        values[0] = scaled(_sensorManager->getAccelX(), 10000);
+        values[1] = scaled(_sensorManager->getAccelY(), 10000);
+        values[2] = scaled(_sensorManager->getAccelZ(), 10000);
+    }},
+    {"gyro", "telemetry/gyro", 3, {{"x", 2}, {"y", 2}, {"z", 2}}, [] (int32_t* values) {
+        values[0] = scaled(_sensorManager->getGyroX(), 100);
+        values[1] = scaled(_sensorManager->getGyroY(), 100);
+        values[2] = scaled(_sensorManager->getGyroZ(), 100);
+    }},
+    {"angles", "telemetry/angles", 3, {{"yaw", 2}, {"pitch", 2}, {"roll", 2}}, [] (int32_t* values) {
+        values[0] = scaled(_sensorManager->getYaw(), 100);
+        values[1] = scaled(_sensorManager->getPitch(), 100);
+        values[2] = scaled(_sensorManager->getRoll(), 100);
+    }},
+    {"power", "telemetry/power", 4, {{"voltage", 3}, {"current", 6}, {"power", 6}, {"energy", 6}}, [] (int32_t* values) {
+        values[0] = _sensorManager->getVoltage();
+        values[1] = _sensorManager->getCurrent();
+        values[2] = _sensorManager->getPower();
+        values[3] = _sensorManager->getEnergy();
+    }},
+    {"engines", "telemetry/engines", 4, {{"left", 0}, {"right", 0}, {"left-acceleration", 0}, {"right-acceleration", 0}}, [] (int32_t* values) {
+        values[0] = _motorController->getCurrentLeftSpeed();
+        values[1] = _motorController->getCurrentRightSpeed();
+        values[2] = _motorController->getLeftAcceleration();
+        values[3] = _motorController->getRightAcceleration();
+    }},
+    {"steering", "telemetry/steering", 2, {{"direction", 0}, {"acceleration", 0}}, [] (int32_t* values) {
+        values[0] = _steering->getAngle();
+        values[1] = _steering->getAcceleration();
+    }},
+};
+
+#define CHANNEL_COUNT (sizeof(CHANNELS) / sizeof(CHANNELS[0]))
+
+static const int32_t POWERS_OF_TEN[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+// Scaled deadbands are clamped below INT32_MAX before the conversion; no
+// field moves that far anyway
+static const float MAX_DEADBAND = 2e9f;
+static const float MAX_RATE = 1000.0f / TELEMETRY_STREAM_INTERVAL;
+
+static StreamState _states[CHANNEL_COUNT];
+static uint8_t _activeCount = 0;
+
+struct BatchState {
+    const char* name;
+    const char* topic;
+    TelemetryBatch batch;
+    uint32_t (*counter)();             // Samples the source has produced so far
+    void (*collect)(BatchState& state);  // Adds the samples produced since the last call
+    uint32_t maxAge;    // ms, 0 when not batching
+    uint32_t started;   // millis() when the frame got its first sample
+    uint32_t consumed;  // counter() value already batched
+};
+
+static void flush(BatchState& state) {
+    if (state.batch.empty()) {
+        return;
+    }
+    Communication::publish(state.topic, state.batch.data(), state.batch.length());
+    state.batch.clear();
+}
+
+static void append(BatchState& state, uint32_t timestamp, const int32_t* values) {
+    if (!state.batch.add(timestamp, values)) {
+        flush(state);
+        state.batch.add(timestamp, values);
+    }
+    if (state.batch.count() == 1) {
+        state.started = hal::clock().millis();
+    }
+    if (state.batch.full()) {
+        flush(state);
+    }
+}
+
+static void collectImu(BatchState& state) {
+    const ImuHistory& history = _sensorManager->getImuHistory();
+    uint32_t written = history.getWrittenCount();
+    // Packets the ring already overwrote are lost; the timestamps show the gap
+    uint8_t pending = min(written - state.consumed, (uint32_t)history.size());
+    state.consumed = written;
+
+    for (uint8_t age = pending; age-- > 0;) {
+        const ImuSample& sample = history.at(age);
+        int32_t values[10];
+        for (uint8_t i = 0; i < 4; i++) values[i] = sample.raw.quaternion[i];
+        for (uint8_t i = 0; i < 3; i++) values[4 + i] = sample.raw.accel[i];
+        for (uint8_t i = 0; i < 3; i++) values[7 + i] = sample.raw.gyro[i];
+        append(state, sample.timestamp, values);
+    }
+}
+
+static void collectSonars(BatchState& state) {
+    uint32_t readings = _sensorManager->getSonarReadingCount();
+    if (readings == state.consumed) {
+        return;
+    }
+    state.consumed = readings;
+    int32_t values[2] = {(int32_t)_sensorManager->getSonarRight(), (int32_t)_sensorManager->getSonarLeft()};
+    append(state, _sensorManager->getSonarReadingTime(), values);
+}
+
+static BatchState _batches[] = {
+    {"imu", "telemetry/batch/imu", TelemetryBatch(TELEMETRY_BATCH_IMU, 10), [] { return _sensorManager->getImuSampleCount(); }, collectImu, 0, 0, 0},
+    {"sonars", "telemetry/batch/sonars", TelemetryBatch(TELEMETRY_BATCH_SONARS, 2), [] { return _sensorManager->getSonarReadingCount(); }, collectSonars, 0, 0, 0},
+};
+
+#define BATCH_COUNT (sizeof(_batches) / sizeof(_batches[0]))
+
+static uint8_t _batchCount = 0;
+
+void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering) {
+    _motorController = motorController;
+    _sensorManager = sensorManager;
+    _steering = steering;
+    unsubscribeAll();
+}
+
+TelemetryStreamResult subscribe(const char* channel, float rate, float deadband) {
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+        if (strcmp(CHANNELS[i].name, channel) != 0) {
+            continue;
+        }
+        // Written so that NaN fails every check
+        if (!(rate == 0 || (rate >= TELEMETRY_STREAM_MIN_RATE && rate <= MAX_RATE))) {
+            return STREAM_INVALID_RATE;
+        }
+        if (deadband != deadband) {
+            return STREAM_INVALID_DEADBAND;
+        }
+
+        StreamState& state = _states[i];
+        bool wasActive = state.period > 0;
+        state.period = rate > 0 ? max((uint32_t)(1000 / rate), (uint32_t)TELEMETRY_STREAM_INTERVAL) : 0;
+        state.release = hal::clock().millis();
+        state.published = false;
+        for (uint8_t field = 0; field < CHANNELS[i].fieldCount; field++) {
+            float scaledDeadband = min(deadband * POWERS_OF_TEN[CHANNELS[i].fields[field].decimals] + 0.5f, MAX_DEADBAND);
+            state.deadband[field] = deadband < 0 ? -1 : (int32_t)scaledDeadband;
+        }
+        _activeCount += (state.period > 0) - wasActive;
+        return STREAM_OK;
+    }
+    return STREAM_UNKNOWN_CHANNEL;
+}
+
+void unsubscribeAll() {
+    memset(_states, 0, sizeof(_states));
+    _activeCount = 0;
+    for (uint8_t i = 0; i < BATCH_COUNT; i++) {
+        _batches[i].maxAge = 0;
+    }
+    _batchCount = 0;
+}
+
+TelemetryStreamResult setBatch(const char* channel, uint32_t maxAge) {
+    for (uint8_t i = 0; i < BATCH_COUNT; i++) {
+        BatchState& state = _batches[i];
+        if (strcmp(state.name, channel) != 0) {
+            continue;
+        }
+        _batchCount += (maxAge > 0) - (state.maxAge > 0);
+        state.maxAge = maxAge;
+        // Only samples from now on
+        state.batch.clear();
+        state.consumed = state.counter();
+        return STREAM_OK;
+    }
+    return STREAM_UNKNOWN_CHANNEL;
+}
+
+static bool withinDeadband(const StreamChannel& channel, const StreamState& state, const int32_t* values) {
+    if (!state.published) {
+        return false;
+    }
+    for (uint8_t field = 0; field < channel.fieldCount; field++) {
+        if (state.deadband[field] < 0 || abs(values[field] - state.last[field]) > state.deadband[field]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void publish(const StreamChannel& channel, const int32_t* values, uint32_t now) {
+    char output[MQTT_PACKET_SIZE / 4];
+    JsonWriter json(output, sizeof(output));
+    json.beginObject();
+    json.field("time", now);
+    for (uint8_t field = 0; field < channel.fieldCount; field++) {
+        json.fieldScaled(channel.fields[field].name, values[field], channel.fields[field].decimals);
+    }
+    json.endObject();
+    if (!json.ok()) {
+        LOG_W("Stream %s does not fit in %d bytes\n", channel.name, (int)sizeof(output));
+        return;
+    }
+    Communication::publish(channel.topic, json.c_str());
+}
+
+static void updateBatches(uint32_t now) {
+    for (uint8_t i = 0; i < BATCH_COUNT; i++) {
+        BatchState& state = _batches[i];
+        if (state.maxAge == 0) {
+            continue;
+        }
+        state.collect(state);
+        if (!state.batch.empty() && now - state.started >= state.maxAge) {
+            flush(state);
+        }
+    }
+}
+
+void update() {
+    if ((_activeCount == 0 && _batchCount == 0) || !Communication::isConnected()) {
+        return;
+    }
+
+    uint32_t now = hal::clock().millis();
+    for (uint8_t i = 0; i < CHANNEL_COUNT; i++) {
+        StreamState& state = _states[i];
+        if (state.period == 0 || (int32_t)(now - state.release) < 0) {
+            continue;
+        }
+        state.release += state.period;
+        if ((int32_t)(now - state.release) >= 0) {
+            state.release = now + state.period;
+        }
+
+        const StreamChannel& channel = CHANNELS[i];
+        int32_t values[TELEMETRY_STREAM_MAX_FIELDS];
+        channel.sample(values);
+        if (withinDeadband(channel, state, values)) {
+            continue;
+        }
+        memcpy(state.last, values, sizeof(values));
+        state.published = true;
+        publish(channel, values, now);
+    }
+
+    if (_batchCount > 0) {
+        updateBatches(now);
+    }
+}
+
+uint8_t getActiveCount() {
+    return _activeCount;
+}
+
+uint8_t getBatchCount() {
+    return _batchCount;
+}
+
+} // namespace TelemetryStreams
@@ -0,0 +1,44 @@
+#ifndef TELEMETRY_STREAMS_H
+#define TELEMETRY_STREAMS_H
+
+#include "config.h"
+#include "MotorController.h"
+#include "SensorManager.h"
+#include "Steering.h"
+
+// Per-channel telemetry requested over telemetry/subscribe. Each channel
+// has its own rate and an optional deadband and is published on
+// telemetry/<channel>. A channel nobody subscribed to is never sampled.
+//
+// High-rate sources (every DMP packet, every sonar ping) can instead be
+// batched over telemetry/batch: samples are packed into TelemetryBatch
+// frames and published on telemetry/batch/<channel> when a frame is full
+// or its first sample is max-age ms old.
+
+#define TELEMETRY_STREAM_MAX_FIELDS 4
+
+enum TelemetryStreamResult : uint8_t {
+    STREAM_OK,
+    STREAM_UNKNOWN_CHANNEL,
+    STREAM_INVALID_RATE,
+    STREAM_INVALID_DEADBAND
+};
+
+namespace TelemetryStreams {
+
+void setup(MotorController* motorController, SensorManager* sensorManager, Steering* steering);
+// rate in Hz, 0 stops the channel, otherwise TELEMETRY_STREAM_MIN_RATE up to
+// the stream task rate. A negative deadband disables suppression, otherwise
+// a sample is dropped while every field stays within deadband (in the
+// published units) of the last published one.
+TelemetryStreamResult subscribe(const char* channel, float rate, float deadband);
+void unsubscribeAll();
+// maxAge in ms, 0 stops batching the channel
+TelemetryStreamResult setBatch(const char* channel, uint32_t maxAge);
+void update();
+uint8_t getActiveCount();
+uint8_t getBatchCount();
+
+} // namespace TelemetryStreams
+
+#endif // TELEMETRY_STREAMS_H
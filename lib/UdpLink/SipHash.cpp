@@ -0,0 +1,52 @@
+#include "SipHash.h"
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static uint64_t readLittleEndian64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int8_t i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);
+}
+
+uint64_t sipHash24(const uint8_t key[SIP_HASH_KEY_SIZE], const uint8_t* data, size_t length) {
+    uint64_t k0 = readLittleEndian64(key);
+    uint64_t k1 = readLittleEndian64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t full = length & ~(size_t)7;
+    for (size_t offset = 0; offset < full; offset += 8) {
+        uint64_t m = readLittleEndian64(data + offset);
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    // Last block: remaining bytes, length in the top byte
+    uint64_t b = (uint64_t)length << 56;
+    for (size_t i = 0; i < (length & 7); i++) {
+        b |= (uint64_t)data[full + i] << (8 * i);
+    }
+    v3 ^= b;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    for (uint8_t i = 0; i < 4; i++) {
+        sipRound(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
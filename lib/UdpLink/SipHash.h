@@ -0,0 +1,12 @@
+#ifndef SIP_HASH_H
+#define SIP_HASH_H
+
+#include "Platform.h"
+
+#define SIP_HASH_KEY_SIZE 16
+
+// SipHash-2-4 (Aumasson, Bernstein), a keyed 64-bit MAC built for short
+// messages. Small and fast enough for every datagram on the ESP8266.
+uint64_t sipHash24(const uint8_t key[SIP_HASH_KEY_SIZE], const uint8_t* data, size_t length);
+
+#endif // SIP_HASH_H
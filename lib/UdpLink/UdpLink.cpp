@@ -0,0 +1,273 @@
+#include "UdpLink.h"
+#include "Communication.h"
+
+namespace UdpLink {
+
+static hal::DatagramSocket* _socket = nullptr;
+static uint8_t _key[SIP_HASH_KEY_SIZE];
+static UdpStats _stats;
+
+static bool _active = false;
+static bool _driving = false;
+static uint32_t _peerAddress;
+static uint16_t _peerPort;
+static uint8_t _sessionKey[SIP_HASH_KEY_SIZE];
+static uint32_t _lastHeard;
+static uint32_t _sequence = 0;
+// Highest controller sequence accepted since boot, kept across sessions
+static uint32_t _peerSequence = 0;
+
+// The last CHALLENGE sent, until its JOIN arrives or UDP_PEER_TIMEOUT passes
+static bool _challenged = false;
+static uint32_t _challengeAddress;
+static uint16_t _challengePort;
+static uint32_t _challengeTime;
+static uint8_t _challengeKey[SIP_HASH_KEY_SIZE];
+
+static uint16_t readU16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static uint32_t readU32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static void writeU32(uint8_t* p, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static int8_t hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool parseKey(const char* hex, uint8_t key[SIP_HASH_KEY_SIZE]) {
+    if (strlen(hex) != SIP_HASH_KEY_SIZE * 2) {
+        return false;
+    }
+    for (uint8_t i = 0; i < SIP_HASH_KEY_SIZE; i++) {
+        int8_t high = hexDigit(hex[2 * i]);
+        int8_t low = hexDigit(hex[2 * i + 1]);
+        if (high < 0 || low < 0) return false;
+        key[i] = high << 4 | low;
+    }
+    return true;
+}
+
+void setup(hal::DatagramSocket* socket, const uint8_t key[SIP_HASH_KEY_SIZE], uint16_t port) {
+    memcpy(_key, key, sizeof(_key));
+    memset(&_stats, 0, sizeof(_stats));
+    _socket = socket->begin(port) ? socket : nullptr;
+    if (!_socket) {
+        LOG_E("UDP port %u could not be opened\n", port);
+        return;
+    }
+    LOG_I("UDP link listening on port %u\n", port);
+}
+
+static void publishStatus() {
+    char output[64];
+    snprintf(output, sizeof(output), "{\"active\":%s,\"peer\":\"%u.%u.%u.%u:%u\"}", _active ? "true" : "false",
+             (unsigned)(_peerAddress & 0xFF), (unsigned)(_peerAddress >> 8 & 0xFF), (unsigned)(_peerAddress >> 16 & 0xFF),
+             (unsigned)(_peerAddress >> 24), (unsigned)_peerPort);
+    Communication::publish("udp/status", output);
+}
+
+// Constant time, so the MAC check does not leak how many bytes matched
+static bool macMatches(const uint8_t key[SIP_HASH_KEY_SIZE], const uint8_t* datagram, size_t length) {
+    uint64_t mac = sipHash24(key, datagram, length - UDP_MAC_SIZE);
+    uint8_t difference = 0;
+    for (uint8_t i = 0; i < UDP_MAC_SIZE; i++) {
+        difference |= datagram[length - UDP_MAC_SIZE + i] ^ (uint8_t)(mac >> (8 * i));
+    }
+    return difference == 0;
+}
+
+static void sessionKey(const uint8_t nonce[UDP_NONCE_SIZE], uint8_t key[SIP_HASH_KEY_SIZE]) {
+    uint8_t input[UDP_NONCE_SIZE + 1];
+    memcpy(input, nonce, UDP_NONCE_SIZE);
+    for (uint8_t half = 0; half < 2; half++) {
+        input[UDP_NONCE_SIZE] = half;
+        uint64_t hash = sipHash24(_key, input, sizeof(input));
+        for (uint8_t i = 0; i < 8; i++) key[8 * half + i] = (uint8_t)(hash >> (8 * i));
+    }
+}
+
+static bool transmit(uint32_t address, uint16_t port, const uint8_t key[SIP_HASH_KEY_SIZE], UdpMessageType type,
+                     const uint8_t* payload, size_t length) {
+    if (UDP_HEADER_SIZE + length + UDP_MAC_SIZE > UDP_MAX_DATAGRAM) {
+        return false;
+    }
+
+    uint8_t datagram[UDP_MAX_DATAGRAM];
+    datagram[0] = UDP_MAGIC;
+    datagram[1] = UDP_VERSION;
+    datagram[2] = type;
+    datagram[3] = UDP_FLAG_ROBOT;
+    writeU32(datagram + 4, ++_sequence);
+    writeU32(datagram + 8, hal::clock().millis());
+    memcpy(datagram + UDP_HEADER_SIZE, payload, length);
+    size_t total = UDP_HEADER_SIZE + length;
+    uint64_t mac = sipHash24(key, datagram, total);
+    for (uint8_t i = 0; i < UDP_MAC_SIZE; i++) {
+        datagram[total + i] = (uint8_t)(mac >> (8 * i));
+    }
+
+    if (!_socket->send(address, port, datagram, total + UDP_MAC_SIZE)) {
+        return false;
+    }
+    _stats.sent++;
+    return true;
+}
+
+// A new nonce per HELLO; only the latest challenge can be joined
+static void challenge(uint32_t address, uint16_t port) {
+    uint8_t payload[UDP_CHALLENGE_PAYLOAD_SIZE];
+    writeU32(payload, hal::random32());
+    writeU32(payload + 4, hal::random32());
+    writeU32(payload + UDP_NONCE_SIZE, _peerSequence + 1);
+    sessionKey(payload, _challengeKey);
+    _challenged = true;
+    _challengeAddress = address;
+    _challengePort = port;
+    _challengeTime = hal::clock().millis();
+    transmit(address, port, _key, UDP_CHALLENGE, payload, sizeof(payload));
+}
+
+static void handleDrive(const uint8_t* payload, size_t length) {
+    if (length < UDP_DRIVE_PAYLOAD_SIZE || ((payload[0] & DRIVE_KINEMATIC) && length < UDP_DRIVE_KINEMATIC_PAYLOAD_SIZE)) {
+        _stats.rejected++;
+        return;
+    }
+    DriveCommand drive;
+    drive.fields = payload[0];
+    int16_t* const values[] = {&drive.left, &drive.right, &drive.steering, &drive.leftAcceleration, &drive.rightAcceleration, &drive.steeringAcceleration,
+                               &drive.velocity, &drive.curvature};
+    uint8_t count = drive.fields & DRIVE_KINEMATIC ? 8 : 6;
+    drive.velocity = 0;
+    drive.curvature = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        *values[i] = (int16_t)readU16(payload + 2 + 2 * i);
+    }
+    if (!_driving) {
+        _driving = true;
+        Communication::setUdpControl(true);
+    }
+    Communication::applyDrive(drive);
+}
+
+// The MAC is checked with the key of the datagram's stage: shared for
+// HELLO, the challenge's for JOIN, the session's for everything else
+static void handleDatagram(const uint8_t* datagram, size_t length, uint32_t address, uint16_t port) {
+    if (length < UDP_HEADER_SIZE + UDP_MAC_SIZE || datagram[0] != UDP_MAGIC || datagram[1] != UDP_VERSION ||
+        (datagram[3] & UDP_FLAG_ROBOT)) {
+        _stats.rejected++;
+        return;
+    }
+    bool fromPeer = _active && address == _peerAddress && port == _peerPort;
+    if (_active && !fromPeer) {
+        LOG_D("UDP datagram from a second peer ignored\n");
+        _stats.rejected++;
+        return;
+    }
+
+    uint8_t type = datagram[2];
+    if (type == UDP_HELLO) {
+        if (!macMatches(_key, datagram, length)) {
+            _stats.rejected++;
+            return;
+        }
+        challenge(address, port);
+        return;
+    }
+
+    bool joining = type == UDP_JOIN;
+    if (joining) {
+        if (!_challenged || address != _challengeAddress || port != _challengePort ||
+            hal::clock().millis() - _challengeTime > UDP_PEER_TIMEOUT || !macMatches(_challengeKey, datagram, length)) {
+            _stats.rejected++;
+            return;
+        }
+    } else if (!fromPeer || !macMatches(_sessionKey, datagram, length)) {
+        _stats.rejected++;
+        return;
+    }
+
+    uint32_t sequence = readU32(datagram + 4);
+    if ((int32_t)(sequence - _peerSequence) <= 0) {
+        _stats.replayed++;
+        return;
+    }
+
+    _stats.received++;
+    _peerSequence = sequence;
+    _lastHeard = hal::clock().millis();
+    if (joining) {
+        _challenged = false;
+        memcpy(_sessionKey, _challengeKey, sizeof(_sessionKey));
+        _stats.sessions++;
+        if (!_active) {
+            _active = true;
+            _peerAddress = address;
+            _peerPort = port;
+            LOG_I("UDP peer connected\n");
+            publishStatus();
+        }
+    }
+
+    const uint8_t* payload = datagram + UDP_HEADER_SIZE;
+    size_t payloadLength = length - UDP_HEADER_SIZE - UDP_MAC_SIZE;
+    switch (datagram[2]) {
+        case UDP_DRIVE:
+            handleDrive(payload, payloadLength);
+            break;
+        case UDP_PING:
+        case UDP_JOIN:
+            send(UDP_PONG, payload, payloadLength);
+            break;
+        default:
+            break;
+    }
+}
+
+void loop() {
+    if (!_socket) {
+        return;
+    }
+
+    uint8_t datagram[UDP_MAX_DATAGRAM];
+    uint32_t address;
+    uint16_t port;
+    size_t length;
+    while ((length = _socket->receive(datagram, sizeof(datagram), address, port)) > 0) {
+        handleDatagram(datagram, length, address, port);
+    }
+
+    if (_active && hal::clock().millis() - _lastHeard > UDP_PEER_TIMEOUT) {
+        LOG_W("UDP peer quiet for %d ms, falling back to MQTT\n", UDP_PEER_TIMEOUT);
+        _active = false;
+        if (_driving) {
+            // Do not leave the last UDP targets running unattended
+            DriveCommand stop = {DRIVE_LEFT | DRIVE_RIGHT, 0, 0, 0, 0, 0, 0, 0, 0};
+            Communication::applyDrive(stop);
+            Communication::setUdpControl(false);
+            _driving = false;
+        }
+        publishStatus();
+    }
+}
+
+bool isEnabled() {
+    return _socket != nullptr;
+}
+
+bool isActive() {
+    return _active;
+}
+
+bool send(UdpMessageType type, const uint8_t* payload, size_t length) {
+    return _active && transmit(_peerAddress, _peerPort, _sessionKey, type, payload, length);
+}
+
+const UdpStats& getStats() {
+    return _stats;
+}
+
+} // namespace UdpLink
@@ -0,0 +1,80 @@
+#ifndef UDP_LINK_H
+#define UDP_LINK_H
+
+#include "config.h"
+#include "Hal.h"
+#include "SipHash.h"
+
+// Optional LAN side channel next to MQTT: compact drive commands in,
+// telemetry frames out, without the broker round trip. Every datagram is
+//
+//   offset  type    field
+//   0       uint8   magic        UDP_MAGIC
+//   1       uint8   version      UDP_VERSION
+//   2       uint8   type         UdpMessageType
+//   3       uint8   flags        UDP_FLAG_ROBOT on everything the robot sends
+//   4       uint32  sequence     per sender, must increase
+//   8       uint32  time         sender clock, ms
+//   12      ...     payload
+//   end-8   uint64  SipHash-2-4 of everything before it
+//
+// little-endian. A controller opens a session with HELLO, answered by a
+// CHALLENGE with a fresh random nonce, then JOIN. Both HELLO and CHALLENGE
+// are MACed with the shared key, JOIN and everything after it with the
+// session key: SipHash of the nonce with a 0 and a 1 byte appended, under
+// the shared key. Datagrams captured in an earlier session or before a
+// reboot therefore never verify again, and a robot datagram reflected
+// back fails on its flag. The sequence of the controller must increase
+// across sessions as well; the challenge tells it where to continue.
+//
+// Telemetry goes to the session peer until it stays quiet for
+// UDP_PEER_TIMEOUT. While the peer drives, MQTT motion commands are
+// ignored; on timeout the wheels are stopped and MQTT has control again.
+
+#define UDP_MAGIC 0x57
+#define UDP_VERSION 2
+#define UDP_FLAG_ROBOT 0x01
+#define UDP_NONCE_SIZE 8
+#define UDP_CHALLENGE_PAYLOAD_SIZE 12
+#define UDP_HEADER_SIZE 12
+#define UDP_MAC_SIZE 8
+#define UDP_DRIVE_PAYLOAD_SIZE 14
+#define UDP_DRIVE_KINEMATIC_PAYLOAD_SIZE 18
+
+enum UdpMessageType : uint8_t {
+    UDP_DRIVE = 1,      // uint8 fields (DriveField), uint8 reserved, int16 left, right, steering,
+                        // left/right/steering acceleration, then with DRIVE_KINEMATIC
+                        // int16 velocity (mm/s), curvature (1/km)
+    UDP_PING = 2,       // Any payload, echoed back in a UDP_PONG
+    UDP_PONG = 3,
+    UDP_TELEMETRY = 4,  // One TelemetryFrame
+    UDP_HELLO = 5,      // Any payload, asks for a UDP_CHALLENGE
+    UDP_CHALLENGE = 6,  // uint8[8] nonce, uint32 lowest sequence the JOIN may carry
+    UDP_JOIN = 7        // Any payload, opens the session and is echoed in a UDP_PONG
+};
+
+struct UdpStats {
+    uint32_t received;
+    uint32_t rejected;  // Malformed, bad MAC, from the robot, outside a session or from a second peer
+    uint32_t replayed;  // Sequence not newer than the last one accepted
+    uint32_t sessions;  // Opened by a JOIN
+    uint32_t sent;
+};
+
+namespace UdpLink {
+
+// 32 hex digits to a SipHash key
+bool parseKey(const char* hex, uint8_t key[SIP_HASH_KEY_SIZE]);
+void setup(hal::DatagramSocket* socket, const uint8_t key[SIP_HASH_KEY_SIZE], uint16_t port);
+// Drains received datagrams and drops a quiet peer
+void loop();
+// Listening, i.e. a key was configured and the port opened
+bool isEnabled();
+// A peer is connected
+bool isActive();
+bool send(UdpMessageType type, const uint8_t* payload, size_t length);
+const UdpStats& getStats();
+
+} // namespace UdpLink
+
+#endif // UDP_LINK_H
@@ -1,5 +1,7 @@
 #include "WiFiPortal.h"
 #include <LittleFS.h>
+#include "HalArduino.h"
+#include "ConfigStore.h"
 
 #define ERROR_LED_GPIO 2  // ESP8266 LED
 
@@ -9,6 +11,10 @@
 // DNS server
 const byte DNS_PORT = 53;
 
+// Settings go through ConfigStore like at boot, which also keeps the fields
+// the form does not show (group, udp_key, ...)
+static LittleFileSystem portalFileSystem;
+
 bool isValidDomain(String domain) {
     if (domain.length() < 1 || domain.length() > 253) return false;
     if (domain.charAt(0) == '.' || domain.charAt(0) == '-' || domain.charAt(domain.length() - 1) == '.' || domain.charAt(domain.length() - 1) == '-') return false;
@@ -247,31 +253,20 @@ void WiFiPortal::handle_root() {
     LOG_I("Loaded portal page.\n");
 
     // Load current values from config file
-    DynamicJsonDocument doc(512);
-    String server_ip = "dev.rightech.io";
-    String server_port = "1883";
-    String device_id = "";
-    String password = "";
-    String ssid = "";
-    String shunt_resistance = "0.1";
-    String max_current = "0.8";
-    String mpu_address = "0x68";
-    String ina226_address = "0x40";
-
-    File configFile = LittleFS.open("/config.json", "r");
-    if (configFile) {
-        deserializeJson(doc, configFile);
-        configFile.close();
-        server_ip = doc["server"] | "dev.rightech.io";
-        server_port = doc["server_port"] | "1883";
-        device_id = doc["device_id"] | "";
-        password = doc["password"] | "";
-        ssid = doc["ssid"] | "";
-        shunt_resistance = String(doc["shunt_resistance"] | 0.1);
-        max_current = String(doc["max_current"] | 0.8);
-        mpu_address = doc["mpu_address"] | "0x68";
-        ina226_address = doc["ina226_address"] | "0x40";
-    }
+    ConfigStore store(portalFileSystem);
+    bool configured = store.load();
+    const Config& config = store.get();
+    String server_ip = config.server;
+    String server_port = String(config.serverPort);
+    String device_id = configured ? config.deviceId : "";
+    String password = config.password;
+    String ssid = config.ssid;
+    String shunt_resistance = String(config.shuntResistance);
+    String max_current = String(config.maxCurrent);
+    char mpu_address[5];
+    char ina226_address[5];
+    snprintf(mpu_address, sizeof(mpu_address), "0x%02X", config.mpuAddress);
+    snprintf(ina226_address, sizeof(ina226_address), "0x%02X", config.ina226Address);
 
     // Generate default device_id if empty
     if (device_id.length() == 0) {
@@ -372,6 +367,12 @@ void WiFiPortal::handle_save() {
         return;
     }
 
+    if (!ConfigStore::validTopicLevel("device_id", device_id.c_str())) {
+        LOG_W("Invalid device ID\n");
+        send_error_page("Device ID cannot contain /, + or # and cannot be \"fleet\".");
+        return;
+    }
+
     // Validate shunt resistance
     float shunt_resistance = shunt_resistance_str.toFloat();
     if (shunt_resistance <= 0 || shunt_resistance > 10) {
@@ -410,21 +411,21 @@ void WiFiPortal::handle_save() {
     }
 
     // Save to config file
-    DynamicJsonDocument doc(512);
-    doc["ssid"] = ssid;
-    doc["password"] = password;
-    doc["server"] = server_ip;
-    doc["server_port"] = server_port;
-    doc["device_id"] = device_id;
-    doc["shunt_resistance"] = shunt_resistance;
-    doc["max_current"] = max_current;
-    doc["mpu_address"] = mpu_address_str;
-    doc["ina226_address"] = ina226_address_str;
-
-    File configFile = LittleFS.open("/config.json", "w");
-    if (configFile) {
-        serializeJson(doc, configFile);
-        configFile.close();
+    ConfigStore store(portalFileSystem);
+    store.load();
+    Config config = store.get();
+    snprintf(config.ssid, sizeof(config.ssid), "%s", ssid.c_str());
+    snprintf(config.password, sizeof(config.password), "%s", password.c_str());
+    snprintf(config.server, sizeof(config.server), "%s", server_ip.c_str());
+    config.serverPort = server_port.toInt();
+    snprintf(config.deviceId, sizeof(config.deviceId), "%s", device_id.c_str());
+    config.shuntResistance = shunt_resistance;
+    config.maxCurrent = max_current;
+    config.mpuAddress = (uint8_t)strtol(mpu_address_str.c_str(), NULL, 0);
+    config.ina226Address = (uint8_t)strtol(ina226_address_str.c_str(), NULL, 0);
+    if (!store.save(config)) {
+        send_error_page("Could not save the settings.");
+        return;
     }
 
     LOG_I("Credentials saved");
@@ -473,7 +474,8 @@ bool WiFiPortal::is_captive_portal() {
 void WiFiPortal::handle_clear_credentials() {
     LOG_I("Clearing WiFi credentials...");
 
-    LittleFS.remove("/config.json");
+    ConfigStore store(portalFileSystem);
+    store.clear();
 
     WiFi.disconnect();
     delay(1000);
@@ -1,33 +1,171 @@
 #include <Arduino.h>
 #include "config.h"
-#include <ArduinoJson.h>
 #include <LittleFS.h>
-#include <EEPROM.h>
+#include <flash_hal.h>
+#include <Ticker.h>
 
 #include "MotorController.h"
 #include "SensorManager.h"
 #include "Steering.h"
 #include "Communication.h"
 #include "WiFiPortal.h"
+#include "Scheduler.h"
+#include "I2cQueue.h"
+#include "ControlLoop.h"
+#include "HalArduino.h"
+#include "UdpLink.h"
+#include "TelemetrySpool.h"
+#include "ConfigStore.h"
+#include "BootReport.h"
+#include "KvStore.h"
+
+ArduinoClock arduinoClock;
+ArduinoGpio arduinoGpio;
+WireI2cBus i2cBus;
+EepromStorage eepromStorage;
+ArduinoServo steeringServo;
+I2cQueue i2cQueue;
+Mpu6050Imu imu(i2cQueue, MPU_INT_PIN);
+Ina226PowerMonitor powerMonitor(i2cQueue);
+Timer0TickTimer sonarTimer;  // Pings never overlap, so the sonars can share it
+AsyncSonar sonarRight(SONAR_RIGHT_PING, MAX_DISTANCE, &sonarTimer);
+AsyncSonar sonarLeft(SONAR_LEFT_PING, MAX_DISTANCE, &sonarTimer);
+EspMqttTransport* mqttTransport = nullptr;
+WiFiUdpSocket udpSocket;
+LittleFileSystem littleFileSystem;
+TelemetrySpool telemetrySpool(littleFileSystem);
+ConfigStore configStore(littleFileSystem);
+EspFlash kvFlash(KV_SECTORS);
+KvStore kvStore(kvFlash);
 
 MotorController motorController(MOTOR_LEFT_PWM, MOTOR_LEFT_DIRECTION, MOTOR_RIGHT_PWM, MOTOR_RIGHT_DIRECTION);
-SensorManager sensorManager;
-Steering steering;
+SensorManager sensorManager(imu, powerMonitor, sonarRight, sonarLeft);
+Steering steering(steeringServo);
+Scheduler scheduler;
+Ticker motorTicker;
+
+static void setPortalRequested(bool requested) {
+  uint8_t flag = requested;
+  kvStore.put(KV_KEY_PORTAL_REQUESTED, &flag, sizeof(flag));
+}
+
+// Before ld/eagle.flash.4m2m.kv.ld reserved its sectors, the store sat right
+// below LittleFS, where an OTA update is staged. A store without offsets or
+// energy takes over what is left there.
+static void migrateKvSectors() {
+  int16_t offsets[6];
+  uint32_t energy;
+  if (kvStore.get(KV_KEY_MPU_OFFSETS, offsets, sizeof(offsets)) ||
+      kvStore.get(KV_KEY_ENERGY, &energy, sizeof(energy))) {
+    return;
+  }
+
+  EspFlash legacyFlash(FS_PHYS_ADDR / FLASH_SECTOR_SIZE - KV_SECTORS, KV_SECTORS);
+  KvStore legacyStore(legacyFlash);
+  if (!legacyStore.begin()) {
+    return;
+  }
+  bool moved = false;
+  if (legacyStore.get(KV_KEY_MPU_OFFSETS, offsets, sizeof(offsets))) {
+    moved |= kvStore.put(KV_KEY_MPU_OFFSETS, offsets, sizeof(offsets));
+  }
+  if (legacyStore.get(KV_KEY_ENERGY, &energy, sizeof(energy))) {
+    moved |= kvStore.put(KV_KEY_ENERGY, &energy, sizeof(energy));
+  }
+  uint8_t portalFlag;
+  if (legacyStore.get(KV_KEY_PORTAL_REQUESTED, &portalFlag, sizeof(portalFlag))) {
+    moved |= kvStore.put(KV_KEY_PORTAL_REQUESTED, &portalFlag, sizeof(portalFlag));
+  }
+  if (moved) {
+    LOG_I("Key/value store moved to its reserved sectors.\n");
+  }
+}
+
+// Values that lived at fixed EEPROM addresses before the key/value store;
+// erased EEPROM reads as all ones
+static void migrateEeprom() {
+  int16_t offsets[6];
+  if (!kvStore.get(KV_KEY_MPU_OFFSETS, offsets, sizeof(offsets))) {
+    int32_t legacyOffsets[6];
+    hal::storage().read(EEPROM_START_ADDRESS, legacyOffsets, sizeof(legacyOffsets));
+    bool calibrated = false;
+    for (uint8_t i = 0; i < 6; i++) {
+      offsets[i] = (int16_t)legacyOffsets[i];
+      calibrated |= legacyOffsets[i] != -1;
+    }
+    if (calibrated && kvStore.put(KV_KEY_MPU_OFFSETS, offsets, sizeof(offsets))) {
+      LOG_I("MPU offsets migrated from EEPROM.\n");
+    }
+  }
+
+  uint8_t portalFlag = 0;
+  hal::storage().read(EEPROM_PORTAL_FLAG_ADDRESS, &portalFlag, sizeof(portalFlag));
+  if (portalFlag == 1) {
+    setPortalRequested(true);
+    portalFlag = 0;
+    hal::storage().write(EEPROM_PORTAL_FLAG_ADDRESS, &portalFlag, sizeof(portalFlag));
+    hal::storage().commit();
+  }
+}
+
+// Staged counters (energy) would lose up to KV_FLUSH_INTERVAL otherwise
+static void restart() {
+  kvStore.flush();
+  ESP.restart();
+}
+
+// Transport, Communication and the UDP link. From here on Wi-Fi associates
+// in the background while setup() goes on.
+static void startNetwork(const Config& config, TelemetrySpool* spool, ConfigStore* store) {
+  if (config.ssid[0] == '\0') {
+    LOG_I("No WiFi settings found. Starting portal...\n");
+    WiFiPortal portal("Wheelbot-Ctrl-Setup");
+    if (!portal.run()) {
+      LOG_E("Portal failed. Restarting...\n");
+      ESP.restart();
+    }
+    return;
+  }
+
+  LOG_I("WiFi settings found (SSID: %s). Connecting...\n", config.ssid);
+  LOG_I("Creating MQTT client for %s:%u as %s...\n", config.server, config.serverPort, config.deviceId);
+  mqttTransport = new EspMqttTransport(config.ssid, config.password, config.server, config.deviceId, config.serverPort, config.wifiReuseIp);
+  Communication::setup(&motorController, &sensorManager, &steering, &scheduler, &i2cQueue, spool, store, mqttTransport, config.deviceId, config.group);
+  LOG_I("Communication Initialized.\n");
+
+  // The LAN link stays off unless a key is provisioned: drive commands must be authenticated
+  uint8_t key[SIP_HASH_KEY_SIZE];
+  if (config.udpKey[0] == '\0') {
+    LOG_I("No udp_key configured, UDP link disabled.\n");
+  } else if (!UdpLink::parseKey(config.udpKey, key)) {
+    LOG_W("udp_key must be %d hex digits, UDP link disabled.\n", SIP_HASH_KEY_SIZE * 2);
+  } else {
+    UdpLink::setup(&udpSocket, key, UDP_PORT);
+  }
+
+  // Connecting continues in the background from Communication::loop();
+  // the control loop runs, with the wheels stopped, until the broker is up
+}
 
 void setup() {
    Serial.begin(115200);
+   hal::setup(&arduinoClock, &arduinoGpio, &i2cBus, &eepromStorage);
+   BootReport::phase(BOOT_STORAGE);
 
    LOG_I("Wheel Bot Starting...\n");
 
-   // Check portal flag in EEPROM
+   // Calibration, the portal flag and counters live in the key/value store
+   eepromStorage.begin(512);
+   if (!kvStore.begin()) {
+       LOG_E("Key/value store unusable, nothing is saved until restart.\n");
+   }
+   migrateKvSectors();
+   migrateEeprom();
    uint8_t portalFlag = 0;
-   EEPROM.begin(512);
-   EEPROM.get(EEPROM_PORTAL_FLAG_ADDRESS, portalFlag);
+   kvStore.get(KV_KEY_PORTAL_REQUESTED, &portalFlag, sizeof(portalFlag));
    if (portalFlag == 1) {
        LOG_I("Portal flag set. Clearing flag and starting portal...\n");
-       portalFlag = 0;
-       EEPROM.put(EEPROM_PORTAL_FLAG_ADDRESS, portalFlag);
-       EEPROM.end();
+       setPortalRequested(false);
 
        WiFiPortal portal("Wheelbot-Ctrl-Setup");
        if (!portal.run()) {
@@ -38,184 +176,88 @@ void setup() {
        delay(1000);
        ESP.restart();
    }
-   EEPROM.end();
-
-    // Load I2C addresses, shunt resistance and max current from config
-    float shunt_resistance = 0.1;
-    float max_current = 0.8;
-    uint8_t mpu_address = 0x68;
-    uint8_t ina226_address = 0x40;
-    if (LittleFS.begin()) {
-       File configFile = LittleFS.open("/config.json", "r");
-       if (configFile) {
-           DynamicJsonDocument doc(512);
-            deserializeJson(doc, configFile);
-            configFile.close();
-            shunt_resistance = doc["shunt_resistance"] | 0.1;
-            max_current = doc["max_current"] | 0.8;
-            mpu_address = (uint8_t)strtol(doc["mpu_address"] | "0x68", NULL, 0);
-            ina226_address = (uint8_t)strtol(doc["ina226_address"] | "0x40", NULL, 0);
-        }
-    }
 
-    motorController.begin();
-   LOG_I("Motor Controller Initialized.\n");
+    i2cBus.begin(SW_I2C_SDA, SW_I2C_SCL);
+
+    // Settings are parsed once, or read from their binary cache
+    bool fileSystemMounted = LittleFS.begin();
+    if (fileSystemMounted) {
+      configStore.load();
+    }
+    const Config& config = configStore.get();
+    ConfigStore* store = fileSystemMounted ? &configStore : nullptr;
+    LOG_I("Config loaded%s.\n", configStore.loadedFromCache() ? " from cache" : "");
+    // Telemetry taken while offline is kept on the littlefs partition
+    TelemetrySpool* spool = fileSystemMounted ? &telemetrySpool : nullptr;
+
+    BootReport::phase(BOOT_ACTUATORS);
+    motorController.begin(config.pwmRange, config.pwmFrequency);
+    // The SDK timer ramps the outputs at 1 kHz in the system task, so a long
+    // loop() pass delays a tick and the next step is longer. A timer1 ISR
+    // is not an option: timer1 is the core's software PWM, and analogWrite()
+    // is not in IRAM and waits for that interrupt to take the new duty.
+    motorTicker.attach_ms(MOTOR_TICK_INTERVAL, [] { motorController.update(); });
+   LOG_I("Motor Controller Initialized (PWM range %u at %u Hz).\n", config.pwmRange, config.pwmFrequency);
 
     steering.begin();
     LOG_I("Steering Initialized.\n");
 
-    sensorManager.begin(shunt_resistance, max_current, mpu_address, ina226_address);
-    LOG_I("Sensor Manager Initialized with shunt %.2f Ohm, max current %.2f A, MPU@0x%02X, INA226@0x%02X.\n", shunt_resistance, max_current, mpu_address, ina226_address);
+    // Fast boot: Wi-Fi associates while the DMP initializes
+    BootReport::setFast(config.fastBoot);
+    if (config.fastBoot) {
+      BootReport::phase(BOOT_NETWORK);
+      startNetwork(config, spool, store);
+    }
 
-  Communication::setup(&motorController, &sensorManager, &steering);
-  LOG_I("Communication Initialized.\n");
+    BootReport::phase(BOOT_SENSORS);
+    sensorManager.setStore(&kvStore);
+    sensorManager.begin(config.shuntResistance, config.maxCurrent, config.mpuAddress, config.ina226Address);
+    LOG_I("Sensor Manager Initialized with shunt %.2f Ohm, max current %.2f A, MPU@0x%02X, INA226@0x%02X.\n", config.shuntResistance, config.maxCurrent, config.mpuAddress, config.ina226Address);
 
-   // Check if WiFi settings are configured
-   String ssid = "";
-   String password = "";
-   if (LittleFS.begin()) {
-        File configFile = LittleFS.open("/config.json", "r");
-        if (configFile) {
-            DynamicJsonDocument doc(512);
-            deserializeJson(doc, configFile);
-            configFile.close();
-             ssid = doc["ssid"] | "";
-             password = doc["password"] | "";
-             shunt_resistance = doc["shunt_resistance"] | 0.1;
-             max_current = doc["max_current"] | 0.8;
-             mpu_address = (uint8_t)strtol(doc["mpu_address"] | "0x68", NULL, 0);
-             ina226_address = (uint8_t)strtol(doc["ina226_address"] | "0x40", NULL, 0);
-         }
-     }
-
-  if (ssid.length() == 0) {
-    LOG_I("No WiFi settings found. Starting portal...\n");
-    WiFiPortal portal("Wheelbot-Ctrl-Setup");
-    if (!portal.run()) {
-      LOG_E("Portal failed. Restarting...\n");
-      ESP.restart();
-    }
-  } else {
-    LOG_I("WiFi settings found (SSID: %s). Connecting...\n", ssid.c_str());
-    // Wait for connection with timeout
-    unsigned long connect_timeout = 60000; // 60 seconds
-    unsigned long start_time = millis();
-    bool connected = false;
-    while (millis() - start_time < connect_timeout) {
-      if (Communication::isConnected()) {
-        connected = true;
-        LOG_I("Connected successfully.\n");
-        break;
-      }
-      delay(1000);
-      LOG_I("Waiting for connection...\n");
-    }
-    if (!connected) {
-      LOG_W("Connection failed. Starting portal...\n");
-      WiFiPortal portal("Wheelbot-Ctrl-Setup");
-      if (!portal.run()) {
-        LOG_E("Portal failed. Restarting...\n");
-        ESP.restart();
-      }
+    BootReport::phase(BOOT_SPOOL);
+    if (spool) {
+      telemetrySpool.begin();
     }
-  }
+
+  if (!config.fastBoot) {
+    BootReport::phase(BOOT_NETWORK);
+    startNetwork(config, spool, store);
   }
 
-long last_publish = 0;
+  BootReport::phase(BOOT_TASKS);
+  ControlLoop::setup(&motorController, &sensorManager, &steering, &scheduler, &i2cQueue, spool, &kvStore);
+  ControlLoop::applyConfig(config, CONFIG_TELEMETRY_INTERVAL | CONFIG_SENSOR_INTERVAL | CONFIG_KINEMATICS_FIELDS | CONFIG_COMMAND_MAX_AGE);
+  BootReport::phase(BOOT_PHASE_COUNT);
+  BootReport::milestone(BOOT_SETUP_DONE, millis());
+  }
 
 //float getRandomFloat(float min, float max) {
 //  return min + (max - min) * (random(0, 2147483647) / 2147483647.0f);
 // }
 
-void publishParameters() {
-  long now = millis();
-  if (!Communication::isConnected() || !(now - last_publish > PUB_DELAY)) {
-    return;
-  }
-  last_publish = now;
-
-  JsonDocument sensors;
-
-  JsonObject sonarsNode = sensors["sonars"].to<JsonObject>();
-  sonarsNode["right"] = sensorManager.getSonarRight();
-  sonarsNode["left"] = sensorManager.getSonarLeft();
-
-  JsonObject accelerometrNode = sensors["accelerometr"].to<JsonObject>();
-  accelerometrNode["x"] = sensorManager.getAccelX();
-  accelerometrNode["y"] = sensorManager.getAccelY();
-  accelerometrNode["z"] = sensorManager.getAccelZ();
-
-  JsonObject gyroscopeNode = sensors["gyroscope"].to<JsonObject>();
-  gyroscopeNode["x"] = sensorManager.getGyroX();
-  gyroscopeNode["y"] = sensorManager.getGyroY();
-  gyroscopeNode["z"] = sensorManager.getGyroZ();
-
-  JsonObject anglesNode = sensors["angles"].to<JsonObject>();
-  anglesNode["yaw"] = sensorManager.getYaw();
-  anglesNode["pitch"] = sensorManager.getPitch();
-  anglesNode["roll"] = sensorManager.getRoll();
-
-  JsonObject powerNode = sensors["power"].to<JsonObject>();
-  powerNode["voltage"] = sensorManager.getVoltage();
-  powerNode["current"] = sensorManager.getCurrent();
-  powerNode["power"] = sensorManager.getPower();
-  powerNode["energy"] = sensorManager.getEnergy();
-
-  String sensors_output;
-  serializeJson(sensors, sensors_output);
-
-  LOG_D("Published sensor parameters: %s\n", sensors_output.c_str());
-
-  #if defined(ENABLE_SEND_DATA)
-    Communication::publish("sensors/json", sensors_output);
-  #endif
-
-  JsonDocument control;
-
-  JsonObject motorsNode = control["engines"].to<JsonObject>();
-  JsonObject leftMotorNode = motorsNode["left"].to<JsonObject>();
-  leftMotorNode["speed"] = motorController.getCurrentLeftSpeed();
-  leftMotorNode["direction"] = motorController.getLeftDirection();
-  leftMotorNode["acceleration"] = motorController.getLeftAcceleration();
-  JsonObject rightMotorNode = motorsNode["right"].to<JsonObject>();
-  rightMotorNode["speed"] = motorController.getCurrentRightSpeed();
-  rightMotorNode["direction"] = motorController.getRightDirection();
-  rightMotorNode["acceleration"] = motorController.getRightAcceleration();
-
-  JsonObject steeringWheelNode = control["steering"].to<JsonObject>();
-  steeringWheelNode["direction"] = steering.getAngle();
-  steeringWheelNode["acceleration"] = steering.getAcceleration();
-
-  String control_output;
-  serializeJson(control, control_output);
-
-  LOG_D("Published control parameters: %s\n", control_output.c_str());
-
-  #if defined(ENABLE_SEND_DATA)
-    Communication::publish("control/json", control_output);
-  #endif
-}
-
 void loop() {
-  sensorManager.update();
-  motorController.update();
-  steering.update();
-  Communication::loop();
+  ControlLoop::loop();
 
   if (Communication::restartRequested()) {
     delay(1000);
-    ESP.restart();
+    restart();
   }
 
   if (Communication::portalRequested()) {
     LOG_I("Portal requested via MQTT. Setting portal flag and restarting...\n");
-    uint8_t portalFlag = 1;
-    EEPROM.begin(512);
-    EEPROM.put(EEPROM_PORTAL_FLAG_ADDRESS, portalFlag);
-    EEPROM.end();
+    setPortalRequested(true);
     delay(1000);
-    ESP.restart();
+    restart();
   }
 
-  publishParameters();
+  // Wrong credentials or an access point that is gone: fall back to the
+  // setup portal. A broker that is down only means waiting for it.
+  if (mqttTransport && mqttTransport->getConnectionStats().wifiConnects == 0 && millis() > WIFI_PORTAL_TIMEOUT) {
+    LOG_W("No WiFi connection since boot. Starting portal...\n");
+    WiFiPortal portal("Wheelbot-Ctrl-Setup");
+    if (!portal.run()) {
+      LOG_E("Portal failed. Restarting...\n");
+    }
+    restart();
+  }
 }
@@ -0,0 +1,1410 @@
+// Host entry point for the native environment: runs the same control stack as
+// the ESP8266 firmware against the fakes in HalNative.h, driven by a virtual
+// clock, so it runs as fast as the host allows.
+//
+// Usage: program [seconds]
+//        program config-bench [iterations]
+//        program kv-powerloss
+//        program ramp-jitter
+//        program sensor-bench [packets]
+//        program publish-alloc [publishes]
+//        program telemetry-codec [publishes]
+//        program batch-codec
+//        program udp-rtt [pings]
+//        program kinematics
+//        program sonar-blocking
+
+#include "config.h"
+#include "HalNative.h"
+#include "MotorController.h"
+#include "SensorManager.h"
+#include "Steering.h"
+#include "Scheduler.h"
+#include "I2cQueue.h"
+#include "Communication.h"
+#include "ControlLoop.h"
+#include "TelemetrySpool.h"
+#include "ConfigStore.h"
+#include "KvStore.h"
+#include "DriveKinematics.h"
+#include "Simulator.h"
+#include "TelemetryFrame.h"
+#include "TelemetryBatch.h"
+#include "TelemetryStreams.h"
+#include "UdpLink.h"
+#include "AsyncSonar.h"
+#include <ArduinoJson.h>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define NATIVE_LOOP_STEP_US 1000  // Virtual time between two loop() passes
+#define NATIVE_DEVICE_ID "wheelbot-native"
+#define KV_HARNESS_STEPS 8000        // Energy updates in the power-loss workload
+#define KV_HARNESS_FLUSH_EVERY 4     // Steps per flush() of the staged energy
+#define KV_HARNESS_OFFSETS_EVERY 500 // Steps per put() of new MPU offsets
+#define KV_HARNESS_PORTAL_EVERY 1000 // Steps per put() of the portal flag
+#define RAMP_HARNESS_ACCELERATION 50 // %/s
+#define RAMP_HARNESS_LEGACY_STEP 5   // PWM counts per update() of the old controller
+#define SENSOR_BENCH_MAX_ANGLE_ERROR 0.01 // deg between the Q16.16 and the old float angles
+#define SENSOR_BENCH_MAX_TILT 45           // deg of pitch and roll in the bench packets, any yaw
+#define TELEMETRY_HARNESS_STEP 250        // ms of running between two compared publishes
+#define TELEMETRY_HARNESS_SENSORS_SIZE 44 // Bytes of a version 1 sensors/bin frame
+#define TELEMETRY_HARNESS_CONTROL_SIZE 20 // Bytes of a version 1 control/bin frame
+#define BATCH_HARNESS_DURATION 20000  // ms of simulated driving per batch-codec run
+#define BATCH_HARNESS_MAX_AGE 1000    // ms, telemetry/batch max-age of both channels
+#define UDP_HARNESS_ROBOT 0x0A000002      // Loopback addresses of the robot and the controller
+#define UDP_HARNESS_CONTROLLER 0x0A000001
+#define UDP_HARNESS_PORT 50000
+#define UDP_HARNESS_MAX_GAP 20            // ms of running between two pings, at most
+#define KINEMATICS_HARNESS_SETTLE 4.0f   // s of driving before the radius is measured
+#define KINEMATICS_HARNESS_TOLERANCE 0.01f // Largest relative radius error
+#define SONAR_HARNESS_DURATION 3000  // ms of sonar task runs per case
+#define SONAR_HARNESS_MAX_READS 8    // Clock reads one updateSonars() may take
+#define SONAR_HARNESS_MAX_CALL 100   // us one updateSonars() may take, the 14 us trigger pulse included
+#define SONAR_HARNESS_ECHO_DELAY 450 // us from the trigger pulse to the echo rising
+#define SONAR_HARNESS_STEP 2         // us between echo line updates
+
+// Every operator new in the program is counted, see publish-alloc
+static uint64_t _allocations = 0;
+
+void* operator new(size_t size) {
+    _allocations++;
+    void* memory = malloc(size ? size : 1);
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+
+VirtualClock virtualClock;
+FakeGpio gpio;
+FakeI2cBus i2cBus;
+MemoryStorage storage;
+FakeServo steeringServo;
+FakeImu imu;
+FakePowerMonitor powerMonitor;
+FakeSonar sonarRight;
+FakeSonar sonarLeft;
+LoopbackMqttTransport mqtt;
+MemoryFileSystem fileSystem;
+TelemetrySpool spool(fileSystem);
+ConfigStore configStore(fileSystem);
+MemoryFlash kvFlash;
+KvStore kvStore(kvFlash);
+
+MotorController motorController(MOTOR_LEFT_PWM, MOTOR_LEFT_DIRECTION, MOTOR_RIGHT_PWM, MOTOR_RIGHT_DIRECTION);
+SensorManager sensorManager(imu, powerMonitor, sonarRight, sonarLeft);
+Steering steering(steeringServo);
+Scheduler scheduler;
+I2cQueue i2cQueue;
+
+// A /config.json as the portal writes it
+static const char BENCH_CONFIG[] =
+    "{\"ssid\":\"lab-network\",\"password\":\"correct horse battery\",\"server\":\"dev.rightech.io\","
+    "\"server_port\":\"1883\",\"device_id\":\"wheelbot-a1b2c3d4\",\"group\":\"lab\","
+    "\"udp_key\":\"000102030405060708090a0b0c0d0e0f\",\"shunt_resistance\":\"0.1\",\"max_current\":\"0.8\","
+    "\"mpu_address\":\"0x68\",\"ina226_address\":\"0x40\"}";
+
+// What setup() used to do: read and parse /config.json once for the sensor
+// settings and again for the network settings
+static uint32_t legacyConfigLoad() {
+    uint32_t checksum = 0;
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        char buffer[CONFIG_JSON_MAX_SIZE];
+        size_t length = fileSystem.read(CONFIG_JSON_PATH, 0, buffer, sizeof(buffer));
+        JsonDocument doc;
+        deserializeJson(doc, buffer, length);
+        const char* ssid = doc["ssid"] | "";
+        const char* server = doc["server"] | "dev.rightech.io";
+        const char* deviceId = doc["device_id"] | "wheelbot-default";
+        float shunt = doc["shunt_resistance"] | 0.1;
+        uint8_t mpuAddress = (uint8_t)strtol(doc["mpu_address"] | "0x68", NULL, 0);
+        checksum += strlen(ssid) + strlen(server) + strlen(deviceId) + (uint32_t)(shunt * 1000) + mpuAddress;
+    }
+    return checksum;
+}
+
+// Host-side timing of the boot-time config load, old path against
+// ConfigStore parsing JSON and ConfigStore reading its cache
+static int benchConfig(unsigned long iterations) {
+    fileSystem.remove(CONFIG_CACHE_PATH);
+    fileSystem.remove(CONFIG_JSON_PATH);
+    fileSystem.append(CONFIG_JSON_PATH, BENCH_CONFIG, strlen(BENCH_CONFIG));
+
+    uint32_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        checksum += legacyConfigLoad();
+    }
+    double legacy = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        fileSystem.remove(CONFIG_CACHE_PATH);
+        configStore.load();
+        checksum += configStore.get().serverPort;
+    }
+    double parse = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++) {
+        configStore.load();
+        checksum += configStore.get().serverPort;
+    }
+    double cached = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+    printf("Config load over %lu iterations (checksum %u):\n", iterations, checksum);
+    printf("  two JSON parses (old setup)   %8.2f us\n", legacy);
+    printf("  ConfigStore, JSON + cache     %8.2f us\n", parse);
+    printf("  ConfigStore, from cache       %8.2f us (%s)\n", cached, configStore.loadedFromCache() ? "hit" : "miss");
+    return 0;
+}
+
+// The firmware's setup() against the fakes, connected to the loopback broker
+static void startStack() {
+    hal::setup(&virtualClock, &gpio, &i2cBus, &storage);
+    i2cBus.attach(MPU_ADDRESS);
+    i2cBus.attach(INA226_ADDRESS);
+    powerMonitor.set(7.4, 0.2);
+    sonarRight.setDistance(120);
+    sonarLeft.setDistance(80);
+
+    motorController.begin();
+    steering.begin();
+    kvStore.begin();
+    sensorManager.setStore(&kvStore);
+    sensorManager.begin();
+    spool.begin();
+    configStore.load();
+    Communication::setup(&motorController, &sensorManager, &steering, &scheduler, &i2cQueue, &spool, &configStore, &mqtt, NATIVE_DEVICE_ID, "");
+    ControlLoop::setup(&motorController, &sensorManager, &steering, &scheduler, &i2cQueue, &spool, &kvStore);
+    mqtt.setConnected(true);
+}
+
+static void runFor(uint32_t ms) {
+    uint64_t end = virtualClock.elapsedMicros() + (uint64_t)ms * 1000;
+    while (virtualClock.elapsedMicros() < end) {
+        ControlLoop::loop();
+        virtualClock.advance(NATIVE_LOOP_STEP_US);
+    }
+}
+
+// Every publish since the last reset, for the harness checks
+static uint32_t _observedMessages = 0;
+static size_t _observedBytes = 0;
+
+static void observePublish(const char* topic, const uint8_t* payload, size_t length, bool retain) {
+    _observedMessages++;
+    _observedBytes += length;
+}
+
+// The sensors/json document as publishParameters() built it before
+// JsonWriter: a JsonDocument serialized into a stack buffer
+static size_t legacySensorsJson(char* output, size_t size) {
+    JsonDocument sensors;
+    JsonObject sonars = sensors["sonars"].to<JsonObject>();
+    sonars["right"] = sensorManager.getSonarRight();
+    sonars["left"] = sensorManager.getSonarLeft();
+    JsonObject accel = sensors["accelerometr"].to<JsonObject>();
+    accel["x"] = q16ToFloat(sensorManager.getAccelX());
+    accel["y"] = q16ToFloat(sensorManager.getAccelY());
+    accel["z"] = q16ToFloat(sensorManager.getAccelZ());
+    JsonObject gyro = sensors["gyroscope"].to<JsonObject>();
+    gyro["x"] = q16ToFloat(sensorManager.getGyroX());
+    gyro["y"] = q16ToFloat(sensorManager.getGyroY());
+    gyro["z"] = q16ToFloat(sensorManager.getGyroZ());
+    JsonObject angles = sensors["angles"].to<JsonObject>();
+    angles["yaw"] = q16ToFloat(sensorManager.getYaw());
+    angles["pitch"] = q16ToFloat(sensorManager.getPitch());
+    angles["roll"] = q16ToFloat(sensorManager.getRoll());
+    JsonObject power = sensors["power"].to<JsonObject>();
+    power["voltage"] = sensorManager.getVoltage() / 1000.0f;
+    power["current"] = sensorManager.getCurrent() / 1000000.0f;
+    power["power"] = sensorManager.getPower() / 1000000.0f;
+    power["energy"] = sensorManager.getEnergy() / 1000000.0f;
+    return serializeJson(sensors, output, size);
+}
+
+// Counts heap allocations of steady-state telemetry publishes in each
+// format. The first publish after connecting also sends diag/boot, so the
+// stack runs a while before counting starts.
+static int publishAlloc(unsigned long publishes) {
+    startStack();
+    runFor(2000);
+    mqtt.setPublishObserver(observePublish);
+
+    bool passed = true;
+    printf("Heap allocations per publishParameters() over %lu calls:\n", publishes);
+    printf("  %-8s %10s %10s %12s\n", "format", "messages", "bytes", "allocations");
+    const TelemetryFormat formats[] = {TELEMETRY_FORMAT_JSON, TELEMETRY_FORMAT_BINARY, TELEMETRY_FORMAT_BOTH};
+    const char* const names[] = {"json", "bin", "both"};
+    for (uint8_t i = 0; i < 3; i++) {
+        Communication::setTelemetryFormat(formats[i]);
+        _observedMessages = 0;
+        _observedBytes = 0;
+        uint64_t allocations = _allocations;
+        for (unsigned long n = 0; n < publishes; n++) {
+            ControlLoop::publishParameters();
+        }
+        allocations = _allocations - allocations;
+        bool ok = allocations == 0 && _observedMessages == publishes * (formats[i] == TELEMETRY_FORMAT_BOTH ? 4 : 2);
+        passed &= ok;
+        printf("  %-8s %10u %10u %12u%s\n", names[i], _observedMessages, (unsigned)_observedBytes, (unsigned)allocations, ok ? "" : "  FAILED");
+    }
+    mqtt.setPublishObserver(nullptr);
+
+    char output[MQTT_PACKET_SIZE];
+    uint64_t allocations = _allocations;
+    for (unsigned long n = 0; n < publishes; n++) {
+        legacySensorsJson(output, sizeof(output));
+    }
+    printf("  JsonDocument sensors/json (old): %.1f allocations per call\n", (double)(_allocations - allocations) / publishes);
+    printf("%s\n", passed ? "No heap use in steady-state publishing" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+// Time stamp counter where the host has one, 0 elsewhere
+static uint64_t cycleCount() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// The IMU and energy arithmetic before the fixed-point change, on doubles
+// and soft-float on the ESP8266
+struct LegacySensors {
+    float ypr[3];  // rad
+    double accel[3];
+    double gyro[3];
+    double energy;  // Wh
+
+    void imu(const hal::ImuRawSample& sample) {
+        float qw = sample.quaternion[0] / 16384.0f;
+        float qx = sample.quaternion[1] / 16384.0f;
+        float qy = sample.quaternion[2] / 16384.0f;
+        float qz = sample.quaternion[3] / 16384.0f;
+        float gravityX = 2 * (qx * qz - qw * qy);
+        float gravityY = 2 * (qw * qx + qy * qz);
+        float gravityZ = qw * qw - qx * qx - qy * qy + qz * qz;
+        ypr[0] = atan2(2 * qx * qy - 2 * qw * qz, 2 * qw * qw + 2 * qx * qx - 1);
+        ypr[1] = atan2(gravityX, sqrt(gravityY * gravityY + gravityZ * gravityZ));
+        ypr[2] = atan2(gravityY, gravityZ);
+        if (gravityZ < 0) {
+            ypr[1] = (ypr[1] > 0 ? PI : -PI) - ypr[1];
+        }
+        float gravity[3] = {gravityX, gravityY, gravityZ};
+        for (uint8_t i = 0; i < 3; i++) {
+            int16_t real = sample.accel[i] - gravity[i] * 8192;
+            accel[i] = static_cast<double>(real) / MPU_METRIC_DEVIDER * 2;
+            gyro[i] = static_cast<double>(sample.gyro[i]) / MPU_METRIC_DEVIDER * 250;
+        }
+    }
+
+    void power(double watts, unsigned long deltaTime) {
+        energy += watts * (deltaTime / 3600000.0);
+    }
+};
+
+// A DMP packet for a random ground-robot orientation (any heading, pitch
+// and roll within SENSOR_BENCH_MAX_TILT), accel and gyro. Near 90 deg of
+// tilt yaw and roll are undefined and rounding alone moves them.
+static hal::ImuRawSample randomImuSample(uint32_t& seed) {
+    float angles[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        seed = seed * 1103515245 + 12345;
+        float range = i == 0 ? 180 : SENSOR_BENCH_MAX_TILT;
+        angles[i] = (((seed >> 8) % 20001) / 10000.0f - 1) * range * PI / 180;
+    }
+    float cy = cosf(angles[0] / 2), sy = sinf(angles[0] / 2);
+    float cp = cosf(angles[1] / 2), sp = sinf(angles[1] / 2);
+    float cr = cosf(angles[2] / 2), sr = sinf(angles[2] / 2);
+    hal::ImuRawSample sample;
+    sample.quaternion[0] = (int16_t)lroundf((cr * cp * cy + sr * sp * sy) * 16384);
+    sample.quaternion[1] = (int16_t)lroundf((sr * cp * cy - cr * sp * sy) * 16384);
+    sample.quaternion[2] = (int16_t)lroundf((cr * sp * cy + sr * cp * sy) * 16384);
+    sample.quaternion[3] = (int16_t)lroundf((cr * cp * sy - sr * sp * cy) * 16384);
+    for (uint8_t i = 0; i < 3; i++) {
+        seed = seed * 1103515245 + 12345;
+        sample.accel[i] = (int16_t)((seed >> 8) % 4001) - 2000;
+        sample.gyro[i] = (int16_t)((seed >> 16) % 2001) - 1000;
+    }
+    return sample;
+}
+
+static double angleError(q16_16 fixed, float radians) {
+    double error = fabs(q16ToFloat(fixed) - radians * 180.0 / PI);
+    return min(error, 360 - error);
+}
+
+// Cost of the orientation and energy arithmetic for one DMP packet, new
+// fixed-point path against the old float one, on the same packets. Both
+// timed regions start from a drained packet and a power reading, so the
+// FIFO, the IMU history and the INA226 request stay outside; a full
+// SensorManager update is timed on its own line for reference. An x86 host
+// has an FPU and the ESP8266 has none, so these figures do not predict the
+// cost on the robot; the check is that both paths agree.
+static int sensorBench(unsigned long packets) {
+    hal::setup(&virtualClock, &gpio, &i2cBus, &storage);
+    SensorManager sensors(imu, powerMonitor, sonarRight, sonarLeft);
+    LegacySensors legacy = {};
+    powerMonitor.set(7.4, 0.2);
+    int32_t power = powerMonitor.getPower();
+    double watts = power / 1e6;
+    uint32_t elapsed = 1000 / MPU_DMP_RATE_HZ;
+
+    uint32_t seed = 1;
+    uint64_t fixedNs = 0, floatNs = 0, updateNs = 0, fixedCycles = 0, floatCycles = 0, updateCycles = 0;
+    q16_16 ypr[3], accel[3], gyro[3];
+    uint64_t remainder = 0;
+    uint32_t energy = 0;
+    double maxError = 0;
+    for (unsigned long i = 0; i < packets; i++) {
+        hal::ImuRawSample sample = randomImuSample(seed);
+        virtualClock.advance(1000000 / MPU_DMP_RATE_HZ);
+
+        imu.pushSample(sample);
+        auto start = std::chrono::steady_clock::now();
+        uint64_t cycles = cycleCount();
+        sensors.updateImu();
+        sensors.update();
+        updateCycles += cycleCount() - cycles;
+        updateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        // Alternate which path runs first, so neither always finds the
+        // other's cache and branch state
+        for (uint8_t pass = 0; pass < 2; pass++) {
+            start = std::chrono::steady_clock::now();
+            cycles = cycleCount();
+            if ((pass + i) % 2 == 0) {
+                SensorManager::orientation(sample, ypr, accel, gyro);
+                energy += SensorManager::addEnergy(remainder, power, elapsed);
+                fixedCycles += cycleCount() - cycles;
+                fixedNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            } else {
+                legacy.imu(sample);
+                legacy.power(watts, elapsed);
+                floatCycles += cycleCount() - cycles;
+                floatNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            }
+        }
+
+        maxError = max(maxError, angleError(ypr[0], legacy.ypr[0]));
+        maxError = max(maxError, angleError(ypr[1], legacy.ypr[1]));
+        maxError = max(maxError, angleError(ypr[2], legacy.ypr[2]));
+        if (ypr[0] != sensors.getYaw() || ypr[1] != sensors.getPitch() || ypr[2] != sensors.getRoll()) {
+            maxError = INFINITY;
+        }
+    }
+
+    printf("Sensor arithmetic (IMU packet + energy) over %lu packets:\n", packets);
+    printf("  %-34s %10s %14s\n", "", "ns/update", "cycles/update");
+    printf("  %-34s %10.1f %14.1f\n", "Q16.16 fixed point", (double)fixedNs / packets, (double)fixedCycles / packets);
+    printf("  %-34s %10.1f %14.1f\n", "float/double (old)", (double)floatNs / packets, (double)floatCycles / packets);
+    printf("  %-34s %10.1f %14.1f\n", "SensorManager update (reference)", (double)updateNs / packets, (double)updateCycles / packets);
+    printf("  max angle difference %.4f deg\n", maxError);
+    printf("  energy %u uWh vs %.1f uWh\n", energy, legacy.energy * 1e6);
+    bool passed = maxError <= SENSOR_BENCH_MAX_ANGLE_ERROR;
+    printf("%s\n", passed ? "Both paths agree" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+// Reads a frame the way a host-side decoder would, from the layout in
+// docs/README_EN.md rather than from TelemetryFrame
+struct FrameReader {
+    const uint8_t* data;
+    size_t length;
+    size_t offset;
+
+    uint32_t get(uint8_t bytes) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < bytes && offset < length; i++) value |= (uint32_t)data[offset++] << (8 * i);
+        return value;
+    }
+    int16_t i16() { return (int16_t)get(2); }
+    int32_t i32() { return (int32_t)get(4); }
+};
+
+// Last payload published on each telemetry topic, by topic suffix. The
+// loop publishes too, so the sequence of bin frames is followed here.
+struct CapturedTelemetry {
+    const char* suffix;
+    uint8_t payload[MQTT_PACKET_SIZE];
+    size_t length;
+    uint32_t count;
+    bool seen;
+    uint16_t sequence;
+    uint32_t gaps;
+};
+
+static CapturedTelemetry _captured[] = {
+    {"/sensors/json"}, {"/sensors/bin"}, {"/control/json"}, {"/control/bin"}
+};
+
+static void captureTelemetry(const char* topic, const uint8_t* payload, size_t length, bool retain) {
+    size_t topicLength = strlen(topic);
+    for (CapturedTelemetry& captured : _captured) {
+        size_t suffixLength = strlen(captured.suffix);
+        if (topicLength >= suffixLength && strcmp(topic + topicLength - suffixLength, captured.suffix) == 0) {
+            captured.length = min(length, sizeof(captured.payload) - 1);
+            memcpy(captured.payload, payload, captured.length);
+            captured.payload[captured.length] = 0;
+            captured.count++;
+            if (strstr(captured.suffix, "/bin")) {
+                FrameReader frame = {payload, length, 2};
+                uint16_t sequence = frame.get(2);
+                if (captured.seen && sequence != (uint16_t)(captured.sequence + 1)) captured.gaps++;
+                captured.sequence = sequence;
+                captured.seen = true;
+            }
+        }
+    }
+}
+
+static bool checkField(const char* name, double json, double frame, double tolerance) {
+    if (fabs(json - frame) <= tolerance) return true;
+    printf("  %s: json %.6f, bin %.6f\n", name, json, frame);
+    return false;
+}
+
+static bool checkHeader(FrameReader& frame, TelemetrySchema schema, size_t size) {
+    bool ok = frame.length == size;
+    ok &= frame.get(1) == TELEMETRY_FRAME_VERSION;
+    ok &= frame.get(1) == (uint32_t)schema;
+    frame.get(2);  // Sequence, followed by captureTelemetry()
+    ok &= frame.get(4) == virtualClock.millis();
+    if (!ok) printf("  bad header or length in schema %d frame\n", schema);
+    return ok;
+}
+
+// The bin frames carry the JSON values at the resolution documented for
+// each field, so decoding both must give the same numbers
+static bool compareSensors(JsonObject json, FrameReader frame) {
+    bool ok = true;
+    ok &= checkField("sonars.right", json["sonars"]["right"], frame.get(2), 0);
+    ok &= checkField("sonars.left", json["sonars"]["left"], frame.get(2), 0);
+    const char* axes[] = {"x", "y", "z"};
+    for (const char* axis : axes) ok &= checkField("accelerometr", json["accelerometr"][axis], frame.i16() / 1000.0, 0.00055);
+    for (const char* axis : axes) ok &= checkField("gyroscope", json["gyroscope"][axis], frame.i16() / 100.0, 0.0055);
+    const char* angles[] = {"yaw", "pitch", "roll"};
+    for (const char* angle : angles) ok &= checkField("angles", json["angles"][angle], frame.i16() / 100.0, 0.0055);
+    ok &= checkField("power.voltage", json["power"]["voltage"], frame.get(2) / 1e3, 5e-4);
+    ok &= checkField("power.current", json["power"]["current"], frame.i32() / 1e6, 5e-7);
+    ok &= checkField("power.power", json["power"]["power"], frame.i32() / 1e6, 5e-7);
+    ok &= checkField("power.energy", json["power"]["energy"], frame.get(4) / 1e6, 5e-7);
+    return ok;
+}
+
+static bool compareControl(JsonObject json, FrameReader frame) {
+    bool ok = true;
+    const char* sides[] = {"left", "right"};
+    for (const char* side : sides) {
+        JsonObject engine = json["engines"][side];
+        ok &= checkField("engines.speed", engine["speed"], (int8_t)frame.get(1), 0);
+        ok &= checkField("engines.direction", engine["direction"], frame.get(1), 0);
+        ok &= checkField("engines.acceleration", engine["acceleration"], frame.i16(), 0);
+    }
+    ok &= checkField("steering.direction", json["steering"]["direction"], frame.i16(), 0);
+    ok &= checkField("steering.acceleration", json["steering"]["acceleration"], frame.i16(), 0);
+    return ok;
+}
+
+// Publishes telemetry in both formats from varied robot states and decodes
+// each bin frame against the JSON of the same publish, then times
+// publishParameters() in each format alone
+static int telemetryCodec(unsigned long publishes) {
+    startStack();
+    runFor(2000);
+    Communication::setTelemetryFormat(TELEMETRY_FORMAT_BOTH);
+    mqtt.setPublishObserver(captureTelemetry);
+
+    uint32_t seed = 7;
+    unsigned long mismatches = 0;
+    for (unsigned long i = 0; i < publishes; i++) {
+        seed = seed * 1103515245 + 12345;
+        sonarRight.setDistance((seed >> 8) % (MAX_DISTANCE + 1));
+        sonarLeft.setDistance((seed >> 16) % (MAX_DISTANCE + 1));
+        powerMonitor.set(6 + (seed >> 8) % 2400 / 1000.0f, ((seed >> 12) % 30000) / 10000.0f - 0.5f);
+        imu.pushSample(randomImuSample(seed));
+        motorController.setTargets(((int32_t)((seed >> 4) % 201) - 100) * MOTOR_SPEED_FULL / 100,
+                                   ((int32_t)((seed >> 12) % 201) - 100) * MOTOR_SPEED_FULL / 100);
+        steering.setAngle((seed >> 20) % 181);
+        runFor(TELEMETRY_HARNESS_STEP);
+
+        for (CapturedTelemetry& captured : _captured) captured.count = 0;
+        ControlLoop::publishParameters();
+        bool ok = true;
+        for (CapturedTelemetry& captured : _captured) ok &= captured.count == 1;
+        if (!ok) {
+            printf("  publish %lu did not send one message per topic\n", i);
+            mismatches++;
+            continue;
+        }
+
+        JsonDocument sensors, control;
+        ok &= !deserializeJson(sensors, (const char*)_captured[0].payload);
+        ok &= !deserializeJson(control, (const char*)_captured[2].payload);
+        FrameReader sensorsFrame = {_captured[1].payload, _captured[1].length, 0};
+        FrameReader controlFrame = {_captured[3].payload, _captured[3].length, 0};
+        ok &= checkHeader(sensorsFrame, TELEMETRY_SCHEMA_SENSORS, TELEMETRY_HARNESS_SENSORS_SIZE);
+        ok &= checkHeader(controlFrame, TELEMETRY_SCHEMA_CONTROL, TELEMETRY_HARNESS_CONTROL_SIZE);
+        ok &= compareSensors(sensors.as<JsonObject>(), sensorsFrame);
+        ok &= compareControl(control.as<JsonObject>(), controlFrame);
+        if (!ok) mismatches++;
+    }
+    uint32_t gaps = _captured[1].gaps + _captured[3].gaps;
+    printf("Round trip over %lu publishes: %lu mismatched, %u sequence gaps\n", publishes, mismatches, gaps);
+
+    printf("  %-8s %12s %12s %14s\n", "format", "bytes/call", "ns/call", "cycles/call");
+    const TelemetryFormat formats[] = {TELEMETRY_FORMAT_JSON, TELEMETRY_FORMAT_BINARY};
+    const char* const names[] = {"json", "bin"};
+    for (uint8_t i = 0; i < 2; i++) {
+        Communication::setTelemetryFormat(formats[i]);
+        mqtt.setPublishObserver(observePublish);
+        _observedBytes = 0;
+        uint64_t ns = 0, cycles = 0;
+        for (unsigned long n = 0; n < publishes; n++) {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t startCycles = cycleCount();
+            ControlLoop::publishParameters();
+            cycles += cycleCount() - startCycles;
+            ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        printf("  %-8s %12.1f %12.1f %14.1f\n", names[i], (double)_observedBytes / publishes, (double)ns / publishes, (double)cycles / publishes);
+    }
+    mqtt.setPublishObserver(nullptr);
+
+    bool passed = mismatches == 0 && gaps == 0;
+    printf("%s\n", passed ? "Binary frames decode to the JSON values" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+struct BatchSample {
+    uint32_t timestamp;
+    int32_t values[TELEMETRY_BATCH_MAX_FIELDS];
+};
+
+// Samples as the sensors produced them and as telemetry/batch delivered them
+struct BatchRecording {
+    TelemetryBatchChannel channel;
+    const char* suffix;
+    uint8_t fieldCount;
+    std::vector<BatchSample> recorded;
+    std::vector<BatchSample> decoded;
+    uint32_t frames;
+    size_t bytes;
+    uint32_t badFrames;
+    bool seen;
+    uint16_t sequence;
+};
+
+static BatchRecording _batchRecordings[] = {
+    {TELEMETRY_BATCH_IMU, "/telemetry/batch/imu", 10},
+    {TELEMETRY_BATCH_SONARS, "/telemetry/batch/sonars", 2},
+};
+
+static void decodeBatch(const char* topic, const uint8_t* payload, size_t length, bool retain) {
+    size_t topicLength = strlen(topic);
+    for (BatchRecording& recording : _batchRecordings) {
+        size_t suffixLength = strlen(recording.suffix);
+        if (topicLength < suffixLength || strcmp(topic + topicLength - suffixLength, recording.suffix) != 0) {
+            continue;
+        }
+        recording.frames++;
+        recording.bytes += length;
+        TelemetryBatchDecoder decoder(payload, length);
+        bool ok = decoder.valid() && decoder.channel() == recording.channel && decoder.fieldCount() == recording.fieldCount;
+        ok &= !recording.seen || decoder.sequence() == (uint16_t)(recording.sequence + 1);
+        recording.seen = true;
+        recording.sequence = decoder.sequence();
+        uint8_t samples = 0;
+        BatchSample sample = {};
+        while (ok && decoder.next(sample.timestamp, sample.values)) {
+            recording.decoded.push_back(sample);
+            samples++;
+        }
+        recording.badFrames += !ok || samples != decoder.count();
+    }
+}
+
+// Takes the samples the sensors produced since the last call, the same way
+// TelemetryStreams reads them
+static void recordBatchSources(uint32_t& imuConsumed, uint32_t& sonarConsumed) {
+    const ImuHistory& history = sensorManager.getImuHistory();
+    uint32_t written = history.getWrittenCount();
+    for (uint8_t age = min(written - imuConsumed, (uint32_t)history.size()); age-- > 0;) {
+        const ImuSample& imuSample = history.at(age);
+        BatchSample sample = {imuSample.timestamp};
+        for (uint8_t i = 0; i < 4; i++) sample.values[i] = imuSample.raw.quaternion[i];
+        for (uint8_t i = 0; i < 3; i++) sample.values[4 + i] = imuSample.raw.accel[i];
+        for (uint8_t i = 0; i < 3; i++) sample.values[7 + i] = imuSample.raw.gyro[i];
+        _batchRecordings[0].recorded.push_back(sample);
+    }
+    imuConsumed = written;
+
+    if (sensorManager.getSonarReadingCount() != sonarConsumed) {
+        sonarConsumed = sensorManager.getSonarReadingCount();
+        BatchSample sample = {sensorManager.getSonarReadingTime(),
+                              {(int32_t)sensorManager.getSonarRight(), (int32_t)sensorManager.getSonarLeft()}};
+        _batchRecordings[1].recorded.push_back(sample);
+    }
+}
+
+// Drives the simulated robot on changing arcs inside an arena with
+// telemetry/batch on for both channels. Every frame is decoded with
+// TelemetryBatchDecoder and must give back exactly the samples the sensors
+// produced, in order; the frame still being filled at the end is the only
+// shortfall allowed. The size is compared with a packed record of the same
+// samples: a uint32 timestamp and an int16 per value.
+static int batchCodec() {
+    startStack();
+    Simulator sim(gpio, steeringServo, sonarRight, sonarLeft, imu, powerMonitor);
+    sim.setConfig(Simulator::defaultConfig());
+    sim.addBox(0, 0, 4.0f, 3.0f);
+    sim.addBox(0.4f, 0.4f, 0.3f, 0.3f);
+    sim.reset(2.0f, 0.6f, 0);
+    steering.setAcceleration(180);
+    mqtt.setPublishObserver(decodeBatch);
+    bool passed = TelemetryStreams::setBatch("imu", BATCH_HARNESS_MAX_AGE) == STREAM_OK;
+    passed &= TelemetryStreams::setBatch("sonars", BATCH_HARNESS_MAX_AGE) == STREAM_OK;
+
+    uint32_t imuConsumed = sensorManager.getImuSampleCount();
+    uint32_t sonarConsumed = sensorManager.getSonarReadingCount();
+    for (uint32_t ms = 0; ms < BATCH_HARNESS_DURATION; ms++) {
+        if (ms % 2000 == 0) {
+            DriveKinematics::drive(ms / 2000 % 2 ? 0.3f : 0.2f, ms / 2000 % 2 ? 2.0f : 1.5f);
+        }
+        ControlLoop::loop();
+        recordBatchSources(imuConsumed, sonarConsumed);
+        virtualClock.advance(1000);
+        sim.step(0.001f);
+    }
+    mqtt.setPublishObserver(nullptr);
+    TelemetryStreams::setBatch("imu", 0);
+    TelemetryStreams::setBatch("sonars", 0);
+
+    printf("telemetry/batch over %d s of driving, %s:\n", BATCH_HARNESS_DURATION / 1000, sim.getState().collided ? "collided" : "no collision");
+    printf("  %-8s %8s %8s %7s %10s %12s %12s %7s\n", "channel", "samples", "decoded", "frames", "bad frames", "bytes/sample", "packed", "ratio");
+    for (BatchRecording& recording : _batchRecordings) {
+        size_t matched = 0;
+        while (matched < recording.decoded.size() && matched < recording.recorded.size()) {
+            const BatchSample& decoded = recording.decoded[matched];
+            const BatchSample& recorded = recording.recorded[matched];
+            if (decoded.timestamp != recorded.timestamp || memcmp(decoded.values, recorded.values, recording.fieldCount * sizeof(int32_t)) != 0) {
+                break;
+            }
+            matched++;
+        }
+        bool ok = recording.frames > 0 && recording.badFrames == 0 && matched == recording.decoded.size();
+        ok &= recording.recorded.size() - matched <= TELEMETRY_BATCH_MAX_COUNT;
+        passed &= ok;
+
+        const char* name = recording.channel == TELEMETRY_BATCH_IMU ? "imu" : "sonars";
+        double perSample = matched ? (double)recording.bytes / matched : 0;
+        double packed = 4 + 2 * recording.fieldCount;
+        printf("  %-8s %8u %8u %7u %10u %12.2f %12.0f %6.1fx%s\n", name, (unsigned)recording.recorded.size(),
+               (unsigned)matched, recording.frames, recording.badFrames, perSample, packed,
+               perSample ? packed / perSample : 0, ok ? "" : "  FAILED");
+    }
+    printf("%s\n", passed ? "Batches decode losslessly" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+static const uint8_t UDP_HARNESS_KEY[SIP_HASH_KEY_SIZE] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+
+// Controller end of the UDP link, built from the datagram layout in
+// lib/UdpLink rather than from UdpLink itself. Keeps the last datagram it
+// sent and the last telemetry datagram it got, for the replay checks.
+struct UdpController {
+    LoopbackDatagramSocket socket;
+    uint8_t sessionKey[SIP_HASH_KEY_SIZE];
+    uint32_t sequence;
+    uint32_t telemetry;
+    uint32_t badMacs;
+    bool challenged;
+    uint8_t sent[UDP_MAX_DATAGRAM];
+    size_t sentLength;
+    uint8_t received[UDP_MAX_DATAGRAM];
+    size_t receivedLength;
+
+    UdpController() : socket(UDP_HARNESS_CONTROLLER), sequence(0), telemetry(0), badMacs(0), challenged(false), sentLength(0), receivedLength(0) {
+        memset(sessionKey, 0, sizeof(sessionKey));
+    }
+
+    void send(UdpMessageType type, const uint8_t* payload, size_t length, const uint8_t* key = nullptr) {
+        uint8_t datagram[UDP_MAX_DATAGRAM] = {UDP_MAGIC, UDP_VERSION, type, 0};
+        uint32_t header[2] = {++sequence, virtualClock.millis()};
+        memcpy(datagram + 4, header, sizeof(header));
+        memcpy(datagram + UDP_HEADER_SIZE, payload, length);
+        size_t total = UDP_HEADER_SIZE + length;
+        uint64_t mac = sipHash24(key ? key : sessionKey, datagram, total);
+        memcpy(datagram + total, &mac, UDP_MAC_SIZE);
+        sentLength = total + UDP_MAC_SIZE;
+        memcpy(sent, datagram, sentLength);
+        socket.send(UDP_HARNESS_ROBOT, UDP_PORT, datagram, sentLength);
+    }
+
+    // As a captured datagram would arrive again, from the controller's address
+    void replay(const uint8_t* datagram, size_t length) {
+        socket.send(UDP_HARNESS_ROBOT, UDP_PORT, datagram, length);
+    }
+
+    void deriveKey(const uint8_t* nonce, uint8_t key[SIP_HASH_KEY_SIZE]) {
+        uint8_t input[UDP_NONCE_SIZE + 1];
+        memcpy(input, nonce, UDP_NONCE_SIZE);
+        for (uint8_t half = 0; half < 2; half++) {
+            input[UDP_NONCE_SIZE] = half;
+            uint64_t hash = sipHash24(UDP_HARNESS_KEY, input, sizeof(input));
+            memcpy(key + 8 * half, &hash, 8);
+        }
+    }
+
+    // HELLO, CHALLENGE, JOIN, PONG; false when the robot did not take it
+    bool join() {
+        send(UDP_HELLO, nullptr, 0, UDP_HARNESS_KEY);
+        challenged = false;
+        for (uint32_t i = 0; i < UDP_HARNESS_MAX_GAP && !challenged; i++) {
+            runFor(1);
+            receivePong(0);
+        }
+        if (!challenged) {
+            return false;
+        }
+        uint32_t id = 0x4A4F494E;
+        send(UDP_JOIN, (const uint8_t*)&id, sizeof(id));
+        for (uint32_t i = 0; i < UDP_HARNESS_MAX_GAP; i++) {
+            runFor(1);
+            if (receivePong(id)) return true;
+        }
+        return false;
+    }
+
+    // Drains the socket; true once a pong carrying id came back. A
+    // challenge sets up the session key and the sequence to go on from.
+    bool receivePong(uint32_t id) {
+        bool pong = false;
+        uint8_t datagram[UDP_MAX_DATAGRAM];
+        uint32_t address;
+        uint16_t port;
+        size_t length;
+        while ((length = socket.receive(datagram, sizeof(datagram), address, port)) > 0) {
+            uint64_t mac = 0;
+            bool challenge = length == UDP_HEADER_SIZE + UDP_CHALLENGE_PAYLOAD_SIZE + UDP_MAC_SIZE && datagram[2] == UDP_CHALLENGE;
+            if (length >= UDP_HEADER_SIZE + UDP_MAC_SIZE) memcpy(&mac, datagram + length - UDP_MAC_SIZE, UDP_MAC_SIZE);
+            if (length < UDP_HEADER_SIZE + UDP_MAC_SIZE || !(datagram[3] & UDP_FLAG_ROBOT) ||
+                mac != sipHash24(challenge ? UDP_HARNESS_KEY : sessionKey, datagram, length - UDP_MAC_SIZE)) {
+                badMacs++;
+                continue;
+            }
+            if (challenge) {
+                deriveKey(datagram + UDP_HEADER_SIZE, sessionKey);
+                uint32_t lowest;
+                memcpy(&lowest, datagram + UDP_HEADER_SIZE + UDP_NONCE_SIZE, sizeof(lowest));
+                sequence = max(sequence, lowest - 1);
+                challenged = true;
+            } else if (datagram[2] == UDP_TELEMETRY) {
+                telemetry++;
+                receivedLength = length;
+                memcpy(received, datagram, length);
+            } else if (datagram[2] == UDP_PONG && length == UDP_HEADER_SIZE + sizeof(id) + UDP_MAC_SIZE) {
+                pong |= memcmp(datagram + UDP_HEADER_SIZE, &id, sizeof(id)) == 0;
+            }
+        }
+        return pong;
+    }
+};
+
+// Pings the robot over UDP at random points of its loop, as a controller
+// on the LAN would, and counts the loop passes and host time until the
+// pong is back. The network is not modelled, so this is the robot's share
+// of the round trip: receive, MAC check, echo and MAC of the reply.
+static int udpRtt(unsigned long pings) {
+    startStack();
+    LoopbackDatagramSocket robotSocket(UDP_HARNESS_ROBOT);
+    UdpController controller;
+    robotSocket.connect(&controller.socket);
+    controller.socket.connect(&robotSocket);
+    controller.socket.begin(UDP_HARNESS_PORT);
+    UdpLink::setup(&robotSocket, UDP_HARNESS_KEY, UDP_PORT);
+    if (!controller.join()) {
+        printf("Controller could not join\nFAILED\n");
+        return 1;
+    }
+
+    uint32_t seed = 11;
+    uint32_t lost = 0, maxPasses = 0;
+    uint64_t totalNs = 0, maxNs = 0;
+    for (uint32_t id = 1; id <= pings; id++) {
+        seed = seed * 1103515245 + 12345;
+        runFor((seed >> 8) % (UDP_HARNESS_MAX_GAP + 1));
+        controller.receivePong(0);
+
+        controller.send(UDP_PING, (const uint8_t*)&id, sizeof(id));
+        uint32_t passes = 0;
+        uint64_t ns = 0;
+        bool received = false;
+        while (!received && passes < UDP_PEER_TIMEOUT) {
+            auto start = std::chrono::steady_clock::now();
+            ControlLoop::loop();
+            ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            virtualClock.advance(NATIVE_LOOP_STEP_US);
+            passes++;
+            received = controller.receivePong(id);
+        }
+        lost += !received;
+        maxPasses = max(maxPasses, passes);
+        totalNs += ns;
+        maxNs = max(maxNs, ns);
+    }
+
+    const UdpStats& stats = UdpLink::getStats();
+    printf("UDP ping round trips over loopback, %lu pings:\n", pings);
+    printf("  lost %u, loop passes until pong at most %u\n", lost, maxPasses);
+    printf("  host time for those passes: avg %.1f us, max %.1f us\n", totalNs / 1000.0 / pings, maxNs / 1000.0);
+    printf("  robot received %u, rejected %u, replayed %u, sent %u\n", stats.received, stats.rejected, stats.replayed, stats.sent);
+    printf("  telemetry datagrams %u, bad MACs %u\n", controller.telemetry, controller.badMacs);
+    bool passed = lost == 0 && maxPasses == 1 && controller.badMacs == 0 && stats.rejected == 0 && controller.telemetry > 0;
+    printf("%s\n", passed ? "Pong within one loop pass" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+static bool replayCheck(const char* name, bool ok) {
+    printf("  %-44s %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// Captures a session, lets the peer time out and plays the captured
+// datagrams back from the controller's address, as anyone on the LAN
+// could. None of them may open a session or drive the wheels; the real
+// controller, and a restarted one, must still be able to join.
+static int udpReplay() {
+    startStack();
+    LoopbackDatagramSocket robotSocket(UDP_HARNESS_ROBOT);
+    UdpController controller;
+    robotSocket.connect(&controller.socket);
+    controller.socket.connect(&robotSocket);
+    controller.socket.begin(UDP_HARNESS_PORT);
+    UdpLink::setup(&robotSocket, UDP_HARNESS_KEY, UDP_PORT);
+    const UdpStats& stats = UdpLink::getStats();
+
+    printf("UDP replay after the peer timeout (%d ms):\n", UDP_PEER_TIMEOUT);
+    bool passed = true;
+    passed &= replayCheck("controller joins", controller.join());
+    uint8_t join[UDP_MAX_DATAGRAM];
+    size_t joinLength = controller.sentLength;
+    memcpy(join, controller.sent, joinLength);
+
+    // Both wheels at 50 %, no ramp
+    uint8_t payload[UDP_DRIVE_PAYLOAD_SIZE] = {DRIVE_LEFT | DRIVE_RIGHT | DRIVE_LEFT_ACCELERATION | DRIVE_RIGHT_ACCELERATION, 0, 50, 0, 50};
+    controller.send(UDP_DRIVE, payload, sizeof(payload));
+    uint8_t drive[UDP_MAX_DATAGRAM];
+    size_t driveLength = controller.sentLength;
+    memcpy(drive, controller.sent, driveLength);
+    runFor(UDP_TELEMETRY_INTERVAL * 2);
+    controller.receivePong(0);
+    passed &= replayCheck("drive datagram drives", motorController.getLeftSpeedUnits() == 50 * MOTOR_SPEED_SCALE);
+    passed &= replayCheck("telemetry captured", controller.receivedLength > 0);
+
+    runFor(UDP_PEER_TIMEOUT + UDP_HARNESS_MAX_GAP);
+    passed &= replayCheck("peer dropped, wheels stopped", !UdpLink::isActive() && motorController.getLeftSpeedUnits() == 0);
+
+    struct Replay {
+        const char* name;
+        const uint8_t* datagram;
+        size_t length;
+    };
+    const Replay replays[] = {
+        {"replayed drive rejected", drive, driveLength},
+        {"reflected robot telemetry rejected", controller.received, controller.receivedLength},
+        {"replayed join rejected", join, joinLength},
+    };
+    for (const Replay& replay : replays) {
+        uint32_t rejected = stats.rejected + stats.replayed;
+        controller.replay(replay.datagram, replay.length);
+        runFor(UDP_HARNESS_MAX_GAP);
+        passed &= replayCheck(replay.name, stats.rejected + stats.replayed == rejected + 1 && !UdpLink::isActive() &&
+                              motorController.getLeftSpeedUnits() == 0);
+    }
+
+    // A fresh challenge has a fresh nonce, so the old join still fails
+    controller.send(UDP_HELLO, nullptr, 0, UDP_HARNESS_KEY);
+    runFor(UDP_HARNESS_MAX_GAP);
+    controller.receivePong(0);
+    uint32_t rejected = stats.rejected;
+    controller.replay(join, joinLength);
+    runFor(UDP_HARNESS_MAX_GAP);
+    passed &= replayCheck("join replayed after a new challenge rejected", stats.rejected == rejected + 1 && !UdpLink::isActive());
+
+    passed &= replayCheck("controller joins again", controller.join());
+    rejected = stats.rejected;
+    controller.replay(drive, driveLength);
+    runFor(UDP_HARNESS_MAX_GAP);
+    passed &= replayCheck("old drive rejected in the new session", stats.rejected == rejected + 1 && motorController.getLeftSpeedUnits() == 0);
+
+    // Restarted controller: sequence from 1, told where to go on by the challenge
+    runFor(UDP_PEER_TIMEOUT + UDP_HARNESS_MAX_GAP);
+    UdpController restarted;
+    robotSocket.connect(&restarted.socket);
+    restarted.socket.connect(&robotSocket);
+    restarted.socket.begin(UDP_HARNESS_PORT);
+    passed &= replayCheck("restarted controller joins", restarted.join());
+
+    printf("  robot received %u, rejected %u, replayed %u, sessions %u\n", stats.received, stats.rejected, stats.replayed, stats.sessions);
+    printf("%s\n", passed ? "Captured datagrams never verify again" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+// Values of the power-loss workload are a function of their version, so a
+// value read back tells which put()/stage() it came from
+struct KvExpectation {
+    uint16_t key;
+    uint32_t committed;  // Version on flash for sure, 0 before the first
+    uint32_t latest;     // Version last handed to the store
+};
+
+static size_t harnessValue(uint16_t key, uint32_t version, uint8_t* value) {
+    if (key == KV_KEY_MPU_OFFSETS) {
+        int16_t offsets[6];
+        for (uint8_t i = 0; i < 6; i++) offsets[i] = (int16_t)((i % 2 ? -1 : 1) * (int32_t)(version * (i + 1)));
+        memcpy(value, offsets, sizeof(offsets));
+        return sizeof(offsets);
+    }
+    if (key == KV_KEY_PORTAL_REQUESTED) {
+        value[0] = version & 1;
+        return 1;
+    }
+    memcpy(value, &version, sizeof(version));
+    return sizeof(version);
+}
+
+// Runs the workload until it completes or the flash loses power
+static void kvWorkload(KvStore& store, KvExpectation* expected) {
+    KvExpectation& energy = expected[0];
+    for (uint32_t step = 1; step <= KV_HARNESS_STEPS && kvFlash.isPowered(); step++) {
+        uint8_t value[KV_MAX_VALUE_SIZE];
+        for (uint8_t i = 1; i < 3; i++) {
+            uint32_t every = expected[i].key == KV_KEY_MPU_OFFSETS ? KV_HARNESS_OFFSETS_EVERY : KV_HARNESS_PORTAL_EVERY;
+            if (step % every == 1) {
+                expected[i].latest++;
+                size_t length = harnessValue(expected[i].key, expected[i].latest, value);
+                if (store.put(expected[i].key, value, length)) expected[i].committed = expected[i].latest;
+            }
+        }
+        energy.latest = step;
+        size_t length = harnessValue(energy.key, step, value);
+        store.stage(energy.key, value, length);
+        if (step % KV_HARNESS_FLUSH_EVERY == 0 && store.flush()) {
+            energy.committed = step;
+        }
+    }
+}
+
+// A recovered value must come from a version between the last one known to
+// be on flash and the last one written; a missing value only before the first
+static bool kvVerify(KvStore& store, const KvExpectation& expected) {
+    uint8_t value[KV_MAX_VALUE_SIZE];
+    uint8_t candidate[KV_MAX_VALUE_SIZE];
+    size_t length = harnessValue(expected.key, 0, candidate);
+    if (!store.get(expected.key, value, length)) {
+        return expected.committed == 0;
+    }
+    for (uint32_t version = max(expected.committed, (uint32_t)1); version <= expected.latest; version++) {
+        harnessValue(expected.key, version, candidate);
+        if (memcmp(value, candidate, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Cuts the power at every flash write and erase of the workload in turn,
+// remounts and checks that every key holds a value it was given, never an
+// older one than was confirmed, and that the store still takes writes
+static int kvPowerLoss() {
+    const uint16_t keys[3] = {KV_KEY_ENERGY, KV_KEY_MPU_OFFSETS, KV_KEY_PORTAL_REQUESTED};
+    KvExpectation expected[3];
+
+    // Dry run for the number of flash operations
+    kvFlash = MemoryFlash();
+    {
+        for (uint8_t i = 0; i < 3; i++) expected[i] = {keys[i], 0, 0};
+        KvStore store(kvFlash);
+        store.begin();
+        kvWorkload(store, expected);
+        KvStats stats = store.getStats();
+        printf("Workload: %u energy updates, %u records, %u coalesced, %u compactions\n", KV_HARNESS_STEPS, stats.records, stats.coalesced, stats.compactions);
+        printf("  erases per sector:");
+        for (uint8_t sector = 0; sector < kvFlash.sectorCount(); sector++) {
+            printf(" %u", kvFlash.getEraseCount(sector));
+        }
+        printf("\n");
+    }
+    uint32_t operations = kvFlash.getWriteCount();
+    for (uint8_t sector = 0; sector < kvFlash.sectorCount(); sector++) operations += kvFlash.getEraseCount(sector);
+
+    uint32_t violations = 0;
+    for (uint32_t budget = 0; budget < operations; budget++) {
+        kvFlash = MemoryFlash();
+        kvFlash.powerLossAfter(budget);
+        for (uint8_t i = 0; i < 3; i++) expected[i] = {keys[i], 0, 0};
+        {
+            KvStore store(kvFlash);
+            if (store.begin()) kvWorkload(store, expected);
+        }
+        kvFlash.restorePower();
+
+        KvStore recovered(kvFlash);
+        bool ok = recovered.begin();
+        for (uint8_t i = 0; ok && i < 3; i++) {
+            if (!kvVerify(recovered, expected[i])) {
+                printf("  power loss at operation %u: key %u not from versions %u..%u\n", budget, expected[i].key, expected[i].committed, expected[i].latest);
+                ok = false;
+            }
+        }
+
+        uint32_t marker = 0xA5A5A5A5;
+        uint32_t check = 0;
+        if (ok && recovered.put(KV_KEY_ENERGY, &marker, sizeof(marker))) {
+            KvStore remounted(kvFlash);
+            ok = remounted.begin() && remounted.get(KV_KEY_ENERGY, &check, sizeof(check)) && check == marker;
+        } else {
+            ok = false;
+        }
+        if (!ok) violations++;
+    }
+
+    printf("Power loss at each of %u flash operations: %u violations\n", operations, violations);
+    return violations == 0 ? 0 : 1;
+}
+
+struct RampProfile {
+    const char* name;
+    uint32_t minInterval;  // us between update() calls
+    uint32_t maxInterval;
+};
+
+static const RampProfile RAMP_PROFILES[] = {
+    {"1 kHz tick", 1000, 1000},
+    {"100 ms task", 100000, 100000},
+    {"0.2..20 ms jitter", 200, 20000},
+    {"1..150 ms jitter", 1000, 150000},
+};
+
+// Ideal speed in units after a command at commandTime from start towards target
+static int32_t idealSpeed(int32_t start, int32_t target, uint64_t commandTime, uint64_t now) {
+    int64_t travelled = (int64_t)RAMP_HARNESS_ACCELERATION * MOTOR_SPEED_SCALE * (int64_t)(now - commandTime) / 1000000;
+    return start < target ? (int32_t)min((int64_t)start + travelled, (int64_t)target) : (int32_t)max((int64_t)start - travelled, (int64_t)target);
+}
+
+// Ramps the left motor 0 -> 100 % -> -100 % with update() called at
+// irregular intervals and compares every step with the ideal slope. The old
+// controller, a fixed PWM step per call, is timed alongside.
+static int rampJitter() {
+    hal::setup(&virtualClock, &gpio, &i2cBus, &storage);
+    uint32_t seed = 12345;
+    bool passed = true;
+    printf("Ramp 0 -> 100 %% -> -100 %% at %d %%/s, ideal 6.000 s\n", RAMP_HARNESS_ACCELERATION);
+    printf("  %-18s %8s %11s %12s %14s\n", "update() calls", "calls", "done at (s)", "max error", "old 0->255 (s)");
+    for (const RampProfile& profile : RAMP_PROFILES) {
+        MotorController motors(MOTOR_LEFT_PWM, MOTOR_LEFT_DIRECTION, MOTOR_RIGHT_PWM, MOTOR_RIGHT_DIRECTION);
+        motors.begin();
+        motors.setLeftAcceleration(RAMP_HARNESS_ACCELERATION);
+        motors.update();
+
+        const int32_t targets[2] = {100 * MOTOR_SPEED_SCALE, -100 * MOTOR_SPEED_SCALE};
+        uint64_t start = virtualClock.elapsedMicros();
+        uint32_t calls = 0;
+        int32_t maxError = 0;
+        int legacySpeed = 0;
+        uint64_t legacyTime = 0;
+        for (int32_t target : targets) {
+            int32_t from = motors.getLeftSpeedUnits();
+            uint64_t commandTime = virtualClock.elapsedMicros();
+            motors.setLeftSpeedPercent(target / MOTOR_SPEED_SCALE);
+            while (motors.getLeftSpeedUnits() != target) {
+                seed = seed * 1103515245 + 12345;
+                virtualClock.advance(profile.minInterval + (seed >> 8) % (profile.maxInterval - profile.minInterval + 1));
+                motors.update();
+                calls++;
+                int32_t error = abs(motors.getLeftSpeedUnits() - idealSpeed(from, target, commandTime, virtualClock.elapsedMicros()));
+                maxError = max(maxError, error);
+                if (legacySpeed < 255 && (legacySpeed = min(legacySpeed + RAMP_HARNESS_LEGACY_STEP, 255)) == 255) {
+                    legacyTime = virtualClock.elapsedMicros() - start;
+                }
+            }
+        }
+        double seconds = (virtualClock.elapsedMicros() - start) / 1e6;
+        bool duty = gpio.getAnalog(MOTOR_LEFT_PWM) == motors.getPwmRange() && gpio.digitalRead(MOTOR_LEFT_DIRECTION) == LOW;
+        printf("  %-18s %8u %11.3f %9.3f %% %14.3f%s\n", profile.name, calls, seconds, (double)maxError / MOTOR_SPEED_SCALE, legacyTime / 1e6, duty ? "" : "  wrong output");
+        // One unit is the rounding of a single step
+        passed &= maxError <= 1 && duty;
+    }
+    printf("%s\n", passed ? "Slope independent of update() timing" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+struct KinematicsCase {
+    const char* name;
+    float velocity;   // m/s
+    float curvature;  // 1/m
+};
+
+static const KinematicsCase KINEMATICS_CASES[] = {
+    {"straight", 0.3f, 0.0f},
+    {"R 1 m", 0.3f, 1.0f},
+    {"R 0.4 m right", 0.3f, -2.5f},
+    {"R 0.4 m reverse", -0.3f, 2.5f},
+    {"R 0.4 m flat out", 0.6f, 2.5f},
+    {"past the lock", 0.5f, 5.0f},
+};
+
+// Drives the simulated robot with fixed wheel and servo targets and
+// returns the turning radius it settles on, 0 when it goes straight
+static float drivenRadius(int32_t left, int32_t right, int servo) {
+    Simulator sim(gpio, steeringServo, sonarRight, sonarLeft, imu, powerMonitor);
+    sim.setConfig(Simulator::defaultConfig());
+    sim.reset(0, 0, 0);
+    motorController.setTargets(left, right);
+    steering.setAngle(servo);
+    for (uint32_t ms = 0; ms < KINEMATICS_HARNESS_SETTLE * 1000; ms++) {
+        virtualClock.advance(1000);
+        motorController.update();
+        if (ms % STEERING_UPDATE_INTERVAL == 0) steering.update();
+        sim.step(0.001f);
+    }
+    const SimState& state = sim.getState();
+    return fabsf(state.yawRate) < 1e-4f ? 0 : state.speed / state.yawRate;
+}
+
+static bool radiusMatches(float radius, float expected) {
+    return expected == 0 ? radius == 0 : fabsf(radius - expected) <= fabsf(expected) * KINEMATICS_HARNESS_TOLERANCE;
+}
+
+// Commands each case through DriveKinematics on the simulator and checks
+// the radius it drives. Alongside: the same speed on both wheels with the
+// same servo angle (separate topics from the host), and, where a wheel
+// saturates, each wheel clipped on its own instead of both scaled.
+static int kinematicsCheck() {
+    hal::setup(&virtualClock, &gpio, &i2cBus, &storage);
+    motorController.begin();
+    motorController.setLeftAcceleration(0);
+    motorController.setRightAcceleration(0);
+    steering.begin();
+    steering.setAcceleration(180);
+    DriveKinematics::setup(&motorController, &steering);
+    const KinematicsConfig& config = DriveKinematics::getConfig();
+
+    bool passed = true;
+    printf("Radius driven in the simulator, wheelbase %.2f m, track %.2f m, %.2f m/s, lock %.0f deg\n",
+           config.wheelbase, config.trackWidth, config.maxWheelSpeed, config.maxSteerAngle);
+    printf("  %-16s %6s %7s %7s %5s %8s %8s %8s %8s\n", "command", "v", "left", "right", "servo", "radius", "driven", "equal", "clipped");
+    for (const KinematicsCase& test : KINEMATICS_CASES) {
+        DriveTargets targets = DriveKinematics::solve(config, test.velocity, test.curvature);
+        float expected = targets.curvature == 0 ? 0 : 1 / targets.curvature;
+        float driven = drivenRadius(targets.left, targets.right, targets.steering);
+
+        int32_t equal = lroundf(targets.velocity / config.maxWheelSpeed * MOTOR_SPEED_FULL);
+        float equalRadius = drivenRadius(equal, equal, targets.steering);
+
+        char clipped[16] = "-";
+        if (targets.saturated) {
+            float half = targets.curvature * config.trackWidth / 2;
+            float velocity = test.velocity / config.maxWheelSpeed * MOTOR_SPEED_FULL;
+            int32_t left = constrain(lroundf(velocity * (1 - half)), -MOTOR_SPEED_FULL, MOTOR_SPEED_FULL);
+            int32_t right = constrain(lroundf(velocity * (1 + half)), -MOTOR_SPEED_FULL, MOTOR_SPEED_FULL);
+            snprintf(clipped, sizeof(clipped), "%.3f", drivenRadius(left, right, targets.steering));
+        }
+
+        bool ok = radiusMatches(driven, expected);
+        passed &= ok;
+        printf("  %-16s %6.2f %6.1f%% %6.1f%% %5d %8.3f %8.3f %8.3f %8s%s\n", test.name, targets.velocity,
+               (float)targets.left / MOTOR_SPEED_SCALE, (float)targets.right / MOTOR_SPEED_SCALE, targets.steering,
+               expected, driven, equalRadius, clipped, ok ? "" : "  wrong radius");
+    }
+    printf("%s\n", passed ? "Commanded radius held, saturated cases included" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+// Counts what each call costs in clock use. While probing, every read moves
+// virtual time on by 1 us, so a busy-wait on the clock shows up as
+// thousands of reads instead of hanging; delay() calls are counted
+// separately. Outside the probed calls it is the plain virtual clock.
+class ProbeClock : public hal::Clock {
+public:
+    uint32_t millis() override { tick(); return virtualClock.millis(); }
+    uint32_t micros() override { tick(); return virtualClock.micros(); }
+    void delay(uint32_t ms) override { delays++; virtualClock.delay(ms); }
+    void delayMicroseconds(uint32_t us) override { virtualClock.delayMicroseconds(us); }
+
+    bool probing = false;
+    uint32_t reads = 0;
+    uint32_t delays = 0;
+
+private:
+    void tick() {
+        if (probing) {
+            reads++;
+            virtualClock.advance(1);
+        }
+    }
+};
+
+// HC-SR04 on the echo pin: raises it SONAR_HARNESS_ECHO_DELAY after the
+// ping and holds it for the round trip of distance. 0 never answers.
+struct EchoLine {
+    uint8_t pin;
+    unsigned int distance;
+    bool pinged;
+    uint64_t rise;
+
+    void update(AsyncSonar& sonar, uint64_t now) {
+        if (sonar.busy() && !pinged) {
+            pinged = true;
+            rise = now + SONAR_HARNESS_ECHO_DELAY;
+        } else if (!sonar.busy()) {
+            pinged = false;
+        }
+        bool high = pinged && distance > 0 && now >= rise && now < rise + (uint64_t)distance * 57;
+        gpio.setInput(pin, high ? HIGH : LOW);
+    }
+};
+
+struct SonarCase {
+    const char* name;
+    unsigned int right;  // cm, 0 = no echo
+    unsigned int left;
+};
+
+static const SonarCase SONAR_CASES[] = {
+    {"near", 35, 80},
+    {"max range", MAX_DISTANCE, MAX_DISTANCE},
+    {"right no echo", 0, 120},
+};
+
+// Runs the sonars task at its period over the firmware's AsyncSonar, the
+// right one on GPIO16 sampled by a tick timer and the left one on GPIO15
+// timed by its pin interrupt, as wired on the robot. Checks that no
+// updateSonars() call waits: no delay(), a handful of clock reads and at
+// most SONAR_HARNESS_MAX_CALL us, whatever the echo time, while both
+// sonars still measure their distance to within 1 cm.
+static int sonarBlocking() {
+    ProbeClock probe;
+    hal::setup(&probe, &gpio, &i2cBus, &storage);
+    bool passed = true;
+    printf("updateSonars() every %d ms for %d ms, pings %d ms apart, GPIO16 sampled every %d us\n",
+           SONAR_POLL_INTERVAL, SONAR_HARNESS_DURATION, SONAR_PING_INTERVAL, SONAR_ECHO_POLL_PERIOD);
+    printf("  %-14s %6s %9s %6s %6s %10s %11s %7s %11s\n", "echo (cm)", "calls", "readings", "right", "left",
+           "max reads", "max us/call", "delays", "ticks/ping");
+    for (const SonarCase& test : SONAR_CASES) {
+        FakeTickTimer timer;
+        AsyncSonar right(SONAR_RIGHT_PING, MAX_DISTANCE, &timer);
+        AsyncSonar left(SONAR_LEFT_PING, MAX_DISTANCE, &timer);
+        right.begin();
+        left.begin();
+        EchoLine rightEcho = {SONAR_RIGHT_PING, test.right, false, 0};
+        EchoLine leftEcho = {SONAR_LEFT_PING, test.left, false, 0};
+        SensorManager sensors(imu, powerMonitor, right, left);
+
+        uint32_t calls = 0;
+        uint32_t maxReads = 0;
+        uint64_t maxTime = 0;
+        uint32_t rightPings = 0;
+        probe.delays = 0;
+        uint64_t end = virtualClock.elapsedMicros() + (uint64_t)SONAR_HARNESS_DURATION * 1000;
+        while (virtualClock.elapsedMicros() < end) {
+            uint64_t next = virtualClock.elapsedMicros() + SONAR_POLL_INTERVAL * 1000;
+            while (virtualClock.elapsedMicros() < next) {
+                virtualClock.advance(SONAR_HARNESS_STEP);
+                rightEcho.update(right, virtualClock.elapsedMicros());
+                leftEcho.update(left, virtualClock.elapsedMicros());
+                timer.run();
+            }
+
+            bool rightIdle = !right.busy();
+            probe.reads = 0;
+            probe.probing = true;
+            uint64_t before = virtualClock.elapsedMicros();
+            sensors.updateSonars();
+            maxTime = max(maxTime, virtualClock.elapsedMicros() - before);
+            probe.probing = false;
+            maxReads = max(maxReads, probe.reads);
+            rightPings += rightIdle && right.busy();
+            calls++;
+        }
+
+        // Each ping waits for its echo, then for the ping interval
+        uint32_t expected = SONAR_HARNESS_DURATION / (SONAR_PING_INTERVAL + SONAR_POLL_INTERVAL) - 1;
+        bool ok = probe.delays == 0 && maxReads <= SONAR_HARNESS_MAX_READS && maxTime <= SONAR_HARNESS_MAX_CALL &&
+                  sensors.getSonarReadingCount() >= expected &&
+                  abs((int)sensors.getSonarRight() - (int)test.right) <= 1 && abs((int)sensors.getSonarLeft() - (int)test.left) <= 1;
+        passed &= ok;
+        printf("  %-14s %6u %9u %6u %6u %10u %11u %7u %11u%s\n", test.name, calls, sensors.getSonarReadingCount(),
+               sensors.getSonarRight(), sensors.getSonarLeft(), maxReads, (unsigned)maxTime, probe.delays,
+               rightPings ? timer.getTickCount() / rightPings : 0, ok ? "" : "  FAILED");
+    }
+    printf("%s\n", passed ? "updateSonars() never waits for an echo" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "config-bench") == 0) {
+        return benchConfig(argc > 2 ? strtoul(argv[2], NULL, 10) : 10000);
+    }
+    if (argc > 1 && strcmp(argv[1], "sensor-bench") == 0) {
+        return sensorBench(argc > 2 ? strtoul(argv[2], NULL, 10) : 200000);
+    }
+    if (argc > 1 && strcmp(argv[1], "telemetry-codec") == 0) {
+        return telemetryCodec(argc > 2 ? strtoul(argv[2], NULL, 10) : 200);
+    }
+    if (argc > 1 && strcmp(argv[1], "udp-rtt") == 0) {
+        return udpRtt(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000);
+    }
+    if (argc > 1 && strcmp(argv[1], "udp-replay") == 0) {
+        return udpReplay();
+    }
+    if (argc > 1 && strcmp(argv[1], "batch-codec") == 0) {
+        return batchCodec();
+    }
+    if (argc > 1 && strcmp(argv[1], "publish-alloc") == 0) {
+        return publishAlloc(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000);
+    }
+    if (argc > 1 && strcmp(argv[1], "kv-powerloss") == 0) {
+        return kvPowerLoss();
+    }
+    if (argc > 1 && strcmp(argv[1], "ramp-jitter") == 0) {
+        return rampJitter();
+    }
+    if (argc > 1 && strcmp(argv[1], "kinematics") == 0) {
+        return kinematicsCheck();
+    }
+    if (argc > 1 && strcmp(argv[1], "sonar-blocking") == 0) {
+        return sonarBlocking();
+    }
+    unsigned long seconds = argc > 1 ? strtoul(argv[1], NULL, 10) : 10;
+
+    startStack();
+
+    uint64_t end = (uint64_t)seconds * 1000000;
+    while (virtualClock.elapsedMicros() < end) {
+        ControlLoop::loop();
+        virtualClock.advance(NATIVE_LOOP_STEP_US);
+    }
+
+    LOG_I("Ran %lu virtual seconds, %u messages published\n", seconds, mqtt.getPublishCount());
+    for (uint8_t i = 0; i < scheduler.getTaskCount(); i++) {
+        const TaskStats& stats = scheduler.getTaskStats(i);
+        LOG_I("  %-10s runs %u overruns %u\n", scheduler.getTaskName(i), stats.runs, stats.overruns);
+    }
+    return 0;
+}
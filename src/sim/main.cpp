@@ -0,0 +1,141 @@
+// Headless simulator: runs the firmware control stack against the planar
+// physics model in lib/Simulator, many episodes back to back under a virtual
+// clock. A demo obstacle-avoidance controller drives the robot through the
+// regular MQTT command topics.
+//
+// Usage: program [episodes] [seconds per episode]
+
+#include <stdio.h>
+#include <chrono>
+#include "config.h"
+#include "HalNative.h"
+#include "Simulator.h"
+#include "MotorController.h"
+#include "SensorManager.h"
+#include "Steering.h"
+#include "Scheduler.h"
+#include "I2cQueue.h"
+#include "Communication.h"
+#include "ControlLoop.h"
+
+#define SIM_STEP_US 1000           // Virtual time per loop() pass and physics step
+#define SIM_CONTROL_PERIOD_US 100000 // Demo controller command rate
+#define SIM_ARENA_WIDTH 4.0f
+#define SIM_ARENA_HEIGHT 3.0f
+#define SIM_DEVICE_ID "wheelbot-sim"
+
+struct EpisodeResult {
+    bool collided;
+    float distance;
+    float seconds;
+};
+
+static float randomRange(uint32_t& seed, float low, float high) {
+    seed = seed * 1664525 + 1013904223;
+    return low + (high - low) * (seed >> 8) / 16777216.0f;
+}
+
+static void buildArena(Simulator& simulator, uint32_t seed) {
+    simulator.clearWalls();
+    simulator.addBox(0, 0, SIM_ARENA_WIDTH, SIM_ARENA_HEIGHT);
+    for (uint8_t i = 0; i < 3; i++) {
+        float x = randomRange(seed, 1.2f, SIM_ARENA_WIDTH - 0.6f);
+        float y = randomRange(seed, 0.3f, SIM_ARENA_HEIGHT - 0.6f);
+        simulator.addBox(x, y, randomRange(seed, 0.1f, 0.4f), randomRange(seed, 0.1f, 0.4f));
+    }
+}
+
+// Steer away from the closer obstacle, slow down and back off when blocked
+static void demoController(LoopbackMqttTransport& mqtt, SensorManager& sensors) {
+    unsigned int left = sensors.getSonarLeft();
+    unsigned int right = sensors.getSonarRight();
+    unsigned int nearest = min(left ? left : MAX_DISTANCE, right ? right : MAX_DISTANCE);
+
+    int speed = nearest < 25 ? -40 : (nearest < 60 ? 35 : 60);
+    int angle = 90;
+    if (nearest < 80) {
+        bool turnLeft = (left ? left : MAX_DISTANCE) > (right ? right : MAX_DISTANCE);
+        angle = turnLeft ? 180 : 0;
+        if (speed < 0) angle = 180 - angle;
+    }
+
+    char payload[8];
+    snprintf(payload, sizeof(payload), "%d", speed);
+    mqtt.inject(SIM_DEVICE_ID "/engines/left/speed_percent", payload);
+    mqtt.inject(SIM_DEVICE_ID "/engines/right/speed_percent", payload);
+    snprintf(payload, sizeof(payload), "%d", angle);
+    mqtt.inject(SIM_DEVICE_ID "/steering-wheel/rotate", payload);
+}
+
+static EpisodeResult runEpisode(uint32_t seed, unsigned long seconds) {
+    VirtualClock virtualClock;
+    FakeGpio gpio;
+    FakeI2cBus i2cBus;
+    MemoryStorage storage;
+    FakeServo steeringServo;
+    FakeImu imu;
+    FakePowerMonitor powerMonitor;
+    FakeSonar sonarRight;
+    FakeSonar sonarLeft;
+    LoopbackMqttTransport mqtt;
+    hal::setup(&virtualClock, &gpio, &i2cBus, &storage);
+
+    MotorController motorController(MOTOR_LEFT_PWM, MOTOR_LEFT_DIRECTION, MOTOR_RIGHT_PWM, MOTOR_RIGHT_DIRECTION);
+    SensorManager sensorManager(imu, powerMonitor, sonarRight, sonarLeft);
+    Steering steering(steeringServo);
+    Scheduler scheduler;
+    I2cQueue i2cQueue;
+
+    Simulator simulator(gpio, steeringServo, sonarRight, sonarLeft, imu, powerMonitor);
+    buildArena(simulator, seed);
+    simulator.reset(0.4f, SIM_ARENA_HEIGHT / 2, randomRange(seed, -0.5f, 0.5f));
+
+    motorController.begin();
+    steering.begin();
+    sensorManager.begin();
+    Communication::setup(&motorController, &sensorManager, &steering, &scheduler, &i2cQueue, nullptr, nullptr, &mqtt, SIM_DEVICE_ID, "");
+    ControlLoop::setup(&motorController, &sensorManager, &steering, &scheduler, &i2cQueue, nullptr, nullptr);
+    mqtt.setConnected(true);
+
+    uint64_t end = (uint64_t)seconds * 1000000;
+    uint64_t nextControl = 0;
+    while (virtualClock.elapsedMicros() < end && !simulator.getState().collided) {
+        if (virtualClock.elapsedMicros() >= nextControl) {
+            demoController(mqtt, sensorManager);
+            nextControl += SIM_CONTROL_PERIOD_US;
+        }
+        ControlLoop::loop();
+        virtualClock.advance(SIM_STEP_US);
+        simulator.step(SIM_STEP_US / 1e6f);
+    }
+
+    EpisodeResult result;
+    result.collided = simulator.getState().collided;
+    result.distance = simulator.getState().distance;
+    result.seconds = virtualClock.elapsedMicros() / 1e6f;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    unsigned long episodes = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    unsigned long seconds = argc > 2 ? strtoul(argv[2], NULL, 10) : 30;
+
+    unsigned long collisions = 0;
+    double distance = 0;
+    double simulated = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned long episode = 0; episode < episodes; episode++) {
+        EpisodeResult result = runEpisode(episode + 1, seconds);
+        collisions += result.collided;
+        distance += result.distance;
+        simulated += result.seconds;
+        LOG_D("episode %lu: %s after %.1f s, %.2f m\n", episode, result.collided ? "collision" : "ok", result.seconds, result.distance);
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("episodes: %lu, collisions: %lu, mean distance: %.2f m\n", episodes, collisions, episodes ? distance / episodes : 0);
+    printf("simulated %.0f s in %.2f s wall time (%.0fx real time, %.0f episodes/min)\n",
+           simulated, wall, wall > 0 ? simulated / wall : 0, wall > 0 ? episodes * 60 / wall : 0);
+    return 0;
+}